@@ -753,13 +753,13 @@ static ssize_t zip_entries_delete_mark(struct zip_t *zip,
   }
 
   while (i < entry_num) {
-    while ((entry_mark[i].type == MZ_KEEP) && (i < entry_num)) {
+    while ((i < entry_num) && (entry_mark[i].type == MZ_KEEP)) {
       writen_num += entry_mark[i].lf_length;
       read_num = writen_num;
       i++;
     }
 
-    while ((entry_mark[i].type == MZ_DELETE) && (i < entry_num)) {
+    while ((i < entry_num) && (entry_mark[i].type == MZ_DELETE)) {
       deleted_entry_flag_array[i] = MZ_TRUE;
       read_num += entry_mark[i].lf_length;
       deleted_length += entry_mark[i].lf_length;
@@ -767,7 +767,7 @@ static ssize_t zip_entries_delete_mark(struct zip_t *zip,
       deleted_entry_num++;
     }
 
-    while ((entry_mark[i].type == MZ_MOVE) && (i < entry_num)) {
+    while ((i < entry_num) && (entry_mark[i].type == MZ_MOVE)) {
       move_length += entry_mark[i].lf_length;
       p = &MZ_ZIP_ARRAY_ELEMENT(
           &pState->m_central_dir, mz_uint8,
@@ -1154,8 +1154,8 @@ int zip_entry_close(struct zip_t *zip) {
 
   if (!mz_zip_writer_create_local_dir_header(
           pzip, zip->entry.header, entrylen, 0, zip->entry.uncomp_size,
-          zip->entry.comp_size, zip->entry.uncomp_crc32, zip->entry.method, 0,
-          dos_time, dos_date)) {
+          zip->entry.comp_size, zip->entry.uncomp_crc32, zip->entry.method,
+          MZ_ZIP_GENERAL_PURPOSE_BIT_FLAG_UTF8, dos_time, dos_date)) {
     // Cannot create zip entry header
     err = ZIP_ECRTHDR;
     goto cleanup;
@@ -1435,6 +1435,24 @@ int zip_entry_extract(struct zip_t *zip,
              : ZIP_EINVIDX;
 }
 
+int zip_entry_copy(struct zip_t *zip, struct zip_t *src, size_t index) {
+  if (!zip || !src) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  if (index >= (size_t)src->archive.m_total_files) {
+    return ZIP_EINVIDX;
+  }
+
+  if (!mz_zip_writer_add_from_zip_reader(&(zip->archive), &(src->archive),
+                                         (mz_uint)index)) {
+    return ZIP_EWRTENT;
+  }
+
+  return 0;
+}
+
 ssize_t zip_entries_total(struct zip_t *zip) {
   if (!zip) {
     // zip_t handler is not initialized
@@ -319,6 +319,19 @@ zip_entry_extract(struct zip_t *zip,
                                        const void *data, size_t size),
                   void *arg);
 
+/**
+ * Copies an entry of another zip archive as it is, without decompressing and
+ * compressing it again.
+ *
+ * @param zip zip archive handler (opened for writing).
+ * @param src zip archive handler (opened for reading).
+ * @param index index of the entry in src.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_entry_copy(struct zip_t *zip, struct zip_t *src,
+                                     size_t index);
+
 /**
  * Returns the number of all entries (files and directories) in the zip archive.
  *
@@ -0,0 +1,921 @@
+﻿/**
+ * minidocx_bench - measures the hot paths of minidocx.
+ *
+ * usage: minidocx_bench [--scale=F] [--list] [scenario...]
+ *
+ * Every scenario reports wall time, throughput, the number of operator new
+ * calls made while it ran and the peak resident set size. Peak RSS is a
+ * process-wide high-water mark; on Linux it is reset before each scenario,
+ * elsewhere run one scenario per process to compare releases.
+ */
+
+#include "minidocx.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace docx;
+
+
+// GCC pairs the inlined replacement operators below with malloc/free and warns
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// updated from every thread, e.g. the workers of SplitBySection()
+static std::atomic<size_t> g_allocs(0);
+static std::atomic<size_t> g_allocBytes(0);
+
+void* operator new(std::size_t size)
+{
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  g_allocBytes.fetch_add(size, std::memory_order_relaxed);
+  void* p = std::malloc(size != 0 ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+
+static void ResetPeakRss()
+{
+#if defined(__linux__)
+  // writing 5 to clear_refs resets VmHWM (Linux 4.0+)
+  FILE* f = std::fopen("/proc/self/clear_refs", "w");
+  if (f != NULL) {
+    std::fputs("5", f);
+    std::fclose(f);
+  }
+#endif
+}
+
+// peak resident set size in MB
+static double PeakRss()
+{
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+    return pmc.PeakWorkingSetSize / 1048576.0;
+  }
+  return 0;
+#else
+#if defined(__linux__)
+  FILE* f = std::fopen("/proc/self/status", "r");
+  if (f != NULL) {
+    char line[256];
+    long kb = -1;
+    while (std::fgets(line, sizeof(line), f) != NULL) {
+      if (std::strncmp(line, "VmHWM:", 6) == 0) {
+        kb = std::atol(line + 6);
+        break;
+      }
+    }
+    std::fclose(f);
+    if (kb >= 0) return kb / 1024.0;
+  }
+#endif
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+  return usage.ru_maxrss / 1048576.0; // bytes
+#else
+  return usage.ru_maxrss / 1024.0; // kilobytes
+#endif
+#endif
+}
+
+
+typedef std::chrono::steady_clock Clock;
+
+struct Result
+{
+  size_t items;
+  size_t bytes; // bytes processed, 0 if not meaningful
+  double seconds;
+};
+
+class Measure
+{
+public:
+  Measure() : allocs_(g_allocs), allocBytes_(g_allocBytes), start_(Clock::now()) {}
+
+  void Report(const char* name, const Result& res)
+  {
+    const size_t allocs = g_allocs - allocs_;
+    const size_t allocBytes = g_allocBytes - allocBytes_;
+    const double itemsPerSec = res.seconds > 0 ? res.items / res.seconds : 0;
+    std::printf("%-18s %10zu %10.3f %12.0f", name, res.items, res.seconds, itemsPerSec);
+    if (res.bytes > 0 && res.seconds > 0) {
+      std::printf(" %9.1f", res.bytes / 1048576.0 / res.seconds);
+    }
+    else {
+      std::printf(" %9s", "-");
+    }
+    std::printf(" %10zu %10.1f %10.1f\n", allocs, allocBytes / 1048576.0, PeakRss());
+  }
+
+  double Elapsed() const
+  {
+    return std::chrono::duration<double>(Clock::now() - start_).count();
+  }
+
+  void Restart()
+  {
+    allocs_ = g_allocs;
+    allocBytes_ = g_allocBytes;
+    start_ = Clock::now();
+  }
+
+private:
+  size_t allocs_;
+  size_t allocBytes_;
+  Clock::time_point start_;
+};
+
+static size_t FileSize(const char* path)
+{
+  FILE* f = std::fopen(path, "rb");
+  if (f == NULL) return 0;
+  std::fseek(f, 0, SEEK_END);
+  const long size = std::ftell(f);
+  std::fclose(f);
+  return size > 0 ? size : 0;
+}
+
+
+static void PrintStats(const Stats& stats)
+{
+  for (size_t i = 0; i < stats.parts.size(); i++) {
+    const PartStats& part = stats.parts[i];
+    std::printf("  %-28s %9.1f KB %10zu nodes  xml %8.3f s  zip %8.3f s\n",
+      part.name.c_str(), part.bytes / 1024.0, part.nodes, part.xmlTime, part.zipTime);
+  }
+  std::printf("  open %.3f s  copy %.3f s  close %.3f s  bookmarks %.3f s  total %.3f s  dom allocs %zu (%.1f MB)\n",
+    stats.openTime, stats.copyTime, stats.closeTime, stats.findBookmarksTime, stats.totalTime,
+    stats.allocations, stats.allocatedBytes / 1048576.0);
+}
+
+
+static double g_scale = 1.0;
+
+static size_t Scaled(const size_t n)
+{
+  const size_t m = static_cast<size_t>(n * g_scale);
+  return m > 0 ? m : 1;
+}
+
+static const char LOREM[] = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, "
+  "sed do eiusmod tempor incididunt ut labore et dolore magna aliqua. "
+  "Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris.";
+
+
+// append 1M paragraphs
+static void BenchAppendParagraphs()
+{
+  const size_t n = Scaled(1000000);
+  Document doc;
+
+  Measure m;
+  for (size_t i = 0; i < n; i++) {
+    doc.AppendParagraph(LOREM);
+  }
+  Result res = { n, n * (sizeof(LOREM) - 1), m.Elapsed() };
+  m.Report("append_paragraphs", res);
+}
+
+// the same from a shared buffer, without a std::string per paragraph
+static void BenchAppendTextView()
+{
+  const size_t n = Scaled(1000000);
+  Document doc;
+
+  Measure m;
+  for (size_t i = 0; i < n; i++) {
+    doc.AppendParagraph(TextView(LOREM, sizeof(LOREM) - 1));
+  }
+  Result res = { n, n * (sizeof(LOREM) - 1), m.Elapsed() };
+  m.Report("append_text_view", res);
+}
+
+// mixed UTF-8 text with a stray control character, checked and cleaned on the way in
+static void BenchAppendUtf8()
+{
+  const size_t n = Scaled(1000000);
+  const std::string text = std::string(LOREM) + "\xE4\xBD\xA0\xE5\xA5\xBD Gr\xC3\xBC\xC3\x9F" "e \x01 ";
+  Document doc;
+
+  Measure m;
+  for (size_t i = 0; i < n; i++) {
+    doc.AppendParagraph(TextView(text.data(), text.size()));
+  }
+  Result res = { n, n * text.size(), m.Elapsed() };
+  m.Report("append_utf8", res);
+}
+
+// tab-separated records with line ends, split into w:t, w:tab and w:br
+static void BenchAppendWithBreaks()
+{
+  const size_t n = Scaled(200000);
+  const std::string text = "Name:\tLorem ipsum\nAddress:\tdolor sit amet, consectetur\r\nPhone:\t0123456789\n";
+  Document doc;
+
+  Measure m;
+  for (size_t i = 0; i < n; i++) {
+    doc.AppendParagraph().AppendRun().AppendTextWithBreaks(TextView(text.data(), text.size()));
+  }
+  Result res = { n, n * text.size(), m.Elapsed() };
+  m.Report("append_with_breaks", res);
+}
+
+// build a 10k x 10 table through GetCell
+static void BenchTableGetCell()
+{
+  const int rows = static_cast<int>(Scaled(10000));
+  const int cols = 10;
+  Document doc;
+
+  Measure m;
+  Table tbl = doc.AppendTable(rows, cols);
+  for (int i = 0; i < rows; i++) {
+    for (int j = 0; j < cols; j++) {
+      tbl.GetCell(i, j).FirstParagraph().AppendRun("cell");
+    }
+  }
+  Result res = { static_cast<size_t>(rows) * cols, 0, m.Elapsed() };
+  m.Report("table_get_cell", res);
+}
+
+// merge every pair of columns, then every pair of rows
+static void BenchMergeCells()
+{
+  const int rows = static_cast<int>(Scaled(1000)) * 2;
+  const int cols = 10;
+  Document doc;
+  Table tbl = doc.AppendTable(rows, cols);
+
+  Measure m;
+  size_t merges = 0;
+  for (int i = 0; i < rows; i++) {
+    for (int j = 0; j < cols; j += 2) {
+      if (tbl.MergeCells(tbl.GetCell(i, j), tbl.GetCell(i, j + 1))) merges++;
+    }
+  }
+  for (int i = 0; i < rows; i += 2) {
+    for (int j = 0; j < cols; j += 2) {
+      if (tbl.MergeCells(tbl.GetCell(i, j), tbl.GetCell(i + 1, j))) merges++;
+    }
+  }
+  Result res = { merges, 0, m.Elapsed() };
+  m.Report("merge_cells", res);
+}
+
+// walk paragraphs and runs through Next()
+static void BenchTraverse()
+{
+  const size_t n = Scaled(200000);
+  Document doc;
+  for (size_t i = 0; i < n; i++) {
+    Paragraph p = doc.AppendParagraph();
+    p.AppendRun("The quick brown fox ");
+    p.AppendRun("jumps over ");
+    p.AppendRun("the lazy dog.");
+  }
+
+  Measure m;
+  size_t runs = 0, bytes = 0;
+  for (Paragraph p = doc.FirstParagraph(); p; p = p.Next()) {
+    for (Run r = p.FirstRun(); r; r = r.Next()) {
+      bytes += r.GetText().size();
+      runs++;
+    }
+  }
+  Result res = { runs, bytes, m.Elapsed() };
+  m.Report("traverse", res);
+}
+
+// save and open a document whose document.xml is about 100 MB
+static void BenchSaveOpen()
+{
+  const char* path = "minidocx_bench_save_open.docx";
+  // each paragraph serializes to roughly 230 bytes
+  const size_t n = Scaled(100u * 1024 * 1024 / 230);
+  Document doc;
+  for (size_t i = 0; i < n; i++) {
+    doc.AppendParagraph(LOREM);
+  }
+
+  Stats saveStats, openStats;
+
+  Measure m;
+  doc.Save(path, &saveStats);
+  const size_t fileSize = FileSize(path);
+  Result save = { n, n * 230, m.Elapsed() };
+  m.Report("save", save);
+
+  m.Restart();
+  Document doc2;
+  doc2.Open(path, &openStats);
+  Result open = { n, n * 230, m.Elapsed() };
+  m.Report("open", open);
+
+  std::printf("%-18s %10.2f MB on disk\n", "", fileSize / 1048576.0);
+  std::printf("save phases:\n");
+  PrintStats(saveStats);
+  std::printf("open phases:\n");
+  PrintStats(openStats);
+
+  // a metadata-only edit writes word/settings.xml again and copies the rest
+  const char* path2 = "minidocx_bench_save_vars.docx";
+  std::map<std::string, std::string> vars;
+  vars["revision"] = "2";
+  doc2.SetVars(vars);
+  m.Restart();
+  doc2.Save(path2);
+  Result saveVars = { 1, fileSize, m.Elapsed() };
+  m.Report("save_vars", saveVars);
+
+  std::remove(path);
+  std::remove(path2);
+}
+
+// FindBookmarks on 100k bookmarks
+static void BenchFindBookmarks()
+{
+  const char* path = "minidocx_bench_bookmarks.docx";
+  const size_t n = Scaled(100000);
+  {
+    Document doc;
+    std::string name;
+    for (size_t i = 0; i < n; i++) {
+      Run r = doc.AppendParagraph().AppendRun("bookmarked text");
+      name = "bm" + std::to_string(i);
+      doc.AddBookmark(name, r, r);
+    }
+    doc.Save(path);
+  }
+
+  Document doc;
+  doc.Open(path);
+
+  Measure m;
+  doc.FindBookmarks();
+  Result res = { n, 0, m.Elapsed() };
+  m.Report("find_bookmarks", res);
+  std::remove(path);
+}
+
+// iterate a 2,000-section catalog through Next(), FirstParagraph() and GetSection()
+static void BenchSections()
+{
+  const size_t n = Scaled(2000);
+  const size_t perSection = 10;
+  Document doc;
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = 0; j < perSection; j++) {
+      doc.AppendParagraph(LOREM);
+    }
+    doc.AppendSectionBreak();
+  }
+
+  Measure m;
+  size_t sections = 0;
+  for (Section s = doc.FirstSection(); s; s = s.Next()) {
+    Paragraph p = s.FirstParagraph();
+    if (p && p.GetSection() == s) sections++;
+  }
+  Result res = { sections, 0, m.Elapsed() };
+  m.Report("sections", res);
+}
+
+// give 1k sections page numbers and one of 10 headers, then save
+static void BenchHeaderFooter()
+{
+  const size_t n = Scaled(1000);
+  Document doc;
+  for (size_t i = 0; i < n; i++) {
+    doc.AppendParagraph(LOREM);
+    doc.AppendSectionBreak();
+  }
+
+  Measure m;
+  size_t sections = 0;
+  for (Section s = doc.FirstSection(); s; s = s.Next()) {
+    Fragment header;
+    header.AppendParagraph("Chapter " + std::to_string(sections % 10));
+    s.SetHeader(header);
+    s.SetPageNumber();
+    sections++;
+  }
+  const char* path = "minidocx_bench_header_footer.docx";
+  doc.Save(path);
+  Result res = { sections, FileSize(path), m.Elapsed() };
+  m.Report("header_footer", res);
+  std::remove(path);
+}
+
+// compile a template with 10k placeholders split across runs, then fill it 100 times
+static void BenchFill()
+{
+  const size_t n = Scaled(10000);
+  const size_t fills = 100;
+  Document doc;
+  for (size_t i = 0; i < n; i++) {
+    Paragraph p = doc.AppendParagraph();
+    p.AppendRun("Dear {{");
+    p.AppendRun("name");
+    p.AppendRun("}}, you owe {{amount}}.");
+  }
+  std::map<std::string, std::string> values;
+  values["name"] = "John Smith";
+  values["amount"] = "$100";
+
+  Measure m;
+  doc.CompileFields();
+  Result compile = { 2 * n, 0, m.Elapsed() };
+  m.Report("compile_fields", compile);
+
+  m.Restart();
+  for (size_t i = 0; i < fills; i++) {
+    doc.Fill(values);
+  }
+  Result fill = { 2 * n * fills, 0, m.Elapsed() };
+  m.Report("fill", fill);
+}
+
+// render 100 records from a template with 1k paragraphs and 2k fields
+static void BenchRender()
+{
+  const char* path = "minidocx_bench_template.docx";
+  const char* out = "minidocx_bench_render.docx";
+  const size_t n = Scaled(1000);
+  const size_t records = 100;
+  {
+    Document doc;
+    for (size_t i = 0; i < n; i++) {
+      doc.AppendParagraph("Dear {{name}}, you owe {{amount}}. " + std::string(LOREM));
+    }
+    doc.Save(path);
+  }
+
+  Measure m;
+  Template tpl;
+  tpl.Open(path);
+  Result open = { 1, 0, m.Elapsed() };
+  m.Report("template_open", open);
+
+  std::map<std::string, std::string> values;
+  m.Restart();
+  for (size_t i = 0; i < records; i++) {
+    values["name"] = "Customer " + std::to_string(i);
+    values["amount"] = "$" + std::to_string(i * 10);
+    tpl.Render(values, out);
+  }
+  Result render = { records, records * FileSize(out), m.Elapsed() };
+  m.Report("render", render);
+  std::remove(path);
+  std::remove(out);
+}
+
+// concatenate 20 documents of 5k paragraphs and 100 bookmarks each
+static void BenchConcat()
+{
+  const char* out = "minidocx_bench_concat.docx";
+  const size_t inputs = 20;
+  const size_t n = Scaled(5000);
+  std::vector<std::string> paths;
+  for (size_t k = 0; k < inputs; k++) {
+    paths.push_back("minidocx_bench_concat" + std::to_string(k) + ".docx");
+    Document doc;
+    for (size_t i = 0; i < n; i++) {
+      Paragraph p = doc.AppendParagraph(LOREM);
+      if (i % (n / 100 + 1) == 0) {
+        doc.AddBookmark("bm" + std::to_string(i), p.FirstRun(), p.FirstRun());
+      }
+    }
+    doc.Save(paths.back());
+  }
+
+  Measure m;
+  Concat(paths, out);
+  Result concat = { inputs * n, FileSize(out), m.Elapsed() };
+  m.Report("concat", concat);
+
+  Document doc;
+  m.Restart();
+  for (size_t k = 0; k < inputs; k++) {
+    Document other;
+    other.Open(paths[k]);
+    doc.Append(other);
+  }
+  Result append = { inputs * n, 0, m.Elapsed() };
+  m.Report("append", append);
+
+  for (size_t k = 0; k < inputs; k++) {
+    std::remove(paths[k].c_str());
+  }
+  std::remove(out);
+}
+
+// split a document of 200 sections with 250 paragraphs each
+static void BenchSplit()
+{
+  const char* path = "minidocx_bench_split.docx";
+  const size_t sections = 200;
+  const size_t n = Scaled(250);
+  {
+    Document doc;
+    for (size_t k = 0; k < sections; k++) {
+      for (size_t i = 0; i < n; i++) {
+        doc.AppendParagraph(LOREM);
+      }
+      if (k + 1 < sections) doc.AppendSectionBreak();
+    }
+    doc.Save(path);
+  }
+
+  Measure m;
+  const size_t files = SplitBySection(path, "minidocx_bench_split_{}.docx");
+  Result split = { files, FileSize(path), m.Elapsed() };
+  m.Report("split_by_section", split);
+
+  std::remove(path);
+  for (size_t k = 1; k <= files; k++) {
+    std::remove(("minidocx_bench_split_" + std::to_string(k) + ".docx").c_str());
+  }
+}
+
+// replace 200 tokens in 10k paragraphs split into three runs each
+static void BenchReplaceAll()
+{
+  const size_t n = Scaled(10000);
+  const size_t tokens = 200;
+  Document doc;
+  for (size_t i = 0; i < n; i++) {
+    Paragraph p = doc.AppendParagraph("Dear TOKEN" + std::to_string(i % tokens));
+    p.AppendRun(", TOK");
+    p.AppendRun("EN" + std::to_string((i + 1) % tokens) + " " + LOREM);
+  }
+
+  std::vector<std::pair<std::string, std::string> > replacements;
+  for (size_t k = 0; k < tokens; k++) {
+    replacements.push_back(std::make_pair("TOKEN" + std::to_string(k), "value " + std::to_string(k)));
+  }
+
+  Measure m;
+  const size_t count = doc.ReplaceAll(replacements);
+  Result replace = { count, n * (sizeof(LOREM) + 20), m.Elapsed() };
+  m.Report("replace_all", replace);
+}
+
+// index 100k paragraphs and run 1k queries against them
+static void BenchTextIndex()
+{
+  const size_t n = Scaled(100000);
+  const size_t queries = 1000;
+  Document doc;
+  for (size_t i = 0; i < n; i++) {
+    Paragraph p = doc.AppendParagraph(LOREM);
+    p.AppendRun(" item " + std::to_string(i));
+  }
+
+  Measure m;
+  TextIndex index;
+  index.Build(doc);
+  Result build = { n, n * (sizeof(LOREM) + 12), m.Elapsed() };
+  m.Report("text_index_build", build);
+
+  m.Restart();
+  size_t hits = 0;
+  for (size_t q = 0; q < queries; q++) {
+    hits += index.Find("item " + std::to_string(q * 97 % n)).size();
+  }
+  Result find = { queries, 0, m.Elapsed() };
+  m.Report("text_index_find", find);
+  if (hits == 0) std::printf("no hits\n");
+}
+
+// add a 1 MB picture file to 1k runs and save, only one copy is stored
+static void BenchPictures()
+{
+  const size_t n = Scaled(1000);
+  const char* picture = "minidocx_bench_picture.png";
+  std::string data("\x89PNG\r\n\x1a\n", 8);
+  data.reserve(1 << 20);
+  unsigned int x = 1;
+  while (data.size() < (1 << 20)) {
+    x = x * 1103515245 + 12345;
+    data.push_back(static_cast<char>(x >> 16));
+  }
+  FILE* f = std::fopen(picture, "wb");
+  if (f == NULL) return;
+  std::fwrite(data.data(), 1, data.size(), f);
+  std::fclose(f);
+
+  Document doc;
+  Measure m;
+  for (size_t i = 0; i < n; i++) {
+    doc.AppendParagraph().AppendRun("").AppendPicture(picture, 1440, 1440);
+  }
+  Result append = { n, data.size(), m.Elapsed() };
+  m.Report("pictures_append", append);
+
+  const char* path = "minidocx_bench_pictures.docx";
+  m.Restart();
+  doc.Save(path);
+  Result save = { 1, FileSize(path), m.Elapsed() };
+  m.Report("pictures_save", save);
+
+  std::remove(path);
+  std::remove(picture);
+}
+
+// convert 100k paragraphs of mixed runs and a 1k row table to text, Markdown
+// and HTML; peak RSS is reset after the input is written and should stay flat
+static void BenchConvert()
+{
+  const char* path = "minidocx_bench_convert.docx";
+  const size_t n = Scaled(100000);
+  const size_t rows = Scaled(1000);
+  {
+    Document doc;
+    for (size_t i = 0; i < n; i++) {
+      Paragraph p = doc.AppendParagraph(LOREM);
+      p.AppendRun("bold ").SetFontStyle(Run::Bold);
+      p.AppendRun("italic").SetFontStyle(Run::Italic);
+    }
+    Table table = doc.AppendTable(rows, 4);
+    for (size_t r = 0; r < rows; r++) {
+      for (int c = 0; c < 4; c++) {
+        table.GetCell(r, c).FirstParagraph().AppendRun("cell");
+      }
+    }
+    doc.Save(path);
+  }
+  ResetPeakRss();
+
+  const char* out = "minidocx_bench_convert.out";
+  const char* names[] = { "convert_text", "convert_markdown", "convert_html" };
+  bool (*converters[])(const std::string&, std::ostream&) = { ToText, ToMarkdown, ToHtml };
+  for (int k = 0; k < 3; k++) {
+    Measure m;
+    {
+      std::ofstream file(out, std::ios::binary);
+      if (!converters[k](path, file)) std::printf("%s failed\n", names[k]);
+    }
+    Result res = { n + rows, FileSize(out), m.Elapsed() };
+    m.Report(names[k], res);
+  }
+
+  std::remove(out);
+  std::remove(path);
+}
+
+// import 10k sections of a heading, two paragraphs, a list and a small table
+// from Markdown and from HTML
+static void BenchImport()
+{
+  const size_t n = Scaled(10000);
+  std::string markdown, html;
+  for (size_t i = 0; i < n; i++) {
+    const std::string heading = "Section " + std::to_string(i);
+    markdown += "## " + heading + "\n\n" + LOREM + "with **bold** and *italic* words.\n\n" + LOREM + "\n\n"
+      "- first item\n- second item with `code`\n\n| key | value |\n| --- | --- |\n| a | 1 |\n| b | 2 |\n\n";
+    html += "<h2>" + heading + "</h2>\n<p>" + LOREM + "with <b>bold</b> and <i>italic</i> words.</p>\n<p>" + LOREM + "</p>\n"
+      "<ul><li>first item</li><li>second item with <code>code</code></li></ul>\n"
+      "<table><tr><th>key</th><th>value</th></tr><tr><td>a</td><td>1</td></tr><tr><td>b</td><td>2</td></tr></table>\n";
+  }
+
+  {
+    Document doc;
+    Measure m;
+    doc.ImportMarkdown(markdown);
+    Result res = { n, markdown.size(), m.Elapsed() };
+    m.Report("import_markdown", res);
+  }
+  {
+    Document doc;
+    Measure m;
+    doc.ImportHtml(html);
+    Result res = { n, html.size(), m.Elapsed() };
+    m.Report("import_html", res);
+  }
+}
+
+// make 10k numbered lists of three items each and save
+static void BenchLists()
+{
+  const size_t n = Scaled(10000);
+  Document doc;
+  Measure m;
+  for (size_t i = 0; i < n; i++) {
+    const int list = doc.AddList(Document::ListFormat::Decimal);
+    for (int k = 0; k < 3; k++) {
+      doc.AppendParagraph(LOREM).SetNumbering(list, k);
+    }
+  }
+  Result add = { n, 0, m.Elapsed() };
+  m.Report("lists_add", add);
+
+  const char* path = "minidocx_bench_lists.docx";
+  m.Restart();
+  doc.Save(path);
+  Result save = { 1, FileSize(path), m.Elapsed() };
+  m.Report("lists_save", save);
+  std::remove(path);
+}
+
+// add 100k hyperlinks to 100 addresses and save
+static void BenchHyperlinks()
+{
+  const size_t n = Scaled(100000);
+  Document doc;
+  Measure m;
+  char url[64];
+  for (size_t i = 0; i < n; i++) {
+    std::snprintf(url, sizeof(url), "https://example.com/page/%u", static_cast<unsigned>(i % 100));
+    doc.AppendParagraph("See ").AppendHyperlink(url, "this page");
+  }
+  Result add = { n, 0, m.Elapsed() };
+  m.Report("hyperlinks_add", add);
+
+  const char* path = "minidocx_bench_hyperlinks.docx";
+  m.Restart();
+  doc.Save(path);
+  Result save = { 1, FileSize(path), m.Elapsed() };
+  m.Report("hyperlinks_save", save);
+  std::remove(path);
+}
+
+// insert a table of contents for 20k headings with a page break after each chapter
+static void BenchTableOfContents()
+{
+  const size_t n = Scaled(20000);
+  Document doc;
+  Paragraph title = doc.AppendParagraph("Report");
+  char heading[64];
+  for (size_t i = 0; i < n; i++) {
+    std::snprintf(heading, sizeof(heading), "## Section %u\n\n", static_cast<unsigned>(i));
+    doc.ImportMarkdown(i % 10 == 0 ? "# Chapter\n\n" + std::string(heading) : heading);
+    doc.AppendParagraph(LOREM);
+    if (i % 10 == 9) doc.AppendPageBreak();
+  }
+
+  Measure m;
+  const size_t entries = doc.InsertTableOfContents(title.Next());
+  Result res = { entries, 0, m.Elapsed() };
+  m.Report("table_of_contents", res);
+}
+
+// estimate the layout of 100k paragraphs, then again after an edit
+static void BenchLayout()
+{
+  const size_t n = Scaled(100000);
+  Document doc;
+  for (size_t i = 0; i < n; i++) {
+    doc.AppendParagraph(LOREM);
+    if (i % 100 == 99) doc.AppendTable(3, 3);
+  }
+
+  LayoutEstimate layout;
+  Measure m;
+  layout.Build(doc);
+  Result build = { n, 0, m.Elapsed() };
+  m.Report("layout_build", build);
+
+  Paragraph p = doc.AppendParagraph(LOREM);
+  m.Restart();
+  layout.Update(p);
+  const int pages = layout.GetPageCount();
+  Result update = { static_cast<size_t>(pages), 0, m.Elapsed() };
+  m.Report("layout_update", update);
+}
+
+// count the text of 100k paragraphs, then keep the counts while appending
+// 100k more and reading them after each
+static void BenchStatistics()
+{
+  const size_t n = Scaled(100000);
+  Document doc;
+  for (size_t i = 0; i < n; i++) {
+    doc.AppendParagraph(LOREM);
+  }
+
+  Measure m;
+  DocumentStatistics stats = doc.GetStatistics();
+  Result count = { n, 0, m.Elapsed() };
+  m.Report("statistics_count", count);
+
+  m.Restart();
+  size_t words = 0;
+  for (size_t i = 0; i < n; i++) {
+    doc.AppendParagraph().AppendRun("Some text ").AppendText("\xe4\xb8\xad\xe6\x96\x87 and more");
+    stats = doc.GetStatistics();
+    words += stats.words;
+  }
+  Result edit = { n, 0, m.Elapsed() };
+  m.Report("statistics_edit", edit);
+  if (words == 0) std::printf("no words\n");
+}
+
+struct Scenario
+{
+  const char* name;
+  void (*run)();
+};
+
+static const Scenario SCENARIOS[] = {
+  { "append_paragraphs", BenchAppendParagraphs },
+  { "append_text_view",  BenchAppendTextView },
+  { "append_utf8",       BenchAppendUtf8 },
+  { "append_with_breaks", BenchAppendWithBreaks },
+  { "table_get_cell",    BenchTableGetCell },
+  { "merge_cells",       BenchMergeCells },
+  { "traverse",          BenchTraverse },
+  { "save_open",         BenchSaveOpen },
+  { "find_bookmarks",    BenchFindBookmarks },
+  { "sections",          BenchSections },
+  { "header_footer",     BenchHeaderFooter },
+  { "fill",              BenchFill },
+  { "render",            BenchRender },
+  { "concat",            BenchConcat },
+  { "split_by_section",  BenchSplit },
+  { "replace_all",       BenchReplaceAll },
+  { "text_index",        BenchTextIndex },
+  { "pictures",          BenchPictures },
+  { "convert",           BenchConvert },
+  { "import",            BenchImport },
+  { "lists",             BenchLists },
+  { "hyperlinks",        BenchHyperlinks },
+  { "table_of_contents", BenchTableOfContents },
+  { "layout",            BenchLayout },
+  { "statistics",        BenchStatistics },
+};
+
+int main(int argc, char* argv[])
+{
+  const size_t count = sizeof(SCENARIOS) / sizeof(SCENARIOS[0]);
+  std::vector<const Scenario*> selected;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strncmp(argv[i], "--scale=", 8) == 0) {
+      g_scale = std::atof(argv[i] + 8);
+      if (g_scale <= 0) g_scale = 1.0;
+      continue;
+    }
+    if (std::strcmp(argv[i], "--list") == 0) {
+      for (size_t j = 0; j < count; j++) std::printf("%s\n", SCENARIOS[j].name);
+      return 0;
+    }
+    size_t j = 0;
+    while (j < count && std::strcmp(argv[i], SCENARIOS[j].name) != 0) j++;
+    if (j == count) {
+      std::fprintf(stderr, "unknown scenario: %s\n", argv[i]);
+      return 1;
+    }
+    selected.push_back(&SCENARIOS[j]);
+  }
+  if (selected.empty()) {
+    for (size_t j = 0; j < count; j++) selected.push_back(&SCENARIOS[j]);
+  }
+
+  std::printf("%-18s %10s %10s %12s %9s %10s %10s %10s\n",
+    "scenario", "items", "seconds", "items/s", "MB/s", "allocs", "alloc MB", "peak MB");
+  for (size_t i = 0; i < selected.size(); i++) {
+    ResetPeakRss();
+    selected[i]->run();
+    std::fflush(stdout);
+  }
+  return 0;
+}
@@ -7,18 +7,41 @@
 
 #include "minidocx.hpp"
 #include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 #include <cstring> // std::strlen(), std::strcmp()
-#include <cstdlib> // std::free()
+#include <cstdlib> // std::free(), std::strtoul()
+#include <cstdio> // std::snprintf()
 #include <cctype> // std::isspace()
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MINIDOCX_SSE2
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h> // _BitScanForward()
+#endif
 #include "zip.h"
 #include "pugixml.hpp"
 
  // Raw string literal R is danger removed Borland not supported him
 #define _RELS "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\"><Relationship Id=\"rId1\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/officeDocument\" Target=\"word/document.xml\"/></Relationships>"
 #define DOCUMENT_XML "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><w:document xmlns:wpc=\"http://schemas.microsoft.com/office/word/2010/wordprocessingCanvas\" xmlns:cx=\"http://schemas.microsoft.com/office/drawing/2014/chartex\" xmlns:cx1=\"http://schemas.microsoft.com/office/drawing/2015/9/8/chartex\" xmlns:cx2=\"http://schemas.microsoft.com/office/drawing/2015/10/21/chartex\" xmlns:cx3=\"http://schemas.microsoft.com/office/drawing/2016/5/9/chartex\" xmlns:cx4=\"http://schemas.microsoft.com/office/drawing/2016/5/10/chartex\" xmlns:cx5=\"http://schemas.microsoft.com/office/drawing/2016/5/11/chartex\" xmlns:cx6=\"http://schemas.microsoft.com/office/drawing/2016/5/12/chartex\" xmlns:cx7=\"http://schemas.microsoft.com/office/drawing/2016/5/13/chartex\" xmlns:cx8=\"http://schemas.microsoft.com/office/drawing/2016/5/14/chartex\" xmlns:mc=\"http://schemas.openxmlformats.org/markup-compatibility/2006\" xmlns:aink=\"http://schemas.microsoft.com/office/drawing/2016/ink\" xmlns:am3d=\"http://schemas.microsoft.com/office/drawing/2017/model3d\" xmlns:o=\"urn:schemas-microsoft-com:office:office\" xmlns:oel=\"http://schemas.microsoft.com/office/2019/extlst\" xmlns:r=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships\" xmlns:m=\"http://schemas.openxmlformats.org/officeDocument/2006/math\" xmlns:v=\"urn:schemas-microsoft-com:vml\" xmlns:wp14=\"http://schemas.microsoft.com/office/word/2010/wordprocessingDrawing\" xmlns:wp=\"http://schemas.openxmlformats.org/drawingml/2006/wordprocessingDrawing\" xmlns:w10=\"urn:schemas-microsoft-com:office:word\" xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\" xmlns:w14=\"http://schemas.microsoft.com/office/word/2010/wordml\" xmlns:w15=\"http://schemas.microsoft.com/office/word/2012/wordml\" xmlns:w16cex=\"http://schemas.microsoft.com/office/word/2018/wordml/cex\" xmlns:w16cid=\"http://schemas.microsoft.com/office/word/2016/wordml/cid\" xmlns:w16=\"http://schemas.microsoft.com/office/word/2018/wordml\" xmlns:w16sdtdh=\"http://schemas.microsoft.com/office/word/2020/wordml/sdtdatahash\" xmlns:w16se=\"http://schemas.microsoft.com/office/word/2015/wordml/symex\" xmlns:wpg=\"http://schemas.microsoft.com/office/word/2010/wordprocessingGroup\" xmlns:wpi=\"http://schemas.microsoft.com/office/word/2010/wordprocessingInk\" xmlns:wne=\"http://schemas.microsoft.com/office/word/2006/wordml\" xmlns:wps=\"http://schemas.microsoft.com/office/word/2010/wordprocessingShape\" mc:Ignorable=\"w14 w15 w16se w16cid w16 w16cex w16sdtdh wp14\"><w:body><w:sectPr><w:pgSz w:w=\"11906\" w:h=\"16838\" /><w:pgMar w:top=\"1440\" w:right=\"1800\" w:bottom=\"1440\" w:left=\"1800\" w:header=\"851\" w:footer=\"992\" w:gutter=\"0\" /><w:cols w:space=\"425\" /><w:docGrid w:type=\"lines\" w:linePitch=\"312\" /></w:sectPr></w:body></w:document>"
-#define CONTENT_TYPES_XML "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\"><Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\" /><Default Extension=\"xml\" ContentType=\"application/xml\" /><Override PartName=\"/word/document.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.document.main+xml\" /><Override PartName=\"/word/footer1.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.footer+xml\" /><Override PartName=\"/word/settings.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.settings+xml\" /></Types>"
-#define DOCUMENT_XML_RELS "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\"><Relationship Id=\"rId1\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/footer\" Target=\"footer1.xml\" /><Relationship Id=\"rId2\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/settings\" Target=\"settings.xml\" /></Relationships>"
-#define FOOTER1_XML "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><w:ftr xmlns:wpc=\"http://schemas.microsoft.com/office/word/2010/wordprocessingCanvas\" xmlns:cx=\"http://schemas.microsoft.com/office/drawing/2014/chartex\" xmlns:cx1=\"http://schemas.microsoft.com/office/drawing/2015/9/8/chartex\" xmlns:cx2=\"http://schemas.microsoft.com/office/drawing/2015/10/21/chartex\" xmlns:cx3=\"http://schemas.microsoft.com/office/drawing/2016/5/9/chartex\" xmlns:cx4=\"http://schemas.microsoft.com/office/drawing/2016/5/10/chartex\" xmlns:cx5=\"http://schemas.microsoft.com/office/drawing/2016/5/11/chartex\" xmlns:cx6=\"http://schemas.microsoft.com/office/drawing/2016/5/12/chartex\" xmlns:cx7=\"http://schemas.microsoft.com/office/drawing/2016/5/13/chartex\" xmlns:cx8=\"http://schemas.microsoft.com/office/drawing/2016/5/14/chartex\" xmlns:mc=\"http://schemas.openxmlformats.org/markup-compatibility/2006\" xmlns:aink=\"http://schemas.microsoft.com/office/drawing/2016/ink\" xmlns:am3d=\"http://schemas.microsoft.com/office/drawing/2017/model3d\" xmlns:o=\"urn:schemas-microsoft-com:office:office\" xmlns:oel=\"http://schemas.microsoft.com/office/2019/extlst\" xmlns:r=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships\" xmlns:m=\"http://schemas.openxmlformats.org/officeDocument/2006/math\" xmlns:v=\"urn:schemas-microsoft-com:vml\" xmlns:wp14=\"http://schemas.microsoft.com/office/word/2010/wordprocessingDrawing\" xmlns:wp=\"http://schemas.openxmlformats.org/drawingml/2006/wordprocessingDrawing\" xmlns:w10=\"urn:schemas-microsoft-com:office:word\" xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\" xmlns:w14=\"http://schemas.microsoft.com/office/word/2010/wordml\" xmlns:w15=\"http://schemas.microsoft.com/office/word/2012/wordml\" xmlns:w16cex=\"http://schemas.microsoft.com/office/word/2018/wordml/cex\" xmlns:w16cid=\"http://schemas.microsoft.com/office/word/2016/wordml/cid\" xmlns:w16=\"http://schemas.microsoft.com/office/word/2018/wordml\" xmlns:w16du=\"http://schemas.microsoft.com/office/word/2023/wordml/word16du\" xmlns:w16sdtdh=\"http://schemas.microsoft.com/office/word/2020/wordml/sdtdatahash\" xmlns:w16se=\"http://schemas.microsoft.com/office/word/2015/wordml/symex\" xmlns:wpg=\"http://schemas.microsoft.com/office/word/2010/wordprocessingGroup\" xmlns:wpi=\"http://schemas.microsoft.com/office/word/2010/wordprocessingInk\" xmlns:wne=\"http://schemas.microsoft.com/office/word/2006/wordml\" xmlns:wps=\"http://schemas.microsoft.com/office/word/2010/wordprocessingShape\" mc:Ignorable=\"w14 w15 w16se w16cid w16 w16cex w16sdtdh wp14\"><w:p><w:pPr><w:jc w:val=\"center\" /></w:pPr><w:r><w:fldChar w:fldCharType=\"begin\" /></w:r><w:r><w:instrText>PAGE \\* MERGEFORMAT</w:instrText></w:r><w:r><w:fldChar w:fldCharType=\"end\" /></w:r></w:p></w:ftr>"
+#define CONTENT_TYPES_XML "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\"><Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\" /><Default Extension=\"xml\" ContentType=\"application/xml\" /><Override PartName=\"/word/document.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.document.main+xml\" /><Override PartName=\"/word/settings.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.settings+xml\" /></Types>"
+#define DOCUMENT_XML_RELS "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\"><Relationship Id=\"rId2\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/settings\" Target=\"settings.xml\" /></Relationships>"
+#define HEADER_FOOTER_NAMESPACES " xmlns:wpc=\"http://schemas.microsoft.com/office/word/2010/wordprocessingCanvas\" xmlns:cx=\"http://schemas.microsoft.com/office/drawing/2014/chartex\" xmlns:cx1=\"http://schemas.microsoft.com/office/drawing/2015/9/8/chartex\" xmlns:cx2=\"http://schemas.microsoft.com/office/drawing/2015/10/21/chartex\" xmlns:cx3=\"http://schemas.microsoft.com/office/drawing/2016/5/9/chartex\" xmlns:cx4=\"http://schemas.microsoft.com/office/drawing/2016/5/10/chartex\" xmlns:cx5=\"http://schemas.microsoft.com/office/drawing/2016/5/11/chartex\" xmlns:cx6=\"http://schemas.microsoft.com/office/drawing/2016/5/12/chartex\" xmlns:cx7=\"http://schemas.microsoft.com/office/drawing/2016/5/13/chartex\" xmlns:cx8=\"http://schemas.microsoft.com/office/drawing/2016/5/14/chartex\" xmlns:mc=\"http://schemas.openxmlformats.org/markup-compatibility/2006\" xmlns:aink=\"http://schemas.microsoft.com/office/drawing/2016/ink\" xmlns:am3d=\"http://schemas.microsoft.com/office/drawing/2017/model3d\" xmlns:o=\"urn:schemas-microsoft-com:office:office\" xmlns:oel=\"http://schemas.microsoft.com/office/2019/extlst\" xmlns:r=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships\" xmlns:m=\"http://schemas.openxmlformats.org/officeDocument/2006/math\" xmlns:v=\"urn:schemas-microsoft-com:vml\" xmlns:wp14=\"http://schemas.microsoft.com/office/word/2010/wordprocessingDrawing\" xmlns:wp=\"http://schemas.openxmlformats.org/drawingml/2006/wordprocessingDrawing\" xmlns:w10=\"urn:schemas-microsoft-com:office:word\" xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\" xmlns:w14=\"http://schemas.microsoft.com/office/word/2010/wordml\" xmlns:w15=\"http://schemas.microsoft.com/office/word/2012/wordml\" xmlns:w16cex=\"http://schemas.microsoft.com/office/word/2018/wordml/cex\" xmlns:w16cid=\"http://schemas.microsoft.com/office/word/2016/wordml/cid\" xmlns:w16=\"http://schemas.microsoft.com/office/word/2018/wordml\" xmlns:w16du=\"http://schemas.microsoft.com/office/word/2023/wordml/word16du\" xmlns:w16sdtdh=\"http://schemas.microsoft.com/office/word/2020/wordml/sdtdatahash\" xmlns:w16se=\"http://schemas.microsoft.com/office/word/2015/wordml/symex\" xmlns:wpg=\"http://schemas.microsoft.com/office/word/2010/wordprocessingGroup\" xmlns:wpi=\"http://schemas.microsoft.com/office/word/2010/wordprocessingInk\" xmlns:wne=\"http://schemas.microsoft.com/office/word/2006/wordml\" xmlns:wps=\"http://schemas.microsoft.com/office/word/2010/wordprocessingShape\" mc:Ignorable=\"w14 w15 w16se w16cid w16 w16cex w16sdtdh wp14\""
+#define PAGE_NUMBER_XML "<w:p><w:pPr><w:jc w:val=\"center\" /></w:pPr><w:r><w:fldChar w:fldCharType=\"begin\" /></w:r><w:r><w:instrText>PAGE \\* MERGEFORMAT</w:instrText></w:r><w:r><w:fldChar w:fldCharType=\"end\" /></w:r></w:p>"
+#define NUMBERING_XML "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><w:numbering xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\"></w:numbering>"
+#define NUMBERING_TYPE "http://schemas.openxmlformats.org/officeDocument/2006/relationships/numbering"
+#define _RELS_APP "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\"><Relationship Id=\"rId1\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/officeDocument\" Target=\"word/document.xml\"/><Relationship Id=\"rId2\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/extended-properties\" Target=\"docProps/app.xml\"/></Relationships>"
+#define APP_XML "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><Properties xmlns=\"http://schemas.openxmlformats.org/officeDocument/2006/extended-properties\" xmlns:vt=\"http://schemas.openxmlformats.org/officeDocument/2006/docPropsVTypes\"><Application>minidocx</Application></Properties>"
 #define SETTINGS_XML "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><w:settings xmlns:mc=\"http://schemas.openxmlformats.org/markup-compatibility/2006\" xmlns:o=\"urn:schemas-microsoft-com:office:office\" xmlns:r=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships\" xmlns:m=\"http://schemas.openxmlformats.org/officeDocument/2006/math\" xmlns:v=\"urn:schemas-microsoft-com:vml\" xmlns:w10=\"urn:schemas-microsoft-com:office:word\" xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\" xmlns:w14=\"http://schemas.microsoft.com/office/word/2010/wordml\" xmlns:w15=\"http://schemas.microsoft.com/office/word/2012/wordml\" xmlns:w16cex=\"http://schemas.microsoft.com/office/word/2018/wordml/cex\" xmlns:w16cid=\"http://schemas.microsoft.com/office/word/2016/wordml/cid\" xmlns:w16=\"http://schemas.microsoft.com/office/word/2018/wordml\" xmlns:w16sdtdh=\"http://schemas.microsoft.com/office/word/2020/wordml/sdtdatahash\" xmlns:w16se=\"http://schemas.microsoft.com/office/word/2015/wordml/symex\" xmlns:sl=\"http://schemas.openxmlformats.org/schemaLibrary/2006/main\" mc:Ignorable=\"w14 w15 w16se w16cid w16 w16cex w16sdtdh\"></w:settings>"
 
 namespace docx
@@ -104,6 +127,16 @@ namespace docx
     }
   };
 
+  // the children of a node as xml
+  std::string SerializeChildren(const pugi::xml_node& node)
+  {
+    xml_string_writer writer;
+    for (pugi::xml_node child = node.first_child(); child; child = child.next_sibling()) {
+      child.print(writer, "", pugi::format_raw);
+    }
+    return writer.result;
+  }
+
   pugi::xml_node GetLastChild(pugi::xml_node node, const char* name)
   {
     pugi::xml_node child = node.last_child();
@@ -113,6 +146,495 @@ namespace docx
     return child;
   }
 
+  // w:pPr, w:tblPr, w:sectPr, ...
+  bool IsPropertyElement(const char* name)
+  {
+    const size_t len = std::strlen(name);
+    return len >= 2 && name[len - 2] == 'P' && name[len - 1] == 'r';
+  }
+
+  // returns the node following 'node' in document order without leaving 'root',
+  // the children of 'node' are skipped unless 'descend' is true
+  pugi::xml_node NextNode(pugi::xml_node node, const pugi::xml_node& root, const bool descend)
+  {
+    if (descend && node.first_child()) return node.first_child();
+    while (node != root && !node.next_sibling()) {
+      node = node.parent();
+    }
+    if (node == root) return pugi::xml_node();
+    return node.next_sibling();
+  }
+
+  // the outermost paragraph holding node, paragraphs in text boxes are part of it
+  pugi::xml_node OuterParagraph(pugi::xml_node node)
+  {
+    pugi::xml_node w_p;
+    for (; node && node.type() == pugi::node_element; node = node.parent()) {
+      if (std::strcmp(node.name(), "w:p") == 0) w_p = node;
+    }
+    return w_p;
+  }
+
+  // the index of the lowest set bit of a non-zero mask
+  unsigned int LowestBit(const unsigned int mask)
+  {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned int>(index);
+#else
+    return static_cast<unsigned int>(__builtin_ctz(mask));
+#endif
+  }
+
+  // Returns the length of the leading printable ASCII of text, that is the
+  // position of the first byte below 0x20 or above 0x7F. Read as signed, both
+  // are less than 0x20, so one comparison per vector finds them.
+  size_t PrintableAsciiLength(const char* text, const size_t size)
+  {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i limit32 = _mm256_set1_epi8(0x20);
+    for (; i + 32 <= size; i += 32) {
+      const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+      const unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(limit32, v)));
+      if (mask != 0) return i + LowestBit(mask);
+    }
+#endif
+#if defined(__AVX2__) || defined(MINIDOCX_SSE2)
+    const __m128i limit16 = _mm_set1_epi8(0x20);
+    for (; i + 16 <= size; i += 16) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+      const unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmplt_epi8(v, limit16)));
+      if (mask != 0) return i + LowestBit(mask);
+    }
+#endif
+    for (; i < size; i++) {
+      const unsigned char ch = static_cast<unsigned char>(text[i]);
+      if (ch < 0x20 || ch > 0x7F) break;
+    }
+    return i;
+  }
+
+  // the length of the well-formed UTF-8 sequence at text that XML 1.0 allows, 0 if none
+  size_t Utf8SequenceLength(const unsigned char* text, const size_t size)
+  {
+    const unsigned char c = text[0];
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xBF; // range of the second byte
+    if (c < 0xC2) return 0;
+    if (c < 0xE0) n = 2;
+    else if (c < 0xF0) {
+      n = 3;
+      if (c == 0xE0) lo = 0xA0;
+      if (c == 0xED) hi = 0x9F; // surrogates
+    }
+    else if (c < 0xF5) {
+      n = 4;
+      if (c == 0xF0) lo = 0x90;
+      if (c == 0xF4) hi = 0x8F;
+    }
+    else return 0;
+
+    if (size < n || text[1] < lo || text[1] > hi) return 0;
+    for (size_t k = 2; k < n; k++) {
+      if (text[k] < 0x80 || text[k] > 0xBF) return 0;
+    }
+    // U+FFFE and U+FFFF
+    if (n == 3 && c == 0xEF && text[1] == 0xBF && text[2] >= 0xBE) return 0;
+    return n;
+  }
+
+  // Checks that text can go into the document as is. Control characters other
+  // than tab, line feed and carriage return are not allowed by XML 1.0 and are
+  // dropped; malformed UTF-8 is replaced with U+FFFD. Returns true if the text
+  // is clean, otherwise writes the cleaned text to 'clean'.
+  bool SanitizeText(const char* text, const size_t size, std::string& clean)
+  {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(text);
+    size_t begin = 0; // of the text not copied to 'clean' yet
+    size_t i = 0;
+    bool dirty = false;
+    while (true) {
+      i += PrintableAsciiLength(text + i, size - i);
+      if (i == size) break;
+
+      size_t n = 1;
+      const char* replacement = NULL;
+      if (p[i] < 0x20) {
+        if (p[i] != '\t' && p[i] != '\n' && p[i] != '\r') replacement = "";
+      }
+      else if (p[i] >= 0x80) {
+        n = Utf8SequenceLength(p + i, size - i);
+        if (n == 0) {
+          n = 1;
+          replacement = "\xEF\xBF\xBD";
+        }
+      }
+      if (replacement != NULL) {
+        if (!dirty) {
+          clean.clear();
+          clean.reserve(size + 16);
+          dirty = true;
+        }
+        clean.append(text + begin, i - begin);
+        clean += replacement;
+        begin = i + n;
+      }
+      i += n;
+    }
+    if (dirty) clean.append(text + begin, size - begin);
+    return !dirty;
+  }
+
+  bool IsXmlSpace(const char ch)
+  {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+  }
+
+  // appends a w:t element holding clean text
+  void AppendTextElement(pugi::xml_node w_r, const char* text, const size_t size)
+  {
+    pugi::xml_node w_t = w_r.append_child("w:t");
+    if (size > 0 && (IsXmlSpace(text[0]) || IsXmlSpace(text[size - 1]))) {
+      w_t.append_attribute("xml:space") = "preserve";
+    }
+    w_t.text().set(text, size);
+  }
+
+  // sets the text of a w:t element, keeping leading and trailing spaces
+  void SetText(pugi::xml_node w_t, const char* text, const size_t size)
+  {
+    if (!w_t.attribute("xml:space")) {
+      w_t.append_attribute("xml:space") = "preserve";
+    }
+    std::string clean;
+    if (SanitizeText(text, size, clean)) w_t.text().set(text, size);
+    else w_t.text().set(clean.data(), clean.size());
+  }
+
+  // a w:t element and where its text begins in the text of the paragraph
+  struct TextSegment
+  {
+    pugi::xml_node w_t;
+    size_t offset;
+    size_t length;
+  };
+
+  // Collects the w:t elements of the runs of a paragraph, including runs nested
+  // in hyperlinks, smart tags and content controls, and returns their text.
+  std::string CollectText(const pugi::xml_node& w_p, std::vector<TextSegment>& segments)
+  {
+    std::string text;
+    segments.clear();
+
+    pugi::xml_node node = w_p.first_child();
+    while (node) {
+      const char* name = node.name();
+      if (std::strcmp(name, "w:r") == 0) {
+        for (pugi::xml_node w_t = node.child("w:t"); w_t; w_t = w_t.next_sibling("w:t")) {
+          const char* t = w_t.text().get();
+          const size_t length = std::strlen(t);
+          if (length == 0) continue;
+          TextSegment seg = { w_t, text.size(), length };
+          segments.push_back(seg);
+          text.append(t, length);
+        }
+        node = NextNode(node, w_p, false);
+      }
+      else {
+        const bool descend = node.type() == pugi::node_element
+          && std::strcmp(name, "w:p") != 0 && !IsPropertyElement(name);
+        node = NextNode(node, w_p, descend);
+      }
+    }
+    return text;
+  }
+
+  bool CompareSegmentOffset(const size_t offset, const TextSegment& seg)
+  {
+    return offset < seg.offset;
+  }
+
+  // Replaces the characters [begin, end) of the text returned by CollectText()
+  // with a single w:t element in the run where 'begin' lies, and returns it.
+  // Only the segments before 'begin' remain valid, so splice back to front;
+  // the text after 'end' may already have been edited.
+  pugi::xml_node SpliceText(const std::vector<TextSegment>& segments, const size_t begin, const size_t end,
+    const char* text, const size_t size)
+  {
+    // the segments containing the first and the last character
+    const size_t i = std::upper_bound(segments.begin(), segments.end(), begin, CompareSegmentOffset) - segments.begin() - 1;
+    const size_t j = std::upper_bound(segments.begin(), segments.end(), end - 1, CompareSegmentOffset) - segments.begin() - 1;
+
+    const TextSegment& first = segments[i];
+    const TextSegment& last = segments[j];
+    const std::string tail(last.w_t.text().get() + (end - last.offset));
+
+    pugi::xml_node w_t = first.w_t;
+    if (begin > first.offset) {
+      const std::string head(first.w_t.text().get(), begin - first.offset);
+      SetText(first.w_t, head.c_str(), head.size());
+      w_t = first.w_t.parent().insert_child_after("w:t", first.w_t);
+    }
+    SetText(w_t, text, size);
+
+    for (size_t k = i + 1; k < j; k++) {
+      segments[k].w_t.parent().remove_child(segments[k].w_t);
+    }
+
+    if (i == j) {
+      if (!tail.empty()) {
+        pugi::xml_node w_tail = w_t.parent().insert_child_after("w:t", w_t);
+        SetText(w_tail, tail.c_str(), tail.size());
+      }
+    }
+    else if (tail.empty()) {
+      last.w_t.parent().remove_child(last.w_t);
+    }
+    else {
+      SetText(last.w_t, tail.c_str(), tail.size());
+    }
+    return w_t;
+  }
+
+  struct NodeHash
+  {
+    size_t operator()(const pugi::xml_node& node) const
+    {
+      return node.hash_value();
+    }
+  };
+
+
+  typedef std::chrono::steady_clock Clock;
+
+  double Seconds(const Clock::time_point& start)
+  {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  size_t CountNodes(const pugi::xml_node& root)
+  {
+    size_t count = 0;
+    pugi::xml_node node = root.first_child();
+    while (node) {
+      count++;
+      if (node.first_child()) {
+        node = node.first_child();
+        continue;
+      }
+      while (!node.next_sibling() && node != root) {
+        node = node.parent();
+      }
+      if (node == root) break;
+      node = node.next_sibling();
+    }
+    return count;
+  }
+
+#if defined(MINIDOCX_COUNT_ALLOCATIONS)
+  // The statistics of the current thread. pugixml has only global memory
+  // management functions, so counting DOM allocations is a build option: the
+  // counting allocator replaces any the application installed, for the whole
+  // process, the first time statistics are requested. It counts nothing
+  // while this is NULL.
+  static thread_local Stats* statsOfThread = NULL;
+
+  void* CountingAllocate(size_t size)
+  {
+    Stats* stats = statsOfThread;
+    if (stats != NULL) {
+      stats->allocations++;
+      stats->allocatedBytes += size;
+    }
+    return std::malloc(size);
+  }
+
+  void CountingDeallocate(void* ptr)
+  {
+    std::free(ptr);
+  }
+#endif
+
+  struct StatsScope
+  {
+    Stats* stats_;
+    Clock::time_point start_;
+
+    StatsScope(Stats* stats) : stats_(stats)
+    {
+      if (stats_ == NULL) return;
+      *stats_ = Stats();
+#if defined(MINIDOCX_COUNT_ALLOCATIONS)
+      static const bool installed = (pugi::set_memory_management_functions(CountingAllocate, CountingDeallocate), true);
+      (void)installed;
+      statsOfThread = stats_;
+#endif
+      start_ = Clock::now();
+    }
+
+    ~StatsScope()
+    {
+      if (stats_ == NULL) return;
+      stats_->totalTime = Seconds(start_);
+#if defined(MINIDOCX_COUNT_ALLOCATIONS)
+      statsOfThread = NULL;
+#endif
+    }
+  };
+
+  // writes one part to the archive
+  bool WritePart(struct zip_t* zip, const char* name, const char* data, const size_t size, Stats* stats)
+  {
+    Clock::time_point start;
+    if (stats != NULL) start = Clock::now();
+
+    if (zip_entry_open(zip, name) != 0) return false;
+    bool ok = zip_entry_write(zip, data, size) == 0;
+    ok = zip_entry_close(zip) == 0 && ok;
+
+    if (stats != NULL) {
+      PartStats part = { name, size, 0, 0, Seconds(start) };
+      stats->parts.push_back(part);
+    }
+    return ok;
+  }
+
+  // serializes a DOM part and writes it to the archive
+  bool WritePart(struct zip_t* zip, const char* name, const pugi::xml_document& doc, Stats* stats)
+  {
+    Clock::time_point start;
+    if (stats != NULL) start = Clock::now();
+
+    xml_string_writer writer;
+    doc.save(writer, "", pugi::format_raw);
+
+    double xmlTime = 0;
+    if (stats != NULL) xmlTime = Seconds(start);
+
+    if (!WritePart(zip, name, writer.result.data(), writer.result.size(), stats)) return false;
+
+    if (stats != NULL) {
+      stats->parts.back().nodes = CountNodes(doc);
+      stats->parts.back().xmlTime = xmlTime;
+    }
+    return true;
+  }
+
+  // reads one part from the archive and parses it
+  bool ReadPart(struct zip_t* zip, const char* name, pugi::xml_document& doc, Stats* stats)
+  {
+    Clock::time_point start;
+    if (stats != NULL) start = Clock::now();
+
+    if (zip_entry_open(zip, name) < 0) {
+      return false;
+    }
+    void* buf = NULL;
+    size_t bufsize = 0;
+    zip_entry_read(zip, &buf, &bufsize);
+    zip_entry_close(zip);
+
+    double zipTime = 0;
+    if (stats != NULL) {
+      zipTime = Seconds(start);
+      start = Clock::now();
+    }
+
+    // keep entities and whitespace-only text such as <w:t xml:space="preserve"> </w:t>
+    doc.load_buffer(buf, bufsize, pugi::parse_default | pugi::parse_declaration | pugi::parse_ws_pcdata_single);
+    std::free(buf);
+
+    if (stats != NULL) {
+      PartStats part = { name, bufsize, CountNodes(doc), Seconds(start), zipTime };
+      stats->parts.push_back(part);
+    }
+    return true;
+  }
+
+  size_t AppendToString(void* arg, uint64_t /*offset*/, const void* data, size_t size)
+  {
+    static_cast<std::string*>(arg)->append(static_cast<const char*>(data), size);
+    return size;
+  }
+
+  // reads a whole entry, false if it does not exist
+  bool ReadEntry(struct zip_t* zip, const std::string& name, std::string& data)
+  {
+    data.clear();
+    if (zip_entry_open(zip, name.c_str()) < 0) return false;
+    const int err = zip_entry_extract(zip, AppendToString, &data);
+    zip_entry_close(zip);
+    return err == 0;
+  }
+
+  // "word/document.xml" -> "word/"
+  std::string DirName(const std::string& path)
+  {
+    const size_t slash = path.rfind('/');
+    return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+  }
+
+  // "word/document.xml" -> "word/_rels/document.xml.rels"
+  std::string RelsPath(const std::string& part)
+  {
+    const std::string dir = DirName(part);
+    return dir + "_rels/" + part.substr(dir.size()) + ".rels";
+  }
+
+  // resolves the target of a relationship against the folder of its source
+  std::string ResolveTarget(const std::string& dir, const std::string& target)
+  {
+    std::string path = target[0] == '/' ? target.substr(1) : dir + target;
+    std::string resolved;
+    size_t begin = 0;
+    while (begin <= path.size()) {
+      size_t end = path.find('/', begin);
+      if (end == std::string::npos) end = path.size();
+      const std::string seg = path.substr(begin, end - begin);
+      if (seg == "..") {
+        const size_t slash = resolved.rfind('/', resolved.size() - 2);
+        resolved.erase(slash == std::string::npos || resolved.size() < 2 ? 0 : slash + 1);
+      }
+      else if (!seg.empty() && seg != ".") {
+        resolved += seg;
+        if (end < path.size()) resolved += '/';
+      }
+      begin = end + 1;
+    }
+    return resolved;
+  }
+
+  // the target to write in a relationship of a part in 'dir'
+  std::string RelativeTarget(const std::string& dir, const std::string& path)
+  {
+    if (path.compare(0, dir.size(), dir) == 0) return path.substr(dir.size());
+    return "/" + path;
+  }
+
+  // "word/media/image1.png" of the second copy becomes "word/media/image1_2.png"
+  std::string NumberedName(const std::string& name, const size_t n)
+  {
+    const size_t dot = name.rfind('.');
+    const size_t stem = dot == std::string::npos || dot < name.rfind('/') + 1 ? name.size() : dot;
+    return name.substr(0, stem) + "_" + std::to_string(n) + name.substr(stem);
+  }
+
+  // reads a whole file
+  bool ReadFile(const std::string& path, std::string& data)
+  {
+    data.clear();
+    FILE* f = std::fopen(path.c_str(), "rb");
+    if (f == NULL) return false;
+    char buffer[1 << 14];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), f)) > 0) data.append(buffer, n);
+    const bool ok = !std::ferror(f);
+    std::fclose(f);
+    return ok;
+  }
+
 
   void SetBorders(pugi::xml_node& w_bdrs, const char* elemName, const Box::BorderStyle style, const double width, const char* color)
   {
@@ -166,6 +688,139 @@ namespace docx
   }
 
 
+  // the parts of a package Document::Save() writes again when changed
+  const unsigned int DIRTY_DOCUMENT = 1; // word/document.xml
+  const unsigned int DIRTY_SETTINGS = 2; // word/settings.xml
+  const unsigned int DIRTY_PACKAGE  = 4; // word/_rels/document.xml.rels and [Content_Types].xml
+  const unsigned int DIRTY_NUMBERING = 8; // word/numbering.xml
+  const unsigned int DIRTY_ALL      = 15;
+
+  // moves a file over another one, which may exist
+  bool ReplaceFile(const std::string& from, const std::string& to)
+  {
+    if (std::rename(from.c_str(), to.c_str()) == 0) return true;
+    // rename() does not replace an existing file on Windows
+    std::remove(to.c_str());
+    return std::rename(from.c_str(), to.c_str()) == 0;
+  }
+
+  struct Bookmark::Impl
+  {
+    unsigned int id_;
+    std::string name_;
+    pugi::xml_node w_bookmarkStart_;
+    pugi::xml_node w_bookmarkEnd_;
+  };
+
+  // the counts of the text of a paragraph
+  struct TextStats
+  {
+    size_t words;
+    size_t characters;
+    size_t charactersWithSpaces;
+    int last; // the class of the last character: 0 none or a space, 1 a letter, 2 an ideograph
+    TextStats() : words(0), characters(0), charactersWithSpaces(0), last(0) {}
+  };
+
+  // a patch point of Document::Fill()
+  struct Field
+  {
+    std::string name_;
+    pugi::xml_node w_t_;                    // receives the value
+    pugi::xml_node w_bookmarkStart_;        // bookmark fields only
+    unsigned int bookmarkId_;               // bookmark fields only
+    std::vector<pugi::xml_node> w_t_rest_;  // the rest of the bookmark text, removed by the first fill
+  };
+
+  // a field whose bookmark was removed, skipped until the fields are compacted
+  bool IsDeadField(const Field& f)
+  {
+    return !f.w_t_ && !f.w_bookmarkStart_;
+  }
+
+  struct Relationship
+  {
+    std::string id_;
+    std::string type_;
+    std::string target_;
+    bool external_;
+  };
+
+  // The parts of a package, the relationships of word/document.xml and the
+  // content types. Relationships are indexed by id, by type and by type and
+  // target, and ids are allocated past the highest one, so adding or finding
+  // one costs O(1) however many the package has.
+  struct Package
+  {
+    std::unordered_set<std::string> parts_; // entries of the archive
+    std::vector<Relationship> rels_;
+    std::unordered_map<std::string, size_t> relById_;
+    std::unordered_map<std::string, size_t> relByType_;   // the first of each type
+    std::unordered_map<std::string, size_t> relByTarget_; // see TargetKey()
+    unsigned int nextRelId_;
+    std::vector<std::pair<std::string, std::string> > defaults_;  // extension, content type
+    std::vector<std::pair<std::string, std::string> > overrides_; // part name, content type
+    std::unordered_map<std::string, size_t> defaultByExt_;
+    std::unordered_map<std::string, size_t> overrideByPart_;
+
+    Package() : nextRelId_(1) {}
+    void Clear();
+    void LoadRelationships(const pugi::xml_document& rels);
+    void LoadContentTypes(const pugi::xml_document& types);
+
+    const Relationship* GetRelationship(const std::string& id) const;
+    const Relationship* FindRelationship(const std::string& type) const;
+    const Relationship* FindRelationship(const std::string& type, const std::string& target, const bool external) const;
+    // returns the id of an equal relationship if there is one
+    std::string AddRelationship(const std::string& type, const std::string& target, const bool external = false);
+
+    std::string ContentType(const std::string& part) const; // part is "word/document.xml"
+    bool AddDefault(const std::string& ext, const std::string& type);
+    bool AddOverride(const std::string& partName, const std::string& type);
+
+    std::string SaveRelationships() const;
+    std::string SaveContentTypes() const;
+
+    static std::string TargetKey(const std::string& type, const std::string& target, const bool external);
+  };
+
+  // a picture of the package
+  struct Media
+  {
+    std::string name_;  // "word/media/image1.png"
+    std::string path_;  // streamed from this file when saving, unless
+    std::string data_;  // the picture was given in memory
+    std::string relId_;
+    bool compress_;     // false for formats that are compressed already
+    bool saved_;        // in the source archive
+  };
+
+  // a header or footer part, never changed once created
+  struct HeaderFooterPart
+  {
+    std::string name_;  // "word/header1.xml"
+    std::string relId_;
+    std::string xml_;
+    bool saved_;
+  };
+
+  // a part copied from another package by Document::Append(), written as it is
+  struct CopiedPart
+  {
+    std::string name_;
+    std::string data_;
+    bool saved_;
+  };
+
+  // the parts another package is about to give, staged until all could be read
+  struct PartImport
+  {
+    std::vector<CopiedPart> parts_;
+    std::unordered_map<std::string, std::string> names_; // part of the other package -> name here
+    std::unordered_set<std::string> taken_;
+    std::vector<std::pair<std::string, std::string> > types_; // part name, content type
+  };
+
   struct Document::Impl
   {
     pugi::xml_document doc_;
@@ -175,23 +830,164 @@ namespace docx
     pugi::xml_document settings_;
     pugi::xml_node     w_settings_;
 
+    // bookmark index
     unsigned int nextBookmarkId_;
-    std::vector<Bookmark> bookmarks_;
-  };
+    std::unordered_map<unsigned int, Bookmark::Impl> bookmarks_; // by id
+    std::unordered_map<std::string, unsigned int> bookmarkIds_;  // by name
+
+    void ForgetBookmark(std::unordered_map<unsigned int, Bookmark::Impl>::iterator it);
+    // forgets the bookmarks starting or ending inside a subtree that is about to be
+    // removed, the other end of a bookmark crossing the subtree is removed as well
+    void ForgetBookmarks(const pugi::xml_node& root);
+
+    // template fields
+    bool fieldsCompiled_;
+    std::vector<Field> fields_;
+    std::unordered_map<unsigned int, size_t> bookmarkFields_; // index in fields_ by bookmark id
+    std::unordered_map<pugi::xml_node, size_t, NodeHash> fieldTexts_; // index in fields_ by w:t, may hold stale entries
+    size_t deadFields_;
+
+    // drops the fields inside a subtree that is about to be removed
+    void DropFields(const pugi::xml_node& root);
+    void CompactFields();
+    void IndexField(const size_t i);
+    void SetField(const size_t i, const char* text, const size_t size);
+
+    // The archive the document was read from or last written to, and the parts
+    // changed since. Handles returned by the document may change its body, so
+    // handing one out marks word/document.xml as changed.
+    std::string source_;
+    unsigned int dirty_;
+
+    bool SaveChanges(const std::string& path, Stats* stats);
+
+    // word/_rels/document.xml.rels, [Content_Types].xml and the entries of the source
+    Package package_;
+
+    void LoadPackage(struct zip_t* zip);
+    std::string AddRelationship(const char* type, const std::string& target, const bool external = false);
+    void AddDefaultContentType(const char* ext, const char* type);
+    void AddOverrideContentType(const std::string& partName, const char* type);
+
+    // pictures, each distinct content is stored once
+    std::vector<Media> media_;
+    std::unordered_map<std::string, size_t> mediaByPath_;
+    std::unordered_multimap<unsigned long long, size_t> mediaByHash_;
+    unsigned int nextImage_;
+    unsigned int nextDrawingId_; // 0 until the body was searched for wp:docPr
+
+    size_t AddMedia(const std::string& path, const char* data, const size_t size);
+    bool AppendDrawing(pugi::xml_node w_r, const size_t media, const int w, const int h);
+    bool WriteMedia(const std::string& path, const bool all, Stats* stats);
+
+    // headers and footers, sections with the same content share a part
+    std::vector<HeaderFooterPart> headerFooters_;
+    std::unordered_map<std::string, size_t> headerFooterByContent_;
+    unsigned int nextHeader_;
+    unsigned int nextFooter_;
+
+    std::string AddHeaderFooter(const bool header, const std::string& content);
+    // the part with this content added since Open(), NULL if there is none
+    const HeaderFooterPart* FindHeaderFooter(const bool header, const std::string& content) const;
+    void WriteHeaderFooters(struct zip_t* zip, const bool all, Stats* stats);
+
+    // parts copied from other packages since Open()
+    std::vector<CopiedPart> copiedParts_;
+
+    bool HasPart(const std::string& name) const;
+    bool ReadCopiedPart(struct zip_t* source, const std::string& name, std::string& data) const;
+    std::string StagePart(const Impl& other, struct zip_t* source, const std::string& src, PartImport& import) const;
+    void WriteCopiedParts(struct zip_t* zip, const bool all, Stats* stats);
+
+    // maps the relationships used by content of another document, copying the
+    // parts they refer to; nothing is added when one of them cannot be resolved
+    bool ImportRelationships(const Impl& other, const pugi::xml_node& root, std::unordered_map<std::string, std::string>& ids);
+    static void MapRelationships(const pugi::xml_node& root, const std::unordered_map<std::string, std::string>& ids);
+
+    // lists, the numbering part is created with the first one
+    pugi::xml_document numbering_;
+    pugi::xml_node     w_numbering_;
+    std::string numberingPart_;
+    int nextNumId_;
+    int nextAbstractNumId_;
+    std::unordered_map<int, int> abstractNums_; // w:abstractNumId by list format
+
+    void LoadNumbering(struct zip_t* zip, Stats* stats);
+    bool CreateNumbering();
+    int AbstractNum(const ListFormat format);
+    int AddList(const ListFormat format);
+    // gives the lists referenced by content taken from another document new ids
+    void ImportNumbering(const Impl& other, pugi::xml_node node, std::unordered_map<int, int>& numIds, std::unordered_map<int, int>& abstractNumIds);
+
+    // Statistics, counted by GetStatistics() and kept up to date from then on.
+    // Only paragraphs with text have an entry.
+    bool statsTracked_;
+    DocumentStatistics stats_;
+    std::unordered_map<pugi::xml_node, TextStats, NodeHash> paragraphStats_;
+
+    void CountStatistics(DocumentStatistics& stats, const bool track);
+    void StopStatistics();
+    void AddStatistics(const TextStats& s, const bool add);
+    void CountContent(const pugi::xml_node& node, const bool add); // the paragraphs in node, added or about to be removed
+    void CountContentAfter(const pugi::xml_node& last);            // the body content appended after last
+    void RecountParagraph(const pugi::xml_node& node);             // the paragraph holding node
+    void TextAppended(const pugi::xml_node& w_p, const pugi::xml_node& w_r, const char* text, const size_t size);
+    void UpdateAppProperties(pugi::xml_document& app, const DocumentStatistics& stats);
+    // the document owning node if it tracks statistics, cheap while none does;
+    // owner, when known, saves the lookup
+    static Impl* Tracking(const pugi::xml_node& node, Impl* owner = NULL);
+
+    static std::atomic<int>& TrackingCount()
+    {
+      static std::atomic<int> count(0);
+      return count;
+    }
 
-  struct Bookmark::Impl
-  {
-    unsigned int id_;
-    std::string name_;
-    pugi::xml_node w_bookmarkStart_;
-    pugi::xml_node w_bookmarkEnd_;
+    // the statistics for docProps/app.xml, counted in place unless they are tracked
+    DocumentStatistics SavedStatistics();
+
+    // the document owning a DOM, for handles that do not keep one
+    static Impl* Owner(const pugi::xml_node& node, Impl* owner = NULL);
+    void Register();
+    void Unregister();
+
+    static std::unordered_map<const void*, Impl*>& Owners()
+    {
+      static std::unordered_map<const void*, Impl*> owners;
+      return owners;
+    }
+
+    static std::mutex& OwnersMutex()
+    {
+      static std::mutex mutex;
+      return mutex;
+    }
+
+    // section index, built by the first section lookup
+    bool sectionsIndexed_;
+    std::vector<pugi::xml_node> sections_; // the w:sectPr of each section, the body's comes last
+    std::unordered_map<pugi::xml_node, size_t, NodeHash> sectionIndex_;         // w:sectPr -> position in sections_
+    std::unordered_map<pugi::xml_node, pugi::xml_node, NodeHash> sectionOf_;    // body paragraph -> w:sectPr
+
+    void IndexSections();
+    void RenumberSections(const size_t from);
+    pugi::xml_node SectionOf(const pugi::xml_node& w_p);
+    size_t SectionIndex(const pugi::xml_node& w_sectPr);
+    void IndexParagraph(const pugi::xml_node& w_p);
+    void RelabelSection(pugi::xml_node w_p, const pugi::xml_node& w_sectPr);
+    void IndexSplit(const pugi::xml_node& w_p, const pugi::xml_node& w_sectPr_new);
+    void IndexMerge(const pugi::xml_node& w_p, const pugi::xml_node& w_sectPr);
+    void UnindexParagraph(const pugi::xml_node& w_p);
   };
 
   struct Paragraph::Impl
   {
+    Document::Impl* doc_;   // NULL for paragraphs in table cells
+    Document::Impl* owner_; // the document holding the paragraph, NULL if not known
     pugi::xml_node w_body_;
     pugi::xml_node w_p_;
     pugi::xml_node w_pPr_;
+    Impl() : doc_(NULL), owner_(NULL) {}
   };
 
   struct TextFrame::Impl
@@ -201,12 +997,18 @@ namespace docx
 
   struct Section::Impl
   {
+    Document::Impl* doc_;
     pugi::xml_node w_body_;
     pugi::xml_node w_p_;      // current paragraph
     pugi::xml_node w_pPr_;
     pugi::xml_node w_p_last_; // the last paragraph of the section
     pugi::xml_node w_pPr_last_;
     pugi::xml_node w_sectPr_;
+    Impl() : doc_(NULL) {}
+
+    void SetBounds(const pugi::xml_node& w_sectPr);
+    bool SetReference(const bool header, const std::string& content, const HeaderFooterType type);
+    void RemoveReference(const bool header, const HeaderFooterType type);
   };
 
   struct Table::Impl
@@ -224,9 +1026,11 @@ namespace docx
 
   struct Run::Impl
   {
+    Document::Impl* owner_; // the document holding the run, NULL if not known
     pugi::xml_node w_p_;
     pugi::xml_node w_r_;
     pugi::xml_node w_rPr_;
+    Impl() : owner_(NULL) {}
   };
 
   struct TableCell::Impl
@@ -237,28 +1041,176 @@ namespace docx
     pugi::xml_node w_tcPr_;
   };
 
+  struct Fragment::Impl
+  {
+    pugi::xml_document doc_;
+    pugi::xml_node     w_body_;
+  };
+
 
-  std::ostream& operator<<(std::ostream& out, const Document& doc)
+  // Every section ends with a paragraph holding its w:sectPr, except the last
+  // one whose w:sectPr is a child of the body. The index maps each body
+  // paragraph to the w:sectPr of its section and each w:sectPr to its position.
+
+  void Document::Impl::RenumberSections(const size_t from)
   {
-    if (doc.impl_) {
-      xml_string_writer writer;
-      doc.impl_->w_body_.print(writer, "  ");
-      out << writer.result;
+    for (size_t i = from; i < sections_.size(); i++) {
+      sectionIndex_[sections_[i]] = i;
     }
-    else {
-      out << "<document />";
+  }
+
+  void Document::Impl::IndexSections()
+  {
+    sections_.clear();
+    sectionIndex_.clear();
+    sectionOf_.clear();
+
+    // walk backwards so that each paragraph meets its w:sectPr first
+    pugi::xml_node w_sectPr = w_sectPr_;
+    sections_.push_back(w_sectPr);
+    for (pugi::xml_node w_p = GetLastChild(w_body_, "w:p"); w_p; w_p = w_p.previous_sibling("w:p")) {
+      pugi::xml_node w_sectPr_p = w_p.child("w:pPr").child("w:sectPr");
+      if (w_sectPr_p) {
+        w_sectPr = w_sectPr_p;
+        sections_.push_back(w_sectPr);
+      }
+      sectionOf_[w_p] = w_sectPr;
     }
-    return out;
+    std::reverse(sections_.begin(), sections_.end());
+    RenumberSections(0);
+    sectionsIndexed_ = true;
   }
 
-  std::ostream& operator<<(std::ostream& out, const Paragraph& p)
+  // returns the w:sectPr of the section of a body paragraph
+  pugi::xml_node Document::Impl::SectionOf(const pugi::xml_node& w_p)
   {
-    if (p.impl_) {
-      xml_string_writer writer;
-      p.impl_->w_p_.print(writer, "  ");
-      out << writer.result;
+    if (!sectionsIndexed_) IndexSections();
+    std::unordered_map<pugi::xml_node, pugi::xml_node, NodeHash>::const_iterator it = sectionOf_.find(w_p);
+    if (it == sectionOf_.end()) {
+      if (w_p.parent() != w_body_) return pugi::xml_node();
+      // added behind the index's back
+      IndexSections();
+      it = sectionOf_.find(w_p);
+      if (it == sectionOf_.end()) return pugi::xml_node();
     }
-    else {
+    return it->second;
+  }
+
+  // returns the position of a section, sections_.size() if unknown
+  size_t Document::Impl::SectionIndex(const pugi::xml_node& w_sectPr)
+  {
+    if (!sectionsIndexed_) IndexSections();
+    std::unordered_map<pugi::xml_node, size_t, NodeHash>::const_iterator it = sectionIndex_.find(w_sectPr);
+    if (it == sectionIndex_.end()) {
+      IndexSections();
+      it = sectionIndex_.find(w_sectPr);
+      if (it == sectionIndex_.end()) return sections_.size();
+    }
+    return it->second;
+  }
+
+  // records a new body paragraph without a section break
+  void Document::Impl::IndexParagraph(const pugi::xml_node& w_p)
+  {
+    if (!sectionsIndexed_) return;
+    // a paragraph belongs to the section of the next paragraph
+    pugi::xml_node w_p_next = w_p.next_sibling("w:p");
+    if (!w_p_next) {
+      sectionOf_[w_p] = sections_.back();
+      return;
+    }
+    std::unordered_map<pugi::xml_node, pugi::xml_node, NodeHash>::const_iterator it = sectionOf_.find(w_p_next);
+    if (it == sectionOf_.end()) {
+      sectionsIndexed_ = false;
+      return;
+    }
+    sectionOf_[w_p] = it->second;
+  }
+
+  // relabels the paragraphs from w_p back to the previous section break
+  void Document::Impl::RelabelSection(pugi::xml_node w_p, const pugi::xml_node& w_sectPr)
+  {
+    sectionOf_[w_p] = w_sectPr;
+    for (w_p = w_p.previous_sibling("w:p"); w_p; w_p = w_p.previous_sibling("w:p")) {
+      if (w_p.child("w:pPr").child("w:sectPr")) break;
+      sectionOf_[w_p] = w_sectPr;
+    }
+  }
+
+  // w_p now ends a new section whose w:sectPr is w_sectPr_new
+  void Document::Impl::IndexSplit(const pugi::xml_node& w_p, const pugi::xml_node& w_sectPr_new)
+  {
+    if (!sectionsIndexed_) return;
+    const size_t i = SectionIndex(SectionOf(w_p));
+    if (sectionIndex_.count(w_sectPr_new) > 0) return; // rebuilt meanwhile
+    if (i == sections_.size()) {
+      sectionsIndexed_ = false;
+      return;
+    }
+    RelabelSection(w_p, w_sectPr_new);
+    sections_.insert(sections_.begin() + i, w_sectPr_new);
+    RenumberSections(i);
+  }
+
+  // the section break of w_p is about to be removed
+  void Document::Impl::IndexMerge(const pugi::xml_node& w_p, const pugi::xml_node& w_sectPr)
+  {
+    if (!sectionsIndexed_) return;
+    const size_t i = SectionIndex(w_sectPr);
+    if (i + 1 >= sections_.size()) {
+      sectionsIndexed_ = false;
+      return;
+    }
+    RelabelSection(w_p, sections_[i + 1]);
+    sectionIndex_.erase(w_sectPr);
+    sections_.erase(sections_.begin() + i);
+    RenumberSections(i);
+  }
+
+  // the body paragraph w_p is about to be removed
+  void Document::Impl::UnindexParagraph(const pugi::xml_node& w_p)
+  {
+    if (!sectionsIndexed_) return;
+    pugi::xml_node w_sectPr = w_p.child("w:pPr").child("w:sectPr");
+    if (w_sectPr) IndexMerge(w_p, w_sectPr);
+    sectionOf_.erase(w_p);
+  }
+
+  // fills in the last paragraph of the section whose w:sectPr is given
+  void Section::Impl::SetBounds(const pugi::xml_node& w_sectPr)
+  {
+    w_sectPr_ = w_sectPr;
+    if (w_sectPr.parent() == w_body_) {
+      w_p_last_ = GetLastChild(w_body_, "w:p");
+    }
+    else {
+      w_p_last_ = w_sectPr.parent().parent();
+    }
+    w_pPr_last_ = w_p_last_.child("w:pPr");
+  }
+
+
+  std::ostream& operator<<(std::ostream& out, const Document& doc)
+  {
+    if (doc.impl_) {
+      xml_string_writer writer;
+      doc.impl_->w_body_.print(writer, "  ");
+      out << writer.result;
+    }
+    else {
+      out << "<document />";
+    }
+    return out;
+  }
+
+  std::ostream& operator<<(std::ostream& out, const Paragraph& p)
+  {
+    if (p.impl_) {
+      xml_string_writer writer;
+      p.impl_->w_p_.print(writer, "  ");
+      out << writer.result;
+    }
+    else {
       out << "<paragraph />";
     }
     return out;
@@ -304,11 +1256,12 @@ namespace docx
 
   Bookmark::Bookmark(const Bookmark& rhs)
   {
-    impl_ = new Impl;
-    impl_->id_ = rhs.impl_->id_;
-    impl_->name_ = rhs.impl_->name_;
-    impl_->w_bookmarkStart_ = rhs.impl_->w_bookmarkStart_;
-    impl_->w_bookmarkEnd_ = rhs.impl_->w_bookmarkEnd_;
+    if (rhs.impl_ != NULL) {
+      impl_ = new Impl(*rhs.impl_);
+    }
+    else {
+      impl_ = NULL;
+    }
   }
 
   Bookmark::~Bookmark()
@@ -319,6 +1272,18 @@ namespace docx
     }
   }
 
+  void Bookmark::operator=(const Bookmark& right)
+  {
+    if (this == &right) return;
+    if (impl_ != NULL) delete impl_;
+    if (right.impl_ != NULL) {
+      impl_ = new Impl(*right.impl_);
+    }
+    else {
+      impl_ = NULL;
+    }
+  }
+
   bool Bookmark::operator==(const Bookmark& rhs)
   {
     if (!impl_ && !rhs.impl_) return true;
@@ -326,17 +1291,33 @@ namespace docx
     return false;
   }
 
+  Bookmark::operator bool()
+  {
+    return impl_ != NULL;
+  }
+
   unsigned int Bookmark::GetId() const
   {
+    if (!impl_) return 0;
     return impl_->id_;
   }
 
   std::string Bookmark::GetName() const
   {
+    if (!impl_) return "";
     return impl_->name_;
   }
 
 
+  // struct Stats
+  Stats::Stats()
+    : openTime(0), copyTime(0), closeTime(0), findBookmarksTime(0), totalTime(0),
+      allocations(0), allocatedBytes(0)
+  {
+
+  }
+
+
   // class Document
   Document::Document()
   {
@@ -347,1396 +1328,2926 @@ namespace docx
     impl_->settings_.load_buffer(SETTINGS_XML, std::strlen(SETTINGS_XML), pugi::parse_declaration);
     impl_->w_settings_ = impl_->settings_.child("w:settings");
     impl_->nextBookmarkId_ = 0;
+    impl_->fieldsCompiled_ = false;
+    impl_->deadFields_ = 0;
+    impl_->sectionsIndexed_ = false;
+    impl_->statsTracked_ = false;
+    impl_->dirty_ = DIRTY_ALL;
+    impl_->LoadPackage(NULL);
+    impl_->LoadNumbering(NULL, NULL);
+    impl_->Register();
   }
 
   Document::~Document()
   {
     if (impl_ != NULL) {
+      impl_->StopStatistics();
+      impl_->Unregister();
       delete impl_;
       impl_ = NULL;
     }
   }
 
-  bool Document::Save(const std::string& path)
+  bool Document::Save(const std::string& path, Stats* stats)
   {
     if (!impl_) return false;
+    StatsScope scope(stats);
+
+    // Handles handed out before the save may still change the body, so once
+    // word/document.xml was changed it is written by every later save. The
+    // package model holds parts only the source has, so without the source
+    // there is nothing complete to write.
+    if (!impl_->source_.empty()) {
+      if (!impl_->SaveChanges(path, stats)) return false;
+      impl_->source_ = path;
+      impl_->dirty_ &= DIRTY_DOCUMENT;
+      return true;
+    }
+
+    Clock::time_point start;
+    if (stats != NULL) start = Clock::now();
 
     struct zip_t* zip = zip_open(path.c_str(), ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
     if (zip == NULL) {
       return false;
     }
 
-    xml_string_writer writer;
-    const char* buf = NULL;
-
-    zip_entry_open(zip, "_rels/.rels");
-    zip_entry_write(zip, _RELS, std::strlen(_RELS));
-    zip_entry_close(zip);
-
-    zip_entry_open(zip, "word/document.xml");
-    impl_->doc_.save(writer, "", pugi::format_raw);
-    buf = writer.result.c_str();
-    zip_entry_write(zip, buf, std::strlen(buf));
-    zip_entry_close(zip);
-
-    zip_entry_open(zip, "word/settings.xml");
-    writer.result = "";
-    impl_->settings_.save(writer, "", pugi::format_raw);
-    buf = writer.result.c_str();
-    zip_entry_write(zip, buf, std::strlen(buf));
-    zip_entry_close(zip);
-
-    zip_entry_open(zip, "word/_rels/document.xml.rels");
-    zip_entry_write(zip, DOCUMENT_XML_RELS, std::strlen(DOCUMENT_XML_RELS));
-    zip_entry_close(zip);
-
-    zip_entry_open(zip, "word/footer1.xml");
-    zip_entry_write(zip, FOOTER1_XML, std::strlen(FOOTER1_XML));
-    zip_entry_close(zip);
-
-    zip_entry_open(zip, "[Content_Types].xml");
-    zip_entry_write(zip, CONTENT_TYPES_XML, std::strlen(CONTENT_TYPES_XML));
-    zip_entry_close(zip);
-
+    if (stats != NULL) stats->openTime = Seconds(start);
+
+    WritePart(zip, "_rels/.rels", _RELS_APP, std::strlen(_RELS_APP), stats);
+    WritePart(zip, "word/document.xml", impl_->doc_, stats);
+    pugi::xml_document app;
+    impl_->UpdateAppProperties(app, impl_->SavedStatistics());
+    WritePart(zip, "docProps/app.xml", app, stats);
+    impl_->AddOverrideContentType("/docProps/app.xml", "application/vnd.openxmlformats-officedocument.extended-properties+xml");
+    WritePart(zip, "word/settings.xml", impl_->settings_, stats);
+    if (impl_->w_numbering_) WritePart(zip, impl_->numberingPart_.c_str(), impl_->numbering_, stats);
+    const std::string rels = impl_->package_.SaveRelationships();
+    WritePart(zip, "word/_rels/document.xml.rels", rels.data(), rels.size(), stats);
+    const std::string types = impl_->package_.SaveContentTypes();
+    WritePart(zip, "[Content_Types].xml", types.data(), types.size(), stats);
+    impl_->WriteHeaderFooters(zip, true, stats);
+    impl_->WriteCopiedParts(zip, true, stats);
+
+    if (stats != NULL) start = Clock::now();
     zip_close(zip);
+    if (stats != NULL) stats->closeTime = Seconds(start);
+
+    // pictures go in afterwards, those compressed already are stored as they are
+    if (!impl_->WriteMedia(path, true, stats)) return false;
+
+    std::unordered_set<std::string>& parts = impl_->package_.parts_;
+    parts.clear();
+    parts.insert("_rels/.rels");
+    parts.insert("docProps/app.xml");
+    parts.insert("word/document.xml");
+    parts.insert("word/settings.xml");
+    parts.insert("word/_rels/document.xml.rels");
+    parts.insert("[Content_Types].xml");
+    if (impl_->w_numbering_) parts.insert(impl_->numberingPart_);
+    for (size_t i = 0; i < impl_->headerFooters_.size(); i++) {
+      parts.insert(impl_->headerFooters_[i].name_);
+    }
+    for (size_t i = 0; i < impl_->copiedParts_.size(); i++) {
+      parts.insert(impl_->copiedParts_[i].name_);
+    }
+    for (size_t i = 0; i < impl_->media_.size(); i++) {
+      parts.insert(impl_->media_[i].name_);
+    }
+    impl_->source_ = path;
+    impl_->dirty_ &= DIRTY_DOCUMENT;
     return true;
   }
 
-  bool Document::Open(const std::string& path)
+  bool Document::Open(const std::string& path, Stats* stats)
   {
     if (!impl_) return false;
+    StatsScope scope(stats);
+
+    Clock::time_point start;
+    if (stats != NULL) start = Clock::now();
 
     struct zip_t* zip = zip_open(path.c_str(), ZIP_DEFAULT_COMPRESSION_LEVEL, 'r');
     if (zip == NULL) {
       return false;
     }
 
-    if (zip_entry_open(zip, "word/document.xml") < 0) {
+    if (stats != NULL) stats->openTime = Seconds(start);
+
+    impl_->StopStatistics();
+    if (!ReadPart(zip, "word/document.xml", impl_->doc_, stats)) {
       zip_close(zip);
+      impl_->source_.clear();
+      impl_->dirty_ = DIRTY_ALL;
       return false;
     }
-    void* buf = NULL;
-    size_t bufsize;
-    zip_entry_read(zip, &buf, &bufsize);
-    zip_entry_close(zip);
-
-    impl_->doc_.load_buffer(buf, bufsize, pugi::parse_declaration);
     impl_->w_body_ = impl_->doc_.child("w:document").child("w:body");
     impl_->w_sectPr_ = impl_->w_body_.child("w:sectPr");
-    std::free(buf);
+    impl_->sectionsIndexed_ = false;
 
-    if (zip_entry_open(zip, "word/settings.xml") >= 0) {
-      zip_entry_read(zip, &buf, &bufsize);
-      zip_entry_close(zip);
+    impl_->source_ = path;
+    impl_->dirty_ = 0;
+    impl_->LoadPackage(zip);
+    impl_->LoadNumbering(zip, stats);
 
-      impl_->settings_.load_buffer(buf, bufsize, pugi::parse_declaration);
+    if (ReadPart(zip, "word/settings.xml", impl_->settings_, stats)) {
       impl_->w_settings_ = impl_->settings_.child("w:settings");
-      std::free(buf);
+    }
+    else {
+      impl_->dirty_ |= DIRTY_SETTINGS;
     }
 
+    if (stats != NULL) start = Clock::now();
     zip_close(zip);
+    if (stats != NULL) {
+      stats->closeTime = Seconds(start);
+      start = Clock::now();
+    }
+
     FindBookmarks();
+    if (stats != NULL) stats->findBookmarksTime = Seconds(start);
     return true;
   }
 
-  Paragraph Document::FirstParagraph()
+  // Writes a new archive next to the target with the entries left unchanged
+  // copied still deflated and the changed parts written again, then moves it
+  // over the target, so a failed save leaves the source as it was.
+  bool Document::Impl::SaveChanges(const std::string& path, Stats* stats)
   {
-    if (!impl_) return Paragraph();
-    pugi::xml_node w_p = impl_->w_body_.child("w:p");
-    if (!w_p) return Paragraph();
+    bool changed = dirty_ != 0 || path != source_;
+    for (size_t i = 0; i < media_.size() && !changed; i++) changed = !media_[i].saved_;
+    for (size_t i = 0; i < headerFooters_.size() && !changed; i++) changed = !headerFooters_[i].saved_;
+    for (size_t i = 0; i < copiedParts_.size() && !changed; i++) changed = !copiedParts_[i].saved_;
+    if (!changed) return true;
 
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_p.child("w:pPr");
-    return Paragraph(impl);
-  }
+    Clock::time_point start;
+    if (stats != NULL) start = Clock::now();
+    struct zip_t* in = zip_open(source_.c_str(), 0, 'r');
+    if (in == NULL) return false;
+    const std::string temp = path + ".tmp";
+    struct zip_t* zip = zip_open(temp.c_str(), ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+    if (zip == NULL) {
+      zip_close(in);
+      return false;
+    }
+    if (stats != NULL) stats->openTime = Seconds(start);
+
+    // The counts of docProps/app.xml follow the text. A package without the
+    // part gets one, along with its relationship.
+    std::string appPart;
+    pugi::xml_document rootRels, app;
+    bool relsChanged = false;
+    if (dirty_ & DIRTY_DOCUMENT) {
+      pugi::xml_node root;
+      if (ReadPart(in, "_rels/.rels", rootRels, NULL)) root = rootRels.child("Relationships");
+      std::unordered_set<std::string> ids;
+      for (pugi::xml_node r = root.child("Relationship"); r; r = r.next_sibling("Relationship")) {
+        ids.insert(r.attribute("Id").as_string());
+        if (appPart.empty() && std::strcmp(r.attribute("Type").as_string(), "http://schemas.openxmlformats.org/officeDocument/2006/relationships/extended-properties") == 0) {
+          appPart = r.attribute("Target").as_string();
+          if (!appPart.empty() && appPart[0] == '/') appPart.erase(0, 1);
+        }
+      }
+      if (root && appPart.empty()) {
+        appPart = "docProps/app.xml";
+        std::string id;
+        for (int n = 1; id.empty() || ids.count(id) > 0; n++) id = "rId" + std::to_string(n);
+        pugi::xml_node r = root.append_child("Relationship");
+        r.append_attribute("Id") = id.c_str();
+        r.append_attribute("Type") = "http://schemas.openxmlformats.org/officeDocument/2006/relationships/extended-properties";
+        r.append_attribute("Target") = appPart.c_str();
+        relsChanged = true;
+      }
+      if (package_.parts_.count(appPart) > 0) ReadPart(in, appPart.c_str(), app, NULL);
+      if (!appPart.empty()) AddOverrideContentType("/" + appPart, "application/vnd.openxmlformats-officedocument.extended-properties+xml");
+    }
+
+    // the entries written again below
+    std::unordered_set<std::string> names;
+    if (dirty_ & DIRTY_DOCUMENT) names.insert("word/document.xml");
+    if (!appPart.empty()) names.insert(appPart);
+    if (relsChanged) names.insert("_rels/.rels");
+    if (dirty_ & DIRTY_SETTINGS) names.insert("word/settings.xml");
+    if ((dirty_ & DIRTY_NUMBERING) && w_numbering_) names.insert(numberingPart_);
+    if (dirty_ & DIRTY_PACKAGE) {
+      names.insert("word/_rels/document.xml.rels");
+      names.insert("[Content_Types].xml");
+    }
+    for (size_t i = 0; i < headerFooters_.size(); i++) {
+      if (!headerFooters_[i].saved_) names.insert(headerFooters_[i].name_);
+    }
+    for (size_t i = 0; i < media_.size(); i++) {
+      if (!media_[i].saved_) names.insert(media_[i].name_);
+    }
+
+    if (stats != NULL) start = Clock::now();
+    bool ok = true;
+    const ssize_t n = zip_entries_total(in);
+    for (ssize_t i = 0; i < n && ok; i++) {
+      zip_entry_openbyindex(in, static_cast<int>(i));
+      const bool copy = names.count(zip_entry_name(in)) == 0;
+      zip_entry_close(in);
+      if (copy) ok = zip_entry_copy(zip, in, static_cast<size_t>(i)) == 0;
+    }
+    zip_close(in);
+    if (stats != NULL) stats->copyTime = Seconds(start);
+    if (!ok) {
+      zip_close(zip);
+      std::remove(temp.c_str());
+      return false;
+    }
 
-  Paragraph Document::LastParagraph()
-  {
-    if (!impl_) return Paragraph();
-    pugi::xml_node w_p = GetLastChild(impl_->w_body_, "w:p");
-    if (!w_p) return Paragraph();
+    if (dirty_ & DIRTY_DOCUMENT) WritePart(zip, "word/document.xml", doc_, stats);
+    if (!appPart.empty()) {
+      UpdateAppProperties(app, SavedStatistics());
+      WritePart(zip, appPart.c_str(), app, stats);
+      package_.parts_.insert(appPart);
+    }
+    if (relsChanged) WritePart(zip, "_rels/.rels", rootRels, stats);
+    if (dirty_ & DIRTY_SETTINGS) WritePart(zip, "word/settings.xml", settings_, stats);
+    if ((dirty_ & DIRTY_NUMBERING) && w_numbering_) {
+      WritePart(zip, numberingPart_.c_str(), numbering_, stats);
+      package_.parts_.insert(numberingPart_);
+    }
+    if (dirty_ & DIRTY_PACKAGE) {
+      const std::string rels = package_.SaveRelationships();
+      WritePart(zip, "word/_rels/document.xml.rels", rels.data(), rels.size(), stats);
+      const std::string types = package_.SaveContentTypes();
+      WritePart(zip, "[Content_Types].xml", types.data(), types.size(), stats);
+    }
+    WriteHeaderFooters(zip, false, stats);
+    WriteCopiedParts(zip, false, stats);
 
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_p.child("w:pPr");
-    return Paragraph(impl);
+    if (stats != NULL) start = Clock::now();
+    zip_close(zip);
+    if (stats != NULL) stats->closeTime = Seconds(start);
+
+    if (!WriteMedia(temp, false, stats) || !ReplaceFile(temp, path)) {
+      std::remove(temp.c_str());
+      return false;
+    }
+    for (size_t i = 0; i < media_.size(); i++) {
+      package_.parts_.insert(media_[i].name_);
+    }
+    for (size_t i = 0; i < headerFooters_.size(); i++) {
+      package_.parts_.insert(headerFooters_[i].name_);
+    }
+    return true;
   }
 
-  Section Document::FirstSection()
+  void Package::Clear()
   {
-    Paragraph firstParagraph = FirstParagraph();
-    if (firstParagraph) return firstParagraph.GetSection();
+    parts_.clear();
+    rels_.clear();
+    relById_.clear();
+    relByType_.clear();
+    relByTarget_.clear();
+    nextRelId_ = 1;
+    defaults_.clear();
+    overrides_.clear();
+    defaultByExt_.clear();
+    overrideByPart_.clear();
+  }
 
-    Section::Impl* impl = new Section::Impl;
-    impl->w_body_ = impl_->w_body_;
-    Section section(impl);
-    section.FindSectionProperties();
-    return section;
+  std::string Package::TargetKey(const std::string& type, const std::string& target, const bool external)
+  {
+    std::string key = type;
+    key += external ? '\x01' : '\x02';
+    key += target;
+    return key;
   }
 
-  Section Document::LastSection()
+  void Package::LoadRelationships(const pugi::xml_document& rels)
   {
-    Paragraph lastParagraph = LastParagraph();
-    if (lastParagraph) return lastParagraph.GetSection();
+    pugi::xml_node root = rels.child("Relationships");
+    for (pugi::xml_node r = root.child("Relationship"); r; r = r.next_sibling("Relationship")) {
+      Relationship rel;
+      rel.id_ = r.attribute("Id").as_string();
+      rel.type_ = r.attribute("Type").as_string();
+      rel.target_ = r.attribute("Target").as_string();
+      rel.external_ = std::strcmp(r.attribute("TargetMode").as_string(), "External") == 0;
+      if (rel.id_.empty() || relById_.count(rel.id_) > 0) continue;
 
-    Section::Impl* impl = new Section::Impl;
-    impl->w_body_ = impl_->w_body_;
-    Section section(impl);
-    section.FindSectionProperties();
-    return section;
+      const size_t index = rels_.size();
+      relById_[rel.id_] = index;
+      relByType_.insert(std::make_pair(rel.type_, index));
+      relByTarget_.insert(std::make_pair(TargetKey(rel.type_, rel.target_, rel.external_), index));
+      if (rel.id_.compare(0, 3, "rId") == 0 && nextRelId_ <= std::strtoul(rel.id_.c_str() + 3, NULL, 10))
+        nextRelId_ = std::strtoul(rel.id_.c_str() + 3, NULL, 10) + 1;
+      rels_.push_back(rel);
+    }
   }
 
-  Paragraph Document::AppendParagraph()
+  void Package::LoadContentTypes(const pugi::xml_document& types)
   {
-    if (!impl_) return Paragraph();
-
-    pugi::xml_node w_p = impl_->w_body_.insert_child_before("w:p", impl_->w_sectPr_);
-    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
+    pugi::xml_node root = types.child("Types");
+    for (pugi::xml_node d = root.child("Default"); d; d = d.next_sibling("Default")) {
+      AddDefault(d.attribute("Extension").as_string(), d.attribute("ContentType").as_string());
+    }
+    for (pugi::xml_node o = root.child("Override"); o; o = o.next_sibling("Override")) {
+      AddOverride(o.attribute("PartName").as_string(), o.attribute("ContentType").as_string());
+    }
+  }
 
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_pPr;
-    return Paragraph(impl);
+  const Relationship* Package::GetRelationship(const std::string& id) const
+  {
+    std::unordered_map<std::string, size_t>::const_iterator it = relById_.find(id);
+    return it == relById_.end() ? NULL : &rels_[it->second];
   }
 
-  Paragraph Document::AppendParagraph(const std::string& text)
+  const Relationship* Package::FindRelationship(const std::string& type) const
   {
-    Paragraph p = AppendParagraph();
-    p.AppendRun(text);
-    return p;
+    std::unordered_map<std::string, size_t>::const_iterator it = relByType_.find(type);
+    return it == relByType_.end() ? NULL : &rels_[it->second];
   }
 
-  Paragraph Document::AppendParagraph(const std::string& text,
-    const double fontSize)
+  const Relationship* Package::FindRelationship(const std::string& type, const std::string& target, const bool external) const
   {
-    Paragraph p = AppendParagraph();
-    p.AppendRun(text, fontSize);
-    return p;
+    std::unordered_map<std::string, size_t>::const_iterator it = relByTarget_.find(TargetKey(type, target, external));
+    return it == relByTarget_.end() ? NULL : &rels_[it->second];
   }
 
-  Paragraph Document::AppendParagraph(const std::string& text,
-    const double fontSize,
-    const std::string& fontAscii,
-    const std::string& fontEastAsia)
+  std::string Package::AddRelationship(const std::string& type, const std::string& target, const bool external)
   {
-    Paragraph p = AppendParagraph();
-    p.AppendRun(text, fontSize, fontAscii, fontEastAsia);
-    return p;
+    const std::string key = TargetKey(type, target, external);
+    std::unordered_map<std::string, size_t>::const_iterator it = relByTarget_.find(key);
+    if (it != relByTarget_.end()) return rels_[it->second].id_;
+
+    Relationship rel;
+    rel.id_ = "rId" + std::to_string(nextRelId_++);
+    rel.type_ = type;
+    rel.target_ = target;
+    rel.external_ = external;
+
+    const size_t index = rels_.size();
+    relById_[rel.id_] = index;
+    relByType_.insert(std::make_pair(type, index));
+    relByTarget_[key] = index;
+    rels_.push_back(rel);
+    return rels_.back().id_;
   }
 
-  Paragraph Document::PrependParagraph()
+  std::string Package::ContentType(const std::string& part) const
   {
-    if (!impl_) return Paragraph();
+    std::unordered_map<std::string, size_t>::const_iterator it = overrideByPart_.find("/" + part);
+    if (it != overrideByPart_.end()) return overrides_[it->second].second;
 
-    pugi::xml_node w_p = impl_->w_body_.prepend_child("w:p");
-    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
+    const size_t dot = part.rfind('.');
+    it = defaultByExt_.find(dot == std::string::npos ? "" : part.substr(dot + 1));
+    return it == defaultByExt_.end() ? "" : defaults_[it->second].second;
+  }
 
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_pPr;
-    return Paragraph(impl);
+  bool Package::AddDefault(const std::string& ext, const std::string& type)
+  {
+    if (defaultByExt_.count(ext) > 0) return false;
+    defaultByExt_[ext] = defaults_.size();
+    defaults_.push_back(std::make_pair(ext, type));
+    return true;
   }
 
-  Paragraph Document::PrependParagraph(const std::string& text)
+  bool Package::AddOverride(const std::string& partName, const std::string& type)
   {
-    Paragraph p = PrependParagraph();
-    p.AppendRun(text);
-    return p;
+    std::unordered_map<std::string, size_t>::const_iterator it = overrideByPart_.find(partName);
+    if (it != overrideByPart_.end()) {
+      if (overrides_[it->second].second == type) return false;
+      overrides_[it->second].second = type;
+      return true;
+    }
+    overrideByPart_[partName] = overrides_.size();
+    overrides_.push_back(std::make_pair(partName, type));
+    return true;
   }
 
-  Paragraph Document::PrependParagraph(const std::string& text,
-    const double fontSize)
+  // an attribute with its value escaped
+  void AppendAttribute(std::string& out, const char* name, const std::string& value)
+  {
+    out += ' ';
+    out += name;
+    out += "=\"";
+    for (size_t i = 0; i < value.size(); i++) {
+      switch (value[i]) {
+      case '&':
+        out += "&amp;";
+        break;
+      case '<':
+        out += "&lt;";
+        break;
+      case '"':
+        out += "&quot;";
+        break;
+      default:
+        out += value[i];
+        break;
+      }
+    }
+    out += '"';
+  }
+
+  std::string Package::SaveRelationships() const
   {
-    Paragraph p = PrependParagraph();
-    p.AppendRun(text, fontSize);
-    return p;
+    std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>"
+      "<Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\">";
+    xml.reserve(xml.size() + rels_.size() * 160);
+    for (size_t i = 0; i < rels_.size(); i++) {
+      xml += "<Relationship";
+      AppendAttribute(xml, "Id", rels_[i].id_);
+      AppendAttribute(xml, "Type", rels_[i].type_);
+      AppendAttribute(xml, "Target", rels_[i].target_);
+      if (rels_[i].external_) xml += " TargetMode=\"External\"";
+      xml += "/>";
+    }
+    xml += "</Relationships>";
+    return xml;
   }
 
-  Paragraph Document::PrependParagraph(const std::string& text,
-    const double fontSize,
-    const std::string& fontAscii,
-    const std::string& fontEastAsia)
+  std::string Package::SaveContentTypes() const
   {
-    Paragraph p = PrependParagraph();
-    p.AppendRun(text, fontSize, fontAscii, fontEastAsia);
-    return p;
+    std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>"
+      "<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\">";
+    for (size_t i = 0; i < defaults_.size(); i++) {
+      xml += "<Default";
+      AppendAttribute(xml, "Extension", defaults_[i].first);
+      AppendAttribute(xml, "ContentType", defaults_[i].second);
+      xml += "/>";
+    }
+    for (size_t i = 0; i < overrides_.size(); i++) {
+      xml += "<Override";
+      AppendAttribute(xml, "PartName", overrides_[i].first);
+      AppendAttribute(xml, "ContentType", overrides_[i].second);
+      xml += "/>";
+    }
+    xml += "</Types>";
+    return xml;
   }
 
-  Paragraph Document::InsertParagraphBefore(const Paragraph& p)
+  void Document::Impl::LoadPackage(struct zip_t* zip)
   {
-    if (!impl_) return Paragraph();
+    package_.Clear();
+    media_.clear();
+    mediaByPath_.clear();
+    mediaByHash_.clear();
+    nextImage_ = 1;
+    nextDrawingId_ = 0;
+    headerFooters_.clear();
+    headerFooterByContent_.clear();
+    copiedParts_.clear();
+    nextHeader_ = 1;
+    nextFooter_ = 1;
 
-    pugi::xml_node w_p = impl_->w_body_.insert_child_before("w:p", p.impl_->w_p_);
-    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
+    pugi::xml_document rels;
+    if (zip == NULL || !ReadPart(zip, "word/_rels/document.xml.rels", rels, NULL)) {
+      rels.load_buffer(DOCUMENT_XML_RELS, std::strlen(DOCUMENT_XML_RELS));
+    }
+    package_.LoadRelationships(rels);
 
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_pPr;
-    return Paragraph(impl);
+    pugi::xml_document types;
+    if (zip == NULL || !ReadPart(zip, "[Content_Types].xml", types, NULL)) {
+      types.load_buffer(CONTENT_TYPES_XML, std::strlen(CONTENT_TYPES_XML));
+    }
+    package_.LoadContentTypes(types);
+
+    if (zip == NULL) return;
+    const ssize_t n = zip_entries_total(zip);
+    for (ssize_t i = 0; i < n; i++) {
+      zip_entry_openbyindex(zip, static_cast<int>(i));
+      package_.parts_.insert(zip_entry_name(zip));
+      zip_entry_close(zip);
+    }
   }
 
-  Paragraph Document::InsertParagraphAfter(const Paragraph& p)
+  std::string Document::Impl::AddRelationship(const char* type, const std::string& target, const bool external)
   {
-    if (!impl_) return Paragraph();
+    const size_t count = package_.rels_.size();
+    const std::string id = package_.AddRelationship(type, target, external);
+    if (package_.rels_.size() != count) dirty_ |= DIRTY_PACKAGE;
+    return id;
+  }
 
-    pugi::xml_node w_p = impl_->w_body_.insert_child_after("w:p", p.impl_->w_p_);
-    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
-
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_pPr;
-    return Paragraph(impl);
-  }
-
-  bool Document::RemoveParagraph(Paragraph& p)
+  void Document::Impl::AddDefaultContentType(const char* ext, const char* type)
   {
-    if (!impl_) return false;
-    return impl_->w_body_.remove_child(p.impl_->w_p_);
+    if (package_.AddDefault(ext, type)) dirty_ |= DIRTY_PACKAGE;
   }
 
-  Paragraph Document::AppendPageBreak()
+  void Document::Impl::AddOverrideContentType(const std::string& partName, const char* type)
   {
-    Paragraph p = AppendParagraph();
-    p.AppendPageBreak();
-    return p;
+    if (package_.AddOverride(partName, type)) dirty_ |= DIRTY_PACKAGE;
   }
 
-  Paragraph Document::AppendSectionBreak()
+  // Returns the relationship id of a header or footer holding the content
+  // (body-level xml), creating the part unless an identical one exists.
+  const HeaderFooterPart* Document::Impl::FindHeaderFooter(const bool header, const std::string& content) const
   {
-    Paragraph p = AppendParagraph();
-    p.InsertSectionBreak();
-    return p;
+    std::string key(1, header ? 'h' : 'f');
+    key += content;
+    std::unordered_map<std::string, size_t>::const_iterator it = headerFooterByContent_.find(key);
+    return it == headerFooterByContent_.end() ? NULL : &headerFooters_[it->second];
   }
 
-  Table Document::AppendTable(const int rows, const int cols)
+  std::string Document::Impl::AddHeaderFooter(const bool header, const std::string& content)
   {
-    if (!impl_) return Table();
+    const HeaderFooterPart* existing = FindHeaderFooter(header, content);
+    if (existing != NULL) return existing->relId_;
 
-    pugi::xml_node w_tbl = impl_->w_body_.insert_child_before("w:tbl", impl_->w_sectPr_);
-    pugi::xml_node w_tblPr = w_tbl.append_child("w:tblPr");
-    pugi::xml_node w_tblGrid = w_tbl.append_child("w:tblGrid");
+    std::string key(1, header ? 'h' : 'f');
+    key += content;
+    const char* kind = header ? "header" : "footer";
+    HeaderFooterPart part;
+    do {
+      part.name_ = std::string("word/") + kind + std::to_string(header ? nextHeader_++ : nextFooter_++) + ".xml";
+    } while (package_.parts_.count(part.name_) > 0);
 
-    Table::Impl* impl = new Table::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_tbl_ = w_tbl;
-    impl->w_tblPr_ = w_tblPr;
-    impl->w_tblGrid_ = w_tblGrid;
-    Table tbl(impl);
+    const char* root = header ? "w:hdr" : "w:ftr";
+    part.xml_ = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?><";
+    part.xml_ += root;
+    part.xml_ += HEADER_FOOTER_NAMESPACES;
+    part.xml_ += ">";
+    part.xml_ += content.empty() ? "<w:p/>" : content; // at least one paragraph
+    part.xml_ += "</";
+    part.xml_ += root;
+    part.xml_ += ">";
+    part.saved_ = false;
 
-    tbl.Create_(rows, cols);
-    tbl.SetAllBorders();
-    tbl.SetWidthPercent(100);
-    tbl.SetCellMarginLeft(CM2Twip(0.19));
-    tbl.SetCellMarginRight(CM2Twip(0.19));
-    tbl.SetAlignment(Table::Alignment::Centered);
-    return tbl;
+    part.relId_ = AddRelationship(header
+      ? "http://schemas.openxmlformats.org/officeDocument/2006/relationships/header"
+      : "http://schemas.openxmlformats.org/officeDocument/2006/relationships/footer",
+      part.name_.substr(5));
+    AddOverrideContentType("/" + part.name_, header
+      ? "application/vnd.openxmlformats-officedocument.wordprocessingml.header+xml"
+      : "application/vnd.openxmlformats-officedocument.wordprocessingml.footer+xml");
+
+    headerFooterByContent_[key] = headerFooters_.size();
+    headerFooters_.push_back(part);
+    return part.relId_;
   }
 
-  void Document::RemoveTable(Table& tbl)
+  void Document::Impl::WriteHeaderFooters(struct zip_t* zip, const bool all, Stats* stats)
   {
-    if (!impl_) return;
-    impl_->w_body_.remove_child(tbl.impl_->w_tbl_);
+    for (size_t i = 0; i < headerFooters_.size(); i++) {
+      HeaderFooterPart& part = headerFooters_[i];
+      if (part.saved_ && !all) continue;
+      WritePart(zip, part.name_.c_str(), part.xml_.data(), part.xml_.size(), stats);
+      part.saved_ = true;
+    }
   }
 
-  TextFrame Document::AppendTextFrame(const int w, const int h)
+  void Document::Impl::WriteCopiedParts(struct zip_t* zip, const bool all, Stats* stats)
   {
-    if (!impl_) return TextFrame();
+    for (size_t i = 0; i < copiedParts_.size(); i++) {
+      CopiedPart& part = copiedParts_[i];
+      if (part.saved_ && !all) continue;
+      WritePart(zip, part.name_.c_str(), part.data_.data(), part.data_.size(), stats);
+      part.saved_ = true;
+    }
+  }
 
-    pugi::xml_node w_p = impl_->w_body_.insert_child_before("w:p", impl_->w_sectPr_);
-    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
-    pugi::xml_node w_framePr = w_pPr.append_child("w:framePr");
+  // whether a part of this name is in the package or about to be written
+  bool Document::Impl::HasPart(const std::string& name) const
+  {
+    if (package_.parts_.count(name) > 0) return true;
+    for (size_t i = 0; i < media_.size(); i++) {
+      if (media_[i].name_ == name) return true;
+    }
+    for (size_t i = 0; i < headerFooters_.size(); i++) {
+      if (headerFooters_[i].name_ == name) return true;
+    }
+    return false;
+  }
 
+  // reads a part copied since Open(), or else from the source archive
+  bool Document::Impl::ReadCopiedPart(struct zip_t* source, const std::string& name, std::string& data) const
+  {
+    for (size_t i = 0; i < copiedParts_.size(); i++) {
+      if (copiedParts_[i].name_ != name) continue;
+      data = copiedParts_[i].data_;
+      return true;
+    }
+    return source != NULL && ReadEntry(source, name, data);
+  }
 
-    Paragraph::Impl* paragraph_impl = new Paragraph::Impl;
-    paragraph_impl->w_body_ = impl_->w_body_;
-    paragraph_impl->w_p_ = w_p;
-    paragraph_impl->w_pPr_ = w_pPr;
+  // Stages a part of other and the parts its relationships refer to, renaming
+  // those whose name is taken here. Returns the new name, empty if a part
+  // cannot be read.
+  std::string Document::Impl::StagePart(const Impl& other, struct zip_t* source, const std::string& src, PartImport& import) const
+  {
+    std::unordered_map<std::string, std::string>::const_iterator it = import.names_.find(src);
+    if (it != import.names_.end()) return it->second;
 
-    TextFrame::Impl* impl = new TextFrame::Impl;
-    impl->w_framePr_ = w_framePr;
-    TextFrame textFrame = TextFrame(impl, paragraph_impl);
+    CopiedPart part;
+    if (!other.ReadCopiedPart(source, src, part.data_)) return "";
+    part.name_ = src;
+    for (size_t n = 2; HasPart(part.name_) || import.taken_.count(part.name_) > 0; n++) part.name_ = NumberedName(src, n);
+    part.saved_ = false;
+    import.names_[src] = part.name_;
+    import.taken_.insert(part.name_);
 
-    textFrame.SetSize(w, h);
-    textFrame.SetBorders();
-    return textFrame;
+    const std::string type = other.package_.ContentType(src);
+    if (!type.empty() && package_.ContentType(part.name_) != type) {
+      import.types_.push_back(std::make_pair("/" + part.name_, type));
+    }
+
+    std::string data;
+    if (other.ReadCopiedPart(source, RelsPath(src), data)) {
+      pugi::xml_document rels;
+      rels.load_buffer(data.data(), data.size());
+      for (pugi::xml_node r = rels.child("Relationships").child("Relationship"); r; r = r.next_sibling("Relationship")) {
+        if (std::strcmp(r.attribute("TargetMode").as_string(), "External") == 0) continue;
+        const std::string target = StagePart(other, source, ResolveTarget(DirName(src), r.attribute("Target").as_string()), import);
+        if (target.empty()) return "";
+        r.attribute("Target") = RelativeTarget(DirName(part.name_), target).c_str();
+      }
+      CopiedPart relsPart;
+      relsPart.name_ = RelsPath(part.name_);
+      xml_string_writer writer;
+      rels.save(writer, "", pugi::format_raw);
+      relsPart.data_ = writer.result;
+      relsPart.saved_ = false;
+      import.taken_.insert(relsPart.name_);
+      import.parts_.push_back(relsPart);
+    }
+    import.parts_.push_back(part);
+    return part.name_;
+  }
+
+  // Pictures, headers and footers added to other since it was opened are added
+  // again, the other parts are copied from its archive the way Concat() does.
+  // ids caches the relationship ids mapped so far.
+  bool Document::Impl::ImportRelationships(const Impl& other, const pugi::xml_node& root, std::unordered_map<std::string, std::string>& ids)
+  {
+    std::vector<std::string> used;
+    std::unordered_set<std::string> seen;
+    pugi::xml_node node = root;
+    while (node) {
+      for (pugi::xml_attribute attr = node.first_attribute(); attr; attr = attr.next_attribute()) {
+        if (std::strncmp(attr.name(), "r:", 2) != 0 || ids.count(attr.value()) > 0) continue;
+        if (seen.insert(attr.value()).second) used.push_back(attr.value());
+      }
+      node = NextNode(node, root, node.type() == pugi::node_element);
+    }
+    if (used.empty()) return true;
+
+    std::unordered_map<std::string, size_t> headerFooters, media;
+    for (size_t i = 0; i < other.headerFooters_.size(); i++) headerFooters[other.headerFooters_[i].relId_] = i;
+    for (size_t i = 0; i < other.media_.size(); i++) media[other.media_[i].relId_] = i;
+
+    // read every part first, a part that cannot be read fails the whole import
+    struct zip_t* source = other.source_.empty() ? NULL : zip_open(other.source_.c_str(), 0, 'r');
+    PartImport import;
+    bool ok = true;
+    for (size_t i = 0; i < used.size() && ok; i++) {
+      if (headerFooters.count(used[i]) > 0 || media.count(used[i]) > 0) continue;
+      const Relationship* rel = other.package_.GetRelationship(used[i]);
+      ok = rel != NULL && (rel->external_ || !StagePart(other, source, ResolveTarget("word/", rel->target_), import).empty());
+    }
+    if (source != NULL) zip_close(source);
+    if (!ok) return false;
+
+    std::vector<size_t> pictures(used.size(), static_cast<size_t>(-1));
+    for (size_t i = 0; i < used.size(); i++) {
+      std::unordered_map<std::string, size_t>::const_iterator it = media.find(used[i]);
+      if (it == media.end()) continue;
+      const Media& m = other.media_[it->second];
+      pictures[i] = m.path_.empty() ? AddMedia("", m.data_.data(), m.data_.size()) : AddMedia(m.path_, NULL, 0);
+      if (pictures[i] == static_cast<size_t>(-1)) return false;
+    }
+
+    for (size_t i = 0; i < import.parts_.size(); i++) {
+      package_.parts_.insert(import.parts_[i].name_);
+      copiedParts_.push_back(import.parts_[i]);
+    }
+    for (size_t i = 0; i < import.types_.size(); i++) {
+      AddOverrideContentType(import.types_[i].first, import.types_[i].second.c_str());
+    }
+    for (size_t i = 0; i < used.size(); i++) {
+      const std::string& id = used[i];
+      std::unordered_map<std::string, size_t>::const_iterator it = headerFooters.find(id);
+      if (it != headerFooters.end()) {
+        // the content sits between the root tags
+        const HeaderFooterPart& part = other.headerFooters_[it->second];
+        const size_t begin = part.xml_.find('>', part.xml_.find(HEADER_FOOTER_NAMESPACES)) + 1;
+        const size_t end = part.xml_.rfind("</");
+        const bool header = part.name_.compare(5, 6, "header") == 0;
+        ids[id] = AddHeaderFooter(header, part.xml_.substr(begin, end - begin));
+        continue;
+      }
+      if (pictures[i] != static_cast<size_t>(-1)) {
+        ids[id] = media_[pictures[i]].relId_;
+        continue;
+      }
+      const Relationship* rel = other.package_.GetRelationship(id);
+      const std::string target = rel->external_
+        ? rel->target_
+        : RelativeTarget("word/", import.names_[ResolveTarget("word/", rel->target_)]);
+      ids[id] = AddRelationship(rel->type_.c_str(), target, rel->external_);
+    }
+    return true;
   }
 
-  void Document::SetReadOnly(const bool enabled)
+  void Document::Impl::MapRelationships(const pugi::xml_node& root, const std::unordered_map<std::string, std::string>& ids)
   {
-    if (!impl_) return;
-
-    if (!enabled) {
-      pugi::xml_node documentProtection = impl_->w_settings_.child("w:documentProtection");
-      if (documentProtection) {
-        impl_->w_settings_.remove_child(documentProtection);
+    pugi::xml_node node = root;
+    while (node) {
+      for (pugi::xml_attribute attr = node.first_attribute(); attr; attr = attr.next_attribute()) {
+        if (std::strncmp(attr.name(), "r:", 2) != 0) continue;
+        std::unordered_map<std::string, std::string>::const_iterator it = ids.find(attr.value());
+        if (it != ids.end()) attr.set_value(it->second.c_str());
       }
-      return;
+      node = NextNode(node, root, node.type() == pugi::node_element);
     }
+  }
 
-    pugi::xml_node documentProtection = impl_->w_settings_.child("w:documentProtection");
-    if (!documentProtection) {
-      documentProtection = impl_->w_settings_.append_child("w:documentProtection");
-    }
+  // the image formats Word takes, told apart by their first bytes
+  struct ImageFormat
+  {
+    const char* magic;
+    size_t magicSize;
+    const char* ext;
+    const char* contentType;
+    bool compressed;
+  };
 
-    pugi::xml_attribute documentProtectionEdit = documentProtection.attribute("w:edit");
-    if (!documentProtectionEdit) {
-      documentProtectionEdit = documentProtection.append_attribute("w:edit");
+  const ImageFormat* FindImageFormat(const char* data, const size_t size)
+  {
+    static const ImageFormat FORMATS[] = {
+      { "\x89PNG", 4, "png", "image/png", true },
+      { "\xFF\xD8\xFF", 3, "jpeg", "image/jpeg", true },
+      { "GIF8", 4, "gif", "image/gif", true },
+      { "BM", 2, "bmp", "image/bmp", false },
+      { "II*\0", 4, "tiff", "image/tiff", false },
+      { "MM\0*", 4, "tiff", "image/tiff", false }
+    };
+    for (size_t i = 0; i < sizeof(FORMATS) / sizeof(FORMATS[0]); i++) {
+      if (size >= FORMATS[i].magicSize && std::memcmp(data, FORMATS[i].magic, FORMATS[i].magicSize) == 0)
+        return &FORMATS[i];
     }
-    documentProtectionEdit.set_value("readOnly");
+    return NULL;
+  }
 
-    pugi::xml_attribute documentProtectionEnforcement = documentProtection.attribute("w:enforcement");
-    if (!documentProtectionEnforcement) {
-      documentProtectionEnforcement = documentProtection.append_attribute("w:enforcement");
+  // FNV-1a
+  unsigned long long HashBytes(unsigned long long hash, const char* data, const size_t size)
+  {
+    for (size_t i = 0; i < size; i++) {
+      hash ^= static_cast<unsigned char>(data[i]);
+      hash *= 1099511628211ULL;
     }
-    documentProtectionEnforcement.set_value("1");
+    return hash;
   }
 
-  std::map<std::string, std::string> Document::GetVars()
+  const unsigned long long HASH_SEED = 14695981039346656037ULL;
+
+  // hashes a file in chunks, keeping its first bytes
+  bool HashFile(const std::string& path, unsigned long long& hash, std::string& head)
   {
-    std::map<std::string, std::string> vars;
-    if (!impl_) return vars;
+    FILE* f = std::fopen(path.c_str(), "rb");
+    if (f == NULL) return false;
+    std::vector<char> buffer(1 << 16);
+    hash = HASH_SEED;
+    head.clear();
+    size_t n;
+    while ((n = std::fread(&buffer[0], 1, buffer.size(), f)) > 0) {
+      if (head.empty()) head.assign(&buffer[0], n < 16 ? n : 16);
+      hash = HashBytes(hash, &buffer[0], n);
+    }
+    const bool ok = !std::ferror(f);
+    std::fclose(f);
+    return ok;
+  }
 
-    pugi::xml_node docVars = impl_->w_settings_.child("w:docVars");
-    if (!docVars) {
-      return vars;
+  // compares the content of a picture with a file or a buffer
+  bool SameContent(const Media& m, const std::string& path, const char* data, const size_t size)
+  {
+    if (m.path_.empty() && data != NULL) {
+      return m.data_.size() == size && std::memcmp(m.data_.data(), data, size) == 0;
     }
 
-    for (pugi::xml_node p = docVars.child("w:docVar"); p; p = p.next_sibling("w:docVar")) {
-      vars.insert(std::pair<std::string, std::string>(p.attribute("w:name").value(), p.attribute("w:val").value()));
+    FILE* a = m.path_.empty() ? NULL : std::fopen(m.path_.c_str(), "rb");
+    FILE* b = data != NULL ? NULL : std::fopen(path.c_str(), "rb");
+    const char* mem = m.path_.empty() ? m.data_.data() : data;
+    const size_t memSize = m.path_.empty() ? m.data_.size() : size;
+    if ((!m.path_.empty() && a == NULL) || (data == NULL && b == NULL)) {
+      if (a != NULL) std::fclose(a);
+      if (b != NULL) std::fclose(b);
+      return false;
     }
 
-    return vars;
+    std::vector<char> bufA(1 << 16), bufB(1 << 16);
+    size_t offset = 0;
+    bool same = true;
+    while (same) {
+      size_t nA, nB;
+      if (a != NULL) {
+        nA = std::fread(&bufA[0], 1, bufA.size(), a);
+      }
+      else {
+        nA = memSize - offset < bufA.size() ? memSize - offset : bufA.size();
+        if (nA > 0) std::memcpy(&bufA[0], mem + offset, nA);
+      }
+      if (b != NULL) {
+        nB = std::fread(&bufB[0], 1, bufB.size(), b);
+      }
+      else {
+        nB = memSize - offset < bufB.size() ? memSize - offset : bufB.size();
+        if (nB > 0) std::memcpy(&bufB[0], mem + offset, nB);
+      }
+      same = nA == nB && std::memcmp(&bufA[0], &bufB[0], nA) == 0;
+      if (nA == 0) break;
+      offset += nA;
+    }
+    if (a != NULL) std::fclose(a);
+    if (b != NULL) std::fclose(b);
+    return same;
   }
 
-  void Document::SetVars(const std::map<std::string, std::string>& vars)
+  // Registers a picture from a file (data is NULL) or from memory and returns
+  // its index, or -1 if the format is not supported. The same content is only
+  // stored once, and a file added before is not read again.
+  size_t Document::Impl::AddMedia(const std::string& path, const char* data, const size_t size)
   {
-    if (!impl_) return;
+    if (data == NULL) {
+      std::unordered_map<std::string, size_t>::const_iterator it = mediaByPath_.find(path);
+      if (it != mediaByPath_.end()) return it->second;
+    }
 
-    pugi::xml_node docVars = impl_->w_settings_.child("w:docVars");
-    if (!docVars) {
-      docVars = impl_->w_settings_.append_child("w:docVars");
+    unsigned long long hash;
+    std::string head;
+    if (data == NULL) {
+      if (!HashFile(path, hash, head)) return static_cast<size_t>(-1);
     }
     else {
-      docVars.remove_children();
+      hash = HashBytes(HASH_SEED, data, size);
+      head.assign(data, size < 16 ? size : 16);
+    }
+    const ImageFormat* format = FindImageFormat(head.data(), head.size());
+    if (format == NULL) return static_cast<size_t>(-1);
+
+    typedef std::unordered_multimap<unsigned long long, size_t>::const_iterator Iterator;
+    std::pair<Iterator, Iterator> same = mediaByHash_.equal_range(hash);
+    for (Iterator it = same.first; it != same.second; ++it) {
+      if (SameContent(media_[it->second], path, data, size)) {
+        if (data == NULL) mediaByPath_[path] = it->second;
+        return it->second;
+      }
     }
 
-    std::map<std::string, std::string>::const_iterator it;
-    for (it = vars.begin(); it != vars.end(); it++) {
-      pugi::xml_node docVar = docVars.append_child("w:docVar");
-      docVar.append_attribute("w:name") = it->first.c_str();
-      docVar.append_attribute("w:val") = it->second.c_str();
+    Media m;
+    do {
+      m.name_ = "word/media/image" + std::to_string(nextImage_++) + "." + format->ext;
+    } while (package_.parts_.count(m.name_) > 0);
+    if (data == NULL) m.path_ = path;
+    else m.data_.assign(data, size);
+    m.relId_ = AddRelationship("http://schemas.openxmlformats.org/officeDocument/2006/relationships/image", m.name_.substr(5));
+    m.compress_ = !format->compressed;
+    m.saved_ = false;
+    AddDefaultContentType(format->ext, format->contentType);
+
+    const size_t index = media_.size();
+    media_.push_back(m);
+    mediaByHash_.insert(std::make_pair(hash, index));
+    if (data == NULL) mediaByPath_[path] = index;
+    return index;
+  }
+
+  bool Document::Impl::AppendDrawing(pugi::xml_node w_r, const size_t media, const int w, const int h)
+  {
+    // drawing ids are unique across the document
+    if (nextDrawingId_ == 0) {
+      nextDrawingId_ = 1;
+      pugi::xml_node node = w_body_.first_child();
+      while (node) {
+        const char* name = node.name();
+        if (std::strcmp(name, "wp:docPr") == 0 && nextDrawingId_ <= node.attribute("id").as_uint())
+          nextDrawingId_ = node.attribute("id").as_uint() + 1;
+        const bool descend = node.type() == pugi::node_element && std::strcmp(name, "w:t") != 0;
+        node = NextNode(node, w_body_, descend);
+      }
     }
-  }
 
-  void Document::AddVars(const std::map<std::string, std::string>& vars)
-  {
-    if (!impl_) return;
+    const Media& m = media_[media];
+    const unsigned int id = nextDrawingId_++;
+    const long long cx = static_cast<long long>(w) * 635; // twips to EMUs
+    const long long cy = static_cast<long long>(h) * 635;
+    const char* file = m.name_.c_str() + m.name_.rfind('/') + 1;
+
+    char xml[2048];
+    const int n = std::snprintf(xml, sizeof(xml),
+      "<w:drawing><wp:inline distT=\"0\" distB=\"0\" distL=\"0\" distR=\"0\">"
+      "<wp:extent cx=\"%lld\" cy=\"%lld\"/><wp:effectExtent l=\"0\" t=\"0\" r=\"0\" b=\"0\"/>"
+      "<wp:docPr id=\"%u\" name=\"Picture %u\"/>"
+      "<wp:cNvGraphicFramePr><a:graphicFrameLocks xmlns:a=\"http://schemas.openxmlformats.org/drawingml/2006/main\" noChangeAspect=\"1\"/></wp:cNvGraphicFramePr>"
+      "<a:graphic xmlns:a=\"http://schemas.openxmlformats.org/drawingml/2006/main\">"
+      "<a:graphicData uri=\"http://schemas.openxmlformats.org/drawingml/2006/picture\">"
+      "<pic:pic xmlns:pic=\"http://schemas.openxmlformats.org/drawingml/2006/picture\">"
+      "<pic:nvPicPr><pic:cNvPr id=\"%u\" name=\"%s\"/><pic:cNvPicPr/></pic:nvPicPr>"
+      "<pic:blipFill><a:blip r:embed=\"%s\"/><a:stretch><a:fillRect/></a:stretch></pic:blipFill>"
+      "<pic:spPr><a:xfrm><a:off x=\"0\" y=\"0\"/><a:ext cx=\"%lld\" cy=\"%lld\"/></a:xfrm>"
+      "<a:prstGeom prst=\"rect\"><a:avLst/></a:prstGeom></pic:spPr>"
+      "</pic:pic></a:graphicData></a:graphic></wp:inline></w:drawing>",
+      cx, cy, id, id, id, file, m.relId_.c_str(), cx, cy);
+    if (n < 0 || n >= static_cast<int>(sizeof(xml))) return false;
+
+    dirty_ |= DIRTY_DOCUMENT;
+    return w_r.append_buffer(xml, n).status == pugi::status_ok;
+  }
+
+  // Appends the pictures to a closed archive, all of them or those not saved
+  // yet. Formats compressed already are stored, the others are deflated, and
+  // pictures given as files are streamed from disk.
+  bool Document::Impl::WriteMedia(const std::string& path, const bool all, Stats* stats)
+  {
+    for (int pass = 0; pass < 2; pass++) {
+      const bool compress = pass == 1;
+      struct zip_t* zip = NULL;
+      for (size_t i = 0; i < media_.size(); i++) {
+        Media& m = media_[i];
+        if (m.compress_ != compress || (m.saved_ && !all)) continue;
+        if (zip == NULL) {
+          zip = zip_open(path.c_str(), compress ? ZIP_DEFAULT_COMPRESSION_LEVEL : 0, 'a');
+          if (zip == NULL) return false;
+        }
 
-    pugi::xml_node docVars = impl_->w_settings_.child("w:docVars");
-    if (!docVars) {
-      docVars = impl_->w_settings_.append_child("w:docVars");
+        Clock::time_point start;
+        if (stats != NULL) start = Clock::now();
+        zip_entry_open(zip, m.name_.c_str());
+        const int err = m.path_.empty()
+          ? zip_entry_write(zip, m.data_.data(), m.data_.size())
+          : zip_entry_fwrite(zip, m.path_.c_str());
+        const size_t bytes = static_cast<size_t>(zip_entry_size(zip));
+        zip_entry_close(zip);
+        if (err < 0) {
+          zip_close(zip);
+          return false;
+        }
+        if (stats != NULL) {
+          PartStats part = { m.name_, bytes, 0, 0, Seconds(start) };
+          stats->parts.push_back(part);
+        }
+      }
+      if (zip != NULL) zip_close(zip);
     }
-
-    std::map<std::string, std::string>::const_iterator it;
-    for (it = vars.begin(); it != vars.end(); it++) {
-      pugi::xml_node docVar = docVars.append_child("w:docVar");
-      docVar.append_attribute("w:name") = it->first.c_str();
-      docVar.append_attribute("w:val") = it->second.c_str();
+    for (size_t i = 0; i < media_.size(); i++) {
+      media_[i].saved_ = true;
     }
+    return true;
   }
 
-  void Document::FindBookmarks()
+  void Document::Impl::LoadNumbering(struct zip_t* zip, Stats* stats)
   {
-    if (!impl_) return;
-
-    unsigned int maxBookmarkId = 0;
-
-    for (pugi::xml_node i = impl_->w_body_.first_child(); i; i = i.next_sibling()) {
-      if (std::strcmp(i.name(), "w:p") != 0) continue;
+    numbering_.reset();
+    w_numbering_ = pugi::xml_node();
+    numberingPart_.clear();
+    nextNumId_ = 1;
+    nextAbstractNumId_ = 0;
+    abstractNums_.clear();
 
-      for (pugi::xml_node j = i.first_child(); j; j = j.next_sibling()) {
+    const Relationship* rel = zip == NULL ? NULL
+      : package_.FindRelationship(NUMBERING_TYPE);
+    if (rel == NULL) return;
+    numberingPart_ = rel->target_[0] == '/' ? rel->target_.substr(1) : "word/" + rel->target_;
+    if (!ReadPart(zip, numberingPart_.c_str(), numbering_, stats)) {
+      numberingPart_.clear();
+      return;
+    }
+    w_numbering_ = numbering_.child("w:numbering");
 
-        if (std::strcmp(j.name(), "w:bookmarkStart") == 0) {
+    // new ids go after the existing ones, the definitions made by
+    // AbstractNum() are recognized by their name and shared again
+    for (pugi::xml_node a = w_numbering_.child("w:abstractNum"); a; a = a.next_sibling("w:abstractNum")) {
+      const int id = a.attribute("w:abstractNumId").as_int();
+      if (nextAbstractNumId_ <= id) nextAbstractNumId_ = id + 1;
+      const char* name = a.child("w:name").attribute("w:val").as_string();
+      if (std::strncmp(name, "minidocx ", 9) == 0) abstractNums_[std::atoi(name + 9)] = id;
+    }
+    for (pugi::xml_node num = w_numbering_.child("w:num"); num; num = num.next_sibling("w:num")) {
+      const int id = num.attribute("w:numId").as_int();
+      if (nextNumId_ <= id) nextNumId_ = id + 1;
+    }
+  }
 
-          Bookmark::Impl* impl = new Bookmark::Impl;
-          impl->id_ = j.attribute("w:id").as_uint();
-          impl->name_ = j.attribute("w:name").as_string();
-          impl->w_bookmarkStart_ = j;
+  bool Document::Impl::CreateNumbering()
+  {
+    if (w_numbering_) return true;
+    numbering_.load_buffer(NUMBERING_XML, std::strlen(NUMBERING_XML), pugi::parse_declaration);
+    w_numbering_ = numbering_.child("w:numbering");
+    if (numberingPart_.empty()) {
+      numberingPart_ = "word/numbering.xml";
+      for (int i = 1; package_.parts_.count(numberingPart_) > 0; i++) {
+        numberingPart_ = "word/numbering" + std::to_string(i) + ".xml";
+      }
+    }
+    AddRelationship(NUMBERING_TYPE, numberingPart_.substr(5));
+    AddOverrideContentType("/" + numberingPart_, "application/vnd.openxmlformats-officedocument.wordprocessingml.numbering+xml");
+    dirty_ |= DIRTY_NUMBERING;
+    return w_numbering_;
+  }
 
-          if (maxBookmarkId < impl->id_)
-            maxBookmarkId = impl->id_;
+  // The w:abstractNum of a list format, one per document. Its levels indent
+  // by 720 twips each and hang the number or bullet by 360.
+  int Document::Impl::AbstractNum(const ListFormat format)
+  {
+    const int key = static_cast<int>(format);
+    std::unordered_map<int, int>::const_iterator it = abstractNums_.find(key);
+    if (it != abstractNums_.end()) return it->second;
 
-          impl_->bookmarks_.push_back(impl);
+    const char* numFmt;
+    switch (format) {
+    case ListFormat::Decimal:
+      numFmt = "decimal";
+      break;
+    case ListFormat::LowerLetter:
+      numFmt = "lowerLetter";
+      break;
+    case ListFormat::UpperLetter:
+      numFmt = "upperLetter";
+      break;
+    case ListFormat::LowerRoman:
+      numFmt = "lowerRoman";
+      break;
+    case ListFormat::UpperRoman:
+      numFmt = "upperRoman";
+      break;
+    default:
+      numFmt = "bullet";
+      break;
+    }
+    static const char* const bullets[] = { "\xE2\x80\xA2", "\xE2\x97\xA6", "\xE2\x96\xAA" };
+
+    // all w:abstractNum come before the first w:num
+    const int id = nextAbstractNumId_++;
+    pugi::xml_node w_num = w_numbering_.child("w:num");
+    pugi::xml_node a = w_num ? w_numbering_.insert_child_before("w:abstractNum", w_num) : w_numbering_.append_child("w:abstractNum");
+    a.append_attribute("w:abstractNumId") = id;
+    a.append_child("w:multiLevelType").append_attribute("w:val") = "hybridMultilevel";
+    a.append_child("w:name").append_attribute("w:val") = ("minidocx " + std::to_string(key)).c_str();
+    for (int i = 0; i < 9; i++) {
+      pugi::xml_node w_lvl = a.append_child("w:lvl");
+      w_lvl.append_attribute("w:ilvl") = i;
+      w_lvl.append_child("w:start").append_attribute("w:val") = 1;
+      w_lvl.append_child("w:numFmt").append_attribute("w:val") = numFmt;
+      const std::string text = format == ListFormat::Bullet ? bullets[i % 3] : "%" + std::to_string(i + 1) + ".";
+      w_lvl.append_child("w:lvlText").append_attribute("w:val") = text.c_str();
+      w_lvl.append_child("w:lvlJc").append_attribute("w:val") = "left";
+      pugi::xml_node w_ind = w_lvl.append_child("w:pPr").append_child("w:ind");
+      w_ind.append_attribute("w:left") = 720 * (i + 1);
+      w_ind.append_attribute("w:hanging") = 360;
+    }
+    abstractNums_[key] = id;
+    return id;
+  }
+
+  // A new w:num for each list, so each numbered list starts at 1.
+  int Document::Impl::AddList(const ListFormat format)
+  {
+    if (!CreateNumbering()) return 0;
+    dirty_ |= DIRTY_NUMBERING;
+
+    const int abstractNumId = AbstractNum(format);
+    const int id = nextNumId_++;
+    pugi::xml_node w_num = w_numbering_.append_child("w:num");
+    w_num.append_attribute("w:numId") = id;
+    w_num.append_child("w:abstractNumId").append_attribute("w:val") = abstractNumId;
+    if (format != ListFormat::Bullet) {
+      pugi::xml_node w_lvlOverride = w_num.append_child("w:lvlOverride");
+      w_lvlOverride.append_attribute("w:ilvl") = 0;
+      w_lvlOverride.append_child("w:startOverride").append_attribute("w:val") = 1;
+    }
+    return id;
+  }
+
+  // Copies the w:num of another numbering part as list 'numId', together with
+  // its w:abstractNum unless 'abstractNumIds' maps that one already.
+  void CopyList(pugi::xml_node w_numbering, const pugi::xml_node& other, const pugi::xml_node& w_num, const int numId,
+    int& nextAbstractNumId, std::unordered_map<int, int>& abstractNumIds)
+  {
+    const int otherAbstractNumId = w_num.child("w:abstractNumId").attribute("w:val").as_int();
+    int abstractNumId;
+    std::unordered_map<int, int>::const_iterator a = abstractNumIds.find(otherAbstractNumId);
+    if (a != abstractNumIds.end()) {
+      abstractNumId = a->second;
+    }
+    else {
+      abstractNumId = nextAbstractNumId++;
+      pugi::xml_node w_abstractNum = other.find_child_by_attribute("w:abstractNum", "w:abstractNumId",
+        std::to_string(otherAbstractNumId).c_str());
+      pugi::xml_node first = w_numbering.child("w:num");
+      pugi::xml_node copy = first ? w_numbering.insert_copy_before(w_abstractNum, first) : w_numbering.append_copy(w_abstractNum);
+      copy.attribute("w:abstractNumId") = abstractNumId;
+      abstractNumIds[otherAbstractNumId] = abstractNumId;
+    }
+
+    pugi::xml_node copy = w_numbering.append_copy(w_num);
+    copy.attribute("w:numId") = numId;
+    copy.child("w:abstractNumId").attribute("w:val") = abstractNumId;
+  }
+
+  void Document::Impl::ImportNumbering(const Impl& other, pugi::xml_node node,
+    std::unordered_map<int, int>& numIds, std::unordered_map<int, int>& abstractNumIds)
+  {
+    if (!other.w_numbering_) return;
+    pugi::xml_node root = node;
+    while (node) {
+      if (std::strcmp(node.name(), "w:numId") == 0) {
+        pugi::xml_attribute w_val = node.attribute("w:val");
+        const int id = w_val.as_int();
+        std::unordered_map<int, int>::const_iterator it = numIds.find(id);
+        if (it != numIds.end()) {
+          w_val = it->second;
         }
-        else if (std::strcmp(j.name(), "w:bookmarkEnd") == 0) {
-
-          const unsigned int id = j.attribute("w:id").as_uint();
-          for (std::vector<Bookmark>::iterator it = impl_->bookmarks_.begin(); it != impl_->bookmarks_.end(); ++it) {
-            if ((*it).GetId() == id) {
-              it->impl_->w_bookmarkEnd_ = j;
-              break;
+        else if (id != 0) {
+          pugi::xml_node w_num = other.w_numbering_.find_child_by_attribute("w:num", "w:numId", w_val.value());
+          if (w_num && CreateNumbering()) {
+            dirty_ |= DIRTY_NUMBERING;
+
+            // the definition, shared if it was made by AbstractNum()
+            const int otherAbstractNumId = w_num.child("w:abstractNumId").attribute("w:val").as_int();
+            if (abstractNumIds.count(otherAbstractNumId) == 0) {
+              pugi::xml_node w_abstractNum = other.w_numbering_.find_child_by_attribute("w:abstractNum", "w:abstractNumId",
+                std::to_string(otherAbstractNumId).c_str());
+              const char* name = w_abstractNum.child("w:name").attribute("w:val").as_string();
+              if (std::strncmp(name, "minidocx ", 9) == 0) {
+                abstractNumIds[otherAbstractNumId] = AbstractNum(static_cast<ListFormat>(std::atoi(name + 9)));
+              }
             }
+            CopyList(w_numbering_, other.w_numbering_, w_num, nextNumId_, nextAbstractNumId_, abstractNumIds);
+            numIds[id] = nextNumId_;
+            w_val = nextNumId_++;
           }
         }
-        else {
-          continue;
-        }
       }
+      node = NextNode(node, root, true);
     }
-
-    if (impl_->bookmarks_.size() > 0)
-      impl_->nextBookmarkId_ = maxBookmarkId++;
   }
 
-  std::vector<Bookmark> Document::GetBookmarks()
+  Document::Impl* Document::Impl::Owner(const pugi::xml_node& node, Impl* owner)
   {
-    if (!impl_) return std::vector<Bookmark>();
-    return impl_->bookmarks_;
+    if (owner != NULL) return owner;
+    std::lock_guard<std::mutex> lock(OwnersMutex());
+    std::unordered_map<const void*, Impl*>::const_iterator it = Owners().find(node.root().internal_object());
+    return it == Owners().end() ? NULL : it->second;
   }
 
-  Bookmark Document::AddBookmark(const std::string& name, const Run& start, const Run& end)
+  void Document::Impl::Register()
   {
-    if (!impl_) return Bookmark();
-
-    Bookmark::Impl* impl = new Bookmark::Impl;
-    impl->id_ = impl_->nextBookmarkId_++;
-    impl->name_ = name;
-
-    pugi::xml_node w_bookmarkStart = start.impl_->w_p_.insert_child_before("w:bookmarkStart", start.impl_->w_r_);
-    w_bookmarkStart.append_attribute("w:id") = impl->id_;
-    w_bookmarkStart.append_attribute("w:name") = impl->name_.c_str();
-
-    pugi::xml_node w_bookmarkEnd = end.impl_->w_p_.insert_child_after("w:bookmarkEnd", end.impl_->w_r_);
-    w_bookmarkEnd.append_attribute("w:id") = impl->id_;
-
-    impl->w_bookmarkStart_ = w_bookmarkStart;
-    impl->w_bookmarkStart_ = w_bookmarkEnd;
-
-    Bookmark b(impl);
-    impl_->bookmarks_.push_back(b);
-    return b;
+    std::lock_guard<std::mutex> lock(OwnersMutex());
+    Owners()[doc_.internal_object()] = this;
   }
 
-
-  void Document::RemoveBookmark(Bookmark& bookmark)
+  void Document::Impl::Unregister()
   {
-    if (!impl_) return;
-
-    std::vector<Bookmark>::iterator it = std::find(
-      impl_->bookmarks_.begin(), impl_->bookmarks_.end(), bookmark);
-    if (it != impl_->bookmarks_.end())
-      impl_->bookmarks_.erase(it);
-
-    bookmark.impl_->w_bookmarkStart_.parent().remove_child(bookmark.impl_->w_bookmarkStart_);
-    bookmark.impl_->w_bookmarkEnd_.parent().remove_child(bookmark.impl_->w_bookmarkEnd_);
+    std::lock_guard<std::mutex> lock(OwnersMutex());
+    Owners().erase(doc_.internal_object());
   }
 
-
-  // class Paragraph
-  Paragraph::Paragraph() : impl_(NULL)
+  Paragraph Document::FirstParagraph()
   {
+    if (!impl_) return Paragraph();
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+    pugi::xml_node w_p = impl_->w_body_.child("w:p");
+    if (!w_p) return Paragraph();
 
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->doc_ = impl_;
+    impl->owner_ = impl_;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_p.child("w:pPr");
+    return Paragraph(impl);
   }
 
-  Paragraph::Paragraph(Impl* impl) : impl_(impl)
+  Paragraph Document::LastParagraph()
   {
+    if (!impl_) return Paragraph();
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+    pugi::xml_node w_p = GetLastChild(impl_->w_body_, "w:p");
+    if (!w_p) return Paragraph();
 
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->doc_ = impl_;
+    impl->owner_ = impl_;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_p.child("w:pPr");
+    return Paragraph(impl);
   }
 
-  Paragraph::Paragraph(const Paragraph& p)
+  Section Document::FirstSection()
   {
-    impl_ = new Impl;
-    impl_->w_body_ = p.impl_->w_body_;
-    impl_->w_p_ = p.impl_->w_p_;
-    impl_->w_pPr_ = p.impl_->w_pPr_;
+    Paragraph firstParagraph = FirstParagraph();
+    if (firstParagraph) return firstParagraph.GetSection();
+
+    Section::Impl* impl = new Section::Impl;
+    impl->doc_ = impl_;
+    impl->w_body_ = impl_->w_body_;
+    Section section(impl);
+    section.FindSectionProperties();
+    return section;
   }
 
-  Paragraph::~Paragraph()
+  Section Document::LastSection()
   {
-    if (impl_ != NULL) {
-      delete impl_;
-      impl_ = NULL;
-    }
+    Paragraph lastParagraph = LastParagraph();
+    if (lastParagraph) return lastParagraph.GetSection();
+
+    Section::Impl* impl = new Section::Impl;
+    impl->doc_ = impl_;
+    impl->w_body_ = impl_->w_body_;
+    Section section(impl);
+    section.FindSectionProperties();
+    return section;
   }
 
-  Run Paragraph::FirstRun()
+  Paragraph Document::AppendParagraph()
   {
-    if (!impl_) return Run();
-    pugi::xml_node w_r = impl_->w_p_.child("w:r");
-    if (!w_r) return Run();
+    if (!impl_) return Paragraph();
+    impl_->dirty_ |= DIRTY_DOCUMENT;
 
-    Run::Impl* impl = new Run::Impl;
-    impl->w_p_ = impl_->w_p_;
-    impl->w_r_ = w_r;
-    impl->w_rPr_ = w_r.child("w:rPr");
-    return Run(impl);
+    pugi::xml_node w_p = impl_->w_body_.insert_child_before("w:p", impl_->w_sectPr_);
+    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
+
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->doc_ = impl_;
+    impl->owner_ = impl_;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_pPr;
+    impl_->IndexParagraph(w_p);
+    return Paragraph(impl);
   }
 
-  Run Paragraph::AppendRun()
+  Paragraph Document::AppendParagraph(const std::string& text)
   {
-    if (!impl_) return Run();
-    pugi::xml_node w_r = impl_->w_p_.append_child("w:r");
-    pugi::xml_node w_rPr = w_r.append_child("w:rPr");
-
-    Run::Impl* impl = new Run::Impl;
-    impl->w_p_ = impl_->w_p_;
-    impl->w_r_ = w_r;
-    impl->w_rPr_ = w_rPr;
-    return Run(impl);
+    Paragraph p = AppendParagraph();
+    p.AppendRun(text);
+    return p;
   }
 
-  Run Paragraph::AppendRun(const std::string& text)
+  Paragraph Document::AppendParagraph(const std::string& text,
+    const double fontSize)
   {
-    Run r = AppendRun();
-    if (!text.empty()) {
-      r.AppendText(text);
-    }
-    return r;
+    Paragraph p = AppendParagraph();
+    p.AppendRun(text, fontSize);
+    return p;
   }
 
-  Run Paragraph::AppendRun(const std::string& text, const double fontSize)
+  Paragraph Document::AppendParagraph(const std::string& text,
+    const double fontSize,
+    const std::string& fontAscii,
+    const std::string& fontEastAsia)
   {
-    Run r = AppendRun(text);
-    if (fontSize != 0) {
-      r.SetFontSize(fontSize);
-    }
-    return r;
+    Paragraph p = AppendParagraph();
+    p.AppendRun(text, fontSize, fontAscii, fontEastAsia);
+    return p;
   }
 
-  Run Paragraph::AppendRun(const std::string& text, const double fontSize, const std::string& fontAscii, const std::string& fontEastAsia)
+  Paragraph Document::AppendParagraph(const TextView& text)
   {
-    Run r = AppendRun(text, fontSize);
-    if (!fontAscii.empty()) {
-      r.SetFont(fontAscii, fontEastAsia);
-    }
-    return r;
+    Paragraph p = AppendParagraph();
+    p.AppendRun(text);
+    return p;
   }
 
-  Run Paragraph::AppendPageBreak()
+  Paragraph Document::AppendParagraph(const TextView& text,
+    const double fontSize)
   {
-    if (!impl_) return Run();
-    pugi::xml_node w_r = impl_->w_p_.append_child("w:r");
-    pugi::xml_node w_br = w_r.append_child("w:br");
-    w_br.append_attribute("w:type") = "page";
-
-    Run::Impl* impl = new Run::Impl;
-    impl->w_p_ = impl_->w_p_;
-    impl->w_r_ = w_r;
-    impl->w_rPr_ = w_br;
-    return Run(impl);
+    Paragraph p = AppendParagraph();
+    p.AppendRun(text, fontSize);
+    return p;
   }
 
-  void Paragraph::SetAlignment(const Alignment alignment)
+  Paragraph Document::PrependParagraph()
   {
-    if (!impl_) return;
+    if (!impl_) return Paragraph();
+    impl_->dirty_ |= DIRTY_DOCUMENT;
 
-    const char* val;
-    switch (alignment) {
-    case Alignment::Left:
-      val = "start";
-      break;
-    case Alignment::Right:
-      val = "end";
-      break;
-    case Alignment::Centered:
-      val = "center";
-      break;
-    case Alignment::Justified:
-      val = "both";
-      break;
-    case Alignment::Distributed:
-      val = "distribute";
-      break;
-    }
+    pugi::xml_node w_p = impl_->w_body_.prepend_child("w:p");
+    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
 
-    pugi::xml_node jc = impl_->w_pPr_.child("w:jc");
-    if (!jc) {
-      jc = impl_->w_pPr_.append_child("w:jc");
-    }
-    pugi::xml_attribute jcVal = jc.attribute("w:val");
-    if (!jcVal) {
-      jcVal = jc.append_attribute("w:val");
-    }
-    jcVal.set_value(val);
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->doc_ = impl_;
+    impl->owner_ = impl_;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_pPr;
+    impl_->IndexParagraph(w_p);
+    return Paragraph(impl);
   }
 
-  void Paragraph::SetLineSpacingSingle()
+  Paragraph Document::PrependParagraph(const std::string& text)
   {
-    SetLineSpacing(240, "auto");
+    Paragraph p = PrependParagraph();
+    p.AppendRun(text);
+    return p;
   }
 
-  void Paragraph::SetLineSpacingLines(const double at)
+  Paragraph Document::PrependParagraph(const std::string& text,
+    const double fontSize)
   {
-    // A normal single-spaced paragaph has a w:line value of 240, or 12 points.
-    // 
-    // If the value of lineRule is auto, then the value of line 
-    // is interpreted as 240th of a line, e.g. 360 = 1.5 lines.
-    SetLineSpacing(at * 240, "auto");
+    Paragraph p = PrependParagraph();
+    p.AppendRun(text, fontSize);
+    return p;
   }
 
-  void Paragraph::SetLineSpacingAtLeast(const int at)
+  Paragraph Document::PrependParagraph(const std::string& text,
+    const double fontSize,
+    const std::string& fontAscii,
+    const std::string& fontEastAsia)
   {
-    // If the value of the lineRule attribute is atLeast or exactly, 
-    // then the value of the line attribute is interpreted as 240th of a point.
-    // (Not really. Actually, values are in twentieths of a point, e.g. 240 = 12 pt.)
-    SetLineSpacing(at, "atLeast");
+    Paragraph p = PrependParagraph();
+    p.AppendRun(text, fontSize, fontAscii, fontEastAsia);
+    return p;
   }
 
-  void Paragraph::SetLineSpacingExactly(const int at)
+  Paragraph Document::PrependParagraph(const TextView& text)
   {
-    SetLineSpacing(at, "exact");
+    Paragraph p = PrependParagraph();
+    p.AppendRun(text);
+    return p;
   }
 
-  void Paragraph::SetLineSpacing(const int at, const char* lineRule)
+  Paragraph Document::PrependParagraph(const TextView& text,
+    const double fontSize)
   {
-    if (!impl_) return;
-    pugi::xml_node spacing = impl_->w_pPr_.child("w:spacing");
-    if (!spacing) {
-      spacing = impl_->w_pPr_.append_child("w:spacing");
-    }
+    Paragraph p = PrependParagraph();
+    p.AppendRun(text, fontSize);
+    return p;
+  }
 
-    pugi::xml_attribute spacingLineRule = spacing.attribute("w:lineRule");
-    if (!spacingLineRule) {
-      spacingLineRule = spacing.append_attribute("w:lineRule");
-    }
+  Paragraph Document::InsertParagraphBefore(const Paragraph& p)
+  {
+    if (!impl_) return Paragraph();
+    impl_->dirty_ |= DIRTY_DOCUMENT;
 
-    pugi::xml_attribute spacingLine = spacing.attribute("w:line");
-    if (!spacingLine) {
-      spacingLine = spacing.append_attribute("w:line");
-    }
+    pugi::xml_node w_p = impl_->w_body_.insert_child_before("w:p", p.impl_->w_p_);
+    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
 
-    spacingLineRule.set_value(lineRule);
-    spacingLine.set_value(at);
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->doc_ = impl_;
+    impl->owner_ = impl_;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_pPr;
+    impl_->IndexParagraph(w_p);
+    return Paragraph(impl);
   }
 
-  void Paragraph::SetBeforeSpacingAuto()
+  Paragraph Document::InsertParagraphAfter(const Paragraph& p)
   {
-    SetSpacingAuto("w:beforeAutospacing");
-  }
+    if (!impl_) return Paragraph();
+    impl_->dirty_ |= DIRTY_DOCUMENT;
 
-  void Paragraph::SetAfterSpacingAuto()
-  {
-    SetSpacingAuto("w:afterAutospacing");
+    pugi::xml_node w_p = impl_->w_body_.insert_child_after("w:p", p.impl_->w_p_);
+    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
+
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->doc_ = impl_;
+    impl->owner_ = impl_;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_pPr;
+    impl_->IndexParagraph(w_p);
+    return Paragraph(impl);
   }
 
-  void Paragraph::SetSpacingAuto(const char* attrNameAuto)
+  void Document::Impl::ForgetBookmark(std::unordered_map<unsigned int, Bookmark::Impl>::iterator it)
   {
-    if (!impl_) return;
-    pugi::xml_node spacing = impl_->w_pPr_.child("w:spacing");
-    if (!spacing) {
-      spacing = impl_->w_pPr_.append_child("w:spacing");
-    }
-    pugi::xml_attribute spacingAuto = spacing.attribute(attrNameAuto);
-    if (!spacingAuto) {
-      spacingAuto = spacing.append_attribute(attrNameAuto);
+    std::unordered_map<unsigned int, size_t>::iterator field = bookmarkFields_.find(it->first);
+    if (field != bookmarkFields_.end()) {
+      Field& f = fields_[field->second];
+      f.w_t_ = pugi::xml_node();
+      f.w_bookmarkStart_ = pugi::xml_node();
+      f.w_t_rest_.clear();
+      bookmarkFields_.erase(field);
+      deadFields_++;
     }
-    // Any value for before or beforeLines is ignored.
-    spacingAuto.set_value("true");
-  }
 
-  void Paragraph::SetBeforeSpacingLines(const double beforeSpacing)
-  {
-    // To specify units in hundreths of a line, 
-    // use attributes 'afterLines'/'beforeLines'.
-    SetSpacing(beforeSpacing * 100, "w:beforeAutospacing", "w:beforeLines");
+    std::unordered_map<std::string, unsigned int>::iterator name = bookmarkIds_.find(it->second.name_);
+    if (name != bookmarkIds_.end() && name->second == it->first)
+      bookmarkIds_.erase(name);
+    bookmarks_.erase(it);
   }
 
-  void Paragraph::SetAfterSpacingLines(const double afterSpacing)
+  void Document::Impl::ForgetBookmarks(const pugi::xml_node& root)
   {
-    SetSpacing(afterSpacing * 100, "w:afterAutospacing", "w:afterLines");
+    if (bookmarks_.empty()) return;
+    pugi::xml_node node = root.first_child();
+    while (node) {
+      const char* name = node.name();
+      if (std::strcmp(name, "w:bookmarkStart") == 0 || std::strcmp(name, "w:bookmarkEnd") == 0) {
+        std::unordered_map<unsigned int, Bookmark::Impl>::iterator it = bookmarks_.find(node.attribute("w:id").as_uint());
+        if (it != bookmarks_.end() && (it->second.w_bookmarkStart_ == node || it->second.w_bookmarkEnd_ == node)) {
+          pugi::xml_node other = it->second.w_bookmarkStart_ == node ? it->second.w_bookmarkEnd_ : it->second.w_bookmarkStart_;
+          pugi::xml_node parent = other;
+          while (parent && parent != root) parent = parent.parent();
+          if (other && parent != root) other.parent().remove_child(other);
+          ForgetBookmark(it);
+        }
+      }
+      node = NextNode(node, root, node.type() == pugi::node_element);
+    }
   }
 
-  void Paragraph::SetBeforeSpacing(const int beforeSpacing)
+  bool IsInside(pugi::xml_node node, const pugi::xml_node& root)
   {
-    SetSpacing(beforeSpacing, "w:beforeAutospacing", "w:before");
+    while (node && node != root) node = node.parent();
+    return node == root;
   }
 
-  void Paragraph::SetAfterSpacing(const int afterSpacing)
+  // whether w_t is still a text element of f, fieldTexts_ is not cleaned up
+  bool OwnsText(const Field& f, const pugi::xml_node& w_t)
   {
-    SetSpacing(afterSpacing, "w:afterAutospacing", "w:after");
+    return f.w_t_ == w_t || std::find(f.w_t_rest_.begin(), f.w_t_rest_.end(), w_t) != f.w_t_rest_.end();
   }
 
-  void Paragraph::SetSpacing(const int twip, const char* attrNameAuto, const char* attrName)
+  // Only the fields met in the subtree are looked at, they are left dead in
+  // place and compacted once they make up half of the fields.
+  void Document::Impl::DropFields(const pugi::xml_node& root)
   {
-    if (!impl_) return;
-    pugi::xml_node elemSpacing = impl_->w_pPr_.child("w:spacing");
-    if (!elemSpacing) {
-      elemSpacing = impl_->w_pPr_.append_child("w:spacing");
-    }
+    if (!fieldsCompiled_ || fields_.size() == deadFields_) return;
 
-    pugi::xml_attribute attrSpacingAuto = elemSpacing.attribute(attrNameAuto);
-    if (attrSpacingAuto) {
-      elemSpacing.remove_attribute(attrSpacingAuto);
+    std::vector<size_t> met;
+    pugi::xml_node node = root.first_child();
+    while (node) {
+      const char* name = node.name();
+      if (std::strcmp(name, "w:t") == 0) {
+        std::unordered_map<pugi::xml_node, size_t, NodeHash>::const_iterator it = fieldTexts_.find(node);
+        if (it != fieldTexts_.end() && OwnsText(fields_[it->second], node)) met.push_back(it->second);
+      }
+      else if (std::strcmp(name, "w:bookmarkStart") == 0) {
+        std::unordered_map<unsigned int, size_t>::const_iterator it = bookmarkFields_.find(node.attribute("w:id").as_uint());
+        if (it != bookmarkFields_.end() && fields_[it->second].w_bookmarkStart_ == node) met.push_back(it->second);
+      }
+      node = NextNode(node, root, node.type() == pugi::node_element);
+    }
+    std::sort(met.begin(), met.end());
+    met.erase(std::unique(met.begin(), met.end()), met.end());
+
+    for (size_t i = 0; i < met.size(); i++) {
+      Field& f = fields_[met[i]];
+      if (IsDeadField(f)) continue;
+
+      if (f.w_bookmarkStart_) {
+        bool keep = !IsInside(f.w_bookmarkStart_, root);
+        if (keep) {
+          // the bookmark keeps its text outside the subtree
+          size_t m = 0;
+          for (size_t k = 0; k < f.w_t_rest_.size(); k++) {
+            if (!IsInside(f.w_t_rest_[k], root)) f.w_t_rest_[m++] = f.w_t_rest_[k];
+          }
+          f.w_t_rest_.resize(m);
+          if (f.w_t_ && IsInside(f.w_t_, root)) {
+            f.w_t_ = pugi::xml_node();
+            if (!f.w_t_rest_.empty()) {
+              f.w_t_ = f.w_t_rest_.front();
+              f.w_t_rest_.erase(f.w_t_rest_.begin());
+            }
+          }
+          // an empty bookmark gets a run when it is filled, which needs a paragraph
+          keep = f.w_t_ || std::strcmp(f.w_bookmarkStart_.parent().name(), "w:p") == 0;
+        }
+        if (keep) continue;
+        bookmarkFields_.erase(f.bookmarkId_);
+      }
+      f.w_t_ = pugi::xml_node();
+      f.w_bookmarkStart_ = pugi::xml_node();
+      f.w_t_rest_.clear();
+      deadFields_++;
     }
 
-    pugi::xml_attribute attrSpacing = elemSpacing.attribute(attrName);
-    if (!attrSpacing) {
-      attrSpacing = elemSpacing.append_attribute(attrName);
-    }
-    attrSpacing.set_value(twip);
+    if (deadFields_ > fields_.size() / 2) CompactFields();
   }
 
-  void Paragraph::SetLeftIndentChars(const double leftIndent)
+  void Document::Impl::CompactFields()
   {
-    // To specify units in hundreths of a character, 
-    // use attributes leftChars/endChars, rightChars/endChars, etc. 
-    SetIndent(leftIndent * 100, "w:leftChars");
-  }
+    size_t n = 0;
+    for (size_t i = 0; i < fields_.size(); i++) {
+      if (IsDeadField(fields_[i])) continue;
+      if (n != i) std::swap(fields_[n], fields_[i]);
+      n++;
+    }
+    fields_.resize(n);
+    deadFields_ = 0;
 
-  void Paragraph::SetRightIndentChars(const double rightIndent)
-  {
-    SetIndent(rightIndent * 100, "w:rightChars");
+    bookmarkFields_.clear();
+    fieldTexts_.clear();
+    for (size_t i = 0; i < fields_.size(); i++) IndexField(i);
   }
 
-  void Paragraph::SetLeftIndent(const int leftIndent)
+  void Document::Impl::IndexField(const size_t i)
   {
-    SetIndent(leftIndent, "w:left");
+    const Field& f = fields_[i];
+    if (f.w_bookmarkStart_) bookmarkFields_[f.bookmarkId_] = i;
+    if (f.w_t_) fieldTexts_[f.w_t_] = i;
+    for (size_t k = 0; k < f.w_t_rest_.size(); k++) fieldTexts_[f.w_t_rest_[k]] = i;
   }
 
-  void Paragraph::SetRightIndent(const int rightIndent)
+  bool Document::RemoveParagraph(Paragraph& p)
   {
-    SetIndent(rightIndent, "w:right");
+    if (!impl_) return false;
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+    impl_->ForgetBookmarks(p.impl_->w_p_);
+    impl_->DropFields(p.impl_->w_p_);
+    if (p.impl_->w_p_.parent() == impl_->w_body_) impl_->UnindexParagraph(p.impl_->w_p_);
+    if (impl_->statsTracked_) impl_->CountContent(p.impl_->w_p_, false);
+    return impl_->w_body_.remove_child(p.impl_->w_p_);
   }
 
-  void Paragraph::SetFirstLineChars(const double indent)
+  Paragraph Document::AppendPageBreak()
   {
-    SetIndent(indent * 100, "w:firstLineChars");
+    Paragraph p = AppendParagraph();
+    p.AppendPageBreak();
+    return p;
   }
 
-  void Paragraph::SetHangingChars(const double indent)
+  Paragraph Document::AppendSectionBreak()
   {
-    SetIndent(indent * 100, "w:hangingChars");
+    Paragraph p = AppendParagraph();
+    p.InsertSectionBreak();
+    return p;
   }
 
-  void Paragraph::SetFirstLine(const int indent)
+  // creates the grid and applies the default table formatting
+  void InitTable(Table& tbl, const int rows, const int cols)
   {
-    SetIndent(indent, "w:firstLine");
+    tbl.Create_(rows, cols);
+    tbl.SetAllBorders();
+    tbl.SetWidthPercent(100);
+    tbl.SetCellMarginLeft(CM2Twip(0.19));
+    tbl.SetCellMarginRight(CM2Twip(0.19));
+    tbl.SetAlignment(Table::Alignment::Centered);
   }
 
-  void Paragraph::SetHanging(const int indent)
+  Table Document::AppendTable(const int rows, const int cols)
   {
-    SetIndent(indent, "w:hanging");
-    SetLeftIndent(indent);
+    if (!impl_) return Table();
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+
+    pugi::xml_node w_tbl = impl_->w_body_.insert_child_before("w:tbl", impl_->w_sectPr_);
+    pugi::xml_node w_tblPr = w_tbl.append_child("w:tblPr");
+    pugi::xml_node w_tblGrid = w_tbl.append_child("w:tblGrid");
+
+    Table::Impl* impl = new Table::Impl;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_tbl_ = w_tbl;
+    impl->w_tblPr_ = w_tblPr;
+    impl->w_tblGrid_ = w_tblGrid;
+    Table tbl(impl);
+    InitTable(tbl, rows, cols);
+    return tbl;
   }
 
-  void Paragraph::SetIndent(const int indent, const char* attrName)
+  void Document::RemoveTable(Table& tbl)
   {
     if (!impl_) return;
-    pugi::xml_node elemIndent = impl_->w_pPr_.child("w:ind");
-    if (!elemIndent) {
-      elemIndent = impl_->w_pPr_.append_child("w:ind");
-    }
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+    impl_->ForgetBookmarks(tbl.impl_->w_tbl_);
+    impl_->DropFields(tbl.impl_->w_tbl_);
+    if (impl_->statsTracked_) impl_->CountContent(tbl.impl_->w_tbl_, false);
+    impl_->w_body_.remove_child(tbl.impl_->w_tbl_);
+  }
 
-    pugi::xml_attribute attrIndent = elemIndent.attribute(attrName);
-    if (!attrIndent) {
-      attrIndent = elemIndent.append_attribute(attrName);
+  void Document::AppendFragment(Fragment&& f)
+  {
+    if (!impl_ || !f.impl_) return;
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+
+    // pugixml cannot move nodes between documents, so they are copied
+    pugi::xml_node w_body = f.impl_->w_body_;
+    for (pugi::xml_node node = w_body.first_child(); node; node = node.next_sibling()) {
+      pugi::xml_node copy = impl_->w_body_.insert_copy_before(node, impl_->w_sectPr_);
+      if (impl_->statsTracked_) impl_->CountContent(copy, true);
+      if (std::strcmp(copy.name(), "w:p") != 0) continue;
+      if (copy.child("w:pPr").child("w:sectPr")) {
+        impl_->sectionsIndexed_ = false;
+      }
+      else {
+        impl_->IndexParagraph(copy);
+      }
     }
-    attrIndent.set_value(indent);
+    w_body.remove_children();
   }
 
-  void Paragraph::SetTopBorder(const BorderStyle style, const double width, const char* color)
+  int Document::AddList(const ListFormat format)
   {
-    SetBorders_("w:top", style, width, color);
+    if (!impl_) return 0;
+    return impl_->AddList(format);
   }
 
-  void Paragraph::SetBottomBorder(const BorderStyle style, const double width, const char* color)
+  // Maps the bookmark a REF, PAGEREF or NOTEREF field code refers to through
+  // 'names', returns false if the code is left as it was.
+  bool RenameFieldBookmark(std::string& instr, const std::unordered_map<std::string, std::string>& names)
   {
-    SetBorders_("w:bottom", style, width, color);
+    size_t begin = instr.find_first_not_of(' ');
+    if (begin == std::string::npos) return false;
+    size_t end = instr.find(' ', begin);
+    const std::string code = instr.substr(begin, end - begin);
+    if (code != "REF" && code != "PAGEREF" && code != "NOTEREF") return false;
+    begin = instr.find_first_not_of(' ', end);
+    if (begin == std::string::npos) return false;
+    end = instr.find(' ', begin);
+    if (end == std::string::npos) end = instr.size();
+    std::unordered_map<std::string, std::string>::const_iterator it = names.find(instr.substr(begin, end - begin));
+    if (it == names.end()) return false;
+    instr.replace(begin, end - begin, it->second);
+    return true;
   }
 
-  void Paragraph::SetLeftBorder(const BorderStyle style, const double width, const char* color)
+  // makes the links and fields of a node follow renamed bookmarks
+  void RenameBookmarkRefs(pugi::xml_node node, const std::unordered_map<std::string, std::string>& names)
   {
-    SetBorders_("w:left", style, width, color);
+    const char* name = node.name();
+    if (std::strcmp(name, "w:hyperlink") == 0) {
+      pugi::xml_attribute w_anchor = node.attribute("w:anchor");
+      std::unordered_map<std::string, std::string>::const_iterator it = names.find(w_anchor.as_string());
+      if (w_anchor && it != names.end()) w_anchor = it->second.c_str();
+    }
+    else if (std::strcmp(name, "w:fldSimple") == 0) {
+      pugi::xml_attribute w_instr = node.attribute("w:instr");
+      std::string instr = w_instr.as_string();
+      if (RenameFieldBookmark(instr, names)) w_instr = instr.c_str();
+    }
+    else if (std::strcmp(name, "w:r") == 0) {
+      for (pugi::xml_node w_instrText = node.child("w:instrText"); w_instrText; w_instrText = w_instrText.next_sibling("w:instrText")) {
+        std::string instr = w_instrText.text().get();
+        if (RenameFieldBookmark(instr, names)) w_instrText.text() = instr.c_str();
+      }
+    }
   }
 
-  void Paragraph::SetRightBorder(const BorderStyle style, const double width, const char* color)
+  bool Document::Append(const Document& other)
   {
-    SetBorders_("w:right", style, width, color);
+    if (!impl_ || !other.impl_ || &other == this) return false;
+    pugi::xml_node w_body = other.impl_->w_body_;
+    if (!w_body.first_child() || w_body.first_child() == other.impl_->w_sectPr_) return true;
+
+    // the parts the body refers to come first, so a failure leaves the body alone
+    std::unordered_map<std::string, std::string> relIds;
+    if (!impl_->ImportRelationships(*other.impl_, w_body, relIds)) return false;
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+
+    // the last section of this document now ends with a paragraph
+    pugi::xml_node w_last = impl_->w_sectPr_ ? impl_->w_sectPr_.previous_sibling() : impl_->w_body_.last_child();
+    if (w_last && impl_->w_sectPr_) {
+      if (std::strcmp(w_last.name(), "w:p") != 0 || w_last.child("w:pPr").child("w:sectPr")) {
+        w_last = impl_->w_body_.insert_child_before("w:p", impl_->w_sectPr_);
+      }
+      pugi::xml_node w_pPr = w_last.child("w:pPr");
+      if (!w_pPr) w_pPr = w_last.prepend_child("w:pPr");
+      w_pPr.append_copy(impl_->w_sectPr_);
+    }
+
+    // bookmarks named as one of ours get a suffix, "_2", "_3"... that neither
+    // document uses, and the links and fields of the other body follow them
+    std::unordered_set<std::string> otherNames;
+    std::unordered_map<unsigned int, Bookmark::Impl>::const_iterator b;
+    for (b = other.impl_->bookmarks_.begin(); b != other.impl_->bookmarks_.end(); ++b) {
+      otherNames.insert(b->second.name_);
+    }
+    std::unordered_map<std::string, std::string> names;
+    for (b = other.impl_->bookmarks_.begin(); b != other.impl_->bookmarks_.end(); ++b) {
+      const std::string& name = b->second.name_;
+      if (!b->second.w_bookmarkStart_ || impl_->bookmarkIds_.count(name) == 0 || names.count(name) > 0) continue;
+      std::string renamed;
+      for (int n = 2; renamed.empty() || impl_->bookmarkIds_.count(renamed) > 0 || otherNames.count(renamed) > 0; n++) {
+        renamed = name + "_" + std::to_string(n);
+      }
+      otherNames.insert(renamed);
+      names[name] = renamed;
+    }
+
+    // copy the body and renumber its bookmarks after ours
+    const unsigned int offset = impl_->nextBookmarkId_;
+    std::unordered_map<int, int> numIds, abstractNumIds;
+    for (pugi::xml_node child = w_body.first_child(); child; child = child.next_sibling()) {
+      if (child == other.impl_->w_sectPr_) continue;
+      pugi::xml_node copy = impl_->w_sectPr_
+        ? impl_->w_body_.insert_copy_before(child, impl_->w_sectPr_)
+        : impl_->w_body_.append_copy(child);
+
+      pugi::xml_node node = copy;
+      while (node) {
+        const char* name = node.name();
+        const bool start = std::strcmp(name, "w:bookmarkStart") == 0;
+        if (start || std::strcmp(name, "w:bookmarkEnd") == 0) {
+          pugi::xml_attribute w_id = node.attribute("w:id");
+          const unsigned int id = w_id.as_uint() + offset;
+          w_id = id;
+
+          Bookmark::Impl& b = impl_->bookmarks_[id];
+          b.id_ = id;
+          if (start) {
+            pugi::xml_attribute w_name = node.attribute("w:name");
+            std::unordered_map<std::string, std::string>::const_iterator it = names.find(w_name.as_string());
+            if (it != names.end()) w_name = it->second.c_str();
+            b.name_ = w_name.as_string();
+            b.w_bookmarkStart_ = node;
+            impl_->bookmarkIds_.insert(std::make_pair(b.name_, id));
+          }
+          else {
+            b.w_bookmarkEnd_ = node;
+          }
+          if (impl_->nextBookmarkId_ <= id)
+            impl_->nextBookmarkId_ = id + 1;
+        }
+
+        else if (!names.empty()) {
+          RenameBookmarkRefs(node, names);
+        }
+
+        const bool descend = node.type() == pugi::node_element
+          && std::strcmp(name, "w:r") != 0 && !IsPropertyElement(name);
+        node = NextNode(node, copy, descend);
+      }
+      Document::Impl::MapRelationships(copy, relIds);
+      impl_->ImportNumbering(*other.impl_, copy, numIds, abstractNumIds);
+      if (impl_->statsTracked_) impl_->CountContent(copy, true);
+    }
+
+    // the last section takes the properties of the other document
+    if (other.impl_->w_sectPr_) {
+      pugi::xml_node w_sectPr = impl_->w_body_.append_copy(other.impl_->w_sectPr_);
+      Document::Impl::MapRelationships(w_sectPr, relIds);
+      if (impl_->w_sectPr_) impl_->w_body_.remove_child(impl_->w_sectPr_);
+      impl_->w_sectPr_ = w_sectPr;
+    }
+    impl_->sectionsIndexed_ = false;
+    return true;
   }
 
-  void Paragraph::SetBorders(const BorderStyle style, const double width, const char* color)
+  TextFrame Document::AppendTextFrame(const int w, const int h)
   {
-    SetTopBorder(style, width, color);
-    SetBottomBorder(style, width, color);
-    SetLeftBorder(style, width, color);
-    SetRightBorder(style, width, color);
+    if (!impl_) return TextFrame();
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+
+    pugi::xml_node w_p = impl_->w_body_.insert_child_before("w:p", impl_->w_sectPr_);
+    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
+    pugi::xml_node w_framePr = w_pPr.append_child("w:framePr");
+
+
+    Paragraph::Impl* paragraph_impl = new Paragraph::Impl;
+    paragraph_impl->doc_ = impl_;
+    paragraph_impl->owner_ = impl_;
+    paragraph_impl->w_body_ = impl_->w_body_;
+    paragraph_impl->w_p_ = w_p;
+    paragraph_impl->w_pPr_ = w_pPr;
+    impl_->IndexParagraph(w_p);
+
+    TextFrame::Impl* impl = new TextFrame::Impl;
+    impl->w_framePr_ = w_framePr;
+    TextFrame textFrame = TextFrame(impl, paragraph_impl);
+
+    textFrame.SetSize(w, h);
+    textFrame.SetBorders();
+    return textFrame;
   }
 
-  void Paragraph::SetBorders_(const char* elemName, const BorderStyle style, const double width, const char* color)
+  void Document::SetReadOnly(const bool enabled)
   {
     if (!impl_) return;
-    pugi::xml_node w_pBdr = impl_->w_pPr_.child("w:pBdr");
-    if (!w_pBdr) {
-      w_pBdr = impl_->w_pPr_.append_child("w:pBdr");
+    impl_->dirty_ |= DIRTY_SETTINGS;
+
+    if (!enabled) {
+      pugi::xml_node documentProtection = impl_->w_settings_.child("w:documentProtection");
+      if (documentProtection) {
+        impl_->w_settings_.remove_child(documentProtection);
+      }
+      return;
     }
-    docx::SetBorders(w_pBdr, elemName, style, width, color);
-  }
 
-  void Paragraph::SetFontSize(const double fontSize)
-  {
-    for (Run r = FirstRun(); r; r = r.Next()) {
-      r.SetFontSize(fontSize);
+    pugi::xml_node documentProtection = impl_->w_settings_.child("w:documentProtection");
+    if (!documentProtection) {
+      documentProtection = impl_->w_settings_.append_child("w:documentProtection");
     }
-  }
 
-  void Paragraph::SetFont(const std::string& fontAscii, const std::string& fontEastAsia)
-  {
-    for (Run r = FirstRun(); r; r = r.Next()) {
-      r.SetFont(fontAscii, fontEastAsia);
+    pugi::xml_attribute documentProtectionEdit = documentProtection.attribute("w:edit");
+    if (!documentProtectionEdit) {
+      documentProtectionEdit = documentProtection.append_attribute("w:edit");
+    }
+    documentProtectionEdit.set_value("readOnly");
+
+    pugi::xml_attribute documentProtectionEnforcement = documentProtection.attribute("w:enforcement");
+    if (!documentProtectionEnforcement) {
+      documentProtectionEnforcement = documentProtection.append_attribute("w:enforcement");
     }
+    documentProtectionEnforcement.set_value("1");
   }
 
-  void Paragraph::SetFontStyle(const Run::FontStyle fontStyle)
+  std::map<std::string, std::string> Document::GetVars()
   {
-    for (Run r = FirstRun(); r; r = r.Next()) {
-      r.SetFontStyle(fontStyle);
+    std::map<std::string, std::string> vars;
+    if (!impl_) return vars;
+
+    pugi::xml_node docVars = impl_->w_settings_.child("w:docVars");
+    if (!docVars) {
+      return vars;
+    }
+
+    for (pugi::xml_node p = docVars.child("w:docVar"); p; p = p.next_sibling("w:docVar")) {
+      vars.insert(std::pair<std::string, std::string>(p.attribute("w:name").value(), p.attribute("w:val").value()));
     }
+
+    return vars;
   }
 
-  void Paragraph::SetCharacterSpacing(const int characterSpacing)
+  void Document::SetVars(const std::map<std::string, std::string>& vars)
   {
-    for (Run r = FirstRun(); r; r = r.Next()) {
-      r.SetCharacterSpacing(characterSpacing);
+    if (!impl_) return;
+    impl_->dirty_ |= DIRTY_SETTINGS;
+
+    pugi::xml_node docVars = impl_->w_settings_.child("w:docVars");
+    if (!docVars) {
+      docVars = impl_->w_settings_.append_child("w:docVars");
+    }
+    else {
+      docVars.remove_children();
+    }
+
+    std::map<std::string, std::string>::const_iterator it;
+    for (it = vars.begin(); it != vars.end(); it++) {
+      pugi::xml_node docVar = docVars.append_child("w:docVar");
+      docVar.append_attribute("w:name") = it->first.c_str();
+      docVar.append_attribute("w:val") = it->second.c_str();
     }
   }
 
-  std::string Paragraph::GetText()
+  void Document::AddVars(const std::map<std::string, std::string>& vars)
   {
-    std::string text;
-    for (Run r = FirstRun(); r; r = r.Next()) {
-      text += r.GetText();
+    if (!impl_) return;
+    impl_->dirty_ |= DIRTY_SETTINGS;
+
+    pugi::xml_node docVars = impl_->w_settings_.child("w:docVars");
+    if (!docVars) {
+      docVars = impl_->w_settings_.append_child("w:docVars");
+    }
+
+    std::map<std::string, std::string>::const_iterator it;
+    for (it = vars.begin(); it != vars.end(); it++) {
+      pugi::xml_node docVar = docVars.append_child("w:docVar");
+      docVar.append_attribute("w:name") = it->first.c_str();
+      docVar.append_attribute("w:val") = it->second.c_str();
     }
-    return text;
   }
 
-  Paragraph Paragraph::Next()
+  void Document::FindBookmarks()
   {
-    if (!impl_) return Paragraph();
-    pugi::xml_node w_p = impl_->w_p_.next_sibling("w:p");
-    if (!w_p) return Paragraph();
+    if (!impl_) return;
 
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_p.child("w:pPr");
-    return Paragraph(impl);
+    impl_->bookmarks_.clear();
+    impl_->bookmarkIds_.clear();
+    impl_->nextBookmarkId_ = 0;
+    impl_->fieldsCompiled_ = false;
+    impl_->fields_.clear();
+    impl_->bookmarkFields_.clear();
+    impl_->fieldTexts_.clear();
+    impl_->deadFields_ = 0;
+
+    // Bookmarks may be placed in paragraphs, tables, cells and between them,
+    // but never inside a run or a property element, so those are skipped.
+    pugi::xml_node node = impl_->w_body_.first_child();
+    while (node) {
+      const char* name = node.name();
+
+      if (std::strcmp(name, "w:bookmarkStart") == 0) {
+        const unsigned int id = node.attribute("w:id").as_uint();
+        Bookmark::Impl& b = impl_->bookmarks_[id];
+        b.id_ = id;
+        b.name_ = node.attribute("w:name").as_string();
+        b.w_bookmarkStart_ = node;
+        impl_->bookmarkIds_.insert(std::make_pair(b.name_, id));
+
+        if (impl_->nextBookmarkId_ <= id)
+          impl_->nextBookmarkId_ = id + 1;
+      }
+      else if (std::strcmp(name, "w:bookmarkEnd") == 0) {
+        const unsigned int id = node.attribute("w:id").as_uint();
+        Bookmark::Impl& b = impl_->bookmarks_[id];
+        b.id_ = id;
+        b.w_bookmarkEnd_ = node;
+      }
+
+      const bool descend = node.type() == pugi::node_element
+        && std::strcmp(name, "w:r") != 0 && !IsPropertyElement(name);
+      node = NextNode(node, impl_->w_body_, descend);
+    }
+
+    // drop ends without a start
+    std::unordered_map<unsigned int, Bookmark::Impl>::iterator it = impl_->bookmarks_.begin();
+    while (it != impl_->bookmarks_.end()) {
+      if (it->second.w_bookmarkStart_.empty()) {
+        it = impl_->bookmarks_.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
   }
 
-  Paragraph Paragraph::Prev()
+  bool CompareBookmarkId(const Bookmark& a, const Bookmark& b)
   {
-    if (!impl_) return Paragraph();
-    pugi::xml_node w_p = impl_->w_p_.previous_sibling("w:p");
-    if (!w_p) return Paragraph();
-
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_p.child("w:pPr");
-    return Paragraph(impl);
+    return a.GetId() < b.GetId();
   }
 
-  Paragraph::operator bool()
+  std::vector<Bookmark> Document::GetBookmarks()
   {
-    return impl_ != NULL && impl_->w_p_;
+    std::vector<Bookmark> bookmarks;
+    if (!impl_) return bookmarks;
+
+    bookmarks.reserve(impl_->bookmarks_.size());
+    std::unordered_map<unsigned int, Bookmark::Impl>::const_iterator it;
+    for (it = impl_->bookmarks_.begin(); it != impl_->bookmarks_.end(); ++it) {
+      bookmarks.push_back(Bookmark(new Bookmark::Impl(it->second)));
+    }
+    std::sort(bookmarks.begin(), bookmarks.end(), CompareBookmarkId);
+    return bookmarks;
   }
 
-  bool Paragraph::operator==(const Paragraph& p)
+  Bookmark Document::FindBookmark(const std::string& name)
   {
-    if (!impl_ && !p.impl_) return true;
-    if (impl_ && p.impl_) return impl_->w_p_ == p.impl_->w_p_;
-    return false;
+    if (!impl_) return Bookmark();
+    std::unordered_map<std::string, unsigned int>::const_iterator it = impl_->bookmarkIds_.find(name);
+    if (it == impl_->bookmarkIds_.end()) return Bookmark();
+    return FindBookmark(it->second);
   }
 
-  void Paragraph::operator=(const Paragraph& right)
+  Bookmark Document::FindBookmark(const unsigned int id)
   {
-    if (this == &right) return;
-    if (impl_ != NULL) delete impl_;
-    if (right.impl_ != NULL) {
-      impl_ = new Impl;
-      impl_->w_body_ = right.impl_->w_body_;
-      impl_->w_p_ = right.impl_->w_p_;
-      impl_->w_pPr_ = right.impl_->w_pPr_;
-    }
-    else {
-      impl_ = NULL;
-    }
+    if (!impl_) return Bookmark();
+    std::unordered_map<unsigned int, Bookmark::Impl>::const_iterator it = impl_->bookmarks_.find(id);
+    if (it == impl_->bookmarks_.end()) return Bookmark();
+    return Bookmark(new Bookmark::Impl(it->second));
   }
 
-  Section Paragraph::GetSection()
+  Bookmark Document::AddBookmark(const std::string& name, const Run& start, const Run& end)
   {
-    if (!impl_) return Section();
-    Section::Impl* impl = new Section::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = impl_->w_p_;
-    impl->w_pPr_ = impl_->w_pPr_;
-    Section section(impl);
-    section.FindSectionProperties();
-    return section;
+    if (!impl_) return Bookmark();
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+    if (impl_->bookmarkIds_.count(name) > 0) return Bookmark();
+
+    const unsigned int id = impl_->nextBookmarkId_++;
+
+    pugi::xml_node w_bookmarkStart = start.impl_->w_p_.insert_child_before("w:bookmarkStart", start.impl_->w_r_);
+    w_bookmarkStart.append_attribute("w:id") = id;
+    w_bookmarkStart.append_attribute("w:name") = name.c_str();
+
+    pugi::xml_node w_bookmarkEnd = end.impl_->w_p_.insert_child_after("w:bookmarkEnd", end.impl_->w_r_);
+    w_bookmarkEnd.append_attribute("w:id") = id;
+
+    Bookmark::Impl& b = impl_->bookmarks_[id];
+    b.id_ = id;
+    b.name_ = name;
+    b.w_bookmarkStart_ = w_bookmarkStart;
+    b.w_bookmarkEnd_ = w_bookmarkEnd;
+    impl_->bookmarkIds_[name] = id;
+
+    return Bookmark(new Bookmark::Impl(b));
   }
 
-  Section Paragraph::InsertSectionBreak()
+  void Document::RemoveBookmark(Bookmark& bookmark)
   {
-    Section section = GetSection();
-    // this paragraph will be the last paragraph of the new section
-    if (section) section.Split();
-    return section;
+    if (!impl_ || !bookmark.impl_) return;
+
+    // the handle may outlive its nodes, e.g. after RemoveParagraph(), so only
+    // the nodes of the index are trusted
+    std::unordered_map<unsigned int, Bookmark::Impl>::iterator it = impl_->bookmarks_.find(bookmark.impl_->id_);
+    if (it == impl_->bookmarks_.end() || it->second.w_bookmarkStart_ != bookmark.impl_->w_bookmarkStart_) return;
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+
+    pugi::xml_node w_bookmarkStart = it->second.w_bookmarkStart_;
+    pugi::xml_node w_bookmarkEnd = it->second.w_bookmarkEnd_;
+    impl_->ForgetBookmark(it);
+    if (w_bookmarkStart) w_bookmarkStart.parent().remove_child(w_bookmarkStart);
+    if (w_bookmarkEnd) w_bookmarkEnd.parent().remove_child(w_bookmarkEnd);
   }
 
-  Section Paragraph::RemoveSectionBreak()
+
+  // a heading listed by InsertTableOfContents()
+  struct TocEntry
   {
-    Section section = GetSection();
-    if (section && section.IsSplit()) section.Merge();
-    return section;
-  }
+    pugi::xml_node w_p_;
+    int level_;
+    std::string text_;
+    std::string bookmark_; // an existing _Toc bookmark of the heading, if any
+    int page_;
+  };
 
-  bool Paragraph::HasSectionBreak()
+  // the outline level of a paragraph from 1 to 9, 0 for body text
+  int HeadingLevel(const pugi::xml_node& w_pPr)
   {
-    return GetSection().IsSplit();
+    const char* style = w_pPr.child("w:pStyle").attribute("w:val").as_string();
+    if (std::strncmp(style, "Heading", 7) == 0 || std::strncmp(style, "heading", 7) == 0) {
+      const int level = std::atoi(style + (style[7] == ' ' ? 8 : 7));
+      if (level >= 1 && level <= 9) return level;
+    }
+    pugi::xml_attribute outlineLvl = w_pPr.child("w:outlineLvl").attribute("w:val");
+    if (outlineLvl) {
+      const int level = outlineLvl.as_int() + 1;
+      if (level >= 1 && level <= 9) return level;
+    }
+    return 0;
   }
 
+  // false for w:val="false", "0" or "off"
+  bool IsOn(const pugi::xml_node& node)
+  {
+    const char* val = node.attribute("w:val").as_string("true");
+    return std::strcmp(val, "false") != 0 && std::strcmp(val, "0") != 0 && std::strcmp(val, "off") != 0;
+  }
 
-  // class Section
-  Section::Section() : impl_(NULL)
+  // a run of a TOC entry, the tab and page number runs are hidden in web layout
+  pugi::xml_node AppendTocRun(pugi::xml_node parent, const bool webHidden)
   {
+    pugi::xml_node w_r = parent.append_child("w:r");
+    pugi::xml_node w_rPr = w_r.append_child("w:rPr");
+    if (webHidden) w_rPr.append_child("w:webHidden");
+    return w_r;
+  }
+
+  void AppendFieldChar(pugi::xml_node parent, const char* type, const bool webHidden)
+  {
+    AppendTocRun(parent, webHidden).append_child("w:fldChar").append_attribute("w:fldCharType") = type;
+  }
+
+  void AppendInstrText(pugi::xml_node parent, const std::string& instr, const bool webHidden)
+  {
+    pugi::xml_node w_instrText = AppendTocRun(parent, webHidden).append_child("w:instrText");
+    w_instrText.append_attribute("xml:space") = "preserve";
+    w_instrText.text().set(instr.c_str());
+  }
+
+  size_t Document::InsertTableOfContents(const Paragraph& p, const int maxLevel, LayoutEstimate* layout)
+  {
+    if (!impl_) return 0;
+    if (p.impl_ && p.impl_->w_p_.parent() != impl_->w_body_) return 0;
+    const int levels = maxLevel < 1 ? 1 : maxLevel > 9 ? 9 : maxLevel;
+
+    // Collect the headings and count the pages in one pass, for want of a
+    // layout estimate. Only explicit breaks are counted: page breaks,
+    // paragraphs starting a page and section breaks other than continuous ones.
+    std::vector<TocEntry> entries;
+    int page = 1;
+    bool started = false;
+    bool breakBefore = false;
+    pugi::xml_node node = impl_->w_body_.first_child();
+    while (node) {
+      const char* name = node.name();
+      if (std::strcmp(name, "w:p") == 0) {
+        pugi::xml_node w_pPr = node.child("w:pPr");
+        pugi::xml_node w_pageBreakBefore = w_pPr.child("w:pageBreakBefore");
+        if (breakBefore || (w_pageBreakBefore && IsOn(w_pageBreakBefore) && started)) page++;
+        breakBefore = false;
+        started = true;
+        const int level = HeadingLevel(w_pPr);
+        TocEntry entry;
+        entry.w_p_ = node;
+        entry.level_ = level;
+        entry.page_ = page;
+
+        // the text of the paragraph and its page breaks
+        pugi::xml_node child = node.first_child();
+        while (child) {
+          const char* n = child.name();
+          bool descend = true;
+          if (std::strcmp(n, "w:t") == 0) {
+            if (level >= 1 && level <= levels) entry.text_ += child.text().get();
+            descend = false;
+          }
+          else if (std::strcmp(n, "w:tab") == 0) {
+            if (level >= 1 && level <= levels) entry.text_ += ' ';
+          }
+          else if (std::strcmp(n, "w:br") == 0) {
+            if (std::strcmp(child.attribute("w:type").as_string(), "page") == 0) page++;
+          }
+          else if (std::strcmp(n, "w:bookmarkStart") == 0) {
+            const char* bookmark = child.attribute("w:name").as_string();
+            if (entry.bookmark_.empty() && std::strncmp(bookmark, "_Toc", 4) == 0) entry.bookmark_ = bookmark;
+          }
+          else if (IsPropertyElement(n) || std::strcmp(n, "w:drawing") == 0 || std::strcmp(n, "w:pict") == 0
+            || std::strcmp(n, "w:object") == 0 || std::strcmp(n, "mc:AlternateContent") == 0) {
+            descend = false;
+          }
+          child = NextNode(child, node, descend);
+        }
+
+        pugi::xml_node w_sectPr = w_pPr.child("w:sectPr");
+        if (w_sectPr && std::strcmp(w_sectPr.child("w:type").attribute("w:val").as_string(), "continuous") != 0) {
+          breakBefore = true;
+        }
+        if (level >= 1 && level <= levels && !entry.text_.empty()) entries.push_back(entry);
+        node = NextNode(node, impl_->w_body_, false);
+        continue;
+      }
+      // headings in tables and content controls are listed too
+      const bool descend = std::strcmp(name, "w:tbl") == 0 || std::strcmp(name, "w:tr") == 0 || std::strcmp(name, "w:tc") == 0
+        || std::strcmp(name, "w:sdt") == 0 || std::strcmp(name, "w:sdtContent") == 0 || std::strcmp(name, "w:customXml") == 0;
+      node = NextNode(node, impl_->w_body_, descend);
+    }
+    if (entries.empty()) return 0;
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+
+    // bookmark the headings that have none
+    unsigned int serial = impl_->nextBookmarkId_;
+    for (size_t i = 0; i < entries.size(); i++) {
+      TocEntry& entry = entries[i];
+      if (!entry.bookmark_.empty()) continue;
+      do {
+        entry.bookmark_ = "_Toc" + std::to_string(serial++);
+      } while (impl_->bookmarkIds_.count(entry.bookmark_) > 0);
+
+      const unsigned int id = impl_->nextBookmarkId_++;
+      pugi::xml_node w_pPr = entry.w_p_.child("w:pPr");
+      pugi::xml_node w_bookmarkStart = w_pPr ? entry.w_p_.insert_child_after("w:bookmarkStart", w_pPr) : entry.w_p_.prepend_child("w:bookmarkStart");
+      w_bookmarkStart.append_attribute("w:id") = id;
+      w_bookmarkStart.append_attribute("w:name") = entry.bookmark_.c_str();
+      pugi::xml_node w_bookmarkEnd = entry.w_p_.append_child("w:bookmarkEnd");
+      w_bookmarkEnd.append_attribute("w:id") = id;
+
+      Bookmark::Impl& b = impl_->bookmarks_[id];
+      b.id_ = id;
+      b.name_ = entry.bookmark_;
+      b.w_bookmarkStart_ = w_bookmarkStart;
+      b.w_bookmarkEnd_ = w_bookmarkEnd;
+      impl_->bookmarkIds_[entry.bookmark_] = id;
+    }
+
+    // right aligned page numbers at the right margin
+    pugi::xml_node pgSz = impl_->w_sectPr_.child("w:pgSz");
+    pugi::xml_node pgMar = impl_->w_sectPr_.child("w:pgMar");
+    const int width = pgSz.attribute("w:w").as_int(11906) - pgMar.attribute("w:left").as_int(1800) - pgMar.attribute("w:right").as_int(1800);
+
+    const pugi::xml_node w_p_next = p.impl_ ? p.impl_->w_p_ : impl_->w_sectPr_;
+    char instr[32];
+    std::snprintf(instr, sizeof(instr), " TOC \\o \"1-%d\" \\h \\z \\u ", levels);
+    std::vector<pugi::xml_node> pageNumbers;
+    pageNumbers.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+      const TocEntry& entry = entries[i];
+      pugi::xml_node w_p = impl_->w_body_.insert_child_before("w:p", w_p_next);
+      pugi::xml_node w_pPr = w_p.append_child("w:pPr");
+      pugi::xml_node w_tab = w_pPr.append_child("w:tabs").append_child("w:tab");
+      w_tab.append_attribute("w:val") = "right";
+      w_tab.append_attribute("w:leader") = "dot";
+      w_tab.append_attribute("w:pos") = width > 0 ? width : 8306;
+      if (entry.level_ > 1) w_pPr.append_child("w:ind").append_attribute("w:left") = 420 * (entry.level_ - 1);
+
+      if (i == 0) {
+        AppendFieldChar(w_p, "begin", false);
+        AppendInstrText(w_p, instr, false);
+        AppendFieldChar(w_p, "separate", false);
+      }
+
+      pugi::xml_node w_hyperlink = w_p.append_child("w:hyperlink");
+      w_hyperlink.append_attribute("w:anchor") = entry.bookmark_.c_str();
+      w_hyperlink.append_attribute("w:history") = 1;
+      AppendTextElement(AppendTocRun(w_hyperlink, false), entry.text_.data(), entry.text_.size());
+      AppendTocRun(w_hyperlink, true).append_child("w:tab");
+      AppendFieldChar(w_hyperlink, "begin", true);
+      AppendInstrText(w_hyperlink, " PAGEREF " + entry.bookmark_ + " \\h ", true);
+      AppendFieldChar(w_hyperlink, "separate", true);
+      pugi::xml_node w_t = AppendTocRun(w_hyperlink, true).append_child("w:t");
+      w_t.text().set(entry.page_);
+      pageNumbers.push_back(w_t);
+      AppendFieldChar(w_hyperlink, "end", true);
+
+      if (i + 1 == entries.size()) AppendFieldChar(w_p, "end", false);
+      impl_->IndexParagraph(w_p);
+      if (layout != NULL) {
+        Paragraph::Impl* impl = new Paragraph::Impl;
+        impl->doc_ = impl_;
+        impl->owner_ = impl_;
+        impl->w_body_ = impl_->w_body_;
+        impl->w_p_ = w_p;
+        impl->w_pPr_ = w_pPr;
+        layout->Update(Paragraph(impl));
+      }
+    }
 
+    // the estimate takes the pages of the table of contents itself into account
+    if (layout != NULL) {
+      for (size_t i = 0; i < entries.size(); i++) {
+        Paragraph::Impl* impl = new Paragraph::Impl;
+        impl->doc_ = entries[i].w_p_.parent() == impl_->w_body_ ? impl_ : NULL;
+        impl->owner_ = impl_;
+        impl->w_body_ = entries[i].w_p_.parent();
+        impl->w_p_ = entries[i].w_p_;
+        impl->w_pPr_ = entries[i].w_p_.child("w:pPr");
+        const int page = layout->GetPage(Paragraph(impl));
+        if (page > 0) pageNumbers[i].text().set(page);
+      }
+    }
+    if (impl_->statsTracked_) {
+      for (size_t i = 0; i < pageNumbers.size(); i++) impl_->RecountParagraph(pageNumbers[i]);
+    }
+    return entries.size();
   }
 
-  Section::Section(Impl* impl) : impl_(impl)
+
+  void FillField(Field& f, const char* text, const size_t size)
   {
+    if (!f.w_t_) {
+      pugi::xml_node w_r = f.w_bookmarkStart_.parent().insert_child_after("w:r", f.w_bookmarkStart_);
+      f.w_t_ = w_r.append_child("w:t");
+    }
+    for (size_t k = 0; k < f.w_t_rest_.size(); k++) {
+      f.w_t_rest_[k].parent().remove_child(f.w_t_rest_[k]);
+    }
+    f.w_t_rest_.clear();
 
+    SetText(f.w_t_, text, size);
   }
 
-  Section::Section(const Section& s)
+  // fills a field, a bookmark without text gets a new w:t
+  void Document::Impl::SetField(const size_t i, const char* text, const size_t size)
   {
-    impl_ = new Impl;
-    impl_->w_body_ = s.impl_->w_body_;
-    impl_->w_p_ = s.impl_->w_p_;
-    impl_->w_p_last_ = s.impl_->w_p_last_;
-    impl_->w_pPr_ = s.impl_->w_pPr_;
-    impl_->w_pPr_last_ = s.impl_->w_pPr_last_;
-    impl_->w_sectPr_ = s.impl_->w_sectPr_;
+    FillField(fields_[i], text, size);
+    fieldTexts_[fields_[i].w_t_] = i;
   }
 
-  Section::~Section()
+  // whether the text from begin to end overlaps one of the w:t elements of texts
+  bool TouchesText(const std::vector<TextSegment>& segments, const size_t begin, const size_t end,
+    const std::unordered_map<pugi::xml_node, std::string, NodeHash>& texts)
   {
-    if (impl_ != NULL) {
-      delete impl_;
-      impl_ = NULL;
+    if (texts.empty()) return false;
+    size_t i = std::upper_bound(segments.begin(), segments.end(), begin, CompareSegmentOffset) - segments.begin() - 1;
+    for (; i < segments.size() && segments[i].offset < end; i++) {
+      if (texts.count(segments[i].w_t)) return true;
     }
+    return false;
   }
 
-  void Section::FindSectionProperties()
+  bool CompareFieldSize(const Field& a, const Field& b)
+  {
+    return a.w_t_rest_.size() < b.w_t_rest_.size();
+  }
+
+  void Document::CompileFields()
   {
     if (!impl_) return;
-    pugi::xml_node w_p_next = impl_->w_p_, w_p, w_pPr, w_sectPr;
-    do {
-      w_p = w_p_next;
-      w_pPr = w_p.child("w:pPr");
-      w_sectPr = w_pPr.child("w:sectPr");
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+
+    // placeholders compiled before keep their w:t, even once filled
+    std::unordered_map<pugi::xml_node, std::string, NodeHash> placeholders;
+    if (impl_->fieldsCompiled_) {
+      for (size_t i = 0; i < impl_->fields_.size(); i++) {
+        const Field& f = impl_->fields_[i];
+        if (!IsDeadField(f) && !f.w_bookmarkStart_) placeholders[f.w_t_] = f.name_;
+      }
+    }
+    impl_->fields_.clear();
+    impl_->bookmarkFields_.clear();
+    impl_->fieldTexts_.clear();
+    impl_->deadFields_ = 0;
+    impl_->fieldsCompiled_ = true;
+
+    // w:t elements already owned by a field
+    std::unordered_set<pugi::xml_node, NodeHash> claimed;
+    std::vector<std::pair<size_t, pugi::xml_node> > kept; // offset and w:t of the placeholders of a paragraph
+
+    // {{name}} placeholders, each is moved into a w:t element of its own
+    std::vector<TextSegment> segments;
+    std::vector<std::pair<size_t, size_t> > matches;
+    pugi::xml_node node = impl_->w_body_.first_child();
+    while (node) {
+      const char* name = node.name();
+      if (std::strcmp(name, "w:p") != 0) {
+        const bool descend = node.type() == pugi::node_element && !IsPropertyElement(name);
+        node = NextNode(node, impl_->w_body_, descend);
+        continue;
+      }
 
-      w_p_next = w_p.next_sibling("w:p");
-    } while (w_sectPr.empty() && !w_p_next.empty());
+      const std::string text = CollectText(node, segments);
+      kept.clear();
+      if (!placeholders.empty()) {
+        for (size_t k = 0; k < segments.size(); k++) {
+          if (placeholders.count(segments[k].w_t)) kept.push_back(std::make_pair(segments[k].offset, segments[k].w_t));
+        }
+      }
 
-    impl_->w_p_last_ = w_p;
-    impl_->w_pPr_last_ = w_pPr;
-    impl_->w_sectPr_ = w_sectPr;
+      matches.clear();
+      size_t begin = text.find("{{");
+      while (begin != std::string::npos) {
+        const size_t end = text.find("}}", begin + 2);
+        if (end == std::string::npos) break;
+        const size_t next = text.find("{{", begin + 2);
+        if (next != std::string::npos && next < end) {
+          begin = next; // "{{ {{name}}"
+          continue;
+        }
+        if (!TouchesText(segments, begin, end + 2, placeholders)) matches.push_back(std::make_pair(begin, end + 2));
+        begin = text.find("{{", end + 2);
+      }
 
-    if (impl_->w_sectPr_.empty()) {
-      impl_->w_sectPr_ = impl_->w_body_.child("w:sectPr");
+      const size_t first = impl_->fields_.size();
+      for (size_t k = matches.size(); k-- > 0; ) {
+        const size_t b = matches[k].first, e = matches[k].second;
+        size_t nb = b + 2, ne = e - 2;
+        while (nb < ne && std::isspace(static_cast<unsigned char>(text[nb]))) nb++;
+        while (ne > nb && std::isspace(static_cast<unsigned char>(text[ne - 1]))) ne--;
+
+        Field f;
+        f.name_ = text.substr(nb, ne - nb);
+        f.w_t_ = SpliceText(segments, b, e, text.c_str() + b, e - b);
+        claimed.insert(f.w_t_);
+        impl_->fields_.push_back(f);
+      }
+      std::reverse(impl_->fields_.begin() + first, impl_->fields_.end());
+
+      // the kept placeholders go in between, in the order of the text
+      if (!kept.empty()) {
+        std::vector<Field> merged;
+        size_t j = first;
+        for (size_t k = 0; k < kept.size(); k++) {
+          while (j < impl_->fields_.size() && matches[j - first].first < kept[k].first) merged.push_back(impl_->fields_[j++]);
+          Field f;
+          f.name_ = placeholders[kept[k].second];
+          f.w_t_ = kept[k].second;
+          claimed.insert(f.w_t_);
+          merged.push_back(f);
+        }
+        merged.insert(merged.end(), impl_->fields_.begin() + j, impl_->fields_.end());
+        impl_->fields_.resize(first);
+        impl_->fields_.insert(impl_->fields_.end(), merged.begin(), merged.end());
+      }
+
+      node = NextNode(node, impl_->w_body_, false);
+    }
+
+    // bookmarks, the innermost wins when they are nested or contain placeholders
+    std::vector<Field> bookmarks;
+    std::unordered_map<unsigned int, Bookmark::Impl>::const_iterator it;
+    for (it = impl_->bookmarks_.begin(); it != impl_->bookmarks_.end(); ++it) {
+      const Bookmark::Impl& b = it->second;
+      Field f;
+      f.name_ = b.name_;
+      f.w_bookmarkStart_ = b.w_bookmarkStart_;
+      f.bookmarkId_ = b.id_;
+
+      pugi::xml_node node = NextNode(b.w_bookmarkStart_, impl_->w_body_, false);
+      while (node && node != b.w_bookmarkEnd_) {
+        const char* name = node.name();
+        if (std::strcmp(name, "w:r") == 0) {
+          for (pugi::xml_node w_t = node.child("w:t"); w_t; w_t = w_t.next_sibling("w:t")) {
+            f.w_t_rest_.push_back(w_t);
+          }
+          node = NextNode(node, impl_->w_body_, false);
+        }
+        else {
+          const bool descend = node.type() == pugi::node_element && !IsPropertyElement(name);
+          node = NextNode(node, impl_->w_body_, descend);
+        }
+      }
+
+      // an empty bookmark gets a run when it is filled, which needs a paragraph
+      if (f.w_t_rest_.empty() && std::strcmp(b.w_bookmarkStart_.parent().name(), "w:p") != 0) continue;
+      bookmarks.push_back(f);
     }
-  }
+    std::sort(bookmarks.begin(), bookmarks.end(), CompareFieldSize);
 
-  void Section::Split()
-  {
-    if (!impl_) return;
-    if (IsSplit()) return;
-    impl_->w_p_last_ = impl_->w_p_;
-    impl_->w_pPr_last_ = impl_->w_pPr_;
-    impl_->w_sectPr_ = impl_->w_pPr_.append_copy(impl_->w_sectPr_);
-  }
+    for (size_t i = 0; i < bookmarks.size(); i++) {
+      Field& f = bookmarks[i];
+      size_t k = 0;
+      while (k < f.w_t_rest_.size() && claimed.count(f.w_t_rest_[k]) == 0) k++;
+      if (k < f.w_t_rest_.size()) continue;
 
-  bool Section::IsSplit()
-  {
-    if (!impl_) return false;
-    return impl_->w_pPr_.child("w:sectPr");
-  }
+      claimed.insert(f.w_t_rest_.begin(), f.w_t_rest_.end());
+      if (!f.w_t_rest_.empty()) {
+        f.w_t_ = f.w_t_rest_.front();
+        f.w_t_rest_.erase(f.w_t_rest_.begin());
+      }
+      impl_->fields_.push_back(f);
+    }
 
-  void Section::Merge()
-  {
-    if (!impl_) return;
-    if (impl_->w_pPr_.child("w:sectPr").empty()) return;
-    impl_->w_pPr_last_.remove_child(impl_->w_sectPr_);
-    FindSectionProperties();
+    for (size_t i = 0; i < impl_->fields_.size(); i++) impl_->IndexField(i);
   }
 
-  void Section::SetPageSize(const int w, const int h)
+  void Document::Fill(const std::map<std::string, std::string>& values)
   {
     if (!impl_) return;
-    pugi::xml_node pgSz = impl_->w_sectPr_.child("w:pgSz");
-    if (!pgSz) {
-      pgSz = impl_->w_sectPr_.append_child("w:pgSz");
+    if (!impl_->fieldsCompiled_) CompileFields();
+
+    // the paragraphs to count again
+    std::unordered_set<pugi::xml_node, NodeHash> filled;
+    for (size_t i = 0; i < impl_->fields_.size(); i++) {
+      Field& f = impl_->fields_[i];
+      if (IsDeadField(f)) continue;
+      std::map<std::string, std::string>::const_iterator value = values.find(f.name_);
+      if (value == values.end()) continue;
+
+      if (impl_->statsTracked_) {
+        if (f.w_t_) filled.insert(OuterParagraph(f.w_t_));
+        else filled.insert(OuterParagraph(f.w_bookmarkStart_));
+        for (size_t k = 0; k < f.w_t_rest_.size(); k++) filled.insert(OuterParagraph(f.w_t_rest_[k]));
+      }
+      impl_->SetField(i, value->second.c_str(), value->second.size());
     }
-    pugi::xml_attribute pgSzW = pgSz.attribute("w:w");
-    if (!pgSzW) {
-      pgSzW = pgSz.append_attribute("w:w");
+
+    for (std::unordered_set<pugi::xml_node, NodeHash>::const_iterator it = filled.begin(); it != filled.end(); ++it) {
+      if (*it) impl_->CountContent(*it, true);
     }
-    pugi::xml_attribute pgSzH = pgSz.attribute("w:h");
-    if (!pgSzH) {
-      pgSzH = pgSz.append_attribute("w:h");
+  }
+
+  std::vector<std::string> Document::GetFields()
+  {
+    std::vector<std::string> names;
+    if (!impl_) return names;
+    if (!impl_->fieldsCompiled_) CompileFields();
+
+    std::unordered_set<std::string> seen;
+    for (size_t i = 0; i < impl_->fields_.size(); i++) {
+      if (IsDeadField(impl_->fields_[i])) continue;
+      if (seen.insert(impl_->fields_[i].name_).second) {
+        names.push_back(impl_->fields_[i].name_);
+      }
     }
-    pgSzW.set_value(w);
-    pgSzH.set_value(h);
+    return names;
   }
 
-  void Section::GetPageSize(int& w, int& h)
+
+  // find and replace
+
+  struct PatternMatch
   {
-    if (!impl_) return;
-    w = h = 0;
-    pugi::xml_node pgSz = impl_->w_sectPr_.child("w:pgSz");
-    if (!pgSz) return;
-    pugi::xml_attribute pgSzW = pgSz.attribute("w:w");
-    if (!pgSzW) return;
-    pugi::xml_attribute pgSzH = pgSz.attribute("w:h");
-    if (!pgSzH) return;
-    w = pgSzW.as_int();
-    h = pgSzH.as_int();
+    size_t begin;
+    size_t end;
+    size_t pattern;
+  };
+
+  bool ComparePatternMatch(const PatternMatch& a, const PatternMatch& b)
+  {
+    if (a.begin != b.begin) return a.begin < b.begin;
+    return a.end > b.end; // the longest first
   }
 
-  void Section::SetPageOrient(const Orientation orient)
+  // An Aho-Corasick automaton over bytes, compiled to a full transition table.
+  // Bytes that occur in no pattern share one column of the table.
+  class PatternAutomaton
   {
-    if (!impl_) return;
-    pugi::xml_node pgSz = impl_->w_sectPr_.child("w:pgSz");
-    if (!pgSz) {
-      pgSz = impl_->w_sectPr_.append_child("w:pgSz");
-    }
-    pugi::xml_attribute pgSzH = pgSz.attribute("w:h");
-    if (!pgSzH) {
-      pgSzH = pgSz.append_attribute("w:h");
+  public:
+    explicit PatternAutomaton(const std::vector<std::pair<std::string, std::string> >& patterns)
+      : columns_(1)
+    {
+      unsigned short column[256] = { 0 };
+      for (size_t i = 0; i < patterns.size(); i++) {
+        const std::string& p = patterns[i].first;
+        for (size_t k = 0; k < p.size(); k++) {
+          const unsigned char c = static_cast<unsigned char>(p[k]);
+          if (column[c] == 0) column[c] = static_cast<unsigned short>(columns_++);
+        }
+      }
+      std::memcpy(column_, column, sizeof(column_));
+
+      // the trie, -1 for missing edges
+      AddState();
+      for (size_t i = 0; i < patterns.size(); i++) {
+        const std::string& p = patterns[i].first;
+        if (p.empty()) continue;
+        int state = 0;
+        for (size_t k = 0; k < p.size(); k++) {
+          const size_t edge = state * columns_ + column_[static_cast<unsigned char>(p[k])];
+          if (next_[edge] < 0) {
+            const int child = AddState();
+            next_[edge] = child;
+          }
+          state = next_[edge];
+        }
+        if (pattern_[state] < 0) {
+          pattern_[state] = static_cast<int>(i); // the first of duplicate patterns wins
+          length_[state] = p.size();
+        }
+      }
+
+      // breadth first: failure links become transitions, and each state
+      // links to the longest pattern among its proper suffixes
+      std::vector<int> queue;
+      for (size_t c = 0; c < columns_; c++) {
+        if (next_[c] < 0) {
+          next_[c] = 0;
+        }
+        else {
+          fail_[next_[c]] = 0;
+          queue.push_back(next_[c]);
+        }
+      }
+      for (size_t head = 0; head < queue.size(); head++) {
+        const int state = queue[head];
+        const int f = fail_[state];
+        output_[state] = pattern_[f] >= 0 ? f : output_[f];
+        for (size_t c = 0; c < columns_; c++) {
+          int& edge = next_[state * columns_ + c];
+          if (edge < 0) {
+            edge = next_[f * columns_ + c];
+          }
+          else {
+            fail_[edge] = next_[f * columns_ + c];
+            queue.push_back(edge);
+          }
+        }
+      }
     }
-    pugi::xml_attribute pgSzW = pgSz.attribute("w:w");
-    if (!pgSzW) {
-      pgSzW = pgSz.append_attribute("w:w");
+
+    // appends every occurrence of every pattern in text
+    void Find(const std::string& text, std::vector<PatternMatch>& matches) const
+    {
+      int state = 0;
+      for (size_t i = 0; i < text.size(); i++) {
+        state = next_[state * columns_ + column_[static_cast<unsigned char>(text[i])]];
+        for (int s = pattern_[state] >= 0 ? state : output_[state]; s > 0; s = output_[s]) {
+          PatternMatch m = { i + 1 - length_[s], i + 1, static_cast<size_t>(pattern_[s]) };
+          matches.push_back(m);
+        }
+      }
     }
-    pugi::xml_attribute pgSzOrient = pgSz.attribute("w:orient");
-    if (!pgSzOrient) {
-      pgSzOrient = pgSz.append_attribute("w:orient");
+
+  private:
+    int AddState()
+    {
+      next_.insert(next_.end(), columns_, -1);
+      fail_.push_back(0);
+      output_.push_back(0);
+      pattern_.push_back(-1);
+      length_.push_back(0);
+      return static_cast<int>(pattern_.size() - 1);
+    }
+
+    unsigned short column_[256];
+    size_t columns_;
+    std::vector<int> next_;     // states x columns
+    std::vector<int> fail_;
+    std::vector<int> output_;   // the next state ending a pattern along the failure links, 0 if none
+    std::vector<int> pattern_;  // the pattern ending at each state, -1 if none
+    std::vector<size_t> length_;
+  };
+
+  size_t Document::ReplaceAll(const std::vector<std::pair<std::string, std::string> >& replacements)
+  {
+    if (!impl_ || replacements.empty()) return 0;
+    const PatternAutomaton automaton(replacements);
+
+    size_t count = 0;
+    std::string text;
+    std::vector<TextSegment> segments;
+    std::vector<PatternMatch> matches;
+    std::vector<PatternMatch> edits;
+
+    // every paragraph of the body, including those in tables and text boxes
+    pugi::xml_node node = impl_->w_body_.first_child();
+    while (node) {
+      const char* name = node.name();
+      if (std::strcmp(name, "w:p") == 0) {
+        text = CollectText(node, segments);
+        matches.clear();
+        automaton.Find(text, matches);
+        if (!matches.empty()) {
+          // leftmost longest, without overlaps
+          std::sort(matches.begin(), matches.end(), ComparePatternMatch);
+          edits.clear();
+          size_t end = 0;
+          for (size_t i = 0; i < matches.size(); i++) {
+            if (matches[i].begin < end) continue;
+            edits.push_back(matches[i]);
+            end = matches[i].end;
+          }
+
+          // Back to front, so that the segments before each edit stay valid.
+          // Edits within a single w:t rewrite it in place, all at once.
+          size_t i = edits.size();
+          while (i > 0) {
+            const PatternMatch& m = edits[i - 1];
+            const size_t k = std::upper_bound(segments.begin(), segments.end(), m.begin, CompareSegmentOffset) - segments.begin() - 1;
+            const TextSegment& seg = segments[k];
+            if (m.end > seg.offset + seg.length) {
+              const std::string& value = replacements[m.pattern].second;
+              SpliceText(segments, m.begin, m.end, value.c_str(), value.size());
+              i--;
+              continue;
+            }
+
+            size_t first = i - 1;
+            while (first > 0 && edits[first - 1].begin >= seg.offset) first--;
+            const char* t = seg.w_t.text().get();
+            std::string rewritten;
+            size_t copied = 0;
+            for (size_t e = first; e < i; e++) {
+              rewritten.append(t + copied, edits[e].begin - seg.offset - copied);
+              rewritten += replacements[edits[e].pattern].second;
+              copied = edits[e].end - seg.offset;
+            }
+            rewritten.append(t + copied);
+            SetText(seg.w_t, rewritten.c_str(), rewritten.size());
+            i = first;
+          }
+          count += edits.size();
+          if (impl_->statsTracked_) impl_->RecountParagraph(node);
+        }
+      }
+      const bool descend = node.type() == pugi::node_element
+        && std::strcmp(name, "w:t") != 0 && !IsPropertyElement(name);
+      node = NextNode(node, impl_->w_body_, descend);
     }
-    int hVal = pgSzH.as_int();
-    int wVal = pgSzW.as_int();
-    switch (orient) {
-    case Orientation::Landscape:
-      if (hVal < wVal) return;
-      pgSzOrient.set_value("landscape");
-      pgSzH.set_value(wVal);
-      pgSzW.set_value(hVal);
-      break;
-    case Orientation::Portrait:
-      if (hVal > wVal) return;
-      pgSzOrient.set_value("portrait");
-      pgSzH.set_value(wVal);
-      pgSzW.set_value(hVal);
-      break;
+
+    if (count > 0) impl_->dirty_ |= DIRTY_DOCUMENT;
+
+    // the text elements of compiled fields may have been replaced
+    if (count > 0 && impl_->fieldsCompiled_) {
+      impl_->fieldsCompiled_ = false;
+      impl_->fields_.clear();
+      impl_->bookmarkFields_.clear();
+      impl_->fieldTexts_.clear();
+      impl_->deadFields_ = 0;
     }
+    return count;
   }
 
-  Section::Orientation Section::GetPageOrient()
+  // statistics
+
+  // spaces, which count as characters with spaces only
+  bool IsUnicodeSpace(const unsigned long cp)
   {
-    if (!impl_) return Orientation::Unknown;
-    Orientation orient = Orientation::Portrait;
-    pugi::xml_node pgSz = impl_->w_sectPr_.child("w:pgSz");
-    if (!pgSz) return orient;
-    pugi::xml_attribute pgSzOrient = pgSz.attribute("w:orient");
-    if (!pgSzOrient) return orient;
-    if (std::string(pgSzOrient.value()).compare("landscape") == 0) {
-      orient = Orientation::Landscape;
-    }
-    return orient;
+    return cp == 0xA0 || cp == 0x1680 || (cp >= 0x2000 && cp <= 0x200A)
+      || cp == 0x202F || cp == 0x205F || cp == 0x3000;
   }
 
-  void Section::SetPageMargin(const int top, const int bottom,
-    const int left, const int right)
+  // Chinese and Japanese characters and punctuation, each a word of its own.
+  // Hangul is written with spaces and is counted like Latin.
+  bool IsIdeograph(const unsigned long cp)
   {
-    if (!impl_) return;
-    pugi::xml_node pgMar = impl_->w_sectPr_.child("w:pgMar");
-    if (!pgMar) {
-      pgMar = impl_->w_sectPr_.append_child("w:pgMar");
-    }
-    pugi::xml_attribute pgMarTop = pgMar.attribute("w:top");
-    if (!pgMarTop) {
-      pgMarTop = pgMar.append_attribute("w:top");
-    }
-    pugi::xml_attribute pgMarBottom = pgMar.attribute("w:bottom");
-    if (!pgMarBottom) {
-      pgMarBottom = pgMar.append_attribute("w:bottom");
-    }
-    pugi::xml_attribute pgMarLeft = pgMar.attribute("w:left");
-    if (!pgMarLeft) {
-      pgMarLeft = pgMar.append_attribute("w:left");
-    }
-    pugi::xml_attribute pgMarRight = pgMar.attribute("w:right");
-    if (!pgMarRight) {
-      pgMarRight = pgMar.append_attribute("w:right");
-    }
-    pgMarTop.set_value(top);
-    pgMarBottom.set_value(bottom);
-    pgMarLeft.set_value(left);
-    pgMarRight.set_value(right);
+    return (cp >= 0x2E80 && cp <= 0x2FDF) || (cp >= 0x3001 && cp <= 0x31BF && (cp < 0x3130 || cp >= 0x31A0))
+      || (cp >= 0x31F0 && cp <= 0x31FF) || (cp >= 0x3400 && cp <= 0x4DBF) || (cp >= 0x4E00 && cp <= 0x9FFF)
+      || (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF01 && cp <= 0xFF9F)
+      || (cp >= 0x20000 && cp <= 0x3FFFF);
   }
 
-  void Section::GetPageMargin(int& top, int& bottom,
-    int& left, int& right)
+  // Adds text to the counts of a paragraph. Words are separated by spaces,
+  // line ends and U+200B, the latter two are not characters; joiners and
+  // byte order marks are not counted at all.
+  void CountText(const char* text, const size_t size, TextStats& s)
   {
-    if (!impl_) return;
-    top = bottom = left = right = 0;
-    pugi::xml_node pgMar = impl_->w_sectPr_.child("w:pgMar");
-    if (!pgMar) return;
-    pugi::xml_attribute pgMarTop = pgMar.attribute("w:top");
-    if (!pgMarTop) return;
-    pugi::xml_attribute pgMarBottom = pgMar.attribute("w:bottom");
-    if (!pgMarBottom) return;
-    pugi::xml_attribute pgMarLeft = pgMar.attribute("w:left");
-    if (!pgMarLeft) return;
-    pugi::xml_attribute pgMarRight = pgMar.attribute("w:right");
-    if (!pgMarRight) return;
-    top = pgMarTop.as_int();
-    bottom = pgMarBottom.as_int();
-    left = pgMarLeft.as_int();
-    right = pgMarRight.as_int();
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(text);
+    const unsigned char* end = p + size;
+    while (p < end) {
+      // printable ASCII, where a word starts at each letter after a space
+      const size_t n = PrintableAsciiLength(reinterpret_cast<const char*>(p), end - p);
+      if (n > 0) {
+        size_t spaces = p[0] == ' ';
+        size_t words = p[0] != ' ' && s.last != 1;
+        for (size_t i = 1; i < n; i++) {
+          spaces += p[i] == ' ';
+          words += (p[i - 1] == ' ') & (p[i] != ' ');
+        }
+        s.words += words;
+        s.characters += n - spaces;
+        s.charactersWithSpaces += n;
+        s.last = p[n - 1] != ' ';
+        p += n;
+        continue;
+      }
+
+      unsigned long cp = *p++;
+      if (cp < 0x20) {
+        if (cp == '\t') s.charactersWithSpaces++;
+        s.last = 0;
+        continue;
+      }
+      if (cp >= 0xC0) {
+        const int k = cp >= 0xF0 ? 3 : cp >= 0xE0 ? 2 : 1;
+        cp &= 0x3F >> k;
+        for (int i = 0; i < k && p < end && (*p & 0xC0) == 0x80; i++) cp = cp << 6 | (*p++ & 0x3F);
+      }
+
+      if (cp == 0x200C || cp == 0x200D || cp == 0xFEFF) continue;
+      if (cp == 0x85 || cp == 0x200B || cp == 0x2028 || cp == 0x2029) {
+        s.last = 0;
+      }
+      else if (IsUnicodeSpace(cp)) {
+        s.charactersWithSpaces++;
+        s.last = 0;
+      }
+      else {
+        s.characters++;
+        s.charactersWithSpaces++;
+        if (IsIdeograph(cp)) {
+          s.words++;
+          s.last = 2;
+        }
+        else {
+          if (s.last != 1) s.words++;
+          s.last = 1;
+        }
+      }
+    }
   }
 
-  void Section::SetPageMargin(const int header, const int footer)
+  // Counts the text of a paragraph. Text boxes and the fallbacks of
+  // mc:AlternateContent are left out, deleted text and field codes are not text.
+  void CountParagraph(const pugi::xml_node& w_p, TextStats& s)
   {
-    if (!impl_) return;
-    pugi::xml_node pgMar = impl_->w_sectPr_.child("w:pgMar");
-    if (!pgMar) {
-      pgMar = impl_->w_sectPr_.append_child("w:pgMar");
-    }
-    pugi::xml_attribute pgMarHeader = pgMar.attribute("w:header");
-    if (!pgMarHeader) {
-      pgMarHeader = pgMar.append_attribute("w:header");
+    pugi::xml_node node = w_p.first_child();
+    while (node) {
+      const char* name = node.name();
+      bool descend = node.type() == pugi::node_element && !IsPropertyElement(name);
+      if (std::strcmp(name, "w:t") == 0) {
+        const char* text = node.text().get();
+        CountText(text, std::strlen(text), s);
+        descend = false;
+      }
+      else if (std::strcmp(name, "w:tab") == 0) {
+        CountText("\t", 1, s);
+      }
+      else if (std::strcmp(name, "w:br") == 0 || std::strcmp(name, "w:cr") == 0) {
+        s.last = 0;
+      }
+      else if (std::strcmp(name, "w:drawing") == 0 || std::strcmp(name, "w:pict") == 0
+        || std::strcmp(name, "w:object") == 0 || std::strcmp(name, "mc:AlternateContent") == 0) {
+        descend = false;
+      }
+      node = NextNode(node, w_p, descend);
+    }
+  }
+
+  void Document::Impl::CountStatistics(DocumentStatistics& stats, const bool track)
+  {
+    if (track) StopStatistics();
+    stats.words = 0;
+    stats.characters = 0;
+    stats.charactersWithSpaces = 0;
+    stats.paragraphs = 0;
+
+    pugi::xml_node node = w_body_.first_child();
+    while (node) {
+      const char* name = node.name();
+      if (std::strcmp(name, "w:p") == 0) {
+        TextStats s;
+        CountParagraph(node, s);
+        if (s.charactersWithSpaces > 0) {
+          stats.words += s.words;
+          stats.characters += s.characters;
+          stats.charactersWithSpaces += s.charactersWithSpaces;
+          stats.paragraphs++;
+          if (track) paragraphStats_[node] = s;
+        }
+        node = NextNode(node, w_body_, false);
+        continue;
+      }
+      const bool descend = node.type() == pugi::node_element && !IsPropertyElement(name);
+      node = NextNode(node, w_body_, descend);
     }
-    pugi::xml_attribute pgMarFooter = pgMar.attribute("w:footer");
-    if (!pgMarFooter) {
-      pgMarFooter = pgMar.append_attribute("w:footer");
+
+    if (track) {
+      statsTracked_ = true;
+      TrackingCount()++;
     }
-    pgMarHeader.set_value(header);
-    pgMarFooter.set_value(footer);
   }
 
-  void Section::GetPageMargin(int& header, int& footer)
+  DocumentStatistics Document::Impl::SavedStatistics()
   {
-    if (!impl_) return;
-    header = footer = 0;
-    pugi::xml_node pgMar = impl_->w_sectPr_.child("w:pgMar");
-    if (!pgMar) return;
-    pugi::xml_attribute pgMarHeader = pgMar.attribute("w:header");
-    if (!pgMarHeader) return;
-    pugi::xml_attribute pgMarFooter = pgMar.attribute("w:footer");
-    if (!pgMarFooter) return;
-    header = pgMarHeader.as_int();
-    footer = pgMarFooter.as_int();
+    if (statsTracked_) return stats_;
+    DocumentStatistics stats;
+    CountStatistics(stats, false);
+    return stats;
   }
 
-  void Section::SetPageNumber(const PageNumberFormat fmt, const unsigned int start)
+  void Document::Impl::StopStatistics()
   {
-    if (!impl_) return;
-
-    pugi::xml_node footerReference = impl_->w_sectPr_.child("w:footerReference");
-    if (!footerReference) {
-      footerReference = impl_->w_sectPr_.append_child("w:footerReference");
-    }
-
-    pugi::xml_attribute footerReferenceId = footerReference.attribute("r:id");
-    if (!footerReferenceId) {
-      footerReferenceId = footerReference.append_attribute("r:id");
-    }
-    footerReferenceId.set_value("rId1");
-
-    pugi::xml_attribute footerReferenceType = footerReference.attribute("w:type");
-    if (!footerReferenceType) {
-      footerReferenceType = footerReference.append_attribute("w:type");
-    }
-    footerReferenceType.set_value("default");
-
-    pugi::xml_node pgNumType = impl_->w_sectPr_.child("w:pgNumType");
-    if (!pgNumType) {
-      pgNumType = impl_->w_sectPr_.append_child("w:pgNumType");
-    }
-
-    pugi::xml_attribute pgNumTypeFmt = pgNumType.attribute("w:fmt");
-    if (!pgNumTypeFmt) {
-      pgNumTypeFmt = pgNumType.append_attribute("w:fmt");
-    }
-    const char* fmtVal = "";
-    switch (fmt) {
-    case PageNumberFormat::Decimal:
-      fmtVal = "decimal";
-      break;
-    case PageNumberFormat::NumberInDash:
-      fmtVal = "numberInDash";
-      break;
-    case PageNumberFormat::CardinalText:
-      fmtVal = "cardinalText";
-      break;
-    case PageNumberFormat::OrdinalText:
-      fmtVal = "ordinalText";
-      break;
-    case PageNumberFormat::LowerLetter:
-      fmtVal = "lowerLetter";
-      break;
-    case PageNumberFormat::UpperLetter:
-      fmtVal = "upperLetter";
-      break;
-    case PageNumberFormat::LowerRoman:
-      fmtVal = "lowerRoman";
-      break;
-    case PageNumberFormat::UpperRoman:
-      fmtVal = "upperRoman";
-      break;
-    }
-    pgNumTypeFmt.set_value(fmtVal);
-
-    pugi::xml_attribute pgNumTypeStart = pgNumType.attribute("w:start");
-    if (start > 0) {
-      if (!pgNumTypeStart) {
-        pgNumTypeStart = pgNumType.append_attribute("w:start");
-        pgNumTypeStart.set_value(start);
-      }
-    }
-    else {
-      if (pgNumTypeStart) {
-        pgNumType.remove_attribute(pgNumTypeStart);
-      }
-    }
+    if (!statsTracked_) return;
+    statsTracked_ = false;
+    paragraphStats_.clear();
+    TrackingCount()--;
   }
 
-  void Section::RemovePageNumber()
+  void Document::Impl::AddStatistics(const TextStats& s, const bool add)
   {
-    if (!impl_) return;
-
-    pugi::xml_node footerReference = impl_->w_sectPr_.child("w:footerReference");
-    if (footerReference) {
-      impl_->w_sectPr_.remove_child(footerReference);
+    if (s.charactersWithSpaces == 0) return;
+    if (add) {
+      stats_.words += s.words;
+      stats_.characters += s.characters;
+      stats_.charactersWithSpaces += s.charactersWithSpaces;
+      stats_.paragraphs++;
     }
-
-    pugi::xml_node pgNumType = impl_->w_sectPr_.child("w:pgNumType");
-    if (pgNumType) {
-      impl_->w_sectPr_.remove_child(pgNumType);
+    else {
+      stats_.words -= s.words;
+      stats_.characters -= s.characters;
+      stats_.charactersWithSpaces -= s.charactersWithSpaces;
+      stats_.paragraphs--;
     }
   }
 
-  Paragraph Section::FirstParagraph()
+  void Document::Impl::CountContent(const pugi::xml_node& root, const bool add)
   {
-    return Prev().LastParagraph().Next();
+    pugi::xml_node node = root;
+    while (node) {
+      const char* name = node.name();
+      if (std::strcmp(name, "w:p") == 0) {
+        std::unordered_map<pugi::xml_node, TextStats, NodeHash>::iterator it = paragraphStats_.find(node);
+        if (it != paragraphStats_.end()) {
+          AddStatistics(it->second, false);
+          paragraphStats_.erase(it);
+        }
+        if (add) {
+          TextStats s;
+          CountParagraph(node, s);
+          if (s.charactersWithSpaces > 0) {
+            AddStatistics(s, true);
+            paragraphStats_[node] = s;
+          }
+        }
+        node = NextNode(node, root, false);
+        continue;
+      }
+      const bool descend = node.type() == pugi::node_element && !IsPropertyElement(name);
+      node = NextNode(node, root, descend);
+    }
   }
 
-  Paragraph Section::LastParagraph()
+  void Document::Impl::CountContentAfter(const pugi::xml_node& last)
   {
-    if (!impl_) return Paragraph();
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = impl_->w_p_last_;
-    impl->w_pPr_ = impl_->w_pPr_last_;
-    return Paragraph(impl);
+    pugi::xml_node node = last ? last.next_sibling() : w_body_.first_child();
+    for (; node && node != w_sectPr_; node = node.next_sibling()) {
+      CountContent(node, true);
+    }
   }
 
-  Section Section::Next()
+  void Document::Impl::RecountParagraph(const pugi::xml_node& node)
   {
-    if (!impl_) return Section();
-    pugi::xml_node w_p = impl_->w_p_last_.next_sibling();
-    if (w_p.empty()) return Section();
-
-    Section::Impl* impl = new Section::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_p.child("w:pPr");
-    Section s(impl);
-    s.FindSectionProperties();
-    return s;
+    const pugi::xml_node w_p = OuterParagraph(node);
+    if (w_p) CountContent(w_p, true);
   }
 
-  Section Section::Prev()
+  // Text appended to w_r. When nothing but bookmarks and proofing marks
+  // follows the run, the text is counted on from where the paragraph ended,
+  // otherwise the paragraph is counted again.
+  void Document::Impl::TextAppended(const pugi::xml_node& w_p, const pugi::xml_node& w_r, const char* text, const size_t size)
   {
-    if (!impl_) return Section();
-
-    pugi::xml_node w_p_prev, w_p, w_pPr, w_sectPr;
-
-    w_p_prev = impl_->w_p_.previous_sibling();
-    if (w_p_prev.empty()) return Section();
-
-    do {
-      w_p = w_p_prev;
-      w_pPr = w_p.child("w:pPr");
-      w_sectPr = w_pPr.child("w:sectPr");
-      w_p_prev = w_p.previous_sibling();
-    } while (w_sectPr.empty() && !w_p_prev.empty());
+    for (pugi::xml_node node = w_r; node && node != w_p; node = node.parent()) {
+      for (pugi::xml_node next = node.next_sibling(); next; next = next.next_sibling()) {
+        const char* name = next.name();
+        if (std::strcmp(name, "w:bookmarkStart") != 0 && std::strcmp(name, "w:bookmarkEnd") != 0
+          && std::strcmp(name, "w:proofErr") != 0) {
+          RecountParagraph(w_p);
+          return;
+        }
+      }
+    }
+    if (OuterParagraph(w_p) != w_p) return; // in a text box
 
-    Section::Impl* impl = new Section::Impl;
-    impl->w_body_ = impl_->w_body_;
-    impl->w_p_ = impl->w_p_last_ = w_p;
-    impl->w_pPr_ = impl->w_pPr_last_ = w_pPr;
-    impl->w_sectPr_ = w_sectPr;
-    return Section(impl);
+    TextStats& s = paragraphStats_[w_p];
+    AddStatistics(s, false);
+    CountText(text, size, s);
+    AddStatistics(s, true);
+    if (s.charactersWithSpaces == 0) paragraphStats_.erase(w_p);
   }
 
-  Section::operator bool()
+  Document::Impl* Document::Impl::Tracking(const pugi::xml_node& node, Impl* owner)
   {
-    return impl_ != NULL && impl_->w_sectPr_;
+    if (owner != NULL) return owner->statsTracked_ ? owner : NULL;
+    if (TrackingCount().load(std::memory_order_relaxed) == 0) return NULL;
+    Impl* doc = Owner(node);
+    return doc != NULL && doc->statsTracked_ ? doc : NULL;
   }
 
-  bool Section::operator==(const Section& s)
+  // Sets the counts of docProps/app.xml, keeping its other properties.
+  void Document::Impl::UpdateAppProperties(pugi::xml_document& app, const DocumentStatistics& stats)
   {
-    if (!impl_ && !s.impl_) return true;
-    if (impl_ && s.impl_) return impl_->w_sectPr_ == s.impl_->w_sectPr_;
-    return false;
+    pugi::xml_node root = app.child("Properties");
+    if (!root) {
+      app.load_buffer(APP_XML, std::strlen(APP_XML), pugi::parse_default | pugi::parse_declaration);
+      root = app.child("Properties");
+    }
+    const char* const names[] = { "Words", "Characters", "Paragraphs", "CharactersWithSpaces" };
+    const size_t values[] = { stats.words, stats.characters, stats.paragraphs, stats.charactersWithSpaces };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      pugi::xml_node node = root.child(names[i]);
+      if (!node) node = root.append_child(names[i]);
+      node.text().set(static_cast<unsigned long long>(values[i]));
+    }
   }
 
-  void Section::operator=(const Section& right)
+  DocumentStatistics Document::GetStatistics()
   {
-    if (this == &right) return;
-    if (impl_ != NULL) delete impl_;
-    if (right.impl_ != NULL) {
-      impl_ = new Impl;
-      impl_->w_body_ = right.impl_->w_body_;
-      impl_->w_p_ = right.impl_->w_p_;
-      impl_->w_p_last_ = right.impl_->w_p_last_;
-      impl_->w_pPr_ = right.impl_->w_pPr_;
-      impl_->w_pPr_last_ = right.impl_->w_pPr_last_;
-      impl_->w_sectPr_ = right.impl_->w_sectPr_;
-    }
-    else {
-      impl_ = NULL;
-    }
+    DocumentStatistics stats = { 0, 0, 0, 0 };
+    if (!impl_) return stats;
+    if (!impl_->statsTracked_) impl_->CountStatistics(impl_->stats_, true);
+    return impl_->stats_;
   }
 
 
-  // class Run
-  Run::Run() : impl_(NULL)
+  // class Paragraph
+  Paragraph::Paragraph() : impl_(NULL)
   {
 
   }
 
-  Run::Run(Impl* impl) : impl_(impl)
+  Paragraph::Paragraph(Impl* impl) : impl_(impl)
   {
 
   }
 
-  Run::Run(const Run& r)
+  Paragraph::Paragraph(const Paragraph& p)
   {
     impl_ = new Impl;
-    impl_->w_p_ = r.impl_->w_p_;
-    impl_->w_r_ = r.impl_->w_r_;
-    impl_->w_rPr_ = r.impl_->w_rPr_;
+    impl_->doc_ = p.impl_->doc_;
+    impl_->owner_ = p.impl_->owner_;
+    impl_->w_body_ = p.impl_->w_body_;
+    impl_->w_p_ = p.impl_->w_p_;
+    impl_->w_pPr_ = p.impl_->w_pPr_;
   }
 
-  Run::~Run()
+  Paragraph::~Paragraph()
   {
     if (impl_ != NULL) {
       delete impl_;
@@ -1744,982 +4255,6028 @@ namespace docx
     }
   }
 
-  void Run::AppendText(const std::string& text)
+  Run Paragraph::FirstRun()
   {
-    if (!impl_) return;
-    pugi::xml_node t = impl_->w_r_.append_child("w:t");
-    if (std::isspace(static_cast<unsigned char>(text[0]))) {
-      t.append_attribute("xml:space") = "preserve";
-    }
-    t.text().set(text.c_str());
-  }
+    if (!impl_) return Run();
+    pugi::xml_node w_r = impl_->w_p_.child("w:r");
+    if (!w_r) return Run();
 
-  std::string Run::GetText()
-  {
-    if (!impl_) return "";
-    std::string text;
-    for (pugi::xml_node t = impl_->w_r_.child("w:t"); t; t = t.next_sibling("w:t")) {
-      text += t.text().get();
-    }
-    return text;
+    Run::Impl* impl = new Run::Impl;
+    impl->owner_ = impl_->owner_;
+    impl->w_p_ = impl_->w_p_;
+    impl->w_r_ = w_r;
+    impl->w_rPr_ = w_r.child("w:rPr");
+    return Run(impl);
   }
 
-  void Run::ClearText()
+  Run Paragraph::AppendRun()
   {
-    if (!impl_) return;
-    impl_->w_r_.remove_children();
+    if (!impl_) return Run();
+    pugi::xml_node w_r = impl_->w_p_.append_child("w:r");
+    pugi::xml_node w_rPr = w_r.append_child("w:rPr");
+
+    Run::Impl* impl = new Run::Impl;
+    impl->owner_ = impl_->owner_;
+    impl->w_p_ = impl_->w_p_;
+    impl->w_r_ = w_r;
+    impl->w_rPr_ = w_rPr;
+    return Run(impl);
   }
 
-  void Run::AppendLineBreak()
+  Run Paragraph::AppendRun(const std::string& text)
   {
-    if (!impl_) return;
-    impl_->w_r_.append_child("w:br");
+    return AppendRun(TextView(text.data(), text.size()));
   }
 
-  void Run::AppendTabs(const unsigned int count)
+  Run Paragraph::AppendRun(const TextView& text)
   {
-    if (!impl_) return;
-    for (unsigned int i = 0; i < count; i++)
-      impl_->w_r_.append_child("w:tab");
+    Run r = AppendRun();
+    if (!text.empty()) {
+      r.AppendText(text);
+    }
+    return r;
   }
 
-  void Run::SetFontSize(const double fontSize)
+  Run Paragraph::AppendRun(const TextView& text, const double fontSize)
   {
-    if (!impl_) return;
-    pugi::xml_node sz = impl_->w_rPr_.child("w:sz");
-    if (!sz) {
-      sz = impl_->w_rPr_.append_child("w:sz");
-    }
-    pugi::xml_attribute szVal = sz.attribute("w:val");
-    if (!szVal) {
-      szVal = sz.append_attribute("w:val");
+    Run r = AppendRun(text);
+    if (fontSize != 0) {
+      r.SetFontSize(fontSize);
     }
-    // font size in half-points (1/144 of an inch)
-    szVal.set_value(fontSize * 2);
+    return r;
   }
 
-  double Run::GetFontSize()
+  Run Paragraph::AppendRun(const std::string& text, const double fontSize)
   {
-    if (!impl_) return -1;
-    pugi::xml_node sz = impl_->w_rPr_.child("w:sz");
-    if (!sz) return 0;
-    pugi::xml_attribute szVal = sz.attribute("w:val");
-    if (!szVal) return 0;
-    return szVal.as_int() / 2.0;
+    Run r = AppendRun(text);
+    if (fontSize != 0) {
+      r.SetFontSize(fontSize);
+    }
+    return r;
   }
 
-  void Run::SetFont(
-    const std::string& fontAscii,
-    const std::string& fontEastAsia)
+  Run Paragraph::AppendRun(const std::string& text, const double fontSize, const std::string& fontAscii, const std::string& fontEastAsia)
   {
-    if (!impl_) return;
-    pugi::xml_node rFonts = impl_->w_rPr_.child("w:rFonts");
-    if (!rFonts) {
-      rFonts = impl_->w_rPr_.append_child("w:rFonts");
+    Run r = AppendRun(text, fontSize);
+    if (!fontAscii.empty()) {
+      r.SetFont(fontAscii, fontEastAsia);
     }
-    pugi::xml_attribute rFontsAscii = rFonts.attribute("w:ascii");
-    if (!rFontsAscii) {
-      rFontsAscii = rFonts.append_attribute("w:ascii");
+    return r;
+  }
+
+  // A w:hyperlink around one run, blue and underlined. External targets share
+  // one relationship per URL, "#name" links to a bookmark without one.
+  Run Paragraph::AppendHyperlink(const std::string& url, const std::string& text)
+  {
+    if (!impl_ || url.empty()) return Run();
+    pugi::xml_node w_hyperlink;
+    if (url[0] == '#') {
+      w_hyperlink = impl_->w_p_.append_child("w:hyperlink");
+      w_hyperlink.append_attribute("w:anchor") = url.c_str() + 1;
     }
-    pugi::xml_attribute rFontsEastAsia = rFonts.attribute("w:eastAsia");
-    if (!rFontsEastAsia) {
-      rFontsEastAsia = rFonts.append_attribute("w:eastAsia");
+    else {
+      Document::Impl* doc = Document::Impl::Owner(impl_->w_p_, impl_->owner_);
+      if (doc == NULL) return Run();
+      doc->dirty_ |= DIRTY_DOCUMENT;
+      const std::string id = doc->AddRelationship("http://schemas.openxmlformats.org/officeDocument/2006/relationships/hyperlink", url, true);
+      w_hyperlink = impl_->w_p_.append_child("w:hyperlink");
+      w_hyperlink.append_attribute("r:id") = id.c_str();
     }
-    rFontsAscii.set_value(fontAscii.c_str());
-    rFontsEastAsia.set_value(fontEastAsia.empty()
-      ? fontAscii.c_str()
-      : fontEastAsia.c_str());
+    w_hyperlink.append_attribute("w:history") = 1;
+
+    pugi::xml_node w_r = w_hyperlink.append_child("w:r");
+    pugi::xml_node w_rPr = w_r.append_child("w:rPr");
+    w_rPr.append_child("w:color").append_attribute("w:val") = "0563C1";
+    w_rPr.append_child("w:u").append_attribute("w:val") = "single";
+
+    Run::Impl* impl = new Run::Impl;
+    impl->owner_ = impl_->owner_;
+    impl->w_p_ = impl_->w_p_;
+    impl->w_r_ = w_r;
+    impl->w_rPr_ = w_rPr;
+    Run r(impl);
+    r.AppendText(text);
+    return r;
   }
 
-  void Run::GetFont(
-    std::string& fontAscii,
-    std::string& fontEastAsia)
+  Run Paragraph::AppendPageBreak()
   {
-    if (!impl_) return;
-    pugi::xml_node rFonts = impl_->w_rPr_.child("w:rFonts");
-    if (!rFonts) return;
+    if (!impl_) return Run();
+    pugi::xml_node w_r = impl_->w_p_.append_child("w:r");
+    pugi::xml_node w_br = w_r.append_child("w:br");
+    w_br.append_attribute("w:type") = "page";
 
-    pugi::xml_attribute rFontsAscii = rFonts.attribute("w:ascii");
-    if (rFontsAscii) fontAscii = rFontsAscii.value();
+    Document::Impl* doc = Document::Impl::Tracking(impl_->w_p_, impl_->owner_);
+    if (doc != NULL) doc->TextAppended(impl_->w_p_, w_r, "\n", 1);
 
-    pugi::xml_attribute rFontsEastAsia = rFonts.attribute("w:eastAsia");
-    if (rFontsEastAsia) fontEastAsia = rFontsEastAsia.value();
+    Run::Impl* impl = new Run::Impl;
+    impl->owner_ = impl_->owner_;
+    impl->w_p_ = impl_->w_p_;
+    impl->w_r_ = w_r;
+    impl->w_rPr_ = w_br;
+    return Run(impl);
   }
 
-  void Run::SetFontColor(const std::string& hex)
+  void Paragraph::SetAlignment(const Alignment alignment)
   {
     if (!impl_) return;
-    pugi::xml_node color = impl_->w_rPr_.child("w:color");
-    if (!color) {
-      color = impl_->w_rPr_.append_child("w:color");
+
+    const char* val;
+    switch (alignment) {
+    case Alignment::Left:
+      val = "start";
+      break;
+    case Alignment::Right:
+      val = "end";
+      break;
+    case Alignment::Centered:
+      val = "center";
+      break;
+    case Alignment::Justified:
+      val = "both";
+      break;
+    case Alignment::Distributed:
+      val = "distribute";
+      break;
     }
-    pugi::xml_attribute colorVal = color.attribute("w:val");
-    if (!colorVal) {
-      colorVal = color.append_attribute("w:val");
+
+    pugi::xml_node jc = impl_->w_pPr_.child("w:jc");
+    if (!jc) {
+      jc = impl_->w_pPr_.append_child("w:jc");
     }
-    colorVal.set_value(hex.c_str());
+    pugi::xml_attribute jcVal = jc.attribute("w:val");
+    if (!jcVal) {
+      jcVal = jc.append_attribute("w:val");
+    }
+    jcVal.set_value(val);
   }
 
-  std::string Run::GetFontColor()
+  void Paragraph::SetLineSpacingSingle()
   {
-    if (impl_) {
-      pugi::xml_node color = impl_->w_rPr_.child("w:color");
-      if (color) {
-        pugi::xml_attribute colorVal = color.attribute("w:val");
-        if (colorVal) {
-          return colorVal.as_string();
-        }
-      }
-    }
-    return "auto";
+    SetLineSpacing(240, "auto");
   }
 
-  void Run::SetFontStyle(const FontStyle f)
+  void Paragraph::SetLineSpacingLines(const double at)
+  {
+    // A normal single-spaced paragaph has a w:line value of 240, or 12 points.
+    // 
+    // If the value of lineRule is auto, then the value of line 
+    // is interpreted as 240th of a line, e.g. 360 = 1.5 lines.
+    SetLineSpacing(at * 240, "auto");
+  }
+
+  void Paragraph::SetLineSpacingAtLeast(const int at)
+  {
+    // If the value of the lineRule attribute is atLeast or exactly, 
+    // then the value of the line attribute is interpreted as 240th of a point.
+    // (Not really. Actually, values are in twentieths of a point, e.g. 240 = 12 pt.)
+    SetLineSpacing(at, "atLeast");
+  }
+
+  void Paragraph::SetLineSpacingExactly(const int at)
+  {
+    SetLineSpacing(at, "exact");
+  }
+
+  void Paragraph::SetLineSpacing(const int at, const char* lineRule)
   {
     if (!impl_) return;
-    pugi::xml_node b = impl_->w_rPr_.child("w:b");
-    if (f & Bold) {
-      if (b.empty()) impl_->w_rPr_.append_child("w:b");
-    }
-    else {
-      impl_->w_rPr_.remove_child(b);
+    pugi::xml_node spacing = impl_->w_pPr_.child("w:spacing");
+    if (!spacing) {
+      spacing = impl_->w_pPr_.append_child("w:spacing");
     }
 
-    pugi::xml_node i = impl_->w_rPr_.child("w:i");
-    if (f & Italic) {
-      if (i.empty()) impl_->w_rPr_.append_child("w:i");
-    }
-    else {
-      impl_->w_rPr_.remove_child(i);
+    pugi::xml_attribute spacingLineRule = spacing.attribute("w:lineRule");
+    if (!spacingLineRule) {
+      spacingLineRule = spacing.append_attribute("w:lineRule");
     }
 
-    pugi::xml_node u = impl_->w_rPr_.child("w:u");
-    if (f & Underline) {
-      if (u.empty())
-        impl_->w_rPr_.append_child("w:u").append_attribute("w:val") = "single";
-    }
-    else {
-      impl_->w_rPr_.remove_child(u);
+    pugi::xml_attribute spacingLine = spacing.attribute("w:line");
+    if (!spacingLine) {
+      spacingLine = spacing.append_attribute("w:line");
     }
 
-    pugi::xml_node strike = impl_->w_rPr_.child("w:strike");
-    if (f & Strikethrough) {
-      if (strike.empty())
-        impl_->w_rPr_.append_child("w:strike").append_attribute("w:val") = "true";
-    }
-    else {
-      impl_->w_rPr_.remove_child(strike);
-    }
+    spacingLineRule.set_value(lineRule);
+    spacingLine.set_value(at);
   }
 
-  Run::FontStyle Run::GetFontStyle()
+  void Paragraph::SetBeforeSpacingAuto()
   {
-    FontStyle fontStyle = 0;
-    if (!impl_) return fontStyle;
-    if (impl_->w_rPr_.child("w:b")) fontStyle |= Bold;
-    if (impl_->w_rPr_.child("w:i")) fontStyle |= Italic;
-    if (impl_->w_rPr_.child("w:u")) fontStyle |= Underline;
-    if (impl_->w_rPr_.child("w:strike")) fontStyle |= Strikethrough;
-    return fontStyle;
+    SetSpacingAuto("w:beforeAutospacing");
   }
 
-  void Run::SetCharacterSpacing(const int characterSpacing)
+  void Paragraph::SetAfterSpacingAuto()
+  {
+    SetSpacingAuto("w:afterAutospacing");
+  }
+
+  void Paragraph::SetSpacingAuto(const char* attrNameAuto)
   {
     if (!impl_) return;
-    pugi::xml_node spacing = impl_->w_rPr_.child("w:spacing");
+    pugi::xml_node spacing = impl_->w_pPr_.child("w:spacing");
     if (!spacing) {
-      spacing = impl_->w_rPr_.append_child("w:spacing");
+      spacing = impl_->w_pPr_.append_child("w:spacing");
     }
-    pugi::xml_attribute spacingVal = spacing.attribute("w:val");
-    if (!spacingVal) {
-      spacingVal = spacing.append_attribute("w:val");
+    pugi::xml_attribute spacingAuto = spacing.attribute(attrNameAuto);
+    if (!spacingAuto) {
+      spacingAuto = spacing.append_attribute(attrNameAuto);
     }
-    spacingVal.set_value(characterSpacing);
+    // Any value for before or beforeLines is ignored.
+    spacingAuto.set_value("true");
   }
 
-  int Run::GetCharacterSpacing()
+  void Paragraph::SetBeforeSpacingLines(const double beforeSpacing)
   {
-    if (!impl_) return -1;
-    return impl_->w_rPr_.child("w:spacing").attribute("w:val").as_int();
+    // To specify units in hundreths of a line, 
+    // use attributes 'afterLines'/'beforeLines'.
+    SetSpacing(beforeSpacing * 100, "w:beforeAutospacing", "w:beforeLines");
   }
 
-  bool Run::IsPageBreak()
+  void Paragraph::SetAfterSpacingLines(const double afterSpacing)
   {
-    if (!impl_) return false;
-    return impl_->w_r_.find_child_by_attribute("w:br", "w:type", "page");
+    SetSpacing(afterSpacing * 100, "w:afterAutospacing", "w:afterLines");
   }
 
-  void Run::Remove()
+  void Paragraph::SetBeforeSpacing(const int beforeSpacing)
   {
-    if (!impl_) return;
-    impl_->w_p_.remove_child(impl_->w_r_);
+    SetSpacing(beforeSpacing, "w:beforeAutospacing", "w:before");
   }
 
-  Run Run::Next()
+  void Paragraph::SetAfterSpacing(const int afterSpacing)
   {
-    if (!impl_) return Run();
-    pugi::xml_node w_r = impl_->w_r_.next_sibling("w:r");
-    if (!w_r) return Run();
+    SetSpacing(afterSpacing, "w:afterAutospacing", "w:after");
+  }
 
-    Run::Impl* impl = new Run::Impl;
-    impl->w_p_ = impl_->w_p_;
-    impl->w_r_ = w_r;
-    impl->w_rPr_ = w_r.child("w:rPr");
-    return Run(impl);
+  void Paragraph::SetSpacing(const int twip, const char* attrNameAuto, const char* attrName)
+  {
+    if (!impl_) return;
+    pugi::xml_node elemSpacing = impl_->w_pPr_.child("w:spacing");
+    if (!elemSpacing) {
+      elemSpacing = impl_->w_pPr_.append_child("w:spacing");
+    }
+
+    pugi::xml_attribute attrSpacingAuto = elemSpacing.attribute(attrNameAuto);
+    if (attrSpacingAuto) {
+      elemSpacing.remove_attribute(attrSpacingAuto);
+    }
+
+    pugi::xml_attribute attrSpacing = elemSpacing.attribute(attrName);
+    if (!attrSpacing) {
+      attrSpacing = elemSpacing.append_attribute(attrName);
+    }
+    attrSpacing.set_value(twip);
   }
 
-  Run::operator bool()
+  void Paragraph::SetLeftIndentChars(const double leftIndent)
   {
-    return impl_ != NULL && impl_->w_r_;
+    // To specify units in hundreths of a character, 
+    // use attributes leftChars/endChars, rightChars/endChars, etc. 
+    SetIndent(leftIndent * 100, "w:leftChars");
   }
 
-  void Run::operator=(const Run& right)
+  void Paragraph::SetRightIndentChars(const double rightIndent)
   {
-    if (this == &right) return;
-    if (impl_ != NULL) delete impl_;
-    if (right.impl_ != NULL) {
-      impl_ = new Impl;
-      impl_->w_p_ = right.impl_->w_p_;
-      impl_->w_r_ = right.impl_->w_r_;
-      impl_->w_rPr_ = right.impl_->w_rPr_;
-    }
-    else {
-      impl_ = NULL;
-    }
+    SetIndent(rightIndent * 100, "w:rightChars");
   }
 
-  // class Table
-  Table::Table(Impl* impl) : impl_(impl)
+  void Paragraph::SetLeftIndent(const int leftIndent)
   {
+    SetIndent(leftIndent, "w:left");
+  }
 
+  void Paragraph::SetRightIndent(const int rightIndent)
+  {
+    SetIndent(rightIndent, "w:right");
   }
 
-  Table::Table() : impl_(NULL)
+  void Paragraph::SetFirstLineChars(const double indent)
   {
+    SetIndent(indent * 100, "w:firstLineChars");
+  }
 
+  void Paragraph::SetHangingChars(const double indent)
+  {
+    SetIndent(indent * 100, "w:hangingChars");
   }
 
-  Table::Table(const Table& t)
+  void Paragraph::SetFirstLine(const int indent)
   {
-    impl_ = new Impl;
-    impl_->w_body_ = t.impl_->w_body_;
-    impl_->w_tbl_ = t.impl_->w_tbl_;
-    impl_->w_tblPr_ = t.impl_->w_tblPr_;
-    impl_->w_tblGrid_ = t.impl_->w_tblGrid_;
-    impl_->rows_ = t.impl_->rows_;
-    impl_->cols_ = t.impl_->cols_;
-    impl_->grid_ = t.impl_->grid_;
+    SetIndent(indent, "w:firstLine");
   }
 
-  Table::~Table()
+  void Paragraph::SetHanging(const int indent)
   {
-    if (impl_ != NULL) {
-      delete impl_;
-      impl_ = NULL;
-    }
+    SetIndent(indent, "w:hanging");
+    SetLeftIndent(indent);
   }
 
-  void Table::operator=(const Table& right)
+  void Paragraph::SetIndent(const int indent, const char* attrName)
   {
-    if (this == &right) return;
-    if (impl_ != NULL) delete impl_;
-    if (right.impl_ != NULL) {
-      impl_ = new Impl;
-      impl_->w_body_ = right.impl_->w_body_;
-      impl_->w_tbl_ = right.impl_->w_tbl_;
-      impl_->w_tblPr_ = right.impl_->w_tblPr_;
-      impl_->w_tblGrid_ = right.impl_->w_tblGrid_;
-      impl_->rows_ = right.impl_->rows_;
-      impl_->cols_ = right.impl_->cols_;
-      impl_->grid_ = right.impl_->grid_;
+    if (!impl_) return;
+    pugi::xml_node elemIndent = impl_->w_pPr_.child("w:ind");
+    if (!elemIndent) {
+      elemIndent = impl_->w_pPr_.append_child("w:ind");
     }
-    else {
-      impl_ = NULL;
+
+    pugi::xml_attribute attrIndent = elemIndent.attribute(attrName);
+    if (!attrIndent) {
+      attrIndent = elemIndent.append_attribute(attrName);
     }
+    attrIndent.set_value(indent);
   }
 
-  void Table::Create_(const int rows, const int cols)
+  void Paragraph::SetTopBorder(const BorderStyle style, const double width, const char* color)
   {
-    if (!impl_) return;
-    impl_->rows_ = rows;
-    impl_->cols_ = cols;
+    SetBorders_("w:top", style, width, color);
+  }
 
-    // init grid
-    for (int i = 0; i < rows; i++) {
-      Row row;
-      for (int j = 0; j < cols; j++) {
-        Cell cell = { i, j, 1, 1 };
-        row.push_back(cell);
-      }
-      impl_->grid_.push_back(row);
-    }
+  void Paragraph::SetBottomBorder(const BorderStyle style, const double width, const char* color)
+  {
+    SetBorders_("w:bottom", style, width, color);
+  }
 
-    // init table
-    for (int j = 0; j < cols; j++)
-      pugi::xml_node w_gridCol = impl_->w_tblGrid_.append_child("w:gridCol");
+  void Paragraph::SetLeftBorder(const BorderStyle style, const double width, const char* color)
+  {
+    SetBorders_("w:left", style, width, color);
+  }
 
-    for (int i = 0; i < rows; i++) {
-      pugi::xml_node w_tr = impl_->w_tbl_.append_child("w:tr");
+  void Paragraph::SetRightBorder(const BorderStyle style, const double width, const char* color)
+  {
+    SetBorders_("w:right", style, width, color);
+  }
 
-      for (int j = 0; j < cols; j++) {
-        pugi::xml_node w_tc = w_tr.append_child("w:tc");
-        pugi::xml_node w_tcPr = w_tc.append_child("w:tcPr");
+  void Paragraph::SetBorders(const BorderStyle style, const double width, const char* color)
+  {
+    SetTopBorder(style, width, color);
+    SetBottomBorder(style, width, color);
+    SetLeftBorder(style, width, color);
+    SetRightBorder(style, width, color);
+  }
 
-        TableCell::Impl* impl = new TableCell::Impl;
-        impl->c_ = &impl_->grid_[i][j];
-        impl->w_tr_ = w_tr;
-        impl->w_tc_ = w_tc;
-        impl->w_tcPr_ = w_tcPr;
-        TableCell tc(impl);
-        // A table cell must contain at least one block-level element, 
-        // even if it is an empty <p/>.
-        tc.AppendParagraph();
-      }
+  void Paragraph::SetBorders_(const char* elemName, const BorderStyle style, const double width, const char* color)
+  {
+    if (!impl_) return;
+    pugi::xml_node w_pBdr = impl_->w_pPr_.child("w:pBdr");
+    if (!w_pBdr) {
+      w_pBdr = impl_->w_pPr_.append_child("w:pBdr");
     }
+    docx::SetBorders(w_pBdr, elemName, style, width, color);
   }
 
-  TableCell Table::GetCell(const int row, const int col)
+  void Paragraph::SetNumbering(const int listId, const int level)
   {
-    if (!impl_) return TableCell();
-    if (row < 0 || row >= impl_->rows_ || col < 0 || col >= impl_->cols_) {
-      return TableCell();
+    if (!impl_) return;
+    pugi::xml_node w_numPr = impl_->w_pPr_.child("w:numPr");
+    if (!w_numPr) {
+      // w:numPr follows the style, keep and frame properties
+      pugi::xml_node before = impl_->w_pPr_.first_child();
+      while (before && (std::strcmp(before.name(), "w:pStyle") == 0 || std::strcmp(before.name(), "w:keepNext") == 0
+        || std::strcmp(before.name(), "w:keepLines") == 0 || std::strcmp(before.name(), "w:pageBreakBefore") == 0
+        || std::strcmp(before.name(), "w:framePr") == 0 || std::strcmp(before.name(), "w:widowControl") == 0)) {
+        before = before.next_sibling();
+      }
+      w_numPr = before ? impl_->w_pPr_.insert_child_before("w:numPr", before) : impl_->w_pPr_.append_child("w:numPr");
+      w_numPr.append_child("w:ilvl").append_attribute("w:val");
+      w_numPr.append_child("w:numId").append_attribute("w:val");
     }
+    w_numPr.child("w:ilvl").attribute("w:val") = level < 0 ? 0 : level > 8 ? 8 : level;
+    w_numPr.child("w:numId").attribute("w:val") = listId;
+  }
 
-    Cell* c = &impl_->grid_[row][col];
-    return GetCell_(c->row, c->col);
+  void Paragraph::RemoveNumbering()
+  {
+    if (!impl_) return;
+    impl_->w_pPr_.remove_child("w:numPr");
   }
 
-  TableCell Table::GetCell_(const int row, const int col)
+  bool Paragraph::GetNumbering(int& listId, int& level)
   {
-    if (!impl_) return TableCell();
-    int i = 0;
-    pugi::xml_node w_tr = impl_->w_tbl_.child("w:tr");
-    while (i < row && !w_tr.empty()) {
-      i++;
-      w_tr = w_tr.next_sibling("w:tr");
-    }
-    if (w_tr.empty()) {
-      return TableCell();
+    if (!impl_) return false;
+    pugi::xml_node w_numPr = impl_->w_pPr_.child("w:numPr");
+    listId = w_numPr.child("w:numId").attribute("w:val").as_int();
+    level = w_numPr.child("w:ilvl").attribute("w:val").as_int();
+    return listId != 0;
+  }
+
+  void Paragraph::SetFontSize(const double fontSize)
+  {
+    for (Run r = FirstRun(); r; r = r.Next()) {
+      r.SetFontSize(fontSize);
     }
+  }
 
-    int j = 0;
-    pugi::xml_node w_tc = w_tr.child("w:tc");
-    while (j < col && !w_tc.empty()) {
-      j += impl_->grid_[row][j].cols;
-      w_tc = w_tc.next_sibling("w:tc");
+  void Paragraph::SetFont(const std::string& fontAscii, const std::string& fontEastAsia)
+  {
+    SetFont(TextView(fontAscii.data(), fontAscii.size()), TextView(fontEastAsia.data(), fontEastAsia.size()));
+  }
+
+  void Paragraph::SetFont(const TextView& fontAscii, const TextView& fontEastAsia)
+  {
+    for (Run r = FirstRun(); r; r = r.Next()) {
+      r.SetFont(fontAscii, fontEastAsia);
     }
-    if (w_tc.empty()) {
-      return TableCell();
+  }
+
+  void Paragraph::SetFontStyle(const Run::FontStyle fontStyle)
+  {
+    for (Run r = FirstRun(); r; r = r.Next()) {
+      r.SetFontStyle(fontStyle);
     }
+  }
 
-    TableCell::Impl* impl = new TableCell::Impl;
-    impl->c_ = &impl_->grid_[row][col];
-    impl->w_tr_ = w_tr;
-    impl->w_tc_ = w_tc;
-    impl->w_tcPr_ = w_tc.child("w:tcPr");
-    return TableCell(impl);
+  void Paragraph::SetCharacterSpacing(const int characterSpacing)
+  {
+    for (Run r = FirstRun(); r; r = r.Next()) {
+      r.SetCharacterSpacing(characterSpacing);
+    }
   }
 
-  bool Table::MergeCells(TableCell tc1, TableCell tc2)
+  std::string Paragraph::GetText()
   {
-    if (tc1.empty() || tc2.empty()) {
-      return false;
+    std::string text;
+    for (Run r = FirstRun(); r; r = r.Next()) {
+      text += r.GetText();
     }
+    return text;
+  }
 
-    Cell* c1 = tc1.impl_->c_;
-    Cell* c2 = tc2.impl_->c_;
+  Paragraph Paragraph::Next()
+  {
+    if (!impl_) return Paragraph();
+    pugi::xml_node w_p = impl_->w_p_.next_sibling("w:p");
+    if (!w_p) return Paragraph();
 
-    if (c1->row == c2->row && c1->col != c2->col && c1->rows == c2->rows) {
-      Cell* left_cell, * right_cell;
-      TableCell* left_tc, * right_tc;
-      if (c1->col < c2->col) {
-        left_cell = c1;
-        left_tc = &tc1;
-        right_cell = c2;
-        right_tc = &tc2;
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->doc_ = impl_->doc_;
+    impl->owner_ = impl_->owner_;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_p.child("w:pPr");
+    return Paragraph(impl);
+  }
+
+  Paragraph Paragraph::Prev()
+  {
+    if (!impl_) return Paragraph();
+    pugi::xml_node w_p = impl_->w_p_.previous_sibling("w:p");
+    if (!w_p) return Paragraph();
+
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->doc_ = impl_->doc_;
+    impl->owner_ = impl_->owner_;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_p.child("w:pPr");
+    return Paragraph(impl);
+  }
+
+  Paragraph::operator bool()
+  {
+    return impl_ != NULL && impl_->w_p_;
+  }
+
+  bool Paragraph::operator==(const Paragraph& p)
+  {
+    if (!impl_ && !p.impl_) return true;
+    if (impl_ && p.impl_) return impl_->w_p_ == p.impl_->w_p_;
+    return false;
+  }
+
+  void Paragraph::operator=(const Paragraph& right)
+  {
+    if (this == &right) return;
+    if (impl_ != NULL) delete impl_;
+    if (right.impl_ != NULL) {
+      impl_ = new Impl;
+      impl_->doc_ = right.impl_->doc_;
+      impl_->owner_ = right.impl_->owner_;
+      impl_->w_body_ = right.impl_->w_body_;
+      impl_->w_p_ = right.impl_->w_p_;
+      impl_->w_pPr_ = right.impl_->w_pPr_;
+    }
+    else {
+      impl_ = NULL;
+    }
+  }
+
+  Section Paragraph::GetSection()
+  {
+    if (!impl_) return Section();
+    Section::Impl* impl = new Section::Impl;
+    impl->doc_ = impl_->doc_;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = impl_->w_p_;
+    impl->w_pPr_ = impl_->w_pPr_;
+    Section section(impl);
+
+    pugi::xml_node w_sectPr;
+    if (impl_->doc_ != NULL) w_sectPr = impl_->doc_->SectionOf(impl_->w_p_);
+    if (w_sectPr) {
+      impl->SetBounds(w_sectPr);
+    }
+    else {
+      section.FindSectionProperties();
+    }
+    return section;
+  }
+
+  Section Paragraph::InsertSectionBreak()
+  {
+    Section section = GetSection();
+    // this paragraph will be the last paragraph of the new section
+    if (section) section.Split();
+    return section;
+  }
+
+  Section Paragraph::RemoveSectionBreak()
+  {
+    Section section = GetSection();
+    if (section && section.IsSplit()) section.Merge();
+    return section;
+  }
+
+  bool Paragraph::HasSectionBreak()
+  {
+    return GetSection().IsSplit();
+  }
+
+
+  // class Section
+  Section::Section() : impl_(NULL)
+  {
+
+  }
+
+  Section::Section(Impl* impl) : impl_(impl)
+  {
+
+  }
+
+  Section::Section(const Section& s)
+  {
+    impl_ = new Impl;
+    impl_->doc_ = s.impl_->doc_;
+    impl_->w_body_ = s.impl_->w_body_;
+    impl_->w_p_ = s.impl_->w_p_;
+    impl_->w_p_last_ = s.impl_->w_p_last_;
+    impl_->w_pPr_ = s.impl_->w_pPr_;
+    impl_->w_pPr_last_ = s.impl_->w_pPr_last_;
+    impl_->w_sectPr_ = s.impl_->w_sectPr_;
+  }
+
+  Section::~Section()
+  {
+    if (impl_ != NULL) {
+      delete impl_;
+      impl_ = NULL;
+    }
+  }
+
+  void Section::FindSectionProperties()
+  {
+    if (!impl_) return;
+    pugi::xml_node w_p_next = impl_->w_p_, w_p, w_pPr, w_sectPr;
+    do {
+      w_p = w_p_next;
+      w_pPr = w_p.child("w:pPr");
+      w_sectPr = w_pPr.child("w:sectPr");
+
+      w_p_next = w_p.next_sibling("w:p");
+    } while (w_sectPr.empty() && !w_p_next.empty());
+
+    impl_->w_p_last_ = w_p;
+    impl_->w_pPr_last_ = w_pPr;
+    impl_->w_sectPr_ = w_sectPr;
+
+    if (impl_->w_sectPr_.empty()) {
+      impl_->w_sectPr_ = impl_->w_body_.child("w:sectPr");
+    }
+  }
+
+  void Section::Split()
+  {
+    if (!impl_ || !impl_->w_p_) return;
+    if (IsSplit()) return;
+    if (!impl_->w_pPr_) {
+      impl_->w_pPr_ = impl_->w_p_.prepend_child("w:pPr");
+    }
+    impl_->w_p_last_ = impl_->w_p_;
+    impl_->w_pPr_last_ = impl_->w_pPr_;
+    impl_->w_sectPr_ = impl_->w_pPr_.append_copy(impl_->w_sectPr_);
+    if (impl_->doc_ != NULL) impl_->doc_->IndexSplit(impl_->w_p_, impl_->w_sectPr_);
+  }
+
+  bool Section::IsSplit()
+  {
+    if (!impl_) return false;
+    return impl_->w_pPr_.child("w:sectPr");
+  }
+
+  void Section::Merge()
+  {
+    if (!impl_) return;
+    pugi::xml_node w_sectPr = impl_->w_pPr_.child("w:sectPr");
+    if (w_sectPr.empty()) return;
+    if (impl_->doc_ != NULL) {
+      impl_->doc_->IndexMerge(impl_->w_p_, w_sectPr);
+      impl_->w_pPr_.remove_child(w_sectPr);
+      impl_->SetBounds(impl_->doc_->SectionOf(impl_->w_p_));
+      return;
+    }
+    impl_->w_pPr_.remove_child(w_sectPr);
+    FindSectionProperties();
+  }
+
+  void Section::SetPageSize(const int w, const int h)
+  {
+    if (!impl_) return;
+    pugi::xml_node pgSz = impl_->w_sectPr_.child("w:pgSz");
+    if (!pgSz) {
+      pgSz = impl_->w_sectPr_.append_child("w:pgSz");
+    }
+    pugi::xml_attribute pgSzW = pgSz.attribute("w:w");
+    if (!pgSzW) {
+      pgSzW = pgSz.append_attribute("w:w");
+    }
+    pugi::xml_attribute pgSzH = pgSz.attribute("w:h");
+    if (!pgSzH) {
+      pgSzH = pgSz.append_attribute("w:h");
+    }
+    pgSzW.set_value(w);
+    pgSzH.set_value(h);
+  }
+
+  void Section::GetPageSize(int& w, int& h)
+  {
+    if (!impl_) return;
+    w = h = 0;
+    pugi::xml_node pgSz = impl_->w_sectPr_.child("w:pgSz");
+    if (!pgSz) return;
+    pugi::xml_attribute pgSzW = pgSz.attribute("w:w");
+    if (!pgSzW) return;
+    pugi::xml_attribute pgSzH = pgSz.attribute("w:h");
+    if (!pgSzH) return;
+    w = pgSzW.as_int();
+    h = pgSzH.as_int();
+  }
+
+  void Section::SetPageOrient(const Orientation orient)
+  {
+    if (!impl_) return;
+    pugi::xml_node pgSz = impl_->w_sectPr_.child("w:pgSz");
+    if (!pgSz) {
+      pgSz = impl_->w_sectPr_.append_child("w:pgSz");
+    }
+    pugi::xml_attribute pgSzH = pgSz.attribute("w:h");
+    if (!pgSzH) {
+      pgSzH = pgSz.append_attribute("w:h");
+    }
+    pugi::xml_attribute pgSzW = pgSz.attribute("w:w");
+    if (!pgSzW) {
+      pgSzW = pgSz.append_attribute("w:w");
+    }
+    pugi::xml_attribute pgSzOrient = pgSz.attribute("w:orient");
+    if (!pgSzOrient) {
+      pgSzOrient = pgSz.append_attribute("w:orient");
+    }
+    int hVal = pgSzH.as_int();
+    int wVal = pgSzW.as_int();
+    switch (orient) {
+    case Orientation::Landscape:
+      if (hVal < wVal) return;
+      pgSzOrient.set_value("landscape");
+      pgSzH.set_value(wVal);
+      pgSzW.set_value(hVal);
+      break;
+    case Orientation::Portrait:
+      if (hVal > wVal) return;
+      pgSzOrient.set_value("portrait");
+      pgSzH.set_value(wVal);
+      pgSzW.set_value(hVal);
+      break;
+    }
+  }
+
+  Section::Orientation Section::GetPageOrient()
+  {
+    if (!impl_) return Orientation::Unknown;
+    Orientation orient = Orientation::Portrait;
+    pugi::xml_node pgSz = impl_->w_sectPr_.child("w:pgSz");
+    if (!pgSz) return orient;
+    pugi::xml_attribute pgSzOrient = pgSz.attribute("w:orient");
+    if (!pgSzOrient) return orient;
+    if (std::string(pgSzOrient.value()).compare("landscape") == 0) {
+      orient = Orientation::Landscape;
+    }
+    return orient;
+  }
+
+  void Section::SetPageMargin(const int top, const int bottom,
+    const int left, const int right)
+  {
+    if (!impl_) return;
+    pugi::xml_node pgMar = impl_->w_sectPr_.child("w:pgMar");
+    if (!pgMar) {
+      pgMar = impl_->w_sectPr_.append_child("w:pgMar");
+    }
+    pugi::xml_attribute pgMarTop = pgMar.attribute("w:top");
+    if (!pgMarTop) {
+      pgMarTop = pgMar.append_attribute("w:top");
+    }
+    pugi::xml_attribute pgMarBottom = pgMar.attribute("w:bottom");
+    if (!pgMarBottom) {
+      pgMarBottom = pgMar.append_attribute("w:bottom");
+    }
+    pugi::xml_attribute pgMarLeft = pgMar.attribute("w:left");
+    if (!pgMarLeft) {
+      pgMarLeft = pgMar.append_attribute("w:left");
+    }
+    pugi::xml_attribute pgMarRight = pgMar.attribute("w:right");
+    if (!pgMarRight) {
+      pgMarRight = pgMar.append_attribute("w:right");
+    }
+    pgMarTop.set_value(top);
+    pgMarBottom.set_value(bottom);
+    pgMarLeft.set_value(left);
+    pgMarRight.set_value(right);
+  }
+
+  void Section::GetPageMargin(int& top, int& bottom,
+    int& left, int& right)
+  {
+    if (!impl_) return;
+    top = bottom = left = right = 0;
+    pugi::xml_node pgMar = impl_->w_sectPr_.child("w:pgMar");
+    if (!pgMar) return;
+    pugi::xml_attribute pgMarTop = pgMar.attribute("w:top");
+    if (!pgMarTop) return;
+    pugi::xml_attribute pgMarBottom = pgMar.attribute("w:bottom");
+    if (!pgMarBottom) return;
+    pugi::xml_attribute pgMarLeft = pgMar.attribute("w:left");
+    if (!pgMarLeft) return;
+    pugi::xml_attribute pgMarRight = pgMar.attribute("w:right");
+    if (!pgMarRight) return;
+    top = pgMarTop.as_int();
+    bottom = pgMarBottom.as_int();
+    left = pgMarLeft.as_int();
+    right = pgMarRight.as_int();
+  }
+
+  void Section::SetPageMargin(const int header, const int footer)
+  {
+    if (!impl_) return;
+    pugi::xml_node pgMar = impl_->w_sectPr_.child("w:pgMar");
+    if (!pgMar) {
+      pgMar = impl_->w_sectPr_.append_child("w:pgMar");
+    }
+    pugi::xml_attribute pgMarHeader = pgMar.attribute("w:header");
+    if (!pgMarHeader) {
+      pgMarHeader = pgMar.append_attribute("w:header");
+    }
+    pugi::xml_attribute pgMarFooter = pgMar.attribute("w:footer");
+    if (!pgMarFooter) {
+      pgMarFooter = pgMar.append_attribute("w:footer");
+    }
+    pgMarHeader.set_value(header);
+    pgMarFooter.set_value(footer);
+  }
+
+  void Section::GetPageMargin(int& header, int& footer)
+  {
+    if (!impl_) return;
+    header = footer = 0;
+    pugi::xml_node pgMar = impl_->w_sectPr_.child("w:pgMar");
+    if (!pgMar) return;
+    pugi::xml_attribute pgMarHeader = pgMar.attribute("w:header");
+    if (!pgMarHeader) return;
+    pugi::xml_attribute pgMarFooter = pgMar.attribute("w:footer");
+    if (!pgMarFooter) return;
+    header = pgMarHeader.as_int();
+    footer = pgMarFooter.as_int();
+  }
+
+  void Section::SetPageNumber(const PageNumberFormat fmt, const unsigned int start)
+  {
+    if (!impl_) return;
+    impl_->SetReference(false, PAGE_NUMBER_XML, HeaderFooterType::Default);
+
+    pugi::xml_node pgNumType = impl_->w_sectPr_.child("w:pgNumType");
+    if (!pgNumType) {
+      pgNumType = impl_->w_sectPr_.append_child("w:pgNumType");
+    }
+
+    pugi::xml_attribute pgNumTypeFmt = pgNumType.attribute("w:fmt");
+    if (!pgNumTypeFmt) {
+      pgNumTypeFmt = pgNumType.append_attribute("w:fmt");
+    }
+    const char* fmtVal = "";
+    switch (fmt) {
+    case PageNumberFormat::Decimal:
+      fmtVal = "decimal";
+      break;
+    case PageNumberFormat::NumberInDash:
+      fmtVal = "numberInDash";
+      break;
+    case PageNumberFormat::CardinalText:
+      fmtVal = "cardinalText";
+      break;
+    case PageNumberFormat::OrdinalText:
+      fmtVal = "ordinalText";
+      break;
+    case PageNumberFormat::LowerLetter:
+      fmtVal = "lowerLetter";
+      break;
+    case PageNumberFormat::UpperLetter:
+      fmtVal = "upperLetter";
+      break;
+    case PageNumberFormat::LowerRoman:
+      fmtVal = "lowerRoman";
+      break;
+    case PageNumberFormat::UpperRoman:
+      fmtVal = "upperRoman";
+      break;
+    }
+    pgNumTypeFmt.set_value(fmtVal);
+
+    pugi::xml_attribute pgNumTypeStart = pgNumType.attribute("w:start");
+    if (start > 0) {
+      if (!pgNumTypeStart) {
+        pgNumTypeStart = pgNumType.append_attribute("w:start");
+        pgNumTypeStart.set_value(start);
+      }
+    }
+    else {
+      if (pgNumTypeStart) {
+        pgNumType.remove_attribute(pgNumTypeStart);
+      }
+    }
+  }
+
+  void Section::RemovePageNumber()
+  {
+    if (!impl_) return;
+
+    // the footer is only dropped if it is the one SetPageNumber() generated
+    Document::Impl* doc = impl_->doc_ != NULL ? impl_->doc_ : Document::Impl::Owner(impl_->w_sectPr_);
+    const HeaderFooterPart* part = doc == NULL ? NULL : doc->FindHeaderFooter(false, PAGE_NUMBER_XML);
+    pugi::xml_node reference = impl_->w_sectPr_.find_child_by_attribute("w:footerReference", "w:type", "default");
+    if (part != NULL && part->relId_ == reference.attribute("r:id").as_string()) {
+      impl_->RemoveReference(false, HeaderFooterType::Default);
+    }
+
+    pugi::xml_node pgNumType = impl_->w_sectPr_.child("w:pgNumType");
+    if (pgNumType) {
+      impl_->w_sectPr_.remove_child(pgNumType);
+    }
+  }
+
+  bool Section::SetHeader(const Fragment& content, const HeaderFooterType type)
+  {
+    if (!impl_ || !content.impl_) return false;
+    return impl_->SetReference(true, SerializeChildren(content.impl_->w_body_), type);
+  }
+
+  bool Section::SetFooter(const Fragment& content, const HeaderFooterType type)
+  {
+    if (!impl_ || !content.impl_) return false;
+    return impl_->SetReference(false, SerializeChildren(content.impl_->w_body_), type);
+  }
+
+  void Section::RemoveHeader(const HeaderFooterType type)
+  {
+    if (!impl_) return;
+    impl_->RemoveReference(true, type);
+  }
+
+  void Section::RemoveFooter(const HeaderFooterType type)
+  {
+    if (!impl_) return;
+    impl_->RemoveReference(false, type);
+  }
+
+  const char* HeaderFooterTypeValue(const Section::HeaderFooterType type)
+  {
+    switch (type) {
+    case Section::HeaderFooterType::First:
+      return "first";
+    case Section::HeaderFooterType::Even:
+      return "even";
+    default:
+      return "default";
+    }
+  }
+
+  bool Section::Impl::SetReference(const bool header, const std::string& content, const HeaderFooterType type)
+  {
+    Document::Impl* doc = doc_ != NULL ? doc_ : Document::Impl::Owner(w_sectPr_);
+    if (doc == NULL) return false;
+    doc->dirty_ |= DIRTY_DOCUMENT;
+
+    const char* name = header ? "w:headerReference" : "w:footerReference";
+    const char* typeVal = HeaderFooterTypeValue(type);
+    pugi::xml_node reference = w_sectPr_.find_child_by_attribute(name, "w:type", typeVal);
+    if (!reference) {
+      // references come first, headers before footers
+      pugi::xml_node last;
+      for (pugi::xml_node child = w_sectPr_.first_child(); child; child = child.next_sibling()) {
+        if (std::strcmp(child.name(), "w:headerReference") != 0
+          && (header || std::strcmp(child.name(), "w:footerReference") != 0)) break;
+        last = child;
+      }
+      reference = last ? w_sectPr_.insert_child_after(name, last) : w_sectPr_.prepend_child(name);
+      reference.append_attribute("w:type") = typeVal;
+      reference.append_attribute("r:id");
+    }
+    reference.attribute("r:id").set_value(doc->AddHeaderFooter(header, content).c_str());
+
+    if (type == HeaderFooterType::First && !w_sectPr_.child("w:titlePg")) {
+      // w:titlePg goes before these
+      static const char* const AFTER[] = { "w:textDirection", "w:bidi", "w:rtlGutter", "w:docGrid", "w:printerSettings" };
+      pugi::xml_node next;
+      for (pugi::xml_node child = w_sectPr_.first_child(); child && !next; child = child.next_sibling()) {
+        for (size_t i = 0; i < sizeof(AFTER) / sizeof(AFTER[0]); i++) {
+          if (std::strcmp(child.name(), AFTER[i]) == 0) next = child;
+        }
+      }
+      if (next) w_sectPr_.insert_child_before("w:titlePg", next);
+      else w_sectPr_.append_child("w:titlePg");
+    }
+    if (type == HeaderFooterType::Even && !doc->w_settings_.child("w:evenAndOddHeaders")) {
+      doc->w_settings_.append_child("w:evenAndOddHeaders");
+      doc->dirty_ |= DIRTY_SETTINGS;
+    }
+    return true;
+  }
+
+  void Section::Impl::RemoveReference(const bool header, const HeaderFooterType type)
+  {
+    const char* name = header ? "w:headerReference" : "w:footerReference";
+    pugi::xml_node reference = w_sectPr_.find_child_by_attribute(name, "w:type", HeaderFooterTypeValue(type));
+    if (!reference) return;
+    w_sectPr_.remove_child(reference);
+
+    Document::Impl* doc = doc_ != NULL ? doc_ : Document::Impl::Owner(w_sectPr_);
+    if (doc != NULL) doc->dirty_ |= DIRTY_DOCUMENT;
+  }
+
+  Paragraph Section::FirstParagraph()
+  {
+    if (!impl_) return Paragraph();
+    if (impl_->doc_ == NULL) return Prev().LastParagraph().Next();
+
+    Document::Impl* doc = impl_->doc_;
+    const size_t i = doc->SectionIndex(impl_->w_sectPr_);
+    if (i == doc->sections_.size()) return Paragraph();
+
+    pugi::xml_node w_p;
+    if (i == 0) {
+      w_p = impl_->w_body_.child("w:p");
+    }
+    else {
+      w_p = doc->sections_[i - 1].parent().parent().next_sibling("w:p");
+    }
+    if (!w_p) return Paragraph();
+
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->doc_ = doc;
+    impl->owner_ = doc;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_p.child("w:pPr");
+    return Paragraph(impl);
+  }
+
+  Paragraph Section::LastParagraph()
+  {
+    if (!impl_) return Paragraph();
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->doc_ = impl_->doc_;
+    impl->owner_ = impl_->doc_;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = impl_->w_p_last_;
+    impl->w_pPr_ = impl_->w_pPr_last_;
+    return Paragraph(impl);
+  }
+
+  Section Section::Next()
+  {
+    if (!impl_) return Section();
+    Document::Impl* doc = impl_->doc_;
+
+    pugi::xml_node w_p;
+    size_t i = 0;
+    if (doc != NULL) {
+      i = doc->SectionIndex(impl_->w_sectPr_);
+      if (i + 1 >= doc->sections_.size()) return Section();
+      w_p = impl_->w_sectPr_.parent().parent().next_sibling("w:p");
+    }
+    else {
+      w_p = impl_->w_p_last_.next_sibling();
+    }
+    if (w_p.empty()) return Section();
+
+    Section::Impl* impl = new Section::Impl;
+    impl->doc_ = doc;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_p.child("w:pPr");
+    Section s(impl);
+    if (doc != NULL) {
+      impl->SetBounds(doc->sections_[i + 1]);
+    }
+    else {
+      s.FindSectionProperties();
+    }
+    return s;
+  }
+
+  Section Section::Prev()
+  {
+    if (!impl_) return Section();
+
+    if (impl_->doc_ != NULL) {
+      Document::Impl* doc = impl_->doc_;
+      const size_t i = doc->SectionIndex(impl_->w_sectPr_);
+      if (i == 0 || i == doc->sections_.size()) return Section();
+
+      Section::Impl* impl = new Section::Impl;
+      impl->doc_ = doc;
+      impl->w_body_ = impl_->w_body_;
+      impl->SetBounds(doc->sections_[i - 1]);
+      impl->w_p_ = impl->w_p_last_;
+      impl->w_pPr_ = impl->w_pPr_last_;
+      return Section(impl);
+    }
+
+    pugi::xml_node w_p_prev, w_p, w_pPr, w_sectPr;
+
+    w_p_prev = impl_->w_p_.previous_sibling();
+    if (w_p_prev.empty()) return Section();
+
+    do {
+      w_p = w_p_prev;
+      w_pPr = w_p.child("w:pPr");
+      w_sectPr = w_pPr.child("w:sectPr");
+      w_p_prev = w_p.previous_sibling();
+    } while (w_sectPr.empty() && !w_p_prev.empty());
+
+    Section::Impl* impl = new Section::Impl;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = impl->w_p_last_ = w_p;
+    impl->w_pPr_ = impl->w_pPr_last_ = w_pPr;
+    impl->w_sectPr_ = w_sectPr;
+    return Section(impl);
+  }
+
+  Section::operator bool()
+  {
+    return impl_ != NULL && impl_->w_sectPr_;
+  }
+
+  bool Section::operator==(const Section& s)
+  {
+    if (!impl_ && !s.impl_) return true;
+    if (impl_ && s.impl_) return impl_->w_sectPr_ == s.impl_->w_sectPr_;
+    return false;
+  }
+
+  void Section::operator=(const Section& right)
+  {
+    if (this == &right) return;
+    if (impl_ != NULL) delete impl_;
+    if (right.impl_ != NULL) {
+      impl_ = new Impl;
+      impl_->doc_ = right.impl_->doc_;
+      impl_->w_body_ = right.impl_->w_body_;
+      impl_->w_p_ = right.impl_->w_p_;
+      impl_->w_p_last_ = right.impl_->w_p_last_;
+      impl_->w_pPr_ = right.impl_->w_pPr_;
+      impl_->w_pPr_last_ = right.impl_->w_pPr_last_;
+      impl_->w_sectPr_ = right.impl_->w_sectPr_;
+    }
+    else {
+      impl_ = NULL;
+    }
+  }
+
+
+  // class Run
+  Run::Run() : impl_(NULL)
+  {
+
+  }
+
+  Run::Run(Impl* impl) : impl_(impl)
+  {
+
+  }
+
+  Run::Run(const Run& r)
+  {
+    impl_ = new Impl;
+    impl_->owner_ = r.impl_->owner_;
+    impl_->w_p_ = r.impl_->w_p_;
+    impl_->w_r_ = r.impl_->w_r_;
+    impl_->w_rPr_ = r.impl_->w_rPr_;
+  }
+
+  Run::~Run()
+  {
+    if (impl_ != NULL) {
+      delete impl_;
+      impl_ = NULL;
+    }
+  }
+
+  void Run::AppendText(const std::string& text)
+  {
+    AppendText(TextView(text.data(), text.size()));
+  }
+
+  void Run::AppendText(const TextView& text)
+  {
+    if (!impl_) return;
+    std::string clean;
+    const bool ok = SanitizeText(text.data, text.size, clean);
+    if (ok) AppendTextElement(impl_->w_r_, text.data, text.size);
+    else AppendTextElement(impl_->w_r_, clean.data(), clean.size());
+
+    Document::Impl* doc = Document::Impl::Tracking(impl_->w_p_, impl_->owner_);
+    if (doc != NULL) doc->TextAppended(impl_->w_p_, impl_->w_r_, ok ? text.data : clean.data(), ok ? text.size : clean.size());
+  }
+
+  void Run::AppendTextWithBreaks(const std::string& text)
+  {
+    AppendTextWithBreaks(TextView(text.data(), text.size()));
+  }
+
+  void Run::AppendTextWithBreaks(const TextView& text)
+  {
+    if (!impl_) return;
+    std::string clean;
+    const bool ok = SanitizeText(text.data, text.size, clean);
+    const char* data = ok ? text.data : clean.data();
+    const size_t size = ok ? text.size : clean.size();
+
+    // clean text has no other bytes below 0x20, so the scan stops at tabs and line ends only
+    size_t begin = 0;
+    size_t i = 0;
+    while (true) {
+      i += PrintableAsciiLength(data + i, size - i);
+      if (i < size && static_cast<unsigned char>(data[i]) >= 0x80) {
+        i++;
+        continue;
+      }
+      if (i > begin) AppendTextElement(impl_->w_r_, data + begin, i - begin);
+      if (i == size) break;
+
+      if (data[i] == '\t') {
+        impl_->w_r_.append_child("w:tab");
+      }
+      else {
+        impl_->w_r_.append_child("w:br");
+        if (data[i] == '\r' && i + 1 < size && data[i + 1] == '\n') i++;
+      }
+      begin = ++i;
+    }
+
+    Document::Impl* doc = Document::Impl::Tracking(impl_->w_p_, impl_->owner_);
+    if (doc != NULL) doc->TextAppended(impl_->w_p_, impl_->w_r_, data, size);
+  }
+
+  std::string Run::GetText()
+  {
+    if (!impl_) return "";
+    std::string text;
+    for (pugi::xml_node t = impl_->w_r_.child("w:t"); t; t = t.next_sibling("w:t")) {
+      text += t.text().get();
+    }
+    return text;
+  }
+
+  size_t Run::GetText(char* buffer, const size_t size)
+  {
+    size_t length = 0;
+    if (!impl_) {
+      if (size > 0) buffer[0] = '\0';
+      return 0;
+    }
+    for (pugi::xml_node t = impl_->w_r_.child("w:t"); t; t = t.next_sibling("w:t")) {
+      const char* text = t.text().get();
+      const size_t n = std::strlen(text);
+      if (length + 1 < size) {
+        const size_t room = size - 1 - length;
+        std::memcpy(buffer + length, text, n < room ? n : room);
+      }
+      length += n;
+    }
+    if (size > 0) buffer[length < size ? length : size - 1] = '\0';
+    return length;
+  }
+
+  bool Run::GetTextView(TextView& text)
+  {
+    if (!impl_) return false;
+    pugi::xml_node t = impl_->w_r_.child("w:t");
+    if (!t || t.next_sibling("w:t")) return false;
+    const char* value = t.text().get();
+    text = TextView(value, std::strlen(value));
+    return true;
+  }
+
+  void Run::ClearText()
+  {
+    if (!impl_) return;
+    Document::Impl* doc = Document::Impl::Owner(impl_->w_p_, impl_->owner_);
+    if (doc != NULL) doc->DropFields(impl_->w_r_);
+    impl_->w_r_.remove_children();
+
+    if (doc != NULL && doc->statsTracked_) doc->RecountParagraph(impl_->w_p_);
+  }
+
+  void Run::AppendLineBreak()
+  {
+    if (!impl_) return;
+    impl_->w_r_.append_child("w:br");
+
+    Document::Impl* doc = Document::Impl::Tracking(impl_->w_p_, impl_->owner_);
+    if (doc != NULL) doc->TextAppended(impl_->w_p_, impl_->w_r_, "\n", 1);
+  }
+
+  void Run::AppendTabs(const unsigned int count)
+  {
+    if (!impl_) return;
+    for (unsigned int i = 0; i < count; i++)
+      impl_->w_r_.append_child("w:tab");
+
+    Document::Impl* doc = Document::Impl::Tracking(impl_->w_p_, impl_->owner_);
+    if (doc != NULL && count > 0) doc->TextAppended(impl_->w_p_, impl_->w_r_, std::string(count, '\t').c_str(), count);
+  }
+
+  bool Run::AppendPicture(const std::string& path, const int w, const int h)
+  {
+    if (!impl_) return false;
+    Document::Impl* doc = Document::Impl::Owner(impl_->w_r_, impl_->owner_);
+    if (doc == NULL) return false;
+    const size_t media = doc->AddMedia(path, NULL, 0);
+    if (media == static_cast<size_t>(-1)) return false;
+    return doc->AppendDrawing(impl_->w_r_, media, w, h);
+  }
+
+  bool Run::AppendPicture(const char* data, const size_t size, const int w, const int h)
+  {
+    if (!impl_ || data == NULL) return false;
+    Document::Impl* doc = Document::Impl::Owner(impl_->w_r_, impl_->owner_);
+    if (doc == NULL) return false;
+    const size_t media = doc->AddMedia("", data, size);
+    if (media == static_cast<size_t>(-1)) return false;
+    return doc->AppendDrawing(impl_->w_r_, media, w, h);
+  }
+
+  void Run::SetFontSize(const double fontSize)
+  {
+    if (!impl_) return;
+    pugi::xml_node sz = impl_->w_rPr_.child("w:sz");
+    if (!sz) {
+      sz = impl_->w_rPr_.append_child("w:sz");
+    }
+    pugi::xml_attribute szVal = sz.attribute("w:val");
+    if (!szVal) {
+      szVal = sz.append_attribute("w:val");
+    }
+    // font size in half-points (1/144 of an inch)
+    szVal.set_value(fontSize * 2);
+  }
+
+  double Run::GetFontSize()
+  {
+    if (!impl_) return -1;
+    pugi::xml_node sz = impl_->w_rPr_.child("w:sz");
+    if (!sz) return 0;
+    pugi::xml_attribute szVal = sz.attribute("w:val");
+    if (!szVal) return 0;
+    return szVal.as_int() / 2.0;
+  }
+
+  void Run::SetFont(
+    const std::string& fontAscii,
+    const std::string& fontEastAsia)
+  {
+    SetFont(TextView(fontAscii.data(), fontAscii.size()), TextView(fontEastAsia.data(), fontEastAsia.size()));
+  }
+
+  void Run::SetFont(
+    const TextView& fontAscii,
+    const TextView& fontEastAsia)
+  {
+    if (!impl_) return;
+    pugi::xml_node rFonts = impl_->w_rPr_.child("w:rFonts");
+    if (!rFonts) {
+      rFonts = impl_->w_rPr_.append_child("w:rFonts");
+    }
+    pugi::xml_attribute rFontsAscii = rFonts.attribute("w:ascii");
+    if (!rFontsAscii) {
+      rFontsAscii = rFonts.append_attribute("w:ascii");
+    }
+    pugi::xml_attribute rFontsEastAsia = rFonts.attribute("w:eastAsia");
+    if (!rFontsEastAsia) {
+      rFontsEastAsia = rFonts.append_attribute("w:eastAsia");
+    }
+    rFontsAscii.set_value(fontAscii.data, fontAscii.size);
+    if (fontEastAsia.empty()) rFontsEastAsia.set_value(fontAscii.data, fontAscii.size);
+    else rFontsEastAsia.set_value(fontEastAsia.data, fontEastAsia.size);
+  }
+
+  void Run::GetFont(
+    std::string& fontAscii,
+    std::string& fontEastAsia)
+  {
+    if (!impl_) return;
+    pugi::xml_node rFonts = impl_->w_rPr_.child("w:rFonts");
+    if (!rFonts) return;
+
+    pugi::xml_attribute rFontsAscii = rFonts.attribute("w:ascii");
+    if (rFontsAscii) fontAscii = rFontsAscii.value();
+
+    pugi::xml_attribute rFontsEastAsia = rFonts.attribute("w:eastAsia");
+    if (rFontsEastAsia) fontEastAsia = rFontsEastAsia.value();
+  }
+
+  void Run::SetFontColor(const std::string& hex)
+  {
+    if (!impl_) return;
+    pugi::xml_node color = impl_->w_rPr_.child("w:color");
+    if (!color) {
+      color = impl_->w_rPr_.append_child("w:color");
+    }
+    pugi::xml_attribute colorVal = color.attribute("w:val");
+    if (!colorVal) {
+      colorVal = color.append_attribute("w:val");
+    }
+    colorVal.set_value(hex.c_str());
+  }
+
+  std::string Run::GetFontColor()
+  {
+    if (impl_) {
+      pugi::xml_node color = impl_->w_rPr_.child("w:color");
+      if (color) {
+        pugi::xml_attribute colorVal = color.attribute("w:val");
+        if (colorVal) {
+          return colorVal.as_string();
+        }
+      }
+    }
+    return "auto";
+  }
+
+  void Run::SetFontStyle(const FontStyle f)
+  {
+    if (!impl_) return;
+    pugi::xml_node b = impl_->w_rPr_.child("w:b");
+    if (f & Bold) {
+      if (b.empty()) impl_->w_rPr_.append_child("w:b");
+    }
+    else {
+      impl_->w_rPr_.remove_child(b);
+    }
+
+    pugi::xml_node i = impl_->w_rPr_.child("w:i");
+    if (f & Italic) {
+      if (i.empty()) impl_->w_rPr_.append_child("w:i");
+    }
+    else {
+      impl_->w_rPr_.remove_child(i);
+    }
+
+    pugi::xml_node u = impl_->w_rPr_.child("w:u");
+    if (f & Underline) {
+      if (u.empty())
+        impl_->w_rPr_.append_child("w:u").append_attribute("w:val") = "single";
+    }
+    else {
+      impl_->w_rPr_.remove_child(u);
+    }
+
+    pugi::xml_node strike = impl_->w_rPr_.child("w:strike");
+    if (f & Strikethrough) {
+      if (strike.empty())
+        impl_->w_rPr_.append_child("w:strike").append_attribute("w:val") = "true";
+    }
+    else {
+      impl_->w_rPr_.remove_child(strike);
+    }
+  }
+
+  Run::FontStyle Run::GetFontStyle()
+  {
+    FontStyle fontStyle = 0;
+    if (!impl_) return fontStyle;
+    if (impl_->w_rPr_.child("w:b")) fontStyle |= Bold;
+    if (impl_->w_rPr_.child("w:i")) fontStyle |= Italic;
+    if (impl_->w_rPr_.child("w:u")) fontStyle |= Underline;
+    if (impl_->w_rPr_.child("w:strike")) fontStyle |= Strikethrough;
+    return fontStyle;
+  }
+
+  void Run::SetCharacterSpacing(const int characterSpacing)
+  {
+    if (!impl_) return;
+    pugi::xml_node spacing = impl_->w_rPr_.child("w:spacing");
+    if (!spacing) {
+      spacing = impl_->w_rPr_.append_child("w:spacing");
+    }
+    pugi::xml_attribute spacingVal = spacing.attribute("w:val");
+    if (!spacingVal) {
+      spacingVal = spacing.append_attribute("w:val");
+    }
+    spacingVal.set_value(characterSpacing);
+  }
+
+  int Run::GetCharacterSpacing()
+  {
+    if (!impl_) return -1;
+    return impl_->w_rPr_.child("w:spacing").attribute("w:val").as_int();
+  }
+
+  bool Run::IsPageBreak()
+  {
+    if (!impl_) return false;
+    return impl_->w_r_.find_child_by_attribute("w:br", "w:type", "page");
+  }
+
+  void Run::Remove()
+  {
+    if (!impl_) return;
+    Document::Impl* doc = Document::Impl::Owner(impl_->w_p_, impl_->owner_);
+    if (doc != NULL) doc->DropFields(impl_->w_r_);
+    impl_->w_p_.remove_child(impl_->w_r_);
+    if (doc != NULL && doc->statsTracked_) doc->RecountParagraph(impl_->w_p_);
+  }
+
+  Run Run::Next()
+  {
+    if (!impl_) return Run();
+    pugi::xml_node w_r = impl_->w_r_.next_sibling("w:r");
+    if (!w_r) return Run();
+
+    Run::Impl* impl = new Run::Impl;
+    impl->owner_ = impl_->owner_;
+    impl->w_p_ = impl_->w_p_;
+    impl->w_r_ = w_r;
+    impl->w_rPr_ = w_r.child("w:rPr");
+    return Run(impl);
+  }
+
+  Run::operator bool()
+  {
+    return impl_ != NULL && impl_->w_r_;
+  }
+
+  void Run::operator=(const Run& right)
+  {
+    if (this == &right) return;
+    if (impl_ != NULL) delete impl_;
+    if (right.impl_ != NULL) {
+      impl_ = new Impl;
+      impl_->owner_ = right.impl_->owner_;
+      impl_->w_p_ = right.impl_->w_p_;
+      impl_->w_r_ = right.impl_->w_r_;
+      impl_->w_rPr_ = right.impl_->w_rPr_;
+    }
+    else {
+      impl_ = NULL;
+    }
+  }
+
+  // class Table
+  Table::Table(Impl* impl) : impl_(impl)
+  {
+
+  }
+
+  Table::Table() : impl_(NULL)
+  {
+
+  }
+
+  Table::Table(const Table& t)
+  {
+    impl_ = new Impl;
+    impl_->w_body_ = t.impl_->w_body_;
+    impl_->w_tbl_ = t.impl_->w_tbl_;
+    impl_->w_tblPr_ = t.impl_->w_tblPr_;
+    impl_->w_tblGrid_ = t.impl_->w_tblGrid_;
+    impl_->rows_ = t.impl_->rows_;
+    impl_->cols_ = t.impl_->cols_;
+    impl_->grid_ = t.impl_->grid_;
+  }
+
+  Table::~Table()
+  {
+    if (impl_ != NULL) {
+      delete impl_;
+      impl_ = NULL;
+    }
+  }
+
+  void Table::operator=(const Table& right)
+  {
+    if (this == &right) return;
+    if (impl_ != NULL) delete impl_;
+    if (right.impl_ != NULL) {
+      impl_ = new Impl;
+      impl_->w_body_ = right.impl_->w_body_;
+      impl_->w_tbl_ = right.impl_->w_tbl_;
+      impl_->w_tblPr_ = right.impl_->w_tblPr_;
+      impl_->w_tblGrid_ = right.impl_->w_tblGrid_;
+      impl_->rows_ = right.impl_->rows_;
+      impl_->cols_ = right.impl_->cols_;
+      impl_->grid_ = right.impl_->grid_;
+    }
+    else {
+      impl_ = NULL;
+    }
+  }
+
+  void Table::Create_(const int rows, const int cols)
+  {
+    if (!impl_) return;
+    impl_->rows_ = rows;
+    impl_->cols_ = cols;
+
+    // init grid
+    for (int i = 0; i < rows; i++) {
+      Row row;
+      for (int j = 0; j < cols; j++) {
+        Cell cell = { i, j, 1, 1 };
+        row.push_back(cell);
+      }
+      impl_->grid_.push_back(row);
+    }
+
+    // init table
+    for (int j = 0; j < cols; j++)
+      pugi::xml_node w_gridCol = impl_->w_tblGrid_.append_child("w:gridCol");
+
+    for (int i = 0; i < rows; i++) {
+      pugi::xml_node w_tr = impl_->w_tbl_.append_child("w:tr");
+
+      for (int j = 0; j < cols; j++) {
+        pugi::xml_node w_tc = w_tr.append_child("w:tc");
+        pugi::xml_node w_tcPr = w_tc.append_child("w:tcPr");
+
+        TableCell::Impl* impl = new TableCell::Impl;
+        impl->c_ = &impl_->grid_[i][j];
+        impl->w_tr_ = w_tr;
+        impl->w_tc_ = w_tc;
+        impl->w_tcPr_ = w_tcPr;
+        TableCell tc(impl);
+        // A table cell must contain at least one block-level element, 
+        // even if it is an empty <p/>.
+        tc.AppendParagraph();
+      }
+    }
+  }
+
+  TableCell Table::GetCell(const int row, const int col)
+  {
+    if (!impl_) return TableCell();
+    if (row < 0 || row >= impl_->rows_ || col < 0 || col >= impl_->cols_) {
+      return TableCell();
+    }
+
+    Cell* c = &impl_->grid_[row][col];
+    return GetCell_(c->row, c->col);
+  }
+
+  TableCell Table::GetCell_(const int row, const int col)
+  {
+    if (!impl_) return TableCell();
+    int i = 0;
+    pugi::xml_node w_tr = impl_->w_tbl_.child("w:tr");
+    while (i < row && !w_tr.empty()) {
+      i++;
+      w_tr = w_tr.next_sibling("w:tr");
+    }
+    if (w_tr.empty()) {
+      return TableCell();
+    }
+
+    int j = 0;
+    pugi::xml_node w_tc = w_tr.child("w:tc");
+    while (j < col && !w_tc.empty()) {
+      j += impl_->grid_[row][j].cols;
+      w_tc = w_tc.next_sibling("w:tc");
+    }
+    if (w_tc.empty()) {
+      return TableCell();
+    }
+
+    TableCell::Impl* impl = new TableCell::Impl;
+    impl->c_ = &impl_->grid_[row][col];
+    impl->w_tr_ = w_tr;
+    impl->w_tc_ = w_tc;
+    impl->w_tcPr_ = w_tc.child("w:tcPr");
+    return TableCell(impl);
+  }
+
+  bool Table::MergeCells(TableCell tc1, TableCell tc2)
+  {
+    if (tc1.empty() || tc2.empty()) {
+      return false;
+    }
+
+    Cell* c1 = tc1.impl_->c_;
+    Cell* c2 = tc2.impl_->c_;
+
+    if (c1->row == c2->row && c1->col != c2->col && c1->rows == c2->rows) {
+      Cell* left_cell, * right_cell;
+      TableCell* left_tc, * right_tc;
+      if (c1->col < c2->col) {
+        left_cell = c1;
+        left_tc = &tc1;
+        right_cell = c2;
+        right_tc = &tc2;
+      }
+      else {
+        left_cell = c2;
+        left_tc = &tc2;
+        right_cell = c1;
+        right_tc = &tc1;
+      }
+
+      const int col = left_cell->col;
+      if ((right_cell->col - col) == left_cell->cols) {
+        const int cols = left_cell->cols + right_cell->cols;
+
+        // update right grid
+        const int right_col = right_cell->col;
+        const int right_cols = right_cell->cols;
+        for (int i = 0; i < right_cell->rows; i++) {
+          const int y = right_cell->row + i;
+          for (int j = 0; j < right_cols; j++) {
+            Cell& c = impl_->grid_[y][right_col + j];
+            c.col = col;
+            c.cols = cols;
+          }
+        }
+
+        // update cells
+        for (int i = 0; i < right_cell->rows; i++) {
+          RemoveCell_(GetCell_(right_cell->row + i, right_col));
+        }
+        for (int i = 0; i < left_cell->rows; i++) {
+          GetCell_(left_cell->row + i, left_cell->col).SetCellSpanning_(cols);
+        }
+
+        // update left grid
+        const int left_cols = left_cell->cols;
+        for (int i = 0; i < left_cell->rows; i++) {
+          const int y = left_cell->row + i;
+          for (int j = 0; j < left_cols; j++) {
+            Cell& c = impl_->grid_[y][left_cell->col + j];
+            c.cols = cols;
+          }
+        }
+
+        right_tc->impl_->c_ = left_cell;
+        right_tc->impl_->w_tc_ = left_tc->impl_->w_tc_;
+        right_tc->impl_->w_tcPr_ = left_tc->impl_->w_tcPr_;
+        return true;
+      }
+    }
+    else if (c1->col == c2->col && c1->row != c2->row && c1->cols == c2->cols) {
+      Cell* top_cell, * bottom_cell;
+      TableCell* top_tc, * bottom_tc;
+      if (c1->row < c2->row) {
+        top_cell = c1;
+        top_tc = &tc1;
+        bottom_cell = c2;
+        bottom_tc = &tc2;
+      }
+      else {
+        top_cell = c2;
+        top_tc = &tc2;
+        bottom_cell = c1;
+        bottom_tc = &tc1;
+      }
+
+      const int row = top_cell->row;
+      if ((bottom_cell->row - top_cell->row) == top_cell->rows) {
+        const int rows = top_cell->rows + bottom_cell->rows;
+
+        // update cells
+        if (top_cell->rows == 1) {
+          pugi::xml_node w_vMerge = top_tc->impl_->w_tcPr_.append_child("w:vMerge");
+          pugi::xml_attribute w_val = w_vMerge.append_attribute("w:val");
+          w_val.set_value("restart");
+        }
+        if (bottom_cell->rows == 1) {
+          bottom_tc->impl_->w_tcPr_.append_child("w:vMerge");
+        }
+        else {
+          bottom_tc->impl_->w_tcPr_.remove_child("w:vMerge");
+          bottom_tc->impl_->w_tcPr_.append_child("w:vMerge");
+        }
+
+        // update top grid
+        const int top_rows = top_cell->rows;
+        for (int i = 0; i < top_rows; i++) {
+          const int x = top_cell->row + i;
+          for (int j = 0; j < top_cell->cols; j++) {
+            Cell& c = impl_->grid_[x][top_cell->col + j];
+            c.rows = rows;
+          }
+        }
+
+        // update bottom grid
+        const int bottom_row = bottom_cell->row;
+        const int bottom_rows = bottom_cell->rows;
+        for (int i = 0; i < bottom_rows; i++) {
+          const int x = bottom_row + i;
+          for (int j = 0; j < bottom_cell->cols; j++) {
+            Cell& c = impl_->grid_[x][bottom_cell->col + j];
+            c.row = row;
+            c.rows = rows;
+          }
+        }
+
+        bottom_tc->impl_->c_ = top_cell;
+        bottom_tc->impl_->w_tc_ = top_tc->impl_->w_tc_;
+        bottom_tc->impl_->w_tcPr_ = top_tc->impl_->w_tcPr_;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void Table::RemoveCell_(TableCell tc)
+  {
+    if (!impl_) return;
+    Document::Impl* doc = Document::Impl::Owner(tc.impl_->w_tc_);
+    if (doc != NULL) {
+      doc->ForgetBookmarks(tc.impl_->w_tc_);
+      doc->DropFields(tc.impl_->w_tc_);
+      if (doc->statsTracked_) doc->CountContent(tc.impl_->w_tc_, false);
+    }
+    tc.impl_->w_tr_.remove_child(tc.impl_->w_tc_);
+  }
+
+  void Table::SetWidthAuto()
+  {
+    SetWidth(0, "auto");
+  }
+
+  void Table::SetWidthPercent(const double w)
+  {
+    SetWidth(w / 0.02, "pct");
+  }
+
+  void Table::SetWidth(const int w, const char* units)
+  {
+    if (!impl_) return;
+    pugi::xml_node w_tblW = impl_->w_tblPr_.child("w:tblW");
+    if (!w_tblW) {
+      w_tblW = impl_->w_tblPr_.append_child("w:tblW");
+    }
+
+    pugi::xml_attribute w_w = w_tblW.attribute("w:w");
+    if (!w_w) {
+      w_w = w_tblW.append_attribute("w:w");
+    }
+
+    pugi::xml_attribute w_type = w_tblW.attribute("w:type");
+    if (!w_type) {
+      w_type = w_tblW.append_attribute("w:type");
+    }
+
+    w_w.set_value(w);
+    w_type.set_value(units);
+  }
+
+  void Table::SetCellMarginTop(const int w, const char* units)
+  {
+    SetCellMargin("w:top", w, units);
+  }
+
+  void Table::SetCellMarginBottom(const int w, const char* units)
+  {
+    SetCellMargin("w:bottom", w, units);
+  }
+
+  void Table::SetCellMarginLeft(const int w, const char* units)
+  {
+    SetCellMargin("w:start", w, units);
+  }
+
+  void Table::SetCellMarginRight(const int w, const char* units)
+  {
+    SetCellMargin("w:end", w, units);
+  }
+
+  void Table::SetCellMargin(const char* elemName, const int w, const char* units)
+  {
+    if (!impl_) return;
+    pugi::xml_node w_tblCellMar = impl_->w_tblPr_.child("w:tblCellMar");
+    if (!w_tblCellMar) {
+      w_tblCellMar = impl_->w_tblPr_.append_child("w:tblCellMar");
+    }
+
+    pugi::xml_node w_tblCellMarChild = w_tblCellMar.child(elemName);
+    if (!w_tblCellMarChild) {
+      w_tblCellMarChild = w_tblCellMar.append_child(elemName);
+    }
+
+    pugi::xml_attribute w_w = w_tblCellMarChild.attribute("w:w");
+    if (!w_w) {
+      w_w = w_tblCellMarChild.append_attribute("w:w");
+    }
+
+    pugi::xml_attribute w_type = w_tblCellMarChild.attribute("w:type");
+    if (!w_type) {
+      w_type = w_tblCellMarChild.append_attribute("w:type");
+    }
+
+    w_w.set_value(w);
+    w_type.set_value(units);
+  }
+
+  void Table::SetAlignment(const Alignment alignment)
+  {
+    if (!impl_) return;
+    const char* val;
+    switch (alignment) {
+    case Alignment::Left:
+      val = "start";
+      break;
+    case Alignment::Right:
+      val = "end";
+      break;
+    case Alignment::Centered:
+      val = "center";
+      break;
+    }
+
+    pugi::xml_node w_jc = impl_->w_tblPr_.child("w:jc");
+    if (!w_jc) {
+      w_jc = impl_->w_tblPr_.append_child("w:jc");
+    }
+    pugi::xml_attribute w_val = w_jc.attribute("w:val");
+    if (!w_val) {
+      w_val = w_jc.append_attribute("w:val");
+    }
+    w_val.set_value(val);
+  }
+
+  void Table::SetTopBorders(const BorderStyle style, const double width, const char* color)
+  {
+    SetBorders_("w:top", style, width, color);
+  }
+
+  void Table::SetBottomBorders(const BorderStyle style, const double width, const char* color)
+  {
+    SetBorders_("w:bottom", style, width, color);
+  }
+
+  void Table::SetLeftBorders(const BorderStyle style, const double width, const char* color)
+  {
+    SetBorders_("w:start", style, width, color);
+  }
+
+  void Table::SetRightBorders(const BorderStyle style, const double width, const char* color)
+  {
+    SetBorders_("w:end", style, width, color);
+  }
+
+  void Table::SetInsideHBorders(const BorderStyle style, const double width, const char* color)
+  {
+    SetBorders_("w:insideH", style, width, color);
+  }
+
+  void Table::SetInsideVBorders(const BorderStyle style, const double width, const char* color)
+  {
+    SetBorders_("w:insideV", style, width, color);
+  }
+
+  void Table::SetInsideBorders(const BorderStyle style, const double width, const char* color)
+  {
+    SetInsideHBorders(style, width, color);
+    SetInsideVBorders(style, width, color);
+  }
+
+  void Table::SetOutsideBorders(const BorderStyle style, const double width, const char* color)
+  {
+    SetTopBorders(style, width, color);
+    SetBottomBorders(style, width, color);
+    SetLeftBorders(style, width, color);
+    SetRightBorders(style, width, color);
+  }
+
+  void Table::SetAllBorders(const BorderStyle style, const double width, const char* color)
+  {
+    SetOutsideBorders(style, width, color);
+    SetInsideBorders(style, width, color);
+  }
+
+  void Table::SetBorders_(const char* elemName, const BorderStyle style, const double width, const char* color)
+  {
+    if (!impl_) return;
+    pugi::xml_node w_tblBorders = impl_->w_tblPr_.child("w:tblBorders");
+    if (!w_tblBorders) {
+      w_tblBorders = impl_->w_tblPr_.append_child("w:tblBorders");
+    }
+    SetBorders(w_tblBorders, elemName, style, width, color);
+  }
+
+  // class TableCell
+  TableCell::TableCell() : impl_(NULL)
+  {
+
+  }
+
+  TableCell::TableCell(Impl* impl) : impl_(impl)
+  {
+
+  }
+
+  TableCell::TableCell(const TableCell& tc)
+  {
+    impl_ = new Impl;
+    impl_->c_ = tc.impl_->c_;
+    impl_->w_tr_ = tc.impl_->w_tr_;
+    impl_->w_tc_ = tc.impl_->w_tc_;
+    impl_->w_tcPr_ = tc.impl_->w_tcPr_;
+  }
+
+  TableCell::~TableCell()
+  {
+    if (impl_ != NULL) {
+      delete impl_;
+      impl_ = NULL;
+    }
+  }
+
+  void TableCell::operator=(const TableCell& right)
+  {
+    if (this == &right) return;
+    if (impl_ != NULL) delete impl_;
+    if (right.impl_ != NULL) {
+      impl_ = new Impl;
+      impl_->c_ = right.impl_->c_;
+      impl_->w_tr_ = right.impl_->w_tr_;
+      impl_->w_tc_ = right.impl_->w_tc_;
+      impl_->w_tcPr_ = right.impl_->w_tcPr_;
+    }
+    else {
+      impl_ = NULL;
+    }
+  }
+
+  TableCell::operator bool()
+  {
+    return impl_ != NULL && impl_->w_tc_;
+  }
+
+  bool TableCell::empty() const
+  {
+    return impl_ == NULL || !impl_->w_tc_;
+  }
+
+  void TableCell::SetWidth(const int w, const char* units)
+  {
+    if (!impl_) return;
+    pugi::xml_node w_tcW = impl_->w_tcPr_.child("w:tcW");
+    if (!w_tcW) {
+      w_tcW = impl_->w_tcPr_.append_child("w:tcW");
+    }
+
+    pugi::xml_attribute w_w = w_tcW.attribute("w:w");
+    if (!w_w) {
+      w_w = w_tcW.append_attribute("w:w");
+    }
+
+    pugi::xml_attribute w_type = w_tcW.attribute("w:type");
+    if (!w_type) {
+      w_type = w_tcW.append_attribute("w:type");
+    }
+
+    w_w.set_value(w);
+    w_type.set_value(units);
+  }
+
+  void TableCell::SetVerticalAlignment(const Alignment align)
+  {
+    if (!impl_) return;
+    pugi::xml_node w_vAlign = impl_->w_tcPr_.child("w:vAlign");
+    if (!w_vAlign) {
+      w_vAlign = impl_->w_tcPr_.append_child("w:vAlign");
+    }
+
+    pugi::xml_attribute w_val = w_vAlign.attribute("w:val");
+    if (!w_val) {
+      w_val = w_vAlign.append_attribute("w:val");
+    }
+
+    const char* val;
+    switch (align) {
+    case Alignment::Top:
+      val = "top";
+      break;
+    case Alignment::Center:
+      val = "center";
+      break;
+    case Alignment::Bottom:
+      val = "bottom";
+      break;
+    }
+    w_val.set_value(val);
+  }
+
+  void TableCell::SetCellSpanning_(const int cols)
+  {
+    if (!impl_) return;
+    pugi::xml_node w_gridSpan = impl_->w_tcPr_.child("w:gridSpan");
+    if (cols == 1) {
+      if (w_gridSpan) {
+        impl_->w_tcPr_.remove_child(w_gridSpan);
+      }
+      return;
+    }
+    if (!w_gridSpan) {
+      w_gridSpan = impl_->w_tcPr_.append_child("w:gridSpan");
+    }
+
+    pugi::xml_attribute w_val = w_gridSpan.attribute("w:val");
+    if (!w_val) {
+      w_val = w_gridSpan.append_attribute("w:val");
+    }
+
+    w_val.set_value(cols);
+  }
+
+  Paragraph TableCell::AppendParagraph()
+  {
+    if (!impl_) return Paragraph();
+    pugi::xml_node w_p = impl_->w_tc_.append_child("w:p");
+    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
+
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->w_body_ = impl_->w_tc_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_pPr;
+    return Paragraph(impl);
+  }
+
+  Paragraph TableCell::FirstParagraph()
+  {
+    if (!impl_) return Paragraph();
+    pugi::xml_node w_p = impl_->w_tc_.child("w:p");
+    pugi::xml_node w_pPr = w_p.child("w:pPr");
+
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->w_body_ = impl_->w_tc_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_pPr;
+    return Paragraph(impl);
+  }
+
+  // class TextFrame
+  TextFrame::TextFrame() : impl_(NULL)
+  {
+
+  }
+
+  TextFrame::TextFrame(Impl* impl, Paragraph::Impl* paragraph_impl)
+    : Paragraph(paragraph_impl), impl_(impl)
+  {
+
+  }
+
+  TextFrame::TextFrame(const TextFrame& tf)
+    : Paragraph(tf)
+  {
+    impl_ = new Impl;
+    impl_->w_framePr_ = tf.impl_->w_framePr_;
+  }
+
+  TextFrame::~TextFrame()
+  {
+    if (impl_ != NULL) {
+      delete impl_;
+      impl_ = NULL;
+    }
+  }
+
+  void TextFrame::SetSize(const int w, const int h)
+  {
+    if (!impl_) return;
+    pugi::xml_attribute w_w = impl_->w_framePr_.attribute("w:w");
+    if (!w_w) {
+      w_w = impl_->w_framePr_.append_attribute("w:w");
+    }
+    pugi::xml_attribute w_h = impl_->w_framePr_.attribute("w:h");
+    if (!w_h) {
+      w_h = impl_->w_framePr_.append_attribute("w:h");
+    }
+
+    w_w.set_value(w);
+    w_h.set_value(h);
+  }
+
+  void TextFrame::SetPositionX(const Position align, const Anchor ralativeTo)
+  {
+    SetAnchor_("w:hAnchor", ralativeTo);
+    SetPosition_("w:xAlign", align);
+  }
+
+  void TextFrame::SetPositionY(const Position align, const Anchor ralativeTo)
+  {
+    SetAnchor_("w:vAnchor", ralativeTo);
+    SetPosition_("w:yAlign", align);
+  }
+
+  void TextFrame::SetPositionX(const int x, const Anchor ralativeTo)
+  {
+    SetAnchor_("w:hAnchor", ralativeTo);
+    SetPosition_("w:x", x);
+  }
+
+  void TextFrame::SetPositionY(const int y, const Anchor ralativeTo)
+  {
+    SetAnchor_("w:vAnchor", ralativeTo);
+    SetPosition_("w:y", y);
+  }
+
+  void TextFrame::SetAnchor_(const char* attrName, const Anchor anchor)
+  {
+    if (!impl_) return;
+    pugi::xml_attribute w_anchor = impl_->w_framePr_.attribute(attrName);
+    if (!w_anchor) {
+      w_anchor = impl_->w_framePr_.append_attribute(attrName);
+    }
+
+    const char* val;
+    switch (anchor) {
+    case Anchor::Page:
+      val = "page";
+      break;
+    case Anchor::Margin:
+      val = "margin";
+      break;
+    }
+    w_anchor.set_value(val);
+  }
+
+  void TextFrame::SetPosition_(const char* attrName, const Position align)
+  {
+    if (!impl_) return;
+    pugi::xml_attribute w_align = impl_->w_framePr_.attribute(attrName);
+    if (!w_align) {
+      w_align = impl_->w_framePr_.append_attribute(attrName);
+    }
+
+    const char* val;
+    switch (align) {
+    case Position::Left:
+      val = "left";
+      break;
+    case Position::Center:
+      val = "center";
+      break;
+    case Position::Right:
+      val = "right";
+      break;
+    case Position::Top:
+      val = "top";
+      break;
+    case Position::Bottom:
+      val = "bottom";
+      break;
+    }
+    w_align.set_value(val);
+  }
+
+  void TextFrame::SetPosition_(const char* attrName, const int twip)
+  {
+    if (!impl_) return;
+    pugi::xml_attribute w_Align = impl_->w_framePr_.attribute(attrName);
+    if (!w_Align) {
+      w_Align = impl_->w_framePr_.append_attribute(attrName);
+    }
+    w_Align.set_value(twip);
+  }
+
+  void TextFrame::SetTextWrapping(const Wrapping wrapping)
+  {
+    if (!impl_) return;
+    pugi::xml_attribute w_wrap = impl_->w_framePr_.attribute("w:wrap");
+    if (!w_wrap) {
+      w_wrap = impl_->w_framePr_.append_attribute("w:wrap");
+    }
+
+    const char* val;
+    switch (wrapping) {
+    case Wrapping::Around:
+      val = "around";
+      break;
+    case Wrapping::None:
+      val = "none";
+      break;
+    }
+    w_wrap.set_value(val);
+  }
+
+
+  // class Fragment
+  Fragment::Fragment()
+  {
+    impl_ = new Impl;
+    impl_->w_body_ = impl_->doc_.append_child("w:body");
+  }
+
+  Fragment::Fragment(Fragment&& f) : impl_(f.impl_)
+  {
+    f.impl_ = NULL;
+  }
+
+  Fragment::~Fragment()
+  {
+    if (impl_ != NULL) {
+      delete impl_;
+      impl_ = NULL;
+    }
+  }
+
+  Paragraph Fragment::FirstParagraph()
+  {
+    if (!impl_) return Paragraph();
+    pugi::xml_node w_p = impl_->w_body_.child("w:p");
+    if (!w_p) return Paragraph();
+
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_p.child("w:pPr");
+    return Paragraph(impl);
+  }
+
+  Paragraph Fragment::LastParagraph()
+  {
+    if (!impl_) return Paragraph();
+    pugi::xml_node w_p = GetLastChild(impl_->w_body_, "w:p");
+    if (!w_p) return Paragraph();
+
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_p.child("w:pPr");
+    return Paragraph(impl);
+  }
+
+  Paragraph Fragment::AppendParagraph()
+  {
+    if (!impl_) return Paragraph();
+
+    pugi::xml_node w_p = impl_->w_body_.append_child("w:p");
+    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
+
+    Paragraph::Impl* impl = new Paragraph::Impl;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_p_ = w_p;
+    impl->w_pPr_ = w_pPr;
+    return Paragraph(impl);
+  }
+
+  Paragraph Fragment::AppendParagraph(const std::string& text)
+  {
+    Paragraph p = AppendParagraph();
+    p.AppendRun(text);
+    return p;
+  }
+
+  Paragraph Fragment::AppendParagraph(const std::string& text,
+    const double fontSize)
+  {
+    Paragraph p = AppendParagraph();
+    p.AppendRun(text, fontSize);
+    return p;
+  }
+
+  Paragraph Fragment::AppendParagraph(const std::string& text,
+    const double fontSize,
+    const std::string& fontAscii,
+    const std::string& fontEastAsia)
+  {
+    Paragraph p = AppendParagraph();
+    p.AppendRun(text, fontSize, fontAscii, fontEastAsia);
+    return p;
+  }
+
+  Paragraph Fragment::AppendParagraph(const TextView& text)
+  {
+    Paragraph p = AppendParagraph();
+    p.AppendRun(text);
+    return p;
+  }
+
+  Paragraph Fragment::AppendParagraph(const TextView& text,
+    const double fontSize)
+  {
+    Paragraph p = AppendParagraph();
+    p.AppendRun(text, fontSize);
+    return p;
+  }
+
+  Paragraph Fragment::AppendPageBreak()
+  {
+    Paragraph p = AppendParagraph();
+    p.AppendPageBreak();
+    return p;
+  }
+
+  Table Fragment::AppendTable(const int rows, const int cols)
+  {
+    if (!impl_) return Table();
+
+    pugi::xml_node w_tbl = impl_->w_body_.append_child("w:tbl");
+    pugi::xml_node w_tblPr = w_tbl.append_child("w:tblPr");
+    pugi::xml_node w_tblGrid = w_tbl.append_child("w:tblGrid");
+
+    Table::Impl* impl = new Table::Impl;
+    impl->w_body_ = impl_->w_body_;
+    impl->w_tbl_ = w_tbl;
+    impl->w_tblPr_ = w_tblPr;
+    impl->w_tblGrid_ = w_tblGrid;
+    Table tbl(impl);
+    InitTable(tbl, rows, cols);
+    return tbl;
+  }
+
+
+  struct Template::Impl
+  {
+    Document doc_;
+
+    // word/document.xml is slices_[0] value[0] slices_[1] ... value[n-1] slices_[n]
+    std::vector<std::string> slices_;
+    std::vector<std::string> names_;    // the field of each value
+    std::vector<std::string> defaults_; // escaped text written when a field has no value
+
+    // the source archive, its entries other than word/document.xml are
+    // copied into every document still compressed
+    std::string archive_;
+  };
+
+  // appends text escaped the way pugixml escapes element text
+  void AppendEscaped(std::string& out, const char* text, const size_t size)
+  {
+    size_t begin = 0;
+    for (size_t i = 0; i < size; i++) {
+      const unsigned char ch = static_cast<unsigned char>(text[i]);
+      if (ch >= 32 && ch != '&' && ch != '<' && ch != '>') continue;
+      if (ch == '\t' || ch == '\r' || ch == '\n') continue;
+
+      out.append(text + begin, i - begin);
+      begin = i + 1;
+      switch (ch) {
+      case '&':
+        out += "&amp;";
+        break;
+      case '<':
+        out += "&lt;";
+        break;
+      case '>':
+        out += "&gt;";
+        break;
+      default:
+        out += "&#";
+        out += static_cast<char>('0' + ch / 10);
+        out += static_cast<char>('0' + ch % 10);
+        out += ';';
+        break;
+      }
+    }
+    out.append(text + begin, size - begin);
+  }
+
+  // class Template
+  Template::Template()
+  {
+    impl_ = new Impl;
+  }
+
+  Template::~Template()
+  {
+    if (impl_ != NULL) {
+      delete impl_;
+      impl_ = NULL;
+    }
+  }
+
+  bool Template::Open(const std::string& path)
+  {
+    if (!impl_) return false;
+    if (!impl_->doc_.Open(path)) return false;
+
+    if (!ReadFile(path, impl_->archive_)) return false;
+    struct zip_t* zip = zip_stream_open(impl_->archive_.data(), impl_->archive_.size(), 0, 'r');
+    if (zip == NULL) return false;
+    zip_stream_close(zip);
+
+    Compile();
+    return true;
+  }
+
+  void Template::Compile()
+  {
+    Document::Impl* doc = impl_->doc_.impl_;
+    impl_->slices_.clear();
+    impl_->names_.clear();
+    impl_->defaults_.clear();
+
+    // Replace every field with a marker that cannot appear in a document:
+    // pugixml writes the control characters around its index as &#01; and &#02;.
+    impl_->doc_.CompileFields();
+    std::vector<std::string> names, texts, defaults;
+    for (size_t i = 0; i < doc->fields_.size(); i++) {
+      Field& f = doc->fields_[i];
+      std::string text;
+      if (f.w_t_) text = f.w_t_.text().get();
+      for (size_t k = 0; k < f.w_t_rest_.size(); k++) {
+        text += f.w_t_rest_[k].text().get();
+      }
+      names.push_back(f.name_);
+      texts.push_back(text);
+      defaults.push_back(std::string());
+      AppendEscaped(defaults.back(), text.c_str(), text.size());
+
+      // set directly, SetText() would strip the control characters
+      char marker[16];
+      const int size = std::snprintf(marker, sizeof(marker), "\x01%u\x02", static_cast<unsigned int>(i));
+      doc->SetField(i, "", 0);
+      f.w_t_.text().set(marker, size);
+    }
+
+    xml_string_writer writer;
+    doc->doc_.save(writer, "", pugi::format_raw);
+    const std::string& xml = writer.result;
+
+    size_t begin = 0;
+    size_t pos = xml.find("&#01;");
+    while (pos != std::string::npos) {
+      const size_t end = xml.find("&#02;", pos);
+      if (end == std::string::npos) break;
+      const size_t i = std::strtoul(xml.c_str() + pos + 5, NULL, 10);
+      if (i < names.size()) {
+        impl_->slices_.push_back(xml.substr(begin, pos - begin));
+        impl_->names_.push_back(names[i]);
+        impl_->defaults_.push_back(defaults[i]);
+        begin = end + 5;
+      }
+      pos = xml.find("&#01;", end + 5);
+    }
+    impl_->slices_.push_back(xml.substr(begin));
+
+    for (size_t i = 0; i < doc->fields_.size(); i++) {
+      doc->SetField(i, texts[i].c_str(), texts[i].size());
+    }
+  }
+
+  std::vector<std::string> Template::GetFields()
+  {
+    if (!impl_) return std::vector<std::string>();
+    return impl_->doc_.GetFields();
+  }
+
+  bool Template::Render(const std::map<std::string, std::string>& values, const std::string& path) const
+  {
+    if (!impl_ || impl_->slices_.empty()) return false;
+
+    std::string xml;
+    xml.reserve(impl_->slices_[0].size() * impl_->slices_.size());
+    std::string clean;
+    for (size_t i = 0; i < impl_->names_.size(); i++) {
+      xml += impl_->slices_[i];
+      std::map<std::string, std::string>::const_iterator value = values.find(impl_->names_[i]);
+      if (value != values.end()) {
+        if (SanitizeText(value->second.data(), value->second.size(), clean)) {
+          AppendEscaped(xml, value->second.data(), value->second.size());
+        }
+        else {
+          AppendEscaped(xml, clean.data(), clean.size());
+        }
+      }
+      else {
+        xml += impl_->defaults_[i];
+      }
+    }
+    xml += impl_->slices_.back();
+
+    struct zip_t* in = zip_stream_open(impl_->archive_.data(), impl_->archive_.size(), 0, 'r');
+    if (in == NULL) return false;
+    struct zip_t* zip = zip_open(path.c_str(), ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+    if (zip == NULL) {
+      zip_stream_close(in);
+      return false;
+    }
+
+    // the entries in the order of the source
+    bool ok = true;
+    const ssize_t n = zip_entries_total(in);
+    for (ssize_t i = 0; i < n && ok; i++) {
+      zip_entry_openbyindex(in, static_cast<int>(i));
+      const bool document = std::strcmp(zip_entry_name(in), "word/document.xml") == 0;
+      const bool dir = zip_entry_isdir(in) != 0;
+      zip_entry_close(in);
+      if (dir) continue;
+      if (document) ok = WritePart(zip, "word/document.xml", xml.data(), xml.size(), NULL);
+      else ok = zip_entry_copy(zip, in, static_cast<size_t>(i)) == 0;
+    }
+    zip_stream_close(in);
+    zip_close(zip);
+    if (!ok) std::remove(path.c_str());
+    return ok;
+  }
+
+
+  // class TextIndex
+  struct TextIndex::Impl
+  {
+    struct Entry
+    {
+      pugi::xml_node w_p;
+      size_t begin;      // in text_
+      size_t length;
+      size_t segBegin;   // in segments_
+      size_t segEnd;
+      bool live;
+    };
+
+    Document::Impl* doc_;
+    bool ngrams_;
+    std::string text_;                  // the text of every paragraph, each followed by '\n'
+    std::vector<TextSegment> segments_; // offsets into text_
+    std::vector<Entry> entries_;        // ordered by begin, edited paragraphs come last
+    std::unordered_map<pugi::xml_node, size_t, NodeHash> entryOf_;
+    std::unordered_map<unsigned int, std::vector<unsigned int> > postings_; // trigram -> entries
+    size_t dead_;                       // bytes of text_ left by edited paragraphs
+
+    static bool CompareBegin(const size_t pos, const Entry& e)
+    {
+      return pos < e.begin;
+    }
+
+    static unsigned int Trigram(const char* s)
+    {
+      return static_cast<unsigned char>(s[0]) << 16
+        | static_cast<unsigned char>(s[1]) << 8
+        | static_cast<unsigned char>(s[2]);
+    }
+
+    void Clear()
+    {
+      text_.clear();
+      segments_.clear();
+      entries_.clear();
+      entryOf_.clear();
+      postings_.clear();
+      dead_ = 0;
+    }
+
+    void Add(const pugi::xml_node& w_p)
+    {
+      std::vector<TextSegment> segments;
+      const std::string text = CollectText(w_p, segments);
+
+      Entry e = { w_p, text_.size(), text.size(), segments_.size(), segments_.size() + segments.size(), true };
+      for (size_t i = 0; i < segments.size(); i++) {
+        segments[i].offset += e.begin;
+        segments_.push_back(segments[i]);
+      }
+      text_ += text;
+      text_ += '\n';
+
+      const unsigned int id = static_cast<unsigned int>(entries_.size());
+      entries_.push_back(e);
+      entryOf_[w_p] = id;
+
+      if (!ngrams_) return;
+      for (size_t i = 0; i + 3 <= text.size(); i++) {
+        std::vector<unsigned int>& list = postings_[Trigram(text.c_str() + i)];
+        if (list.empty() || list.back() != id) list.push_back(id);
+      }
+    }
+
+    void Drop(const pugi::xml_node& w_p)
+    {
+      std::unordered_map<pugi::xml_node, size_t, NodeHash>::iterator it = entryOf_.find(w_p);
+      if (it == entryOf_.end()) return;
+      Entry& e = entries_[it->second];
+      e.live = false;
+      dead_ += e.length + 1;
+      entryOf_.erase(it);
+    }
+
+    // rebuilds the index once edited paragraphs take up half of it
+    void Compact()
+    {
+      if (dead_ < text_.size() / 2) return;
+      std::vector<pugi::xml_node> live;
+      for (size_t i = 0; i < entries_.size(); i++) {
+        if (entries_[i].live) live.push_back(entries_[i].w_p);
+      }
+      Clear();
+      for (size_t i = 0; i < live.size(); i++) {
+        Add(live[i]);
+      }
+    }
+
+    // appends the matches in a live entry
+    void Search(const Entry& e, const std::string& query, const size_t limit, std::vector<TextMatch>& matches) const
+    {
+      const char* text = text_.data();
+      const char* end = text + e.begin + e.length;
+      const char* pos = std::search(text + e.begin, end, query.begin(), query.end());
+      while (pos != end) {
+        if (limit > 0 && matches.size() >= limit) return;
+        matches.push_back(MakeMatch(e, pos - text));
+        pos = std::search(pos + 1, end, query.begin(), query.end());
+      }
+    }
+
+    TextMatch MakeMatch(const Entry& e, const size_t pos) const
+    {
+      const std::vector<TextSegment>::const_iterator first = segments_.begin() + e.segBegin;
+      const TextSegment& seg = *(std::upper_bound(first, segments_.begin() + e.segEnd, pos, CompareSegmentOffset) - 1);
+
+      pugi::xml_node parent = e.w_p.parent();
+      Paragraph::Impl* p = new Paragraph::Impl;
+      p->doc_ = doc_ != NULL && parent == doc_->w_body_ ? doc_ : NULL;
+      p->owner_ = doc_;
+      p->w_body_ = parent;
+      p->w_p_ = e.w_p;
+      p->w_pPr_ = e.w_p.child("w:pPr");
+
+      Run::Impl* r = new Run::Impl;
+      r->owner_ = doc_;
+      r->w_p_ = e.w_p;
+      r->w_r_ = seg.w_t.parent();
+      r->w_rPr_ = r->w_r_.child("w:rPr");
+
+      TextMatch m = { Paragraph(p), Run(r), pos - e.begin };
+      return m;
+    }
+  };
+
+  TextIndex::TextIndex() : impl_(new Impl)
+  {
+    impl_->doc_ = NULL;
+    impl_->ngrams_ = true;
+    impl_->dead_ = 0;
+  }
+
+  TextIndex::~TextIndex()
+  {
+    delete impl_;
+  }
+
+  void TextIndex::Build(const Document& doc, const bool ngrams)
+  {
+    impl_->Clear();
+    impl_->doc_ = doc.impl_;
+    impl_->ngrams_ = ngrams;
+    if (!doc.impl_) return;
+    doc.impl_->dirty_ |= DIRTY_DOCUMENT; // matches are handles into the body
+
+    pugi::xml_node w_body = doc.impl_->w_body_;
+    pugi::xml_node node = w_body.first_child();
+    while (node) {
+      const char* name = node.name();
+      if (std::strcmp(name, "w:p") == 0) impl_->Add(node);
+      const bool descend = node.type() == pugi::node_element
+        && std::strcmp(name, "w:t") != 0 && !IsPropertyElement(name);
+      node = NextNode(node, w_body, descend);
+    }
+  }
+
+  std::vector<TextMatch> TextIndex::Find(const std::string& query, const size_t limit) const
+  {
+    std::vector<TextMatch> matches;
+    if (query.empty()) return matches;
+
+    if (!impl_->ngrams_ || query.size() < 3) {
+      size_t pos = impl_->text_.find(query);
+      while (pos != std::string::npos) {
+        const Impl::Entry& e = *(std::upper_bound(impl_->entries_.begin(), impl_->entries_.end(), pos, Impl::CompareBegin) - 1);
+        if (e.live && pos + query.size() <= e.begin + e.length) {
+          if (limit > 0 && matches.size() >= limit) break;
+          matches.push_back(impl_->MakeMatch(e, pos));
+        }
+        pos = impl_->text_.find(query, pos + 1);
+      }
+      return matches;
+    }
+
+    // the paragraphs in the shortest posting list that are in all the others
+    std::vector<const std::vector<unsigned int>*> lists;
+    for (size_t i = 0; i + 3 <= query.size(); i++) {
+      std::unordered_map<unsigned int, std::vector<unsigned int> >::const_iterator it
+        = impl_->postings_.find(Impl::Trigram(query.c_str() + i));
+      if (it == impl_->postings_.end()) return matches;
+      lists.push_back(&it->second);
+    }
+    size_t shortest = 0;
+    for (size_t i = 1; i < lists.size(); i++) {
+      if (lists[i]->size() < lists[shortest]->size()) shortest = i;
+    }
+
+    const std::vector<unsigned int>& candidates = *lists[shortest];
+    for (size_t c = 0; c < candidates.size(); c++) {
+      const Impl::Entry& e = impl_->entries_[candidates[c]];
+      if (!e.live) continue;
+      bool all = true;
+      for (size_t i = 0; i < lists.size() && all; i++) {
+        all = i == shortest || std::binary_search(lists[i]->begin(), lists[i]->end(), candidates[c]);
+      }
+      if (!all) continue;
+      impl_->Search(e, query, limit, matches);
+      if (limit > 0 && matches.size() >= limit) break;
+    }
+    return matches;
+  }
+
+  void TextIndex::Update(const Paragraph& p)
+  {
+    if (!p.impl_) return;
+    impl_->Drop(p.impl_->w_p_);
+    impl_->Add(p.impl_->w_p_);
+    impl_->Compact();
+  }
+
+  void TextIndex::Remove(const Paragraph& p)
+  {
+    if (!p.impl_) return;
+    impl_->Drop(p.impl_->w_p_);
+    impl_->Compact();
+  }
+
+
+  // class LayoutEstimate
+
+  // advance widths of the characters from ' ' to '~' in 1/1000 em
+  const unsigned short SERIF_WIDTHS[95] = {
+    250, 333, 408, 500, 500, 833, 778, 180, 333, 333, 500, 564, 250, 333, 250, 278,
+    500, 500, 500, 500, 500, 500, 500, 500, 500, 500, 278, 278, 564, 564, 564, 444,
+    921, 722, 667, 667, 722, 611, 556, 722, 722, 333, 389, 722, 611, 889, 722, 722,
+    556, 722, 667, 556, 611, 722, 722, 944, 722, 722, 611, 333, 278, 333, 469, 500,
+    333, 444, 500, 444, 500, 444, 333, 500, 500, 278, 278, 500, 278, 778, 500, 500,
+    500, 500, 333, 389, 278, 500, 500, 722, 500, 500, 444, 480, 200, 480, 541
+  };
+
+  const unsigned short SANS_WIDTHS[95] = {
+    278, 278, 355, 556, 556, 889, 667, 191, 333, 333, 389, 584, 278, 333, 278, 278,
+    556, 556, 556, 556, 556, 556, 556, 556, 556, 556, 278, 278, 584, 584, 584, 556,
+    1015, 667, 667, 722, 722, 667, 611, 778, 722, 278, 500, 667, 556, 833, 722, 778,
+    667, 778, 722, 667, 611, 722, 667, 944, 667, 667, 611, 278, 278, 278, 469, 556,
+    333, 556, 556, 500, 556, 556, 278, 556, 556, 222, 222, 500, 222, 833, 556, 556,
+    556, 556, 333, 500, 278, 556, 500, 722, 500, 500, 500, 334, 260, 334, 584
+  };
+
+  // how a font is measured
+  struct FontMetrics
+  {
+    const char* name_;
+    const unsigned short* widths_; // NULL for monospaced fonts, 600 each
+    int scale_;                    // of widths_ in percent
+    int height_;                   // of a single line in 1/1000 em
+  };
+
+  // matched by prefix, the first entry is used for other fonts
+  const FontMetrics FONT_METRICS[] = {
+    { "Times New Roman", SERIF_WIDTHS, 100, 1150 },
+    { "Arial", SANS_WIDTHS, 100, 1150 },
+    { "Helvetica", SANS_WIDTHS, 100, 1150 },
+    { "Calibri", SANS_WIDTHS, 90, 1220 },
+    { "Cambria", SERIF_WIDTHS, 105, 1170 },
+    { "Georgia", SERIF_WIDTHS, 110, 1140 },
+    { "Verdana", SANS_WIDTHS, 112, 1220 },
+    { "Tahoma", SANS_WIDTHS, 98, 1210 },
+    { "Segoe UI", SANS_WIDTHS, 98, 1330 },
+    { "Courier", NULL, 100, 1130 },
+    { "Consolas", NULL, 92, 1170 }
+  };
+
+  const FontMetrics& GetFontMetrics(const char* font)
+  {
+    for (size_t i = 1; i < sizeof(FONT_METRICS) / sizeof(FONT_METRICS[0]); i++) {
+      if (std::strncmp(font, FONT_METRICS[i].name_, std::strlen(FONT_METRICS[i].name_)) == 0) return FONT_METRICS[i];
+    }
+    return FONT_METRICS[0];
+  }
+
+  // Han, kana, Hangul and fullwidth forms, laid out a full em wide and
+  // breakable before and after each character
+  bool IsEastAsian(const unsigned long cp)
+  {
+    return (cp >= 0x1100 && cp <= 0x11FF) || (cp >= 0x2E80 && cp <= 0xA4CF) || (cp >= 0xAC00 && cp <= 0xD7AF)
+      || (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60)
+      || (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x20000 && cp <= 0x3FFFF);
+  }
+
+  struct LayoutEstimate::Impl
+  {
+    // a line of a paragraph and the break ending it, if any
+    struct Line
+    {
+      int height; // in twips
+      unsigned char brk;
+    };
+    enum { NoBreak, PageBreak, ColumnBreak };
+
+    // a paragraph measured at some width
+    struct Lines
+    {
+      int width;
+      int before;
+      int after;
+      bool pageBreakBefore;
+      bool inFlow; // false for frames
+      std::vector<Line> lines;
+      int page;          // where the paragraph starts
+      unsigned int pass; // the pagination that placed it
+    };
+
+    // the text area of a section
+    struct Geometry
+    {
+      int width;   // of a column
+      int height;
+      int columns;
+      int pitch;   // of the document grid, 0 if lines do not snap to one
+      const char* type;
+    };
+
+    Document::Impl* doc_;
+    int defaultTab_;
+    std::unordered_map<pugi::xml_node, Lines, NodeHash> lines_;
+    unsigned int pass_;
+    bool paginated_;
+    int pages_;
+
+    // pagination state
+    std::vector<pugi::xml_node> sections_; // the w:sectPr of each section
+    size_t section_;
+    Geometry geo_;
+    int page_;
+    int column_;
+    int y_;
+    std::vector<std::pair<pugi::xml_node, Lines*> > rowParagraphs_; // the paragraphs of the table being placed
+
+    // line breaking state
+    struct Breaker
+    {
+      int width;     // of the lines after the first
+      int avail;     // of the current line
+      int x;         // the committed width of the current line
+      int lineH;     // the natural height of the current line
+      int word;      // the width of the word not committed yet
+      int wordH;
+      int markH;     // the height of an empty line
+      Lines* out;
+      const pugi::xml_node* spacing;
+    };
+
+    void Clear()
+    {
+      lines_.clear();
+      pass_ = 0;
+      paginated_ = false;
+      pages_ = 0;
+    }
+
+    static Geometry GetGeometry(const pugi::xml_node& w_sectPr)
+    {
+      const pugi::xml_node pgSz = w_sectPr.child("w:pgSz");
+      const pugi::xml_node pgMar = w_sectPr.child("w:pgMar");
+      const pugi::xml_node cols = w_sectPr.child("w:cols");
+      const pugi::xml_node docGrid = w_sectPr.child("w:docGrid");
+      Geometry geo;
+      geo.columns = cols.attribute("w:num").as_int(1);
+      if (geo.columns < 1) geo.columns = 1;
+      const int width = pgSz.attribute("w:w").as_int(12240) - pgMar.attribute("w:left").as_int(1440)
+        - pgMar.attribute("w:right").as_int(1440) - pgMar.attribute("w:gutter").as_int(0);
+      geo.width = (width - cols.attribute("w:space").as_int(720) * (geo.columns - 1)) / geo.columns;
+      geo.height = pgSz.attribute("w:h").as_int(15840) - std::abs(pgMar.attribute("w:top").as_int(1440))
+        - std::abs(pgMar.attribute("w:bottom").as_int(1440));
+      if (geo.width < 720) geo.width = 720;
+      if (geo.height < 720) geo.height = 720;
+      const char* grid = docGrid.attribute("w:type").as_string();
+      geo.pitch = std::strcmp(grid, "lines") == 0 || std::strcmp(grid, "linesAndChars") == 0 || std::strcmp(grid, "snapToChars") == 0
+        ? docGrid.attribute("w:linePitch").as_int(0) : 0;
+      geo.type = w_sectPr.child("w:type").attribute("w:val").as_string("nextPage");
+      return geo;
+    }
+
+    // the height of a line from its natural height and the paragraph spacing
+    int LineHeight(const Breaker& b, int natural) const
+    {
+      const pugi::xml_node& spacing = *b.spacing;
+      const char* rule = spacing.attribute("w:lineRule").as_string("auto");
+      const int line = spacing.attribute("w:line").as_int(240);
+      if (std::strcmp(rule, "exact") == 0) return line;
+      if (geo_.pitch > 0) natural = (natural + geo_.pitch - 1) / geo_.pitch * geo_.pitch;
+      if (std::strcmp(rule, "atLeast") == 0) return natural > line ? natural : line;
+      return natural * line / 240;
+    }
+
+    void EndLine(Breaker& b, const unsigned char brk) const
+    {
+      Line line = { LineHeight(b, b.lineH > 0 ? b.lineH : b.markH), brk };
+      b.out->lines.push_back(line);
+      b.avail = b.width;
+      b.x = 0;
+      b.lineH = 0;
+    }
+
+    // puts the pending word on the current line or the next
+    void Commit(Breaker& b) const
+    {
+      if (b.word == 0 && b.wordH == 0) return;
+      if (b.x > 0 && b.x + b.word > b.avail) EndLine(b, NoBreak);
+      // a word wider than the line is broken anywhere
+      while (b.word > b.avail && b.avail > 0) {
+        if (b.wordH > b.lineH) b.lineH = b.wordH;
+        b.word -= b.avail;
+        EndLine(b, NoBreak);
+      }
+      b.x += b.word;
+      if (b.wordH > b.lineH) b.lineH = b.wordH;
+      b.word = 0;
+      b.wordH = 0;
+    }
+
+    void Text(Breaker& b, const char* text, const FontMetrics& latin, const int size, const bool bold) const
+    {
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(text);
+      const int latinH = size * latin.height_ / 1000;
+      const long long scale = latin.scale_ * (bold ? 105 : 100); // in 1/10000
+      while (*p) {
+        unsigned long cp = *p++;
+        if (cp >= 0xC0) {
+          const int n = cp >= 0xF0 ? 3 : cp >= 0xE0 ? 2 : 1;
+          cp &= 0x3F >> n;
+          for (int k = 0; k < n && (*p & 0xC0) == 0x80; k++) cp = cp << 6 | (*p++ & 0x3F);
+        }
+
+        if (cp == ' ' || cp == 0x3000) {
+          Commit(b);
+          b.x += cp == ' ' ? static_cast<int>((size * (latin.widths_ ? latin.widths_[0] : 600) * scale + 5000000) / 10000000) : size;
+          if (latinH > b.lineH) b.lineH = latinH;
+        }
+        else if (IsEastAsian(cp)) {
+          Commit(b);
+          b.word = size;
+          b.wordH = size * 1300 / 1000;
+          Commit(b);
+        }
+        else {
+          int w;
+          if (cp >= 0x300 && cp <= 0x36F) w = 0; // combining marks
+          else if (latin.widths_ == NULL) w = 600;
+          else if (cp >= 0x20 && cp < 0x7F) w = latin.widths_[cp - 0x20];
+          else w = latin.widths_['o' - 0x20];
+          b.word += static_cast<int>((size * w * scale + 5000000) / 10000000);
+          if (latinH > b.wordH) b.wordH = latinH;
+          if (cp == '-' || cp == '/') Commit(b); // breakable after
+        }
+      }
+    }
+
+    // the runs of a paragraph and of the elements wrapping them
+    void Inline(Breaker& b, const pugi::xml_node& parent) const
+    {
+      for (pugi::xml_node node = parent.first_child(); node; node = node.next_sibling()) {
+        const char* name = node.name();
+        if (std::strcmp(name, "w:r") == 0) {
+          MeasureRun(b, node);
+        }
+        else if (std::strcmp(name, "w:hyperlink") == 0 || std::strcmp(name, "w:ins") == 0 || std::strcmp(name, "w:smartTag") == 0
+          || std::strcmp(name, "w:fldSimple") == 0 || std::strcmp(name, "w:sdt") == 0 || std::strcmp(name, "w:sdtContent") == 0
+          || std::strcmp(name, "w:customXml") == 0 || std::strcmp(name, "w:moveTo") == 0) {
+          Inline(b, node);
+        }
+      }
+    }
+
+    void MeasureRun(Breaker& b, const pugi::xml_node& w_r) const
+    {
+      const pugi::xml_node w_rPr = w_r.child("w:rPr");
+      if (w_rPr.child("w:vanish")) return;
+      const int size = w_rPr.child("w:sz").attribute("w:val").as_int(20) * 10;
+      const pugi::xml_node rFonts = w_rPr.child("w:rFonts");
+      const FontMetrics& latin = GetFontMetrics(rFonts.attribute("w:ascii").as_string(rFonts.attribute("w:hAnsi").as_string()));
+      const bool bold = w_rPr.child("w:b") && std::strcmp(w_rPr.child("w:b").attribute("w:val").as_string("true"), "false") != 0
+        && std::strcmp(w_rPr.child("w:b").attribute("w:val").as_string("true"), "0") != 0;
+      const int height = size * latin.height_ / 1000;
+      b.markH = height;
+
+      for (pugi::xml_node node = w_r.first_child(); node; node = node.next_sibling()) {
+        const char* name = node.name();
+        if (std::strcmp(name, "w:t") == 0) {
+          Text(b, node.text().get(), latin, size, bold);
+        }
+        else if (std::strcmp(name, "w:tab") == 0 || std::strcmp(name, "w:ptab") == 0) {
+          Commit(b);
+          b.x = (b.x / defaultTab_ + 1) * defaultTab_;
+          if (height > b.lineH) b.lineH = height;
+          if (b.x > b.avail) {
+            EndLine(b, NoBreak);
+          }
+        }
+        else if (std::strcmp(name, "w:br") == 0 || std::strcmp(name, "w:cr") == 0) {
+          Commit(b);
+          if (height > b.lineH) b.lineH = height;
+          const char* type = node.attribute("w:type").as_string();
+          EndLine(b, std::strcmp(type, "page") == 0 ? PageBreak : std::strcmp(type, "column") == 0 ? ColumnBreak : NoBreak);
+        }
+        else if (std::strcmp(name, "w:noBreakHyphen") == 0 || std::strcmp(name, "w:sym") == 0) {
+          b.word += size / 2;
+          if (height > b.wordH) b.wordH = height;
+        }
+        else if (std::strcmp(name, "w:drawing") == 0) {
+          // inline pictures only, anchored ones are out of the flow
+          const pugi::xml_node extent = node.child("wp:inline").child("wp:extent");
+          if (!extent) continue;
+          Commit(b);
+          b.word = static_cast<int>(extent.attribute("cx").as_llong() / 635);
+          b.wordH = static_cast<int>(extent.attribute("cy").as_llong() / 635);
+          Commit(b);
+        }
+        else if (std::strcmp(name, "mc:AlternateContent") == 0) {
+          MeasureRun(b, node.child("mc:Choice"));
+        }
+      }
+    }
+
+    void Measure(const pugi::xml_node& w_p, const int width, Lines& out) const
+    {
+      const pugi::xml_node w_pPr = w_p.child("w:pPr");
+      const pugi::xml_node spacing = w_pPr.child("w:spacing");
+      const pugi::xml_node ind = w_pPr.child("w:ind");
+      const int markSize = w_pPr.child("w:rPr").child("w:sz").attribute("w:val").as_int(20) * 10;
+      const int line = geo_.pitch > 0 ? geo_.pitch : 240;
+
+      out.width = width;
+      out.lines.clear();
+      out.inFlow = !w_pPr.child("w:framePr");
+      const pugi::xml_node pageBreakBefore = w_pPr.child("w:pageBreakBefore");
+      out.pageBreakBefore = pageBreakBefore && std::strcmp(pageBreakBefore.attribute("w:val").as_string("true"), "false") != 0
+        && std::strcmp(pageBreakBefore.attribute("w:val").as_string("true"), "0") != 0;
+      out.before = spacing.attribute("w:beforeLines") ? spacing.attribute("w:beforeLines").as_int() * line / 100
+        : spacing.attribute("w:beforeAutospacing").as_bool() ? 280 : spacing.attribute("w:before").as_int(0);
+      out.after = spacing.attribute("w:afterLines") ? spacing.attribute("w:afterLines").as_int() * line / 100
+        : spacing.attribute("w:afterAutospacing").as_bool() ? 280 : spacing.attribute("w:after").as_int(0);
+
+      // indents, list items without their own take those of our lists
+      int left = ind.attribute("w:left").as_int(ind.attribute("w:start").as_int(0));
+      int hanging = ind.attribute("w:hanging").as_int(0);
+      const pugi::xml_node numPr = w_pPr.child("w:numPr");
+      if (!ind && numPr) {
+        left = 720 * (numPr.child("w:ilvl").attribute("w:val").as_int(0) + 1);
+        hanging = 360;
+      }
+      if (ind.attribute("w:leftChars")) left = ind.attribute("w:leftChars").as_int() * markSize / 100;
+      const int right = ind.attribute("w:rightChars") ? ind.attribute("w:rightChars").as_int() * markSize / 100
+        : ind.attribute("w:right").as_int(ind.attribute("w:end").as_int(0));
+      const int firstLine = ind.attribute("w:firstLineChars") ? ind.attribute("w:firstLineChars").as_int() * markSize / 100
+        : ind.attribute("w:hangingChars") ? -ind.attribute("w:hangingChars").as_int() * markSize / 100
+        : ind.attribute("w:firstLine").as_int(0) - hanging;
+
+      Breaker b;
+      b.width = width - left - right;
+      if (b.width < 240) b.width = 240;
+      b.avail = b.width - firstLine;
+      if (b.avail < 240) b.avail = 240;
+      b.x = 0;
+      b.lineH = 0;
+      b.word = 0;
+      b.wordH = 0;
+      b.markH = markSize * FONT_METRICS[0].height_ / 1000;
+      b.out = &out;
+      b.spacing = &spacing;
+
+      Inline(b, w_p);
+      Commit(b);
+      EndLine(b, NoBreak);
+    }
+
+    Lines& Get(const pugi::xml_node& w_p, const int width)
+    {
+      Lines& lines = lines_[w_p];
+      if (lines.lines.empty() || lines.width != width) Measure(w_p, width, lines);
+      return lines;
+    }
+
+    void NextPage()
+    {
+      page_++;
+      column_ = 0;
+      y_ = 0;
+    }
+
+    void NextColumn()
+    {
+      if (++column_ < geo_.columns) y_ = 0;
+      else NextPage();
+    }
+
+    void PlaceParagraph(const pugi::xml_node& w_p)
+    {
+      Lines& lines = Get(w_p, geo_.width);
+      lines.page = page_;
+      lines.pass = pass_;
+      if (!lines.inFlow) return;
+      if (lines.pageBreakBefore && y_ > 0) NextPage();
+
+      int before = lines.before;
+      for (size_t i = 0; i < lines.lines.size(); i++) {
+        const Line& line = lines.lines[i];
+        if (y_ > 0 && y_ + before + line.height > geo_.height) {
+          NextColumn();
+          before = 0;
+        }
+        if (i == 0) lines.page = page_;
+        y_ += before + line.height;
+        before = 0;
+        if (line.brk == PageBreak) NextPage();
+        else if (line.brk == ColumnBreak) NextColumn();
+      }
+      y_ += lines.after;
+    }
+
+    // the height of the content of a table cell, its paragraphs are put in rowParagraphs_
+    int BlockHeight(const pugi::xml_node& parent, const int width)
+    {
+      int height = 0;
+      for (pugi::xml_node node = parent.first_child(); node; node = node.next_sibling()) {
+        const char* name = node.name();
+        if (std::strcmp(name, "w:p") == 0) {
+          Lines& lines = Get(node, width);
+          rowParagraphs_.push_back(std::make_pair(node, &lines));
+          height += lines.before + lines.after;
+          for (size_t i = 0; i < lines.lines.size(); i++) height += lines.lines[i].height;
+        }
+        else if (std::strcmp(name, "w:tbl") == 0) {
+          std::vector<int> rows;
+          TableRows(node, width, rows);
+          for (size_t i = 0; i < rows.size(); i++) height += rows[i];
+        }
+        else if (std::strcmp(name, "w:sdt") == 0 || std::strcmp(name, "w:customXml") == 0) {
+          height += BlockHeight(std::strcmp(name, "w:sdt") == 0 ? node.child("w:sdtContent") : node, width);
+        }
+      }
+      return height;
+    }
+
+    // the height of each row of a table, its paragraphs are put in rowParagraphs_
+    void TableRows(const pugi::xml_node& w_tbl, const int width, std::vector<int>& rows)
+    {
+      const pugi::xml_node w_tblPr = w_tbl.child("w:tblPr");
+      const pugi::xml_node tblCellMar = w_tblPr.child("w:tblCellMar");
+      const int margins = tblCellMar.child("w:left").attribute("w:w").as_int(108) + tblCellMar.child("w:right").attribute("w:w").as_int(108);
+      std::vector<int> grid;
+      for (pugi::xml_node gridCol = w_tbl.child("w:tblGrid").child("w:gridCol"); gridCol; gridCol = gridCol.next_sibling("w:gridCol")) {
+        grid.push_back(gridCol.attribute("w:w").as_int(0));
+      }
+
+      for (pugi::xml_node w_tr = w_tbl.child("w:tr"); w_tr; w_tr = w_tr.next_sibling("w:tr")) {
+        const pugi::xml_node w_trPr = w_tr.child("w:trPr");
+        size_t col = w_trPr.child("w:gridBefore").attribute("w:val").as_uint(0);
+        int cells = 0;
+        for (pugi::xml_node w_tc = w_tr.child("w:tc"); w_tc; w_tc = w_tc.next_sibling("w:tc")) cells++;
+
+        int height = 0;
+        for (pugi::xml_node w_tc = w_tr.child("w:tc"); w_tc; w_tc = w_tc.next_sibling("w:tc")) {
+          const pugi::xml_node w_tcPr = w_tc.child("w:tcPr");
+          const size_t span = w_tcPr.child("w:gridSpan").attribute("w:val").as_uint(1);
+          int w = 0;
+          for (size_t k = col; k < col + span && k < grid.size(); k++) w += grid[k];
+          if (w == 0) {
+            const pugi::xml_node tcW = w_tcPr.child("w:tcW");
+            w = std::strcmp(tcW.attribute("w:type").as_string(), "dxa") == 0 ? tcW.attribute("w:w").as_int(0) : 0;
+          }
+          if (w == 0) w = width / cells;
+          col += span;
+
+          const int h = BlockHeight(w_tc, w - margins > 240 ? w - margins : 240);
+          if (h > height) height = h;
+        }
+
+        const pugi::xml_node trHeight = w_trPr.child("w:trHeight");
+        const int min = trHeight.attribute("w:val").as_int(0);
+        if (std::strcmp(trHeight.attribute("w:hRule").as_string(), "exact") == 0 && min > 0) height = min;
+        else if (min > height) height = min;
+        rows.push_back(height);
+      }
+    }
+
+    // rows move to the next page as a whole unless they are taller than one
+    void PlaceTable(const pugi::xml_node& w_tbl)
+    {
+      std::vector<int> rows;
+      size_t first = 0;
+      rowParagraphs_.clear();
+      TableRows(w_tbl, geo_.width, rows);
+
+      // rowParagraphs_ holds the paragraphs of all rows in order, split them by row
+      pugi::xml_node w_tr = w_tbl.child("w:tr");
+      for (size_t i = 0; i < rows.size(); i++, w_tr = w_tr.next_sibling("w:tr")) {
+        if (y_ > 0 && y_ + rows[i] > geo_.height) NextColumn();
+        size_t last = first;
+        while (last < rowParagraphs_.size() && IsDescendant(rowParagraphs_[last].first, w_tr)) last++;
+        for (size_t k = first; k < last; k++) {
+          rowParagraphs_[k].second->page = page_;
+          rowParagraphs_[k].second->pass = pass_;
+        }
+        first = last;
+
+        y_ += rows[i];
+        while (y_ > geo_.height) {
+          const int rest = y_ - geo_.height;
+          NextColumn();
+          y_ = rest;
+        }
+      }
+    }
+
+    static bool IsDescendant(pugi::xml_node node, const pugi::xml_node& ancestor)
+    {
+      for (; node; node = node.parent()) {
+        if (node == ancestor) return true;
+      }
+      return false;
+    }
+
+    void PlaceBlocks(const pugi::xml_node& parent)
+    {
+      for (pugi::xml_node node = parent.first_child(); node; node = node.next_sibling()) {
+        const char* name = node.name();
+        if (std::strcmp(name, "w:p") == 0) {
+          PlaceParagraph(node);
+          if (node.child("w:pPr").child("w:sectPr") && section_ + 1 < sections_.size()) StartSection(sections_[++section_]);
+        }
+        else if (std::strcmp(name, "w:tbl") == 0) {
+          PlaceTable(node);
+        }
+        else if (std::strcmp(name, "w:sdt") == 0) {
+          PlaceBlocks(node.child("w:sdtContent"));
+        }
+        else if (std::strcmp(name, "w:customXml") == 0) {
+          PlaceBlocks(node);
+        }
+      }
+    }
+
+    void StartSection(const pugi::xml_node& w_sectPr)
+    {
+      geo_ = GetGeometry(w_sectPr);
+      if (std::strcmp(geo_.type, "continuous") == 0) {
+        if (column_ >= geo_.columns) NextPage();
+        return;
+      }
+      if (std::strcmp(geo_.type, "nextColumn") == 0) {
+        NextColumn();
+        return;
+      }
+      NextPage();
+      // a blank page to start on an even or odd page
+      if ((std::strcmp(geo_.type, "evenPage") == 0 && page_ % 2 == 1) || (std::strcmp(geo_.type, "oddPage") == 0 && page_ % 2 == 0)) page_++;
+    }
+
+    void Paginate()
+    {
+      if (paginated_) return;
+      paginated_ = true;
+      pass_++;
+      pages_ = 0;
+      if (doc_ == NULL) return;
+
+      // the section of a paragraph is defined by the next section break
+      sections_.clear();
+      for (pugi::xml_node w_p = doc_->w_body_.child("w:p"); w_p; w_p = w_p.next_sibling("w:p")) {
+        const pugi::xml_node w_sectPr = w_p.child("w:pPr").child("w:sectPr");
+        if (w_sectPr) sections_.push_back(w_sectPr);
+      }
+      sections_.push_back(doc_->w_sectPr_);
+
+      section_ = 0;
+      geo_ = GetGeometry(sections_[0]);
+      page_ = 1;
+      column_ = 0;
+      y_ = 0;
+      PlaceBlocks(doc_->w_body_);
+      pages_ = page_;
+    }
+
+    int PageOf(const pugi::xml_node& w_p)
+    {
+      Paginate();
+      std::unordered_map<pugi::xml_node, Lines, NodeHash>::const_iterator it = lines_.find(w_p);
+      return it == lines_.end() || it->second.pass != pass_ ? 0 : it->second.page;
+    }
+
+    void Invalidate(const pugi::xml_node& w_p)
+    {
+      lines_.erase(w_p);
+      paginated_ = false;
+    }
+  };
+
+  LayoutEstimate::LayoutEstimate() : impl_(new Impl)
+  {
+    impl_->doc_ = NULL;
+    impl_->defaultTab_ = 720;
+    impl_->Clear();
+  }
+
+  LayoutEstimate::~LayoutEstimate()
+  {
+    delete impl_;
+  }
+
+  void LayoutEstimate::Build(const Document& doc)
+  {
+    impl_->Clear();
+    impl_->doc_ = doc.impl_;
+    if (!doc.impl_) return;
+    impl_->defaultTab_ = doc.impl_->w_settings_.child("w:defaultTabStop").attribute("w:val").as_int(720);
+    if (impl_->defaultTab_ <= 0) impl_->defaultTab_ = 720;
+    impl_->Paginate();
+  }
+
+  void LayoutEstimate::Update(const Paragraph& p)
+  {
+    if (!p.impl_) return;
+    impl_->Invalidate(p.impl_->w_p_);
+  }
+
+  void LayoutEstimate::Remove(const Paragraph& p)
+  {
+    if (!p.impl_) return;
+    impl_->Invalidate(p.impl_->w_p_);
+  }
+
+  int LayoutEstimate::GetPageCount()
+  {
+    impl_->Paginate();
+    return impl_->pages_;
+  }
+
+  int LayoutEstimate::GetPage(const Paragraph& p)
+  {
+    if (!p.impl_) return 0;
+    return impl_->PageOf(p.impl_->w_p_);
+  }
+
+  int LayoutEstimate::GetLineCount(const Paragraph& p)
+  {
+    if (!p.impl_) return 0;
+    impl_->Paginate();
+    std::unordered_map<pugi::xml_node, Impl::Lines, NodeHash>::const_iterator it = impl_->lines_.find(p.impl_->w_p_);
+    return it == impl_->lines_.end() || it->second.pass != impl_->pass_ ? 0 : static_cast<int>(it->second.lines.size());
+  }
+
+
+  // concatenation
+
+  size_t WriteToEntry(void* arg, uint64_t /*offset*/, const void* data, size_t size)
+  {
+    return zip_entry_write(static_cast<struct zip_t*>(arg), data, size) == 0 ? size : 0;
+  }
+
+  // stops the extraction once the start tag of the root element was read
+  size_t AppendRootTag(void* arg, uint64_t /*offset*/, const void* data, size_t size)
+  {
+    std::string* head = static_cast<std::string*>(arg);
+    head->append(static_cast<const char*>(data), size);
+    const size_t root = head->find("<w:document");
+    return root != std::string::npos && head->find('>', root) != std::string::npos ? 0 : size;
+  }
+
+  // streams an entry of one archive into another
+  bool CopyEntry(struct zip_t* in, const std::string& src, struct zip_t* out, const std::string& dst)
+  {
+    if (zip_entry_open(in, src.c_str()) < 0) return false;
+    zip_entry_open(out, dst.c_str());
+    const int err = zip_entry_extract(in, WriteToEntry, out);
+    zip_entry_close(out);
+    zip_entry_close(in);
+    return err == 0;
+  }
+
+  // whether the relationship type ends with one of 'types'
+  bool IsPartType(const char* type, const char* const* types, const size_t n)
+  {
+    const char* slash = std::strrchr(type, '/');
+    if (slash == NULL) return false;
+    for (size_t i = 0; i < n; i++) {
+      if (std::strcmp(slash, types[i]) == 0) return true;
+    }
+    return false;
+  }
+
+  // parts of which a package has one, the first input's serving all inputs
+  bool IsSharedPart(const char* type)
+  {
+    static const char* const TYPES[] = {
+      "/styles", "/stylesWithEffects", "/settings", "/webSettings", "/fontTable", "/theme", "/glossaryDocument"
+    };
+    return IsPartType(type, TYPES, sizeof(TYPES) / sizeof(TYPES[0]));
+  }
+
+  // parts of which a package has one, with entries the body refers to by id
+  bool IsNotesPart(const char* type)
+  {
+    static const char* const TYPES[] = {
+      "/footnotes", "/endnotes", "/comments", "/commentsExtended", "/commentsIds", "/commentsExtensible", "/people"
+    };
+    return IsPartType(type, TYPES, sizeof(TYPES) / sizeof(TYPES[0]));
+  }
+
+  // whether a notes part holds more than the separators every footnotes and
+  // endnotes part starts with
+  bool HasNotes(struct zip_t* zip, const std::string& name)
+  {
+    pugi::xml_document doc;
+    if (!ReadPart(zip, name.c_str(), doc, NULL)) return false;
+    for (pugi::xml_node n = doc.document_element().first_child(); n; n = n.next_sibling()) {
+      if (n.type() != pugi::node_element) continue;
+      const char* type = n.attribute("w:type").as_string();
+      if (*type == '\0' || std::strcmp(type, "normal") == 0) return true;
+    }
+    return false;
+  }
+
+  struct ConcatOutput
+  {
+    struct zip_t* zip_;
+    Package package_;       // the parts written so far
+    std::string namespaces_; // declarations missing from the first input
+    pugi::xml_document numbering_; // the lists of all inputs, written last
+    std::string numberingPart_;
+    int nextNumId_;
+    int nextAbstractNumId_;
+  };
+
+  struct ConcatInput
+  {
+    struct zip_t* zip_;
+    size_t index_;
+    Package package_;
+    std::unordered_map<std::string, std::string> copied_; // part name -> name in the output
+    std::unordered_map<std::string, std::string> relIds_; // relationship id -> id in the output
+    std::unordered_map<int, int> numIds_;                 // w:numId -> id in the output
+  };
+
+  // reads the numbering part of the first input, the lists of the later ones go after its own
+  void LoadNumbering(ConcatOutput& out, struct zip_t* zip)
+  {
+    out.nextNumId_ = 1;
+    out.nextAbstractNumId_ = 0;
+    const Relationship* rel = out.package_.FindRelationship(NUMBERING_TYPE);
+    if (rel == NULL) return;
+    out.numberingPart_ = ResolveTarget("word/", rel->target_);
+    if (!ReadPart(zip, out.numberingPart_.c_str(), out.numbering_, NULL)) return;
+
+    pugi::xml_node w_numbering = out.numbering_.child("w:numbering");
+    for (pugi::xml_node a = w_numbering.child("w:abstractNum"); a; a = a.next_sibling("w:abstractNum")) {
+      const int id = a.attribute("w:abstractNumId").as_int();
+      if (out.nextAbstractNumId_ <= id) out.nextAbstractNumId_ = id + 1;
+    }
+    for (pugi::xml_node num = w_numbering.child("w:num"); num; num = num.next_sibling("w:num")) {
+      const int id = num.attribute("w:numId").as_int();
+      if (out.nextNumId_ <= id) out.nextNumId_ = id + 1;
+    }
+  }
+
+  // Adds the lists of a later input to the numbering part of the output under
+  // new ids. Picture bullets are not carried over, their levels fall back to
+  // the text of w:lvlText.
+  bool MergeNumbering(ConcatOutput& out, ConcatInput& in, const std::string& part)
+  {
+    pugi::xml_document numbering;
+    if (!ReadPart(in.zip_, part.c_str(), numbering, NULL)) return false;
+    pugi::xml_node other = numbering.child("w:numbering");
+
+    if (!out.numbering_.child("w:numbering")) {
+      out.numbering_.load_buffer(NUMBERING_XML, std::strlen(NUMBERING_XML), pugi::parse_declaration);
+      if (out.numberingPart_.empty()) {
+        out.numberingPart_ = "word/numbering.xml";
+        for (int i = 1; out.package_.parts_.count(out.numberingPart_) > 0; i++) {
+          out.numberingPart_ = "word/numbering" + std::to_string(i) + ".xml";
+        }
       }
-      else {
-        left_cell = c2;
-        left_tc = &tc2;
-        right_cell = c1;
-        right_tc = &tc1;
+      out.package_.parts_.insert(out.numberingPart_);
+      out.package_.AddRelationship(NUMBERING_TYPE, out.numberingPart_.substr(5));
+      out.package_.AddOverride("/" + out.numberingPart_, "application/vnd.openxmlformats-officedocument.wordprocessingml.numbering+xml");
+    }
+    pugi::xml_node w_numbering = out.numbering_.child("w:numbering");
+    for (pugi::xml_attribute a = other.first_attribute(); a; a = a.next_attribute()) {
+      if (std::strncmp(a.name(), "xmlns:", 6) == 0 && !w_numbering.attribute(a.name())) {
+        w_numbering.append_attribute(a.name()) = a.value();
+      }
+    }
+    for (pugi::xml_node a = other.child("w:abstractNum"); a; a = a.next_sibling("w:abstractNum")) {
+      for (pugi::xml_node lvl = a.child("w:lvl"); lvl; lvl = lvl.next_sibling("w:lvl")) {
+        lvl.remove_child("w:lvlPicBulletId");
       }
+    }
 
-      const int col = left_cell->col;
-      if ((right_cell->col - col) == left_cell->cols) {
-        const int cols = left_cell->cols + right_cell->cols;
+    std::unordered_map<int, int> abstractNumIds;
+    for (pugi::xml_node w_num = other.child("w:num"); w_num; w_num = w_num.next_sibling("w:num")) {
+      in.numIds_[w_num.attribute("w:numId").as_int()] = out.nextNumId_;
+      CopyList(w_numbering, other, w_num, out.nextNumId_++, out.nextAbstractNumId_, abstractNumIds);
+    }
+    return true;
+  }
 
-        // update right grid
-        const int right_col = right_cell->col;
-        const int right_cols = right_cell->cols;
-        for (int i = 0; i < right_cell->rows; i++) {
-          const int y = right_cell->row + i;
-          for (int j = 0; j < right_cols; j++) {
-            Cell& c = impl_->grid_[y][right_col + j];
-            c.col = col;
-            c.cols = cols;
-          }
+  // copies a part, the parts it refers to and their relationships
+  std::string CopyPart(ConcatOutput& out, ConcatInput& in, const std::string& src)
+  {
+    std::unordered_map<std::string, std::string>::const_iterator it = in.copied_.find(src);
+    if (it != in.copied_.end()) return it->second;
+
+    std::string dst = src;
+    for (size_t n = in.index_ + 1; out.package_.parts_.count(dst) > 0; n++) dst = NumberedName(src, n);
+    in.copied_[src] = dst;
+    if (!CopyEntry(in.zip_, src, out.zip_, dst)) return "";
+    out.package_.parts_.insert(dst);
+
+    const std::string type = in.package_.ContentType(src);
+    if (!type.empty() && out.package_.ContentType(dst) != type) {
+      out.package_.AddOverride("/" + dst, type);
+    }
+
+    std::string data;
+    if (ReadEntry(in.zip_, RelsPath(src), data)) {
+      pugi::xml_document rels;
+      rels.load_buffer(data.data(), data.size());
+      pugi::xml_node root = rels.child("Relationships");
+      for (pugi::xml_node r = root.child("Relationship"); r; r = r.next_sibling("Relationship")) {
+        if (std::strcmp(r.attribute("TargetMode").as_string(), "External") == 0) continue;
+        const std::string target = CopyPart(out, in, ResolveTarget(DirName(src), r.attribute("Target").as_string()));
+        if (!target.empty()) r.attribute("Target") = RelativeTarget(DirName(dst), target).c_str();
+      }
+      xml_string_writer writer;
+      rels.save(writer, "", pugi::format_raw);
+      const std::string relsPath = RelsPath(dst);
+      WritePart(out.zip_, relsPath.c_str(), writer.result.data(), writer.result.size(), NULL);
+      out.package_.parts_.insert(relsPath);
+    }
+    return dst;
+  }
+
+  // Maps the relationships of word/document.xml of a later input into the
+  // output. Fails when the notes or comments of the input would have to share
+  // the part of an earlier one, their ids are not renumbered.
+  bool MergeRelationships(ConcatOutput& out, ConcatInput& in, const pugi::xml_document& rels)
+  {
+    for (pugi::xml_node r = rels.child("Relationships").child("Relationship"); r; r = r.next_sibling("Relationship")) {
+      const char* type = r.attribute("Type").as_string();
+      const std::string id = r.attribute("Id").as_string();
+      std::string target = r.attribute("Target").as_string();
+      const bool external = std::strcmp(r.attribute("TargetMode").as_string(), "External") == 0;
+
+      if (!external) {
+        const std::string part = ResolveTarget("word/", target);
+        if (std::strcmp(type, NUMBERING_TYPE) == 0) {
+          if (!MergeNumbering(out, in, part)) return false;
+          in.relIds_[id] = out.package_.FindRelationship(type)->id_;
+          continue;
         }
 
-        // update cells
-        for (int i = 0; i < right_cell->rows; i++) {
-          RemoveCell_(GetCell_(right_cell->row + i, right_cell->col));
+        // reuse the part of the first input for styles, settings, ... and
+        // the notes part of an earlier input if this one has no notes
+        const Relationship* shared = IsSharedPart(type) || IsNotesPart(type) ? out.package_.FindRelationship(type) : NULL;
+        if (shared != NULL && IsNotesPart(type) && HasNotes(in.zip_, part)) return false;
+        if (shared != NULL) {
+          in.relIds_[id] = shared->id_;
+          continue;
         }
-        for (int i = 0; i < left_cell->rows; i++) {
-          GetCell_(left_cell->row + i, left_cell->col).SetCellSpanning_(cols);
+
+        const std::string copied = CopyPart(out, in, part);
+        if (copied.empty()) return false;
+        target = RelativeTarget("word/", copied);
+      }
+      // an equal relationship is reused
+      in.relIds_[id] = out.package_.AddRelationship(type, target, external);
+    }
+    return true;
+  }
+
+  // collects the namespace declarations of the root element missing from 'known'
+  void CollectNamespaces(const std::string& tag, std::string& known, std::string& missing)
+  {
+    size_t pos = tag.find(" xmlns:");
+    while (pos != std::string::npos) {
+      const size_t eq = tag.find('=', pos);
+      const size_t end = tag.find_first_of("\"'", tag.find_first_of("\"'", eq) + 1);
+      if (eq == std::string::npos || end == std::string::npos) break;
+      const std::string prefix = tag.substr(pos, eq - pos + 1); // " xmlns:w="
+      if (known.find(prefix) == std::string::npos) {
+        known += tag.substr(pos, end + 1 - pos);
+        missing += tag.substr(pos, end + 1 - pos);
+      }
+      pos = tag.find(" xmlns:", end);
+    }
+  }
+
+  // the byte ranges of a serialized document.xml
+  struct BodyRange
+  {
+    size_t bodyBegin;   // after <w:body>
+    size_t sectPrBegin; // the final w:sectPr of the body, or bodyEnd
+    size_t bodyEnd;     // at </w:body>
+  };
+
+  bool FindBodyRange(const std::string& xml, BodyRange& range)
+  {
+    size_t body = xml.find("<w:body");
+    if (body == std::string::npos) return false;
+    body = xml.find('>', body);
+    range.bodyEnd = xml.rfind("</w:body>");
+    if (body == std::string::npos || range.bodyEnd == std::string::npos || range.bodyEnd < body) return false;
+    range.bodyBegin = body + 1;
+    range.sectPrBegin = range.bodyEnd;
+
+    size_t end = range.bodyEnd;
+    while (end > range.bodyBegin && std::isspace(static_cast<unsigned char>(xml[end - 1]))) end--;
+    if (end >= 11 && xml.compare(end - 11, 11, "</w:sectPr>") == 0) {
+      // match the start tag, w:sectPrChange may nest another w:sectPr
+      int depth = 0;
+      size_t pos = end;
+      while (pos > range.bodyBegin) {
+        pos = xml.rfind("w:sectPr", pos - 1);
+        if (pos == std::string::npos || pos < range.bodyBegin + 1) return true;
+        const char c = xml[pos + 8];
+        if (c != '>' && c != ' ' && c != '/') continue;
+        if (xml[pos - 1] == '/') {
+          depth++;
+        }
+        else if (xml[pos - 1] == '<') {
+          const size_t gt = xml.find('>', pos);
+          if (xml[gt - 1] == '/') continue; // <w:sectPr/> nested
+          if (--depth == 0) {
+            range.sectPrBegin = pos - 1;
+            return true;
+          }
         }
+      }
+    }
+    else if (end >= 2 && xml.compare(end - 2, 2, "/>") == 0) {
+      const size_t pos = xml.rfind('<', end);
+      if (pos != std::string::npos && xml.compare(pos, 9, "<w:sectPr") == 0) range.sectPrBegin = pos;
+    }
+    return true;
+  }
 
-        // update left grid
-        const int left_cols = left_cell->cols;
-        for (int i = 0; i < left_cell->rows; i++) {
-          const int y = left_cell->row + i;
-          for (int j = 0; j < left_cols; j++) {
-            Cell& c = impl_->grid_[y][left_cell->col + j];
-            c.cols = cols;
+  // the value of an attribute of a serialized start tag
+  std::string TagAttribute(const std::string& xml, const size_t tag, const char* name)
+  {
+    const size_t end = xml.find('>', tag);
+    size_t pos = xml.find(name, tag);
+    if (pos == std::string::npos || pos > end) return std::string();
+    pos += std::strlen(name);
+    return xml.substr(pos, xml.find('"', pos) - pos);
+  }
+
+  // Gives the bookmarks of the body of a later input named as one of an
+  // earlier input a suffix, "_2", "_3"... that is not taken, and adds the
+  // names of the input to 'taken'.
+  void RenameBookmarks(const std::string& xml, const BodyRange& range, std::unordered_set<std::string>& taken,
+    std::unordered_map<std::string, std::string>& names)
+  {
+    std::vector<std::string> own;
+    std::unordered_set<std::string> used;
+    for (size_t pos = xml.find("<w:bookmarkStart ", range.bodyBegin); pos < range.bodyEnd; pos = xml.find("<w:bookmarkStart ", pos + 1)) {
+      own.push_back(TagAttribute(xml, pos, " w:name=\""));
+      used.insert(own.back());
+    }
+    for (size_t i = 0; i < own.size(); i++) {
+      if (taken.count(own[i]) == 0 || names.count(own[i]) > 0) continue;
+      std::string renamed;
+      for (int n = 2; renamed.empty() || taken.count(renamed) > 0 || used.count(renamed) > 0; n++) {
+        renamed = own[i] + "_" + std::to_string(n);
+      }
+      used.insert(renamed);
+      names[own[i]] = renamed;
+    }
+    for (size_t i = 0; i < own.size(); i++) {
+      std::unordered_map<std::string, std::string>::const_iterator it = names.find(own[i]);
+      taken.insert(it != names.end() ? it->second : own[i]);
+    }
+  }
+
+  // Copies document.xml bytes to the output, moving bookmark ids by 'offset'
+  // and mapping r:* relationship attributes through 'relIds', the lists of
+  // w:numId through 'numIds' and bookmark names, with the links and fields
+  // referring to them, through 'names'.
+  void RewriteBody(const char* begin, const char* end, const unsigned int offset,
+    const std::unordered_map<std::string, std::string>& relIds, const std::unordered_map<int, int>& numIds,
+    const std::unordered_map<std::string, std::string>& names, unsigned int& maxId, std::string& out)
+  {
+    const char* p = begin;
+    while (p < end) {
+      const char* lt = static_cast<const char*>(std::memchr(p, '<', end - p));
+      if (lt == NULL) break;
+      const char* gt = static_cast<const char*>(std::memchr(lt, '>', end - lt));
+      if (gt == NULL) break;
+      out.append(p, lt - p);
+      p = gt + 1;
+
+      const std::string tag(lt, p);
+      const bool bookmark = tag.compare(0, 16, "<w:bookmarkStart") == 0 || tag.compare(0, 14, "<w:bookmarkEnd") == 0;
+      const bool numId = !numIds.empty() && tag.compare(0, 9, "<w:numId ") == 0;
+      const bool link = !names.empty() && (tag.compare(0, 13, "<w:hyperlink ") == 0 || tag.compare(0, 13, "<w:fldSimple ") == 0);
+      if (!names.empty() && (tag.compare(0, 13, "<w:instrText>") == 0 || tag.compare(0, 13, "<w:instrText ") == 0)) {
+        // the field code up to the end tag
+        const char* next = static_cast<const char*>(std::memchr(p, '<', end - p));
+        if (next == NULL) next = end;
+        std::string instr(p, next);
+        RenameFieldBookmark(instr, names);
+        out += tag;
+        out += instr;
+        p = next;
+        continue;
+      }
+      if (!bookmark && !numId && !link && tag.find(" r:") == std::string::npos) {
+        out += tag;
+        continue;
+      }
+
+      size_t copied = 0;
+      size_t attr = tag.find(' ');
+      while (attr != std::string::npos) {
+        const size_t eq = tag.find("=\"", attr);
+        if (eq == std::string::npos) break;
+        const size_t value = eq + 2;
+        const size_t valueEnd = tag.find('"', value);
+        if (valueEnd == std::string::npos) break;
+        const std::string name = tag.substr(attr + 1, eq - attr - 1);
+
+        std::string replacement;
+        bool replace = false;
+        if (bookmark && name == "w:id") {
+          const unsigned int id = static_cast<unsigned int>(std::strtoul(tag.c_str() + value, NULL, 10)) + offset;
+          if (maxId < id) maxId = id;
+          replacement = std::to_string(id);
+          replace = true;
+        }
+        else if ((bookmark && name == "w:name") || (link && name == "w:anchor")) {
+          std::unordered_map<std::string, std::string>::const_iterator it = names.find(tag.substr(value, valueEnd - value));
+          if (it != names.end()) {
+            replacement = it->second;
+            replace = true;
+          }
+        }
+        else if (link && name == "w:instr") {
+          replacement = tag.substr(value, valueEnd - value);
+          replace = RenameFieldBookmark(replacement, names);
+        }
+        else if (numId && name == "w:val") {
+          std::unordered_map<int, int>::const_iterator it = numIds.find(std::atoi(tag.c_str() + value));
+          if (it != numIds.end()) {
+            replacement = std::to_string(it->second);
+            replace = true;
           }
         }
+        else if (name.compare(0, 2, "r:") == 0) {
+          std::unordered_map<std::string, std::string>::const_iterator it = relIds.find(tag.substr(value, valueEnd - value));
+          if (it != relIds.end()) {
+            replacement = it->second;
+            replace = true;
+          }
+        }
+        if (replace) {
+          out.append(tag, copied, value - copied);
+          out += replacement;
+          copied = valueEnd;
+        }
+        attr = tag.find(' ', valueEnd);
+      }
+      out.append(tag, copied, std::string::npos);
+    }
+    out.append(p, end - p);
+  }
 
-        right_tc->impl_->c_ = left_cell;
-        right_tc->impl_->w_tc_ = left_tc->impl_->w_tc_;
-        right_tc->impl_->w_tcPr_ = left_tc->impl_->w_tcPr_;
-        return true;
+  bool Concat(const std::vector<std::string>& inputs, const std::string& output)
+  {
+    if (inputs.empty()) return false;
+
+    ConcatOutput out;
+    out.zip_ = zip_open(output.c_str(), ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+    if (out.zip_ == NULL) return false;
+
+    const char* const DOCUMENT = "word/document.xml";
+    const char* const DOCUMENT_RELS = "word/_rels/document.xml.rels";
+    const char* const CONTENT_TYPES = "[Content_Types].xml";
+
+    // First pass: copy the parts other than document.xml and merge the
+    // relationships, content types and namespace declarations.
+    std::vector<std::unordered_map<std::string, std::string> > relIds(inputs.size());
+    std::vector<std::unordered_map<int, int> > numIds(inputs.size());
+    std::string known;
+    std::string data;
+    for (size_t i = 0; i < inputs.size(); i++) {
+      ConcatInput in;
+      in.index_ = i;
+      in.zip_ = zip_open(inputs[i].c_str(), 0, 'r');
+      if (in.zip_ == NULL) {
+        zip_close(out.zip_);
+        std::remove(output.c_str());
+        return false;
+      }
+      pugi::xml_document types;
+      if (ReadEntry(in.zip_, CONTENT_TYPES, data)) types.load_buffer(data.data(), data.size());
+      in.package_.LoadContentTypes(types);
+
+      pugi::xml_document rels;
+      if (ReadEntry(in.zip_, DOCUMENT_RELS, data)) rels.load_buffer(data.data(), data.size());
+
+      if (i == 0) {
+        out.package_.LoadContentTypes(types);
+        out.package_.LoadRelationships(rels);
+        LoadNumbering(out, in.zip_);
+
+        // the numbering part is written last, with the lists of all inputs
+        const ssize_t n = zip_entries_total(in.zip_);
+        for (ssize_t k = 0; k < n; k++) {
+          zip_entry_openbyindex(in.zip_, static_cast<int>(k));
+          const std::string name = zip_entry_name(in.zip_);
+          const bool dir = zip_entry_isdir(in.zip_) != 0;
+          zip_entry_close(in.zip_);
+          if (dir || name == DOCUMENT || name == DOCUMENT_RELS || name == CONTENT_TYPES) continue;
+          out.package_.parts_.insert(name);
+          in.copied_[name] = name;
+          if (name != out.numberingPart_) CopyEntry(in.zip_, name, out.zip_, name);
+        }
+      }
+      else if (MergeRelationships(out, in, rels)) {
+        relIds[i] = in.relIds_;
+        numIds[i] = in.numIds_;
+      }
+      else {
+        zip_close(in.zip_);
+        zip_close(out.zip_);
+        std::remove(output.c_str());
+        return false;
+      }
+
+      // the start tag of the root element
+      std::string head;
+      zip_entry_open(in.zip_, DOCUMENT);
+      zip_entry_extract(in.zip_, AppendRootTag, &head);
+      zip_entry_close(in.zip_);
+      const size_t root = head.find("<w:document");
+      if (root != std::string::npos) {
+        const std::string tag = head.substr(root, head.find('>', root) - root);
+        std::string missing;
+        CollectNamespaces(tag, known, missing);
+        if (i > 0) out.namespaces_ += missing;
+      }
+      zip_close(in.zip_);
+    }
+
+    // Second pass: write word/document.xml from the byte ranges of the bodies.
+    // Every input but the last ends with a paragraph holding its final w:sectPr.
+    zip_entry_open(out.zip_, DOCUMENT);
+    std::string xml, chunk, tail;
+    std::unordered_set<std::string> bookmarkNames;
+    std::unordered_map<std::string, std::string> names;
+    unsigned int offset = 0;
+    bool ok = true;
+    for (size_t i = 0; i < inputs.size() && ok; i++) {
+      struct zip_t* zip = zip_open(inputs[i].c_str(), 0, 'r');
+      ok = zip != NULL && ReadEntry(zip, DOCUMENT, xml);
+      if (zip != NULL) zip_close(zip);
+
+      BodyRange range;
+      if (!ok || !FindBodyRange(xml, range)) {
+        ok = false;
+        break;
+      }
+
+      names.clear();
+      RenameBookmarks(xml, range, bookmarkNames, names);
+
+      chunk.clear();
+      if (i == 0) {
+        size_t root = xml.find("<w:document");
+        root = xml.find('>', root);
+        chunk.append(xml, 0, root);
+        chunk += out.namespaces_;
+        chunk.append(xml, root, range.bodyBegin - root);
+        tail.assign(xml, range.bodyEnd, std::string::npos);
+      }
+
+      unsigned int maxId = offset;
+      RewriteBody(xml.data() + range.bodyBegin, xml.data() + range.sectPrBegin, offset, relIds[i], numIds[i], names, maxId, chunk);
+
+      if (i + 1 < inputs.size()) {
+        chunk += "<w:p><w:pPr>";
+        RewriteBody(xml.data() + range.sectPrBegin, xml.data() + range.bodyEnd, 0, relIds[i], numIds[i], names, maxId, chunk);
+        chunk += "</w:pPr></w:p>";
+      }
+      else {
+        RewriteBody(xml.data() + range.sectPrBegin, xml.data() + range.bodyEnd, 0, relIds[i], numIds[i], names, maxId, chunk);
+        chunk += tail;
       }
+      offset = maxId + 1;
+      zip_entry_write(out.zip_, chunk.data(), chunk.size());
     }
-    else if (c1->col == c2->col && c1->row != c2->row && c1->cols == c2->cols) {
-      Cell* top_cell, * bottom_cell;
-      TableCell* top_tc, * bottom_tc;
-      if (c1->row < c2->row) {
-        top_cell = c1;
-        top_tc = &tc1;
-        bottom_cell = c2;
-        bottom_tc = &tc2;
+    zip_entry_close(out.zip_);
+
+    if (ok && out.numbering_.child("w:numbering")) {
+      ok = WritePart(out.zip_, out.numberingPart_.c_str(), out.numbering_, NULL);
+    }
+
+    const std::string rels = out.package_.SaveRelationships();
+    ok = WritePart(out.zip_, DOCUMENT_RELS, rels.data(), rels.size(), NULL) && ok;
+
+    const std::string types = out.package_.SaveContentTypes();
+    ok = WritePart(out.zip_, CONTENT_TYPES, types.data(), types.size(), NULL) && ok;
+
+    zip_close(out.zip_);
+    if (!ok) std::remove(output.c_str());
+    return ok;
+  }
+
+
+  // splitting
+
+  struct SplitJob
+  {
+    size_t index_;
+    std::string body_; // the content of the section, its w:sectPr last
+  };
+
+  // Writes the sections handed over by the scanner to their own packages on a
+  // few worker threads. At most one job per worker waits in the queue, so the
+  // memory used stays bounded by a few sections.
+  class SplitWriter
+  {
+  public:
+    SplitWriter(const std::string& input, const std::string& pattern, const size_t threads,
+      const std::string& rels, const std::string& types)
+      : input_(input), pattern_(pattern), capacity_(threads), done_(false), failed_(false)
+    {
+      rels_.load_buffer(rels.data(), rels.size(), pugi::parse_default | pugi::parse_declaration);
+      types_.load_buffer(types.data(), types.size(), pugi::parse_default | pugi::parse_declaration);
+      for (size_t i = 0; i < threads; i++) {
+        workers_.push_back(std::thread(&SplitWriter::Run, this));
+      }
+    }
+
+    // blocks while the queue is full
+    void Push(const size_t index, std::string& body)
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (jobs_.size() >= capacity_) notFull_.wait(lock);
+      jobs_.push_back(SplitJob());
+      jobs_.back().index_ = index;
+      jobs_.back().body_.swap(body);
+      notEmpty_.notify_one();
+    }
+
+    // waits for the pending jobs, true if every package was written
+    bool Finish()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+      }
+      notEmpty_.notify_all();
+      for (size_t i = 0; i < workers_.size(); i++) {
+        workers_[i].join();
+      }
+      workers_.clear();
+      return !failed_;
+    }
+
+    // deletes the packages written, once the split failed
+    void RemoveWritten()
+    {
+      for (size_t i = 0; i < written_.size(); i++) {
+        std::remove(written_[i].c_str());
+      }
+      written_.clear();
+    }
+
+    std::string prefix_; // word/document.xml up to and including <w:body>
+
+  private:
+    void Run()
+    {
+      for (;;) {
+        SplitJob job;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          while (!done_ && jobs_.empty()) notEmpty_.wait(lock);
+          if (jobs_.empty()) return;
+          job.index_ = jobs_.front().index_;
+          job.body_.swap(jobs_.front().body_);
+          jobs_.pop_front();
+          notFull_.notify_one();
+        }
+        std::string path;
+        const bool ok = Write(job, path);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ok) written_.push_back(path);
+        else failed_ = true;
+      }
+    }
+
+    // the values of the r:* attributes of serialized XML
+    static void CollectRelationshipIds(const std::string& xml, std::unordered_set<std::string>& ids)
+    {
+      for (size_t pos = xml.find(" r:"); pos != std::string::npos; pos = xml.find(" r:", pos + 1)) {
+        const size_t eq = xml.find("=\"", pos);
+        if (eq == std::string::npos) break;
+        if (xml.find_first_of(" <>", pos + 1) < eq) continue;
+        const size_t end = xml.find('"', eq + 2);
+        if (end == std::string::npos) break;
+        ids.insert(xml.substr(eq + 2, end - eq - 2));
+      }
+    }
+
+    // adds the parts and those they refer to, through their relationships, to 'parts'
+    static void Reach(struct zip_t* zip, std::vector<std::string>& pending, std::unordered_set<std::string>& parts)
+    {
+      std::string data;
+      while (!pending.empty()) {
+        const std::string part = pending.back();
+        pending.pop_back();
+        if (!parts.insert(part).second || !ReadEntry(zip, RelsPath(part), data)) continue;
+        pugi::xml_document rels;
+        rels.load_buffer(data.data(), data.size());
+        for (pugi::xml_node r = rels.child("Relationships").child("Relationship"); r; r = r.next_sibling("Relationship")) {
+          if (std::strcmp(r.attribute("TargetMode").as_string(), "External") == 0) continue;
+          pending.push_back(ResolveTarget(DirName(part), r.attribute("Target").as_string()));
+        }
+      }
+    }
+
+    // Writes the package of a section. It keeps the relationships of
+    // document.xml the section refers to and those of the parts of which a
+    // package has one (styles, numbering, footnotes...), and leaves out the
+    // parts only the other sections reach.
+    bool Write(const SplitJob& job, std::string& path) const
+    {
+      path = pattern_;
+      const std::string number = std::to_string(job.index_ + 1);
+      const size_t braces = path.find("{}");
+      if (braces != std::string::npos) {
+        path.replace(braces, 2, number);
       }
       else {
-        top_cell = c2;
-        top_tc = &tc2;
-        bottom_cell = c1;
-        bottom_tc = &tc1;
+        const size_t dot = path.rfind('.');
+        path.insert(dot == std::string::npos || dot < path.rfind('/') + 1 ? path.size() : dot, "_" + number);
       }
 
-      const int row = top_cell->row;
-      if ((bottom_cell->row - top_cell->row) == top_cell->rows) {
-        const int rows = top_cell->rows + bottom_cell->rows;
+      struct zip_t* in = zip_open(input_.c_str(), 0, 'r');
+      if (in == NULL) return false;
+      struct zip_t* out = zip_open(path.c_str(), ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+      if (out == NULL) {
+        zip_close(in);
+        return false;
+      }
+
+      std::unordered_set<std::string> ids;
+      CollectRelationshipIds(job.body_, ids);
+      static const char* const CUSTOM_XML[] = { "/customXml" };
+      pugi::xml_document rels;
+      rels.reset(rels_);
+      pugi::xml_node relationships = rels.child("Relationships");
+      std::vector<std::string> kept, dropped;
+      pugi::xml_node r = relationships.child("Relationship");
+      while (r) {
+        pugi::xml_node next = r.next_sibling("Relationship");
+        const char* type = r.attribute("Type").as_string();
+        const bool keep = ids.count(r.attribute("Id").as_string()) > 0
+          || std::strcmp(type, NUMBERING_TYPE) == 0 || IsSharedPart(type) || IsNotesPart(type)
+          || IsPartType(type, CUSTOM_XML, 1);
+        if (std::strcmp(r.attribute("TargetMode").as_string(), "External") != 0) {
+          (keep ? kept : dropped).push_back(ResolveTarget("word/", r.attribute("Target").as_string()));
+        }
+        if (!keep) relationships.remove_child(r);
+        r = next;
+      }
+      std::unordered_set<std::string> keptParts, droppedParts, skipped;
+      Reach(in, kept, keptParts);
+      Reach(in, dropped, droppedParts);
+      for (std::unordered_set<std::string>::const_iterator it = droppedParts.begin(); it != droppedParts.end(); ++it) {
+        if (keptParts.count(*it) > 0) continue;
+        skipped.insert(*it);
+        skipped.insert(RelsPath(*it));
+      }
+
+      pugi::xml_document types;
+      types.reset(types_);
+      pugi::xml_node w_types = types.child("Types");
+      pugi::xml_node o = w_types.child("Override");
+      while (o) {
+        pugi::xml_node next = o.next_sibling("Override");
+        if (skipped.count(o.attribute("PartName").as_string() + 1) > 0) w_types.remove_child(o);
+        o = next;
+      }
+
+      bool ok = true;
+      const ssize_t n = zip_entries_total(in);
+      for (ssize_t k = 0; k < n && ok; k++) {
+        zip_entry_openbyindex(in, static_cast<int>(k));
+        const std::string name = zip_entry_name(in);
+        const bool dir = zip_entry_isdir(in) != 0;
+        zip_entry_close(in);
+        if (dir || skipped.count(name) > 0) continue;
+        if (name == "word/_rels/document.xml.rels") {
+          ok = WritePart(out, name.c_str(), rels, NULL);
+        }
+        else if (name == "[Content_Types].xml") {
+          ok = WritePart(out, name.c_str(), types, NULL);
+        }
+        else if (name == "word/document.xml") {
+          static const char TAIL[] = "</w:body></w:document>";
+          zip_entry_open(out, name.c_str());
+          ok = zip_entry_write(out, prefix_.data(), prefix_.size()) == 0
+            && zip_entry_write(out, job.body_.data(), job.body_.size()) == 0
+            && zip_entry_write(out, TAIL, sizeof(TAIL) - 1) == 0;
+          zip_entry_close(out);
+        }
+        else {
+          ok = CopyEntry(in, name, out, name);
+        }
+      }
+      zip_close(out);
+      zip_close(in);
+      if (!ok) std::remove(path.c_str());
+      return ok;
+    }
+
+    const std::string input_;
+    const std::string pattern_;
+    pugi::xml_document rels_;  // word/_rels/document.xml.rels
+    pugi::xml_document types_; // [Content_Types].xml
+    const size_t capacity_;
+    std::vector<std::thread> workers_;
+    std::deque<SplitJob> jobs_;
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    bool done_;
+    bool failed_;
+    std::vector<std::string> written_;
+  };
+
+  // Cuts word/document.xml into sections while it is being inflated. Only the
+  // depth of the elements is tracked: a section ends with a paragraph of the
+  // body holding a w:sectPr in its w:pPr, or with the w:sectPr of the body.
+  class SectionScanner
+  {
+  public:
+    explicit SectionScanner(SplitWriter& writer)
+      : writer_(writer), inBody_(false), finished_(false), pos_(0), depth_(0),
+      inPPr_(false), sectPrBegin_(std::string::npos), sectPrEnd_(std::string::npos), bodySectPr_(std::string::npos), sections_(0)
+    {
+    }
+
+    static size_t Feed(void* arg, uint64_t /*offset*/, const void* data, size_t size)
+    {
+      static_cast<SectionScanner*>(arg)->Scan(static_cast<const char*>(data), size);
+      return size;
+    }
+
+    bool Finished() const { return finished_; }
+    size_t Sections() const { return sections_; }
+
+  private:
+    void Scan(const char* data, const size_t size)
+    {
+      if (finished_) return;
+      buffer_.append(data, size);
+      for (;;) {
+        const size_t lt = buffer_.find('<', pos_);
+        if (lt == std::string::npos) {
+          pos_ = buffer_.size();
+          return;
+        }
+        const size_t gt = TagEnd(lt);
+        if (gt == std::string::npos) {
+          pos_ = lt;
+          return;
+        }
+        pos_ = gt + 1;
+        Tag(lt, pos_);
+        if (finished_) return;
+      }
+    }
 
-        // update cells
-        if (top_cell->rows == 1) {
-          pugi::xml_node w_vMerge = top_tc->impl_->w_tcPr_.append_child("w:vMerge");
-          pugi::xml_attribute w_val = w_vMerge.append_attribute("w:val");
-          w_val.set_value("restart");
+    // the position of the '>' closing the tag at 'lt', skipping quoted values
+    size_t TagEnd(const size_t lt) const
+    {
+      char quote = 0;
+      for (size_t i = lt + 1; i < buffer_.size(); i++) {
+        const char c = buffer_[i];
+        if (quote) {
+          if (c == quote) quote = 0;
         }
-        if (bottom_cell->rows == 1) {
-          bottom_tc->impl_->w_tcPr_.append_child("w:vMerge");
+        else if (c == '"' || c == '\'') {
+          quote = c;
         }
-        else {
-          bottom_tc->impl_->w_tcPr_.remove_child("w:vMerge");
-          bottom_tc->impl_->w_tcPr_.append_child("w:vMerge");
+        else if (c == '>') {
+          return i;
         }
+      }
+      return std::string::npos;
+    }
 
-        // update top grid
-        const int top_rows = top_cell->rows;
-        for (int i = 0; i < top_rows; i++) {
-          const int x = top_cell->row + i;
-          for (int j = 0; j < top_cell->cols; j++) {
-            Cell& c = impl_->grid_[x][top_cell->col + j];
-            c.rows = rows;
-          }
+    bool IsTag(const size_t lt, const char* name) const
+    {
+      const size_t len = std::strlen(name);
+      if (buffer_.compare(lt, len, name) != 0) return false;
+      const char c = buffer_[lt + len];
+      return c == '>' || c == '/' || std::isspace(static_cast<unsigned char>(c));
+    }
+
+    void Tag(const size_t begin, const size_t end)
+    {
+      const char kind = buffer_[begin + 1];
+      if (kind == '?' || kind == '!') return;
+
+      if (!inBody_) {
+        if (IsTag(begin, "<w:body")) {
+          writer_.prefix_ = buffer_.substr(0, end);
+          Consume(end);
+          inBody_ = true;
         }
+        return;
+      }
 
-        // update bottom grid
-        const int bottom_row = bottom_cell->row;
-        const int bottom_rows = bottom_cell->rows;
-        for (int i = 0; i < bottom_rows; i++) {
-          const int x = bottom_row + i;
-          for (int j = 0; j < bottom_cell->cols; j++) {
-            Cell& c = impl_->grid_[x][bottom_cell->col + j];
-            c.row = row;
-            c.rows = rows;
+      if (kind == '/') {
+        if (depth_ == 0) {
+          // </w:body>, the rest of the body is the last section unless
+          // it has nothing but the w:sectPr of the body
+          if (buffer_.find('<') < (bodySectPr_ == std::string::npos ? begin : bodySectPr_)) {
+            buffer_.erase(begin);
+            writer_.Push(sections_++, buffer_);
           }
+          finished_ = true;
+          return;
+        }
+        depth_--;
+        if (depth_ == 2 && sectPrBegin_ != std::string::npos && sectPrEnd_ == std::string::npos) {
+          sectPrEnd_ = end;
+        }
+        else if (depth_ == 1 && inPPr_) {
+          inPPr_ = false;
+        }
+        else if (depth_ == 0 && sectPrEnd_ != std::string::npos) {
+          EndSection(end);
         }
+        return;
+      }
 
-        bottom_tc->impl_->c_ = top_cell;
-        bottom_tc->impl_->w_tc_ = top_tc->impl_->w_tc_;
-        bottom_tc->impl_->w_tcPr_ = top_tc->impl_->w_tcPr_;
-        return true;
+      const bool empty = buffer_[end - 2] == '/';
+      if (depth_ == 0 && IsTag(begin, "<w:sectPr")) {
+        bodySectPr_ = begin;
+      }
+      else if (depth_ == 1 && IsTag(begin, "<w:pPr")) {
+        inPPr_ = !empty;
       }
+      else if (depth_ == 2 && inPPr_ && IsTag(begin, "<w:sectPr")) {
+        sectPrBegin_ = begin;
+        if (empty) sectPrEnd_ = end;
+      }
+      if (!empty) depth_++;
     }
 
-    return false;
-  }
+    // moves the w:sectPr of the paragraph ending at 'end' behind it
+    void EndSection(const size_t end)
+    {
+      std::string body;
+      body.reserve(end);
+      body.append(buffer_, 0, sectPrBegin_);
+      body.append(buffer_, sectPrEnd_, end - sectPrEnd_);
+      body.append(buffer_, sectPrBegin_, sectPrEnd_ - sectPrBegin_);
+      writer_.Push(sections_++, body);
+      Consume(end);
+    }
 
-  void Table::RemoveCell_(TableCell tc)
+    void Consume(const size_t end)
+    {
+      buffer_.erase(0, end);
+      pos_ = 0;
+      sectPrBegin_ = sectPrEnd_ = std::string::npos;
+    }
+
+    SplitWriter& writer_;
+    std::string buffer_; // the current section
+    bool inBody_;
+    bool finished_;
+    size_t pos_;         // where to continue scanning in buffer_
+    int depth_;          // the number of open elements inside w:body
+    bool inPPr_;         // inside the w:pPr of a paragraph of the body
+    size_t sectPrBegin_;
+    size_t sectPrEnd_;
+    size_t bodySectPr_;  // the w:sectPr of the body
+    size_t sections_;
+  };
+
+  size_t SplitBySection(const std::string& input, const std::string& outputPattern)
   {
-    if (!impl_) return;
-    tc.impl_->w_tr_.remove_child(tc.impl_->w_tc_);
+    struct zip_t* zip = zip_open(input.c_str(), 0, 'r');
+    if (zip == NULL) return 0;
+    std::string rels, types;
+    ReadEntry(zip, "word/_rels/document.xml.rels", rels);
+    ReadEntry(zip, "[Content_Types].xml", types);
+    if (zip_entry_open(zip, "word/document.xml") < 0) {
+      zip_close(zip);
+      return 0;
+    }
+
+    size_t threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 2;
+    if (threads > 8) threads = 8;
+
+    SplitWriter writer(input, outputPattern, threads, rels, types);
+    SectionScanner scanner(writer);
+    const int err = zip_entry_extract(zip, SectionScanner::Feed, &scanner);
+    zip_entry_close(zip);
+    zip_close(zip);
+
+    const bool ok = writer.Finish() && err == 0 && scanner.Finished();
+    if (!ok) writer.RemoveWritten();
+    return ok ? scanner.Sections() : 0;
   }
 
-  void Table::SetWidthAuto()
+  // converting
+
+  void AppendUtf8(std::string& out, const unsigned long cp)
   {
-    SetWidth(0, "auto");
+    if (cp < 0x80) {
+      out += static_cast<char>(cp);
+    }
+    else if (cp < 0x800) {
+      out += static_cast<char>(0xC0 | (cp >> 6));
+      out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000) {
+      out += static_cast<char>(0xE0 | (cp >> 12));
+      out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x110000) {
+      out += static_cast<char>(0xF0 | (cp >> 18));
+      out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+      out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
   }
 
-  void Table::SetWidthPercent(const double w)
+  // the code points of the named entities found in XML and the common ones of HTML
+  struct NamedEntity
   {
-    SetWidth(w / 0.02, "pct");
+    const char* name;
+    unsigned long cp;
+  };
+
+  const NamedEntity NAMED_ENTITIES[] = {
+    { "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' }, { "apos", '\'' },
+    { "nbsp", 0xA0 }, { "copy", 0xA9 }, { "reg", 0xAE }, { "deg", 0xB0 }, { "middot", 0xB7 },
+    { "times", 0xD7 }, { "ndash", 0x2013 }, { "mdash", 0x2014 }, { "lsquo", 0x2018 },
+    { "rsquo", 0x2019 }, { "ldquo", 0x201C }, { "rdquo", 0x201D }, { "bull", 0x2022 },
+    { "hellip", 0x2026 }, { "euro", 0x20AC }, { "trade", 0x2122 }
+  };
+
+  // appends text with its entity references replaced, unknown ones are kept as they are
+  void AppendDecoded(std::string& out, const char* p, const size_t size)
+  {
+    const char* end = p + size;
+    while (p < end) {
+      const char* amp = static_cast<const char*>(std::memchr(p, '&', end - p));
+      if (amp == NULL) {
+        out.append(p, end - p);
+        return;
+      }
+      out.append(p, amp - p);
+      p = amp + 1;
+
+      const char* semi = p;
+      while (semi < end && semi - p < 10 && *semi != ';') semi++;
+      if (semi == end || *semi != ';') {
+        out += '&';
+        continue;
+      }
+
+      const size_t len = semi - p;
+      bool found = false;
+      if (len > 1 && p[0] == '#') {
+        const bool hex = p[1] == 'x' || p[1] == 'X';
+        const std::string digits(p + (hex ? 2 : 1), semi);
+        AppendUtf8(out, std::strtoul(digits.c_str(), NULL, hex ? 16 : 10));
+        found = true;
+      }
+      for (size_t i = 0; !found && i < sizeof(NAMED_ENTITIES) / sizeof(NAMED_ENTITIES[0]); i++) {
+        if (std::strlen(NAMED_ENTITIES[i].name) == len && std::memcmp(NAMED_ENTITIES[i].name, p, len) == 0) {
+          AppendUtf8(out, NAMED_ENTITIES[i].cp);
+          found = true;
+        }
+      }
+      if (found) {
+        p = semi + 1;
+      }
+      else {
+        out += '&';
+      }
+    }
   }
 
-  void Table::SetWidth(const int w, const char* units)
+  // A pull parser for word/document.xml as it is inflated. Feed() adds a chunk
+  // and Next() steps through the tokens it completes, returning false when the
+  // rest of the buffer is an unfinished token, so only that is held in memory.
+  class XmlPullParser
   {
-    if (!impl_) return;
-    pugi::xml_node w_tblW = impl_->w_tblPr_.child("w:tblW");
-    if (!w_tblW) {
-      w_tblW = impl_->w_tblPr_.append_child("w:tblW");
+  public:
+    enum Kind { Start, End, Empty, Text };
+
+    XmlPullParser() : pos_(0), begin_(0), end_(0), kind_(Text) {}
+
+    void Feed(const char* data, const size_t size)
+    {
+      buffer_.erase(0, pos_);
+      pos_ = 0;
+      buffer_.append(data, size);
     }
 
-    pugi::xml_attribute w_w = w_tblW.attribute("w:w");
-    if (!w_w) {
-      w_w = w_tblW.append_attribute("w:w");
+    bool Next()
+    {
+      while (pos_ < buffer_.size()) {
+        begin_ = pos_;
+        if (buffer_[pos_] != '<') {
+          // text ends where the next tag begins
+          const size_t lt = buffer_.find('<', pos_);
+          if (lt == std::string::npos) return false;
+          end_ = pos_ = lt;
+          kind_ = Text;
+          return true;
+        }
+        const size_t gt = TagEnd(pos_);
+        if (gt == std::string::npos) return false;
+        end_ = pos_ = gt + 1;
+
+        const char c = buffer_[begin_ + 1];
+        if (c == '?' || c == '!') continue;
+        kind_ = c == '/' ? End : buffer_[gt - 1] == '/' ? Empty : Start;
+        return true;
+      }
+      return false;
     }
 
-    pugi::xml_attribute w_type = w_tblW.attribute("w:type");
-    if (!w_type) {
-      w_type = w_tblW.append_attribute("w:type");
+    Kind kind() const { return kind_; }
+
+    // whether the current tag is a 'name' element
+    bool Is(const char* name) const
+    {
+      const size_t at = begin_ + (kind_ == End ? 2 : 1);
+      const size_t len = std::strlen(name);
+      if (kind_ == Text || buffer_.compare(at, len, name) != 0) return false;
+      const char c = buffer_[at + len];
+      return c == '>' || c == '/' || std::isspace(static_cast<unsigned char>(c));
     }
 
-    w_w.set_value(w);
-    w_type.set_value(units);
-  }
+    // the value of an attribute of the current tag, empty if it has none
+    std::string Attribute(const char* name) const
+    {
+      std::string value;
+      const size_t len = std::strlen(name);
+      const char* tag = buffer_.data() + begin_;
+      const char* end = buffer_.data() + end_;
+      const char* p = std::search(tag, end, name, name + len);
+      while (p != end) {
+        const char* eq = p + len;
+        if (std::isspace(static_cast<unsigned char>(p[-1])) && *eq == '=') {
+          const char quote = eq[1];
+          const char* close = std::find(eq + 2, end, quote);
+          if (close != end) AppendDecoded(value, eq + 2, close - eq - 2);
+          return value;
+        }
+        p = std::search(p + 1, end, name, name + len);
+      }
+      return value;
+    }
 
-  void Table::SetCellMarginTop(const int w, const char* units)
-  {
-    SetCellMargin("w:top", w, units);
-  }
+    // the text of the current token with entities decoded
+    void AppendText(std::string& out) const
+    {
+      AppendDecoded(out, buffer_.data() + begin_, end_ - begin_);
+    }
 
-  void Table::SetCellMarginBottom(const int w, const char* units)
-  {
-    SetCellMargin("w:bottom", w, units);
-  }
+  private:
+    std::string buffer_;
+    size_t pos_;   // where the next token begins
+    size_t begin_; // the current token
+    size_t end_;
+    Kind kind_;
 
-  void Table::SetCellMarginLeft(const int w, const char* units)
-  {
-    SetCellMargin("w:start", w, units);
-  }
+    size_t TagEnd(const size_t lt) const
+    {
+      char quote = 0;
+      for (size_t i = lt + 1; i < buffer_.size(); i++) {
+        const char c = buffer_[i];
+        if (quote) {
+          if (c == quote) quote = 0;
+        }
+        else if (c == '"' || c == '\'') {
+          quote = c;
+        }
+        else if (c == '>') {
+          return i;
+        }
+      }
+      return std::string::npos;
+    }
+  };
 
-  void Table::SetCellMarginRight(const int w, const char* units)
+  // Turns the tokens of word/document.xml into text, Markdown or HTML as they
+  // come. Only the current run is buffered, to put emphasis markers around
+  // its text rather than its spaces.
+  class DocumentConverter
   {
-    SetCellMargin("w:end", w, units);
-  }
+  public:
+    enum Format { PlainText, Markdown, Html };
 
-  void Table::SetCellMargin(const char* elemName, const int w, const char* units)
-  {
-    if (!impl_) return;
-    pugi::xml_node w_tblCellMar = impl_->w_tblPr_.child("w:tblCellMar");
-    if (!w_tblCellMar) {
-      w_tblCellMar = impl_->w_tblPr_.append_child("w:tblCellMar");
+    DocumentConverter(std::ostream& out, const Format format)
+      : out_(out), format_(format), inBody_(false), done_(false), skip_(0),
+      inPPr_(false), inRun_(false), inRPr_(false), inText_(false), opened_(false),
+      heading_(0), list_(false), listOpen_(false), afterList_(false),
+      bold_(false), italic_(false), underline_(false), strike_(false),
+      tables_(0), rows_(0), cells_(0), cellParagraphs_(0)
+    {
     }
 
-    pugi::xml_node w_tblCellMarChild = w_tblCellMar.child(elemName);
-    if (!w_tblCellMarChild) {
-      w_tblCellMarChild = w_tblCellMar.append_child(elemName);
+    static size_t Feed(void* arg, uint64_t /*offset*/, const void* data, size_t size)
+    {
+      DocumentConverter* c = static_cast<DocumentConverter*>(arg);
+      c->parser_.Feed(static_cast<const char*>(data), size);
+      while (c->parser_.Next()) c->Token();
+      return size;
     }
 
-    pugi::xml_attribute w_w = w_tblCellMarChild.attribute("w:w");
-    if (!w_w) {
-      w_w = w_tblCellMarChild.append_attribute("w:w");
+    bool Finish()
+    {
+      CloseList();
+      out_.flush();
+      return done_ && !out_.fail();
+    }
+
+  private:
+    std::ostream& out_;
+    Format format_;
+    XmlPullParser parser_;
+    bool inBody_;
+    bool done_;
+    int skip_;           // depth inside drawings, field codes, deleted text...
+    bool inPPr_;
+    bool inRun_;
+    bool inRPr_;
+    bool inText_;
+    bool opened_;        // the start of the current paragraph was written
+    int heading_;        // of the current paragraph, 0 if not a heading
+    bool list_;          // the current paragraph is a list item
+    bool listOpen_;      // <ul> written
+    bool afterList_;     // the previous paragraph was a list item
+    bool bold_, italic_, underline_, strike_;
+    std::string run_;    // text of the current run not written yet
+    std::string escaped_;
+    int tables_;         // nesting depth
+    int rows_;           // rows of the outermost table so far
+    int cells_;          // cells of its current row so far
+    int cellParagraphs_; // paragraphs of the current cell so far
+
+    void Write(const char* s)
+    {
+      out_ << s;
     }
 
-    pugi::xml_attribute w_type = w_tblCellMarChild.attribute("w:type");
-    if (!w_type) {
-      w_type = w_tblCellMarChild.append_attribute("w:type");
+    void Write(const std::string& s)
+    {
+      out_.write(s.data(), s.size());
     }
 
-    w_w.set_value(w);
-    w_type.set_value(units);
-  }
+    // writes text escaped for the output format
+    void WriteEscaped(const char* p, const size_t size)
+    {
+      if (format_ == PlainText) {
+        out_.write(p, size);
+        return;
+      }
+      escaped_.clear();
+      for (size_t i = 0; i < size; i++) {
+        const char c = p[i];
+        if (format_ == Html) {
+          if (c == '&') escaped_ += "&amp;";
+          else if (c == '<') escaped_ += "&lt;";
+          else if (c == '>') escaped_ += "&gt;";
+          else if (c == '"') escaped_ += "&quot;";
+          else escaped_ += c;
+        }
+        else {
+          if (std::strchr("\\`*_[]<>#|~", c) != NULL && c != '\0') escaped_ += '\\';
+          escaped_ += c;
+        }
+      }
+      Write(escaped_);
+    }
 
-  void Table::SetAlignment(const Alignment alignment)
-  {
-    if (!impl_) return;
-    const char* val;
-    switch (alignment) {
-    case Alignment::Left:
-      val = "start";
-      break;
-    case Alignment::Right:
-      val = "end";
-      break;
-    case Alignment::Centered:
-      val = "center";
-      break;
+    bool IsOff(const std::string& val) const
+    {
+      return val == "0" || val == "false" || val == "none";
+    }
+
+    void CloseList()
+    {
+      if (listOpen_) {
+        Write("</ul>\n");
+        listOpen_ = false;
+      }
+    }
+
+    // writes what starts the current paragraph, once its properties are known
+    void OpenParagraph()
+    {
+      if (opened_) return;
+      opened_ = true;
+
+      if (tables_ > 0) {
+        if (cellParagraphs_++ > 0) {
+          Write(format_ == Html ? "<br/>" : format_ == Markdown ? "<br>" : " ");
+        }
+        return;
+      }
+
+      if (format_ == Html) {
+        if (list_ && !listOpen_) {
+          Write("<ul>\n");
+          listOpen_ = true;
+        }
+        else if (!list_) {
+          CloseList();
+        }
+        if (list_) Write("<li>");
+        else if (heading_ > 0) out_ << "<h" << heading_ << ">";
+        else Write("<p>");
+      }
+      else if (format_ == Markdown) {
+        // a list needs a blank line after it
+        if (afterList_ && !list_) Write("\n");
+        if (list_) Write("- ");
+        else if (heading_ > 0) Write(std::string(heading_, '#') + " ");
+      }
+    }
+
+    void CloseParagraph()
+    {
+      OpenParagraph();
+      if (tables_ == 0) {
+        if (format_ == Html) {
+          if (list_) Write("</li>\n");
+          else if (heading_ > 0) out_ << "</h" << heading_ << ">\n";
+          else Write("</p>\n");
+        }
+        else if (format_ == Markdown) {
+          Write(list_ ? "\n" : "\n\n");
+        }
+        else {
+          Write("\n");
+        }
+        afterList_ = list_;
+      }
+      opened_ = false;
+    }
+
+    // writes the buffered text of the run inside its emphasis markers
+    void FlushRun()
+    {
+      if (run_.empty()) return;
+      OpenParagraph();
+      if (format_ == PlainText) {
+        Write(run_);
+        run_.clear();
+        return;
+      }
+
+      // Markdown emphasis must not start or end with a space
+      size_t begin = 0;
+      size_t end = run_.size();
+      while (begin < end && IsXmlSpace(run_[begin])) begin++;
+      while (end > begin && IsXmlSpace(run_[end - 1])) end--;
+      WriteEscaped(run_.data(), begin);
+      if (begin < end) {
+        if (format_ == Html) {
+          if (bold_) Write("<strong>");
+          if (italic_) Write("<em>");
+          if (underline_) Write("<u>");
+          if (strike_) Write("<s>");
+          WriteEscaped(run_.data() + begin, end - begin);
+          if (strike_) Write("</s>");
+          if (underline_) Write("</u>");
+          if (italic_) Write("</em>");
+          if (bold_) Write("</strong>");
+        }
+        else {
+          if (bold_) Write("**");
+          if (italic_) Write("*");
+          if (strike_) Write("~~");
+          WriteEscaped(run_.data() + begin, end - begin);
+          if (strike_) Write("~~");
+          if (italic_) Write("*");
+          if (bold_) Write("**");
+        }
+      }
+      WriteEscaped(run_.data() + end, run_.size() - end);
+      run_.clear();
+    }
+
+    void Break()
+    {
+      FlushRun();
+      OpenParagraph();
+      if (format_ == Html) Write("<br/>");
+      else if (format_ == Markdown) Write(tables_ > 0 ? "<br>" : "  \n");
+      else Write(tables_ > 0 ? " " : "\n");
+    }
+
+    void Token()
+    {
+      const XmlPullParser::Kind kind = parser_.kind();
+      if (kind == XmlPullParser::Text) {
+        if (inText_ && skip_ == 0) parser_.AppendText(run_);
+        return;
+      }
+      if (!inBody_) {
+        if (kind == XmlPullParser::Start && parser_.Is("w:body")) inBody_ = true;
+        return;
+      }
+      if (skip_ > 0) {
+        if (kind == XmlPullParser::Start) skip_++;
+        else if (kind == XmlPullParser::End) skip_--;
+        return;
+      }
+
+      if (kind == XmlPullParser::End) {
+        End();
+      }
+      else {
+        Begin(kind == XmlPullParser::Empty);
+      }
+    }
+
+    void Begin(const bool empty)
+    {
+      if (parser_.Is("w:drawing") || parser_.Is("w:pict") || parser_.Is("w:object")
+        || parser_.Is("mc:AlternateContent") || parser_.Is("w:instrText") || parser_.Is("w:delText")
+        || parser_.Is("w:sectPr") || parser_.Is("w:tblPr") || parser_.Is("w:tblGrid") || parser_.Is("w:trPr") || parser_.Is("w:tcPr")) {
+        if (!empty) skip_ = 1;
+        return;
+      }
+
+      if (inPPr_) {
+        if (parser_.Is("w:pStyle")) {
+          const std::string style = parser_.Attribute("w:val");
+          if (style.compare(0, 7, "Heading") == 0 || style.compare(0, 7, "heading") == 0) {
+            heading_ = std::atoi(style.c_str() + (style.size() > 7 && style[7] == ' ' ? 8 : 7));
+          }
+          else if (style == "Title") {
+            heading_ = 1;
+          }
+        }
+        else if (parser_.Is("w:outlineLvl")) {
+          heading_ = std::atoi(parser_.Attribute("w:val").c_str()) + 1;
+        }
+        else if (parser_.Is("w:numPr")) {
+          list_ = true;
+        }
+        if (heading_ > 6) heading_ = 6;
+        if (heading_ < 0) heading_ = 0;
+        if (parser_.Is("w:rPr") && !empty) skip_ = 1; // the paragraph mark
+        return;
+      }
+      if (inRPr_) {
+        const bool off = IsOff(parser_.Attribute("w:val"));
+        if (parser_.Is("w:b")) bold_ = !off;
+        else if (parser_.Is("w:i")) italic_ = !off;
+        else if (parser_.Is("w:u")) underline_ = !off;
+        else if (parser_.Is("w:strike")) strike_ = !off;
+        return;
+      }
+
+      if (parser_.Is("w:p")) {
+        opened_ = false;
+        heading_ = 0;
+        list_ = false;
+        if (empty) CloseParagraph();
+      }
+      else if (parser_.Is("w:pPr")) {
+        inPPr_ = !empty;
+      }
+      else if (parser_.Is("w:r")) {
+        inRun_ = !empty;
+        bold_ = italic_ = underline_ = strike_ = false;
+      }
+      else if (inRun_ && parser_.Is("w:rPr")) {
+        inRPr_ = !empty;
+      }
+      else if (inRun_ && parser_.Is("w:t")) {
+        inText_ = !empty;
+      }
+      else if (inRun_ && parser_.Is("w:tab")) {
+        FlushRun();
+        OpenParagraph();
+        Write(format_ == Html ? "&emsp;" : "\t");
+      }
+      else if (inRun_ && (parser_.Is("w:br") || parser_.Is("w:cr"))) {
+        Break();
+      }
+      else if (parser_.Is("w:tbl")) {
+        if (tables_++ == 0) {
+          if (format_ == Html) CloseList();
+          if (format_ == Markdown && afterList_) Write("\n");
+          afterList_ = false;
+          rows_ = 0;
+        }
+        if (format_ == Html) Write("<table>\n");
+      }
+      else if (parser_.Is("w:tr")) {
+        if (format_ == Html) Write("<tr>");
+        else if (tables_ == 1) {
+          cells_ = 0;
+          if (format_ == Markdown) Write("|");
+        }
+      }
+      else if (parser_.Is("w:tc")) {
+        if (format_ == Html) {
+          Write("<td>");
+          cellParagraphs_ = 0;
+        }
+        else if (tables_ == 1) {
+          if (format_ == Markdown) Write(" ");
+          else if (cells_ > 0) Write("\t");
+          cellParagraphs_ = 0;
+        }
+        else if (cellParagraphs_++ > 0) {
+          Write(" ");
+        }
+      }
     }
 
-    pugi::xml_node w_jc = impl_->w_tblPr_.child("w:jc");
-    if (!w_jc) {
-      w_jc = impl_->w_tblPr_.append_child("w:jc");
-    }
-    pugi::xml_attribute w_val = w_jc.attribute("w:val");
-    if (!w_val) {
-      w_val = w_jc.append_attribute("w:val");
+    void End()
+    {
+      if (parser_.Is("w:body")) {
+        done_ = true;
+        inBody_ = false;
+      }
+      else if (parser_.Is("w:pPr")) {
+        inPPr_ = false;
+      }
+      else if (parser_.Is("w:rPr")) {
+        inRPr_ = false;
+      }
+      else if (parser_.Is("w:t")) {
+        inText_ = false;
+      }
+      else if (parser_.Is("w:r")) {
+        FlushRun();
+        inRun_ = false;
+      }
+      else if (parser_.Is("w:p")) {
+        FlushRun();
+        CloseParagraph();
+      }
+      else if (parser_.Is("w:tc")) {
+        if (format_ == Html) Write("</td>");
+        else if (tables_ == 1) {
+          if (format_ == Markdown) Write(" |");
+          cells_++;
+        }
+      }
+      else if (parser_.Is("w:tr")) {
+        if (format_ == Html) Write("</tr>\n");
+        else if (tables_ == 1) {
+          Write("\n");
+          if (format_ == Markdown && rows_ == 0) {
+            Write("|");
+            for (int i = 0; i < cells_; i++) Write(" --- |");
+            Write("\n");
+          }
+          rows_++;
+        }
+      }
+      else if (parser_.Is("w:tbl")) {
+        if (format_ == Html) Write("</table>\n");
+        if (--tables_ == 0 && format_ == Markdown) Write("\n");
+      }
     }
-    w_val.set_value(val);
-  }
+  };
 
-  void Table::SetTopBorders(const BorderStyle style, const double width, const char* color)
+  bool ConvertDocument(const std::string& input, std::ostream& out, const DocumentConverter::Format format)
   {
-    SetBorders_("w:top", style, width, color);
+    struct zip_t* zip = zip_open(input.c_str(), 0, 'r');
+    if (zip == NULL) return false;
+    if (zip_entry_open(zip, "word/document.xml") < 0) {
+      zip_close(zip);
+      return false;
+    }
+    DocumentConverter converter(out, format);
+    const int err = zip_entry_extract(zip, DocumentConverter::Feed, &converter);
+    zip_entry_close(zip);
+    zip_close(zip);
+    return converter.Finish() && err == 0;
   }
 
-  void Table::SetBottomBorders(const BorderStyle style, const double width, const char* color)
+  bool ToText(const std::string& input, std::ostream& out)
   {
-    SetBorders_("w:bottom", style, width, color);
+    return ConvertDocument(input, out, DocumentConverter::PlainText);
   }
 
-  void Table::SetLeftBorders(const BorderStyle style, const double width, const char* color)
+  bool ToMarkdown(const std::string& input, std::ostream& out)
   {
-    SetBorders_("w:start", style, width, color);
+    return ConvertDocument(input, out, DocumentConverter::Markdown);
   }
 
-  void Table::SetRightBorders(const BorderStyle style, const double width, const char* color)
+  bool ToHtml(const std::string& input, std::ostream& out)
   {
-    SetBorders_("w:end", style, width, color);
+    return ConvertDocument(input, out, DocumentConverter::Html);
   }
 
-  void Table::SetInsideHBorders(const BorderStyle style, const double width, const char* color)
-  {
-    SetBorders_("w:insideH", style, width, color);
-  }
 
-  void Table::SetInsideVBorders(const BorderStyle style, const double width, const char* color)
-  {
-    SetBorders_("w:insideV", style, width, color);
-  }
+  // importing
 
-  void Table::SetInsideBorders(const BorderStyle style, const double width, const char* color)
+  // Builds paragraphs, runs and tables straight into a body for ImportHtml()
+  // and ImportMarkdown(). Paragraphs are started by their first text, so the
+  // properties set before apply to them; text of the same style is gathered
+  // and written as one run.
+  class BodyBuilder
   {
-    SetInsideHBorders(style, width, color);
-    SetInsideVBorders(style, width, color);
-  }
+  public:
+    enum Style { Plain = 0, Bold = 1, Italic = 2, Underline = 4, Strike = 8, Code = 16 };
 
-  void Table::SetOutsideBorders(const BorderStyle style, const double width, const char* color)
-  {
-    SetTopBorders(style, width, color);
-    SetBottomBorders(style, width, color);
-    SetLeftBorders(style, width, color);
-    SetRightBorders(style, width, color);
-  }
+    // the w:hyperlink elements made for external URLs, given their r:id afterwards
+    std::vector<std::pair<pugi::xml_node, std::string> > links_;
 
-  void Table::SetAllBorders(const BorderStyle style, const double width, const char* color)
-  {
-    SetOutsideBorders(style, width, color);
-    SetInsideBorders(style, width, color);
-  }
+    BodyBuilder(pugi::xml_node w_body, pugi::xml_node before, pugi::xml_node w_tblPr)
+      : container_(w_body), before_(before), w_tblPr_(w_tblPr),
+      heading_(0), list_(0), level_(0), quote_(0), header_(false), style_(Plain), runStyle_(Plain)
+    {
+    }
 
-  void Table::SetBorders_(const char* elemName, const BorderStyle style, const double width, const char* color)
-  {
-    if (!impl_) return;
-    pugi::xml_node w_tblBorders = impl_->w_tblPr_.child("w:tblBorders");
-    if (!w_tblBorders) {
-      w_tblBorders = impl_->w_tblPr_.append_child("w:tblBorders");
+    // properties of the next paragraph
+    void SetHeading(const int level) { heading_ = level < 1 ? 0 : level > 6 ? 6 : level; }
+    void SetListItem(const int listId, const int level) { list_ = listId; level_ = level < 0 ? 0 : level > 8 ? 8 : level; }
+    void SetQuote(const int depth) { quote_ = depth; } // kept until changed
+
+    void SetStyle(const unsigned int style) { style_ = style; }
+    bool InParagraph() const { return !w_p_.empty(); }
+
+    void Text(const char* text, const size_t size)
+    {
+      if (size == 0) return;
+      Open();
+      if (style_ != runStyle_) {
+        Flush();
+        w_r_ = pugi::xml_node();
+        runStyle_ = style_;
+      }
+      text_.append(text, size);
     }
-    SetBorders(w_tblBorders, elemName, style, width, color);
-  }
 
-  // class TableCell
-  TableCell::TableCell() : impl_(NULL)
-  {
+    void Text(const std::string& text)
+    {
+      Text(text.data(), text.size());
+    }
 
-  }
+    void Break()
+    {
+      Open();
+      Flush();
+      if (style_ != runStyle_) {
+        w_r_ = pugi::xml_node();
+        runStyle_ = style_;
+      }
+      Run().append_child("w:br");
+    }
 
-  TableCell::TableCell(Impl* impl) : impl_(impl)
-  {
+    // runs go in a hyperlink until EndLink()
+    void StartLink(const std::string& url)
+    {
+      Open();
+      Flush();
+      w_r_ = pugi::xml_node();
+      w_link_ = w_p_.append_child("w:hyperlink");
+      if (!url.empty() && url[0] == '#') {
+        w_link_.append_attribute("w:anchor") = url.c_str() + 1;
+      }
+      else {
+        links_.push_back(std::make_pair(w_link_, url));
+      }
+      w_link_.append_attribute("w:history") = 1;
+    }
 
-  }
+    void EndLink()
+    {
+      if (!w_link_) return;
+      Flush();
+      w_r_ = pugi::xml_node();
+      w_link_ = pugi::xml_node();
+    }
 
-  TableCell::TableCell(const TableCell& tc)
-  {
-    impl_ = new Impl;
-    impl_->c_ = tc.impl_->c_;
-    impl_->w_tr_ = tc.impl_->w_tr_;
-    impl_->w_tc_ = tc.impl_->w_tc_;
-    impl_->w_tcPr_ = tc.impl_->w_tcPr_;
-  }
+    void EndParagraph()
+    {
+      if (w_p_) Flush();
+      w_p_ = pugi::xml_node();
+      w_r_ = pugi::xml_node();
+      w_link_ = pugi::xml_node();
+      heading_ = 0;
+      list_ = 0;
+    }
 
-  TableCell::~TableCell()
-  {
-    if (impl_ != NULL) {
-      delete impl_;
-      impl_ = NULL;
+    bool InTable() const { return !tables_.empty(); }
+
+    void StartTable()
+    {
+      EndParagraph();
+      TableState t;
+      t.container = container_;
+      t.before = before_;
+      t.w_tbl = Insert("w:tbl");
+      t.w_tbl.append_copy(w_tblPr_);
+      t.w_tbl.append_child("w:tblGrid");
+      t.cols = 0;
+      t.cells = 0;
+      tables_.push_back(t);
+    }
+
+    void StartRow()
+    {
+      if (tables_.empty()) StartTable();
+      TableState& t = tables_.back();
+      if (t.w_tr) EndRow();
+      t.w_tr = t.w_tbl.append_child("w:tr");
+      t.cells = 0;
     }
-  }
 
-  void TableCell::operator=(const TableCell& right)
-  {
-    if (this == &right) return;
-    if (impl_ != NULL) delete impl_;
-    if (right.impl_ != NULL) {
-      impl_ = new Impl;
-      impl_->c_ = right.impl_->c_;
-      impl_->w_tr_ = right.impl_->w_tr_;
-      impl_->w_tc_ = right.impl_->w_tc_;
-      impl_->w_tcPr_ = right.impl_->w_tcPr_;
+    void StartCell(const bool header)
+    {
+      if (tables_.empty() || !tables_.back().w_tr) StartRow();
+      TableState& t = tables_.back();
+      if (t.w_tc) EndCell();
+      t.w_tc = t.w_tr.append_child("w:tc");
+      t.w_tc.append_child("w:tcPr");
+      container_ = t.w_tc;
+      before_ = pugi::xml_node();
+      header_ = header;
     }
-    else {
-      impl_ = NULL;
+
+    void EndCell()
+    {
+      if (tables_.empty() || !tables_.back().w_tc) return;
+      EndParagraph();
+      TableState& t = tables_.back();
+      // a cell must end with a paragraph
+      if (std::strcmp(t.w_tc.last_child().name(), "w:p") != 0) t.w_tc.append_child("w:p").append_child("w:pPr");
+      t.w_tc = pugi::xml_node();
+      t.cells++;
+      container_ = pugi::xml_node();
+      header_ = false;
+    }
+
+    void EndRow()
+    {
+      if (tables_.empty() || !tables_.back().w_tr) return;
+      EndCell();
+      TableState& t = tables_.back();
+      if (t.cells > t.cols) t.cols = t.cells;
+      t.w_tr = pugi::xml_node();
     }
-  }
 
-  TableCell::operator bool()
-  {
-    return impl_ != NULL && impl_->w_tc_;
-  }
+    void EndTable()
+    {
+      if (tables_.empty()) return;
+      EndRow();
+      TableState& t = tables_.back();
+      container_ = t.container;
+      before_ = t.before;
+      if (t.cols == 0) {
+        container_.remove_child(t.w_tbl);
+      }
+      else {
+        pugi::xml_node w_tblGrid = t.w_tbl.child("w:tblGrid");
+        for (int j = 0; j < t.cols; j++) w_tblGrid.append_child("w:gridCol");
+        // rows with fewer cells are filled up
+        for (pugi::xml_node w_tr = t.w_tbl.child("w:tr"); w_tr; w_tr = w_tr.next_sibling("w:tr")) {
+          int cells = 0;
+          for (pugi::xml_node w_tc = w_tr.child("w:tc"); w_tc; w_tc = w_tc.next_sibling("w:tc")) cells++;
+          for (; cells < t.cols; cells++) {
+            pugi::xml_node w_tc = w_tr.append_child("w:tc");
+            w_tc.append_child("w:tcPr");
+            w_tc.append_child("w:p").append_child("w:pPr");
+          }
+        }
+      }
+      tables_.pop_back();
+    }
 
-  bool TableCell::empty() const
+    void Finish()
+    {
+      EndParagraph();
+      while (!tables_.empty()) EndTable();
+    }
+
+  private:
+    struct TableState
+    {
+      pugi::xml_node container; // where the table was inserted
+      pugi::xml_node before;
+      pugi::xml_node w_tbl;
+      pugi::xml_node w_tr;
+      pugi::xml_node w_tc;
+      int cols;
+      int cells;
+    };
+
+    pugi::xml_node container_; // the body or a table cell
+    pugi::xml_node before_;    // the body's w:sectPr
+    pugi::xml_node w_tblPr_;
+    std::vector<TableState> tables_;
+
+    pugi::xml_node w_p_;
+    pugi::xml_node w_r_;
+    pugi::xml_node w_link_;
+    int heading_;
+    int list_;  // Document::AddList() id, 0 if not a list item
+    int level_;
+    int quote_;
+    bool header_;
+    unsigned int style_;
+    unsigned int runStyle_;
+    std::string text_; // of the current run, not written yet
+
+    pugi::xml_node Insert(const char* name)
+    {
+      if (!container_) StartCell(false);
+      return before_ ? container_.insert_child_before(name, before_) : container_.append_child(name);
+    }
+
+    void Open()
+    {
+      if (w_p_) return;
+      w_p_ = Insert("w:p");
+      pugi::xml_node w_pPr = w_p_.append_child("w:pPr");
+      if (heading_ > 0) w_pPr.append_child("w:keepNext");
+      if (list_ != 0) {
+        pugi::xml_node w_numPr = w_pPr.append_child("w:numPr");
+        w_numPr.append_child("w:ilvl").append_attribute("w:val") = level_;
+        w_numPr.append_child("w:numId").append_attribute("w:val") = list_;
+      }
+      if (quote_ > 0) {
+        // the indent of a list level grows by the quote
+        pugi::xml_node w_ind = w_pPr.append_child("w:ind");
+        w_ind.append_attribute("w:left") = 720 * quote_ + (list_ != 0 ? 720 * (level_ + 1) : 0);
+        if (list_ != 0) w_ind.append_attribute("w:hanging") = 360;
+      }
+      if (heading_ > 0) w_pPr.append_child("w:outlineLvl").append_attribute("w:val") = heading_ - 1;
+      w_r_ = pugi::xml_node();
+      runStyle_ = style_;
+    }
+
+    pugi::xml_node Run()
+    {
+      if (w_r_) return w_r_;
+      w_r_ = (w_link_ ? w_link_ : w_p_).append_child("w:r");
+      pugi::xml_node w_rPr = w_r_.append_child("w:rPr");
+      const unsigned int style = runStyle_ | (heading_ > 0 || header_ ? Bold : Plain);
+      if (style & Code) {
+        pugi::xml_node w_rFonts = w_rPr.append_child("w:rFonts");
+        w_rFonts.append_attribute("w:ascii") = "Courier New";
+        w_rFonts.append_attribute("w:hAnsi") = "Courier New";
+      }
+      if (style & Bold) w_rPr.append_child("w:b");
+      if (style & Italic) w_rPr.append_child("w:i");
+      if (style & Strike) w_rPr.append_child("w:strike").append_attribute("w:val") = "true";
+      if (w_link_) w_rPr.append_child("w:color").append_attribute("w:val") = "0563C1";
+      if (heading_ > 0) {
+        // font size in half-points
+        static const int sizes[] = { 32, 28, 26, 24, 22, 22 };
+        w_rPr.append_child("w:sz").append_attribute("w:val") = sizes[heading_ - 1];
+      }
+      if ((style & Underline) || w_link_) w_rPr.append_child("w:u").append_attribute("w:val") = "single";
+      return w_r_;
+    }
+
+    void Flush()
+    {
+      if (text_.empty()) return;
+      std::string clean;
+      if (SanitizeText(text_.data(), text_.size(), clean)) AppendTextElement(Run(), text_.data(), text_.size());
+      else AppendTextElement(Run(), clean.data(), clean.size());
+      text_.clear();
+    }
+  };
+
+  bool IsAsciiSpace(const char c)
   {
-    return impl_ == NULL || !impl_->w_tc_;
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
   }
 
-  void TableCell::SetWidth(const int w, const char* units)
+  // A forgiving single pass HTML reader. Whitespace is collapsed outside <pre>,
+  // unknown tags are ignored with their content kept, and the content of <head>,
+  // <script> and <style> is left out.
+  class HtmlImporter
   {
-    if (!impl_) return;
-    pugi::xml_node w_tcW = impl_->w_tcPr_.child("w:tcW");
-    if (!w_tcW) {
-      w_tcW = impl_->w_tcPr_.append_child("w:tcW");
+  public:
+    HtmlImporter(Document& doc, BodyBuilder& builder)
+      : doc_(doc), builder_(builder), bold_(0), italic_(0), underline_(0), strike_(0), code_(0),
+      pre_(0), quote_(0), space_(false), breaks_(0), orphans_(0)
+    {
     }
 
-    pugi::xml_attribute w_w = w_tcW.attribute("w:w");
-    if (!w_w) {
-      w_w = w_tcW.append_attribute("w:w");
+    void Parse(const char* data, const size_t size)
+    {
+      const char* p = data;
+      const char* end = data + size;
+      while (p < end) {
+        if (*p != '<') {
+          const char* lt = static_cast<const char*>(std::memchr(p, '<', end - p));
+          if (lt == NULL) lt = end;
+          Text(p, lt - p);
+          p = lt;
+          continue;
+        }
+
+        if (end - p >= 4 && std::memcmp(p, "<!--", 4) == 0) {
+          const char* close = std::search(p + 4, end, "-->", "-->" + 3);
+          p = close == end ? end : close + 3;
+          continue;
+        }
+
+        // find the end of the tag outside of quoted attribute values
+        const char* q = p + 1;
+        char quote = 0;
+        for (; q < end; q++) {
+          if (quote) {
+            if (*q == quote) quote = 0;
+          }
+          else if (*q == '"' || *q == '\'') {
+            quote = *q;
+          }
+          else if (*q == '>') {
+            break;
+          }
+        }
+        if (q == end) break;
+
+        const bool closing = p[1] == '/';
+        const char* n = p + (closing ? 2 : 1);
+        std::string name;
+        while (n < q && (std::isalnum(static_cast<unsigned char>(*n)))) {
+          name += static_cast<char>(std::tolower(static_cast<unsigned char>(*n)));
+          n++;
+        }
+        p = q + 1;
+        if (name.empty()) continue; // <!DOCTYPE>, <?xml?> or a stray <
+
+        if (!closing && (name == "head" || name == "script" || name == "style" || name == "title" || name == "template")) {
+          p = SkipElement(p, end, name);
+          continue;
+        }
+        if (closing) End(name);
+        else if (name == "a") Link(n, q);
+        else Start(name, q[-1] == '/');
+      }
+      builder_.Finish();
+    }
+
+  private:
+    Document& doc_;
+    BodyBuilder& builder_;
+    int bold_, italic_, underline_, strike_, code_;
+    int pre_;
+    int quote_;
+    bool space_;             // a collapsed space is pending
+    int breaks_;             // line ends in <pre> not written yet
+    std::vector<std::pair<bool, int> > lists_; // each open list, whether ordered and its id once it has an item
+    int orphans_;            // the list of <li> outside <ul> and <ol>
+    std::string text_;
+
+    // the position after the closing tag of a skipped element
+    static const char* SkipElement(const char* p, const char* end, const std::string& name)
+    {
+      while (p < end) {
+        const char* lt = static_cast<const char*>(std::memchr(p, '<', end - p));
+        if (lt == NULL) return end;
+        p = lt + 1;
+        if (p < end && *p == '/' && static_cast<size_t>(end - p - 1) >= name.size()) {
+          size_t i = 0;
+          while (i < name.size() && std::tolower(static_cast<unsigned char>(p[1 + i])) == name[i]) i++;
+          if (i == name.size()) {
+            const char* gt = static_cast<const char*>(std::memchr(p, '>', end - p));
+            return gt == NULL ? end : gt + 1;
+          }
+        }
+      }
+      return end;
     }
 
-    pugi::xml_attribute w_type = w_tcW.attribute("w:type");
-    if (!w_type) {
-      w_type = w_tcW.append_attribute("w:type");
+    // <a href="..."> starts a hyperlink, other anchors are ignored
+    void Link(const char* p, const char* end)
+    {
+      builder_.EndLink();
+      while (p < end) {
+        while (p < end && IsAsciiSpace(*p)) p++;
+        const char* name = p;
+        while (p < end && *p != '=' && *p != '>' && *p != '/' && !IsAsciiSpace(*p)) p++;
+        const bool href = p - name == 4 && std::tolower(static_cast<unsigned char>(name[0])) == 'h'
+          && std::tolower(static_cast<unsigned char>(name[1])) == 'r' && std::tolower(static_cast<unsigned char>(name[2])) == 'e'
+          && std::tolower(static_cast<unsigned char>(name[3])) == 'f';
+        if (p == name) {
+          p++;
+          continue;
+        }
+        if (p >= end || *p != '=') continue;
+        p++;
+        const char quote = p < end && (*p == '"' || *p == '\'') ? *p++ : 0;
+        const char* value = p;
+        while (p < end && (quote ? *p != quote : !IsAsciiSpace(*p))) p++;
+        if (href) {
+          std::string url;
+          AppendDecoded(url, value, p - value);
+          if (!url.empty()) {
+            if (space_) builder_.Text(" ", 1);
+            space_ = false;
+            builder_.StartLink(url);
+          }
+          return;
+        }
+        if (p < end) p++;
+      }
     }
 
-    w_w.set_value(w);
-    w_type.set_value(units);
-  }
+    void SetStyle()
+    {
+      builder_.SetStyle((bold_ > 0 ? BodyBuilder::Bold : 0) | (italic_ > 0 ? BodyBuilder::Italic : 0)
+        | (underline_ > 0 ? BodyBuilder::Underline : 0) | (strike_ > 0 ? BodyBuilder::Strike : 0)
+        | (code_ > 0 || pre_ > 0 ? BodyBuilder::Code : 0));
+    }
 
-  void TableCell::SetVerticalAlignment(const Alignment align)
-  {
-    if (!impl_) return;
-    pugi::xml_node w_vAlign = impl_->w_tcPr_.child("w:vAlign");
-    if (!w_vAlign) {
-      w_vAlign = impl_->w_tcPr_.append_child("w:vAlign");
+    void EndBlock()
+    {
+      builder_.EndParagraph();
+      builder_.SetQuote(quote_);
+      space_ = false;
+      breaks_ = 0;
     }
 
-    pugi::xml_attribute w_val = w_vAlign.attribute("w:val");
-    if (!w_val) {
-      w_val = w_vAlign.append_attribute("w:val");
+    void Text(const char* p, const size_t size)
+    {
+      text_.clear();
+      AppendDecoded(text_, p, size);
+
+      if (pre_ > 0) {
+        // line ends become breaks once more text follows, so the ones right
+        // after <pre> and before </pre> are dropped
+        size_t begin = 0;
+        for (size_t i = 0; i <= text_.size(); i++) {
+          if (i < text_.size() && text_[i] != '\n') continue;
+          size_t end = i;
+          if (end > begin && text_[end - 1] == '\r') end--;
+          if (end > begin) {
+            for (; breaks_ > 0; breaks_--) builder_.Break();
+            builder_.Text(text_.data() + begin, end - begin);
+          }
+          if (i < text_.size() && builder_.InParagraph()) breaks_++;
+          begin = i + 1;
+        }
+        return;
+      }
+
+      size_t begin = 0;
+      for (size_t i = 0; i < text_.size(); i++) {
+        if (!IsAsciiSpace(text_[i])) continue;
+        if (i > begin) Word(text_.data() + begin, i - begin);
+        if (builder_.InParagraph()) space_ = true;
+        begin = i + 1;
+      }
+      if (begin < text_.size()) Word(text_.data() + begin, text_.size() - begin);
     }
 
-    const char* val;
-    switch (align) {
-    case Alignment::Top:
-      val = "top";
-      break;
-    case Alignment::Center:
-      val = "center";
-      break;
-    case Alignment::Bottom:
-      val = "bottom";
-      break;
+    void Word(const char* p, const size_t size)
+    {
+      if (space_) builder_.Text(" ", 1);
+      space_ = false;
+      builder_.Text(p, size);
+    }
+
+    void Start(const std::string& name, const bool empty)
+    {
+      if (name == "br") {
+        builder_.Break();
+        space_ = false;
+      }
+      else if (name == "b" || name == "strong") { bold_++; SetStyle(); }
+      else if (name == "i" || name == "em" || name == "cite" || name == "var") { italic_++; SetStyle(); }
+      else if (name == "u" || name == "ins") { underline_++; SetStyle(); }
+      else if (name == "s" || name == "strike" || name == "del") { strike_++; SetStyle(); }
+      else if (name == "code" || name == "tt" || name == "kbd" || name == "samp") { code_++; SetStyle(); }
+      else if (name.size() == 2 && name[0] == 'h' && name[1] >= '1' && name[1] <= '6') {
+        EndBlock();
+        builder_.SetHeading(name[1] - '0');
+      }
+      else if (name == "ul" || name == "ol") {
+        EndBlock();
+        if (!empty) lists_.push_back(std::make_pair(name == "ol", 0));
+      }
+      else if (name == "li") {
+        EndBlock();
+        int& id = lists_.empty() ? orphans_ : lists_.back().second;
+        if (id == 0) {
+          id = doc_.AddList(!lists_.empty() && lists_.back().first ? Document::ListFormat::Decimal : Document::ListFormat::Bullet);
+        }
+        builder_.SetListItem(id, lists_.empty() ? 0 : static_cast<int>(lists_.size()) - 1);
+      }
+      else if (name == "blockquote") {
+        quote_++;
+        EndBlock();
+      }
+      else if (name == "pre") {
+        EndBlock();
+        pre_++;
+        SetStyle();
+      }
+      else if (name == "table") {
+        EndBlock();
+        builder_.StartTable();
+      }
+      else if (name == "tr") {
+        builder_.StartRow();
+      }
+      else if (name == "td" || name == "th") {
+        builder_.StartCell(name == "th");
+        space_ = false;
+      }
+      else if (IsBlock(name)) {
+        // <li><p> keeps the list item
+        if (builder_.InParagraph() || name == "hr") EndBlock();
+      }
+      if (empty && name != "br") End(name);
     }
-    w_val.set_value(val);
-  }
 
-  void TableCell::SetCellSpanning_(const int cols)
-  {
-    if (!impl_) return;
-    pugi::xml_node w_gridSpan = impl_->w_tcPr_.child("w:gridSpan");
-    if (cols == 1) {
-      if (w_gridSpan) {
-        impl_->w_tcPr_.remove_child(w_gridSpan);
+    void End(const std::string& name)
+    {
+      if (name == "a") builder_.EndLink();
+      else if (name == "b" || name == "strong") { if (bold_ > 0) bold_--; SetStyle(); }
+      else if (name == "i" || name == "em" || name == "cite" || name == "var") { if (italic_ > 0) italic_--; SetStyle(); }
+      else if (name == "u" || name == "ins") { if (underline_ > 0) underline_--; SetStyle(); }
+      else if (name == "s" || name == "strike" || name == "del") { if (strike_ > 0) strike_--; SetStyle(); }
+      else if (name == "code" || name == "tt" || name == "kbd" || name == "samp") { if (code_ > 0) code_--; SetStyle(); }
+      else if (name == "ul" || name == "ol") {
+        if (!lists_.empty()) lists_.pop_back();
+        EndBlock();
+      }
+      else if (name == "blockquote") {
+        if (quote_ > 0) quote_--;
+        EndBlock();
+      }
+      else if (name == "pre") {
+        if (pre_ > 0) pre_--;
+        SetStyle();
+        EndBlock();
+      }
+      else if (name == "table") {
+        builder_.EndTable();
+        EndBlock();
+      }
+      else if (name == "tr") {
+        builder_.EndRow();
+      }
+      else if (name == "td" || name == "th") {
+        builder_.EndCell();
+        space_ = false;
+      }
+      else if (name == "li" || (name.size() == 2 && name[0] == 'h' && name[1] >= '1' && name[1] <= '6') || IsBlock(name)) {
+        EndBlock();
       }
-      return;
     }
-    if (!w_gridSpan) {
-      w_gridSpan = impl_->w_tcPr_.append_child("w:gridSpan");
+
+    static bool IsBlock(const std::string& name)
+    {
+      static const char* const blocks[] = {
+        "p", "div", "hr", "section", "article", "header", "footer", "nav", "aside", "main",
+        "figure", "figcaption", "dl", "dt", "dd", "address", "center", "caption", "body"
+      };
+      for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        if (name == blocks[i]) return true;
+      }
+      return false;
     }
+  };
 
-    pugi::xml_attribute w_val = w_gridSpan.attribute("w:val");
-    if (!w_val) {
-      w_val = w_gridSpan.append_attribute("w:val");
+  // A single pass reader for the common Markdown blocks: ATX and setext
+  // headings, paragraphs, hard breaks, bullet and ordered lists, block quotes,
+  // fenced code and pipe tables. Inline it knows emphasis, strong emphasis,
+  // strikethrough, code spans, escapes, entities and <br>; links keep their
+  // text and images are left out.
+  class MarkdownImporter
+  {
+  public:
+    MarkdownImporter(Document& doc, BodyBuilder& builder)
+      : doc_(doc), builder_(builder), kind_(None), level_(0), ordered_(false), quote_(0)
+    {
     }
 
-    w_val.set_value(cols);
-  }
+    void Parse(const char* data, const size_t size)
+    {
+      const char* end = data + size;
+      const char* line = data;
+      std::string fence; // of the open code block
+      bool table = false;
+
+      while (line < end) {
+        const char* eol = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (eol == NULL) eol = end;
+        const char* next = eol < end ? eol + 1 : end;
+        const char* le = eol;
+        if (le > line && le[-1] == '\r') le--;
+
+        // indentation
+        const char* p = line;
+        int indent = 0;
+        while (p < le && (*p == ' ' || *p == '\t')) {
+          indent += *p == '\t' ? 4 - indent % 4 : 1;
+          p++;
+        }
 
-  Paragraph TableCell::AppendParagraph()
-  {
-    if (!impl_) return Paragraph();
-    pugi::xml_node w_p = impl_->w_tc_.append_child("w:p");
-    pugi::xml_node w_pPr = w_p.append_child("w:pPr");
+        if (!fence.empty()) {
+          if (static_cast<size_t>(le - p) >= fence.size() && std::memcmp(p, fence.data(), fence.size()) == 0
+            && IsBlank(p + fence.size(), le, fence[0])) {
+            builder_.EndParagraph();
+            fence.clear();
+          }
+          else {
+            if (builder_.InParagraph()) builder_.Break();
+            builder_.SetStyle(BodyBuilder::Code);
+            builder_.Text(line, le - line);
+            builder_.SetStyle(BodyBuilder::Plain);
+          }
+          line = next;
+          continue;
+        }
 
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_tc_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_pPr;
-    return Paragraph(impl);
-  }
+        if (p == le) {
+          Flush();
+          if (table) builder_.EndTable();
+          table = false;
+          line = next;
+          continue;
+        }
 
-  Paragraph TableCell::FirstParagraph()
-  {
-    if (!impl_) return Paragraph();
-    pugi::xml_node w_p = impl_->w_tc_.child("w:p");
-    pugi::xml_node w_pPr = w_p.child("w:pPr");
+        if (table) {
+          if (std::memchr(p, '|', le - p) != NULL) {
+            Row(p, le, false);
+            line = next;
+            continue;
+          }
+          builder_.EndTable();
+          table = false;
+        }
 
-    Paragraph::Impl* impl = new Paragraph::Impl;
-    impl->w_body_ = impl_->w_tc_;
-    impl->w_p_ = w_p;
-    impl->w_pPr_ = w_pPr;
-    return Paragraph(impl);
-  }
+        // block quote, only its outer marker is taken
+        int quote = 0;
+        if (indent < 4 && *p == '>') {
+          quote = 1;
+          p++;
+          if (p < le && *p == ' ') p++;
+          indent = 0;
+          while (p < le && *p == ' ') {
+            indent++;
+            p++;
+          }
+        }
+        if (quote != quote_) Flush();
+        quote_ = quote;
+        builder_.SetQuote(quote_);
+        if (p == le) {
+          Flush();
+          line = next;
+          continue;
+        }
 
-  // class TextFrame
-  TextFrame::TextFrame() : impl_(NULL)
-  {
+        // fenced code
+        if (indent < 4 && le - p >= 3 && (std::memcmp(p, "```", 3) == 0 || std::memcmp(p, "~~~", 3) == 0)) {
+          Flush();
+          lists_.clear();
+          const char* f = p;
+          while (f < le && *f == *p) f++;
+          fence.assign(p, f);
+          line = next;
+          continue;
+        }
 
-  }
+        // ATX heading
+        if (indent < 4 && *p == '#') {
+          const char* h = p;
+          while (h < le && *h == '#') h++;
+          const int level = static_cast<int>(h - p);
+          if (level <= 6 && (h == le || *h == ' ' || *h == '\t')) {
+            Flush();
+            lists_.clear();
+            const char* e = le;
+            while (e > h && IsAsciiSpace(e[-1])) e--;
+            const char* c = e;
+            while (c > h && c[-1] == '#') c--;
+            if (c == h || c[-1] == ' ' || c[-1] == '\t') e = c; // closing sequence
+            while (h < e && IsAsciiSpace(*h)) h++;
+            builder_.SetHeading(level);
+            Inline(h, e);
+            builder_.EndParagraph();
+            line = next;
+            continue;
+          }
+        }
 
-  TextFrame::TextFrame(Impl* impl, Paragraph::Impl* paragraph_impl)
-    : Paragraph(paragraph_impl), impl_(impl)
-  {
+        // setext heading underline
+        if (indent < 4 && kind_ == Paragraph && (*p == '=' || *p == '-') && IsBlank(p, le, *p)) {
+          builder_.SetHeading(*p == '=' ? 1 : 2);
+          Flush();
+          line = next;
+          continue;
+        }
 
-  }
+        // thematic break
+        if (indent < 4 && (*p == '-' || *p == '*' || *p == '_') && IsThematicBreak(p, le)) {
+          Flush();
+          lists_.clear();
+          line = next;
+          continue;
+        }
 
-  TextFrame::TextFrame(const TextFrame& tf)
-    : Paragraph(tf)
-  {
-    impl_ = new Impl;
-    impl_->w_framePr_ = tf.impl_->w_framePr_;
-  }
+        // list item
+        const char* content = ListMarker(p, le);
+        if (content != NULL && (kind_ != Paragraph || indent < 4)) {
+          Flush();
+          kind_ = Item;
+          level_ = indent / 2 > 8 ? 8 : indent / 2;
+          ordered_ = *p >= '0' && *p <= '9';
+          while (content < le && IsAsciiSpace(*content)) content++;
+          text_.assign(content, le);
+          line = next;
+          continue;
+        }
 
-  TextFrame::~TextFrame()
-  {
-    if (impl_ != NULL) {
-      delete impl_;
-      impl_ = NULL;
-    }
-  }
+        // pipe table, recognized by its delimiter row
+        if (std::memchr(p, '|', le - p) != NULL && next < end && IsDelimiterRow(next, end)) {
+          Flush();
+          lists_.clear();
+          builder_.StartTable();
+          Row(p, le, true);
+          table = true;
+          line = static_cast<const char*>(std::memchr(next, '\n', end - next));
+          line = line == NULL ? end : line + 1;
+          continue;
+        }
 
-  void TextFrame::SetSize(const int w, const int h)
-  {
-    if (!impl_) return;
-    pugi::xml_attribute w_w = impl_->w_framePr_.attribute("w:w");
-    if (!w_w) {
-      w_w = impl_->w_framePr_.append_attribute("w:w");
+        // paragraph text, lines are joined by a space or by a hard break
+        if (kind_ == None) {
+          kind_ = Paragraph;
+        }
+        else if (!text_.empty()) {
+          size_t e = text_.size();
+          while (e > 0 && text_[e - 1] == ' ') e--;
+          bool hard = text_.size() - e >= 2;
+          if (!hard && e > 0 && text_[e - 1] == '\\') {
+            hard = true;
+            e--;
+          }
+          text_.resize(e);
+          text_ += hard ? '\n' : ' ';
+        }
+        text_.append(p, le);
+        line = next;
+      }
+
+      Flush();
+      builder_.Finish();
     }
-    pugi::xml_attribute w_h = impl_->w_framePr_.attribute("w:h");
-    if (!w_h) {
-      w_h = impl_->w_framePr_.append_attribute("w:h");
+
+  private:
+    enum Kind { None, Paragraph, Item };
+
+    Document& doc_;
+    BodyBuilder& builder_;
+    Kind kind_;       // of the block being gathered
+    int level_;
+    bool ordered_;
+    int quote_;
+    std::vector<std::pair<bool, int> > lists_; // the list at each level of the items so far, whether ordered and its id
+    std::string text_; // of the block being gathered
+    std::string chunk_;
+
+    // whether [p, end) holds only c and spaces
+    static bool IsBlank(const char* p, const char* end, const char c)
+    {
+      for (; p < end; p++) {
+        if (*p != c && !IsAsciiSpace(*p)) return false;
+      }
+      return true;
     }
 
-    w_w.set_value(w);
-    w_h.set_value(h);
-  }
+    static bool IsThematicBreak(const char* p, const char* end)
+    {
+      const char c = *p;
+      int count = 0;
+      for (; p < end; p++) {
+        if (*p == c) count++;
+        else if (!IsAsciiSpace(*p)) return false;
+      }
+      return count >= 3;
+    }
 
-  void TextFrame::SetPositionX(const Position align, const Anchor ralativeTo)
-  {
-    SetAnchor_("w:hAnchor", ralativeTo);
-    SetPosition_("w:xAlign", align);
-  }
+    // the content after a list marker, NULL if the line has none
+    static const char* ListMarker(const char* p, const char* end)
+    {
+      if (*p == '-' || *p == '*' || *p == '+') {
+        p++;
+      }
+      else {
+        const char* d = p;
+        while (d < end && d - p < 9 && *d >= '0' && *d <= '9') d++;
+        if (d == p || d == end || (*d != '.' && *d != ')')) return NULL;
+        p = d + 1;
+      }
+      if (p == end) return p;
+      return *p == ' ' || *p == '\t' ? p : NULL;
+    }
 
-  void TextFrame::SetPositionY(const Position align, const Anchor ralativeTo)
-  {
-    SetAnchor_("w:vAnchor", ralativeTo);
-    SetPosition_("w:yAlign", align);
-  }
+    // a line like | --- | :---: | ---: |
+    static bool IsDelimiterRow(const char* p, const char* end)
+    {
+      const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+      if (eol == NULL) eol = end;
+      bool dash = false;
+      for (; p < eol; p++) {
+        if (*p == '-') dash = true;
+        else if (*p != '|' && *p != ':' && !IsAsciiSpace(*p)) return false;
+      }
+      return dash;
+    }
 
-  void TextFrame::SetPositionX(const int x, const Anchor ralativeTo)
-  {
-    SetAnchor_("w:hAnchor", ralativeTo);
-    SetPosition_("w:x", x);
-  }
+    void Row(const char* p, const char* end, const bool header)
+    {
+      while (p < end && IsAsciiSpace(*p)) p++;
+      while (end > p && IsAsciiSpace(end[-1])) end--;
+      if (p < end && *p == '|') p++;
+      if (end > p && end[-1] == '|' && (end - 1 == p || end[-2] != '\\')) end--;
+
+      builder_.StartRow();
+      const char* cell = p;
+      for (const char* q = p; q <= end; q++) {
+        if (q < end && (*q != '|' || q[-1] == '\\')) continue;
+        const char* b = cell;
+        const char* e = q;
+        while (b < e && IsAsciiSpace(*b)) b++;
+        while (e > b && IsAsciiSpace(e[-1])) e--;
+        builder_.StartCell(header);
+        Inline(b, e);
+        builder_.EndCell();
+        cell = q + 1;
+      }
+      builder_.EndRow();
+    }
 
-  void TextFrame::SetPositionY(const int y, const Anchor ralativeTo)
-  {
-    SetAnchor_("w:vAnchor", ralativeTo);
-    SetPosition_("w:y", y);
-  }
+    void Flush()
+    {
+      if (kind_ == Item) {
+        // deeper lists end with an item above them
+        lists_.resize(level_ + 1, std::make_pair(false, 0));
+        std::pair<bool, int>& list = lists_[level_];
+        if (list.second == 0 || list.first != ordered_) {
+          list.first = ordered_;
+          list.second = doc_.AddList(ordered_ ? Document::ListFormat::Decimal : Document::ListFormat::Bullet);
+        }
+        builder_.SetListItem(list.second, level_);
+      }
+      else if (kind_ != None) {
+        lists_.clear();
+      }
+      if (kind_ != None) {
+        size_t e = text_.size();
+        while (e > 0 && IsAsciiSpace(text_[e - 1])) e--;
+        Inline(text_.data(), text_.data() + e);
+        builder_.EndParagraph();
+      }
+      builder_.SetHeading(0);
+      kind_ = None;
+      text_.clear();
+    }
 
-  void TextFrame::SetAnchor_(const char* attrName, const Anchor anchor)
-  {
-    if (!impl_) return;
-    pugi::xml_attribute w_anchor = impl_->w_framePr_.attribute(attrName);
-    if (!w_anchor) {
-      w_anchor = impl_->w_framePr_.append_attribute(attrName);
+    // whether a closing delimiter follows
+    static bool HasCloser(const char* p, const char* end, const char* delim, const size_t len)
+    {
+      for (const char* q = std::search(p, end, delim, delim + len); q != end; q = std::search(q + 1, end, delim, delim + len)) {
+        if (!IsAsciiSpace(q[-1])) return true;
+      }
+      return false;
     }
 
-    const char* val;
-    switch (anchor) {
-    case Anchor::Page:
-      val = "page";
-      break;
-    case Anchor::Margin:
-      val = "margin";
-      break;
+    void Emit(const unsigned int style)
+    {
+      builder_.SetStyle(style);
+      builder_.Text(chunk_);
+      chunk_.clear();
     }
-    w_anchor.set_value(val);
-  }
 
-  void TextFrame::SetPosition_(const char* attrName, const Position align)
-  {
-    if (!impl_) return;
-    pugi::xml_attribute w_align = impl_->w_framePr_.attribute(attrName);
-    if (!w_align) {
-      w_align = impl_->w_framePr_.append_attribute(attrName);
+    void Inline(const char* p, const char* end, unsigned int style = BodyBuilder::Plain)
+    {
+      const char* begin = p;
+      while (p < end) {
+        const char c = *p;
+        if (c == '\\' && p + 1 < end && std::ispunct(static_cast<unsigned char>(p[1]))) {
+          chunk_ += p[1];
+          p += 2;
+        }
+        else if (c == '\n') {
+          Emit(style);
+          builder_.Break();
+          p++;
+        }
+        else if (c == '`') {
+          const char* q = p;
+          while (q < end && *q == '`') q++;
+          const std::string ticks(p, q);
+          const char* close = std::search(q, end, ticks.begin(), ticks.end());
+          if (close == end) {
+            chunk_.append(p, q);
+            p = q;
+            continue;
+          }
+          Emit(style);
+          // one space on each side is stripped
+          if (close - q >= 2 && *q == ' ' && close[-1] == ' ') {
+            q++;
+            close--;
+          }
+          chunk_.assign(q, close);
+          Emit(style | BodyBuilder::Code);
+          p = close + ticks.size() + (close < end && *close == ' ' ? 1 : 0);
+        }
+        else if (c == '*' || c == '_' || (c == '~' && p + 1 < end && p[1] == '~')) {
+          const size_t len = c != '~' && p + 1 < end && p[1] == c ? 2 : c == '~' ? 2 : 1;
+          const unsigned int flag = c == '~' ? BodyBuilder::Strike : len == 2 ? BodyBuilder::Bold : BodyBuilder::Italic;
+          const char* after = p + len;
+          const bool left = after < end && !IsAsciiSpace(*after);
+          const bool right = p > begin && !IsAsciiSpace(p[-1]);
+          // intraword underscores are literal
+          const bool word = c == '_' && after < end && p > begin
+            && std::isalnum(static_cast<unsigned char>(*after)) && std::isalnum(static_cast<unsigned char>(p[-1]));
+          if ((style & flag) && right && !word) {
+            Emit(style);
+            style &= ~flag;
+          }
+          else if (!(style & flag) && left && !word && HasCloser(after, end, p, len)) {
+            Emit(style);
+            style |= flag;
+          }
+          else {
+            chunk_.append(p, len);
+          }
+          p = after;
+        }
+        else if ((c == '[' || (c == '!' && p + 1 < end && p[1] == '[')) && Link(p, end, style)) {
+          continue;
+        }
+        else if (c == '<') {
+          const char* gt = static_cast<const char*>(std::memchr(p, '>', end - p));
+          const std::string tag = gt == NULL ? std::string() : std::string(p + 1, gt);
+          if (tag == "br" || tag == "br/" || tag == "br /") {
+            Emit(style);
+            builder_.Break();
+            p = gt + 1;
+          }
+          else if (tag.compare(0, 7, "http://") == 0 || tag.compare(0, 8, "https://") == 0 || tag.compare(0, 7, "mailto:") == 0) {
+            // autolink
+            Emit(style);
+            builder_.StartLink(tag);
+            chunk_ = tag;
+            Emit(style);
+            builder_.EndLink();
+            p = gt + 1;
+          }
+          else {
+            chunk_ += c;
+            p++;
+          }
+        }
+        else if (c == '&') {
+          const char* semi = p + 1;
+          while (semi < end && semi - p <= 10 && *semi != ';') semi++;
+          if (semi < end && *semi == ';') {
+            AppendDecoded(chunk_, p, semi + 1 - p);
+            p = semi + 1;
+          }
+          else {
+            chunk_ += c;
+            p++;
+          }
+        }
+        else {
+          chunk_ += c;
+          p++;
+        }
+      }
+      Emit(style);
     }
 
-    const char* val;
-    switch (align) {
-    case Position::Left:
-      val = "left";
-      break;
-    case Position::Center:
-      val = "center";
-      break;
-    case Position::Right:
-      val = "right";
-      break;
-    case Position::Top:
-      val = "top";
-      break;
-    case Position::Bottom:
-      val = "bottom";
-      break;
+    // [text](url "title") becomes a hyperlink, ![alt](src) is left out
+    bool Link(const char*& p, const char* end, const unsigned int style)
+    {
+      const bool image = *p == '!';
+      const char* open = image ? p + 1 : p;
+      int depth = 0;
+      const char* close = open;
+      for (; close < end; close++) {
+        if (*close == '\\') close++;
+        else if (*close == '[') depth++;
+        else if (*close == ']' && --depth == 0) break;
+      }
+      if (close >= end || close + 1 >= end || close[1] != '(') return false;
+      const char* paren = static_cast<const char*>(std::memchr(close + 2, ')', end - close - 2));
+      if (paren == NULL) return false;
+
+      if (!image) {
+        Emit(style);
+        const char* url = close + 2;
+        while (url < paren && IsAsciiSpace(*url)) url++;
+        const char* e = url;
+        while (e < paren && !IsAsciiSpace(*e)) e++;
+        if (e > url && *url == '<' && e[-1] == '>') {
+          url++;
+          e--;
+        }
+        if (e > url) builder_.StartLink(std::string(url, e));
+        Inline(open + 1, close, style);
+        builder_.EndLink();
+      }
+      p = paren + 1;
+      return true;
     }
-    w_align.set_value(val);
-  }
+  };
 
-  void TextFrame::SetPosition_(const char* attrName, const int twip)
+  void Document::ImportHtml(const std::string& html)
   {
     if (!impl_) return;
-    pugi::xml_attribute w_Align = impl_->w_framePr_.attribute(attrName);
-    if (!w_Align) {
-      w_Align = impl_->w_framePr_.append_attribute(attrName);
+    impl_->dirty_ |= DIRTY_DOCUMENT;
+
+    // tables get the properties of AppendTable()
+    Fragment scratch;
+    Table table = scratch.AppendTable(1, 1);
+    BodyBuilder builder(impl_->w_body_, impl_->w_sectPr_, table.impl_->w_tblPr_);
+    const pugi::xml_node last = impl_->w_sectPr_ ? impl_->w_sectPr_.previous_sibling() : impl_->w_body_.last_child();
+    HtmlImporter(*this, builder).Parse(html.data(), html.size());
+    for (size_t i = 0; i < builder.links_.size(); i++) {
+      const std::string id = impl_->AddRelationship("http://schemas.openxmlformats.org/officeDocument/2006/relationships/hyperlink", builder.links_[i].second, true);
+      builder.links_[i].first.prepend_attribute("r:id") = id.c_str();
     }
-    w_Align.set_value(twip);
+    if (impl_->statsTracked_) impl_->CountContentAfter(last);
+    impl_->sectionsIndexed_ = false;
   }
 
-  void TextFrame::SetTextWrapping(const Wrapping wrapping)
+  void Document::ImportMarkdown(const std::string& markdown)
   {
     if (!impl_) return;
-    pugi::xml_attribute w_wrap = impl_->w_framePr_.attribute("w:wrap");
-    if (!w_wrap) {
-      w_wrap = impl_->w_framePr_.append_attribute("w:wrap");
-    }
+    impl_->dirty_ |= DIRTY_DOCUMENT;
 
-    const char* val;
-    switch (wrapping) {
-    case Wrapping::Around:
-      val = "around";
-      break;
-    case Wrapping::None:
-      val = "none";
-      break;
+    Fragment scratch;
+    Table table = scratch.AppendTable(1, 1);
+    BodyBuilder builder(impl_->w_body_, impl_->w_sectPr_, table.impl_->w_tblPr_);
+    const pugi::xml_node last = impl_->w_sectPr_ ? impl_->w_sectPr_.previous_sibling() : impl_->w_body_.last_child();
+    MarkdownImporter(*this, builder).Parse(markdown.data(), markdown.size());
+    for (size_t i = 0; i < builder.links_.size(); i++) {
+      const std::string id = impl_->AddRelationship("http://schemas.openxmlformats.org/officeDocument/2006/relationships/hyperlink", builder.links_[i].second, true);
+      builder.links_[i].first.prepend_attribute("r:id") = id.c_str();
     }
-    w_wrap.set_value(val);
+    if (impl_->statsTracked_) impl_->CountContentAfter(last);
+    impl_->sectionsIndexed_ = false;
   }
 
 
+
 } // namespace docx
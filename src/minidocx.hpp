@@ -9,6 +9,11 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <utility> // std::pair
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define MINIDOCX_STRING_VIEW
+#endif
 
 
 namespace docx
@@ -107,6 +112,26 @@ namespace docx
   class Table;
   class TableCell;
   class TextFrame;
+  class Fragment;
+  class LayoutEstimate;
+
+
+  // Text the caller keeps, e.g. in a memory-mapped file or an arena. The
+  // overloads taking it copy the bytes straight into the document instead of
+  // through a temporary std::string. It is not built from a bare const char*
+  // so that string literals still pick the std::string overloads.
+  struct TextView
+  {
+    const char* data;
+    size_t size;
+
+    TextView() : data(""), size(0) {}
+    TextView(const char* data, const size_t size) : data(data), size(size) {}
+#ifdef MINIDOCX_STRING_VIEW
+    TextView(const std::string_view text) : data(text.data()), size(text.size()) {}
+#endif
+    bool empty() const { return size == 0; }
+  };
 
 
   class Box
@@ -160,6 +185,7 @@ namespace docx
   class Table : public Box
   {
     friend class Document;
+    friend class Fragment;
 
   public:
     // constructs an empty table
@@ -228,6 +254,7 @@ namespace docx
   {
     friend class Document;
     friend class Paragraph;
+    friend class TextIndex;
     friend std::ostream& operator<<(std::ostream& out, const Run& r);
 
   public:
@@ -242,11 +269,30 @@ namespace docx
 
     // text
     void AppendText(const std::string& text);
+    void AppendText(const TextView& text);
+    // Like AppendText(), with each tab as a w:tab and each line end (\n, \r\n
+    // or \r) as a w:br, which Word shows where w:t would ignore them.
+    void AppendTextWithBreaks(const std::string& text);
+    void AppendTextWithBreaks(const TextView& text);
     std::string GetText();
+    // Copies the text into buffer, at most size - 1 bytes and a terminating
+    // zero, and returns the length of the whole text like snprintf().
+    size_t GetText(char* buffer, const size_t size);
+    // Points text into the document when the run holds a single w:t, which
+    // stays valid until the run is edited. Returns false for other runs.
+    bool GetTextView(TextView& text);
     void ClearText();
     void AppendLineBreak();
     void AppendTabs(const unsigned int count = 1);
 
+    // picture
+    // Adds an inline picture of w x h twips from a PNG, JPEG, GIF, BMP or TIFF
+    // file or buffer. The document stores each distinct picture once however
+    // often it is added; files are read when saving rather than kept in memory,
+    // so they must stay in place until then. Fails for runs of fragments.
+    bool AppendPicture(const std::string& path, const int w, const int h);
+    bool AppendPicture(const char* data, const size_t size, const int w, const int h);
+
     // text formatting
     typedef unsigned int FontStyle;
     enum : FontStyle
@@ -260,6 +306,7 @@ namespace docx
     double GetFontSize();
 
     void SetFont(const std::string& fontAscii, const std::string& fontEastAsia = "");
+    void SetFont(const TextView& fontAscii, const TextView& fontEastAsia = TextView());
     void GetFont(std::string& fontAscii, std::string& fontEastAsia);
 
     void SetFontColor(const std::string& hex);
@@ -343,7 +390,20 @@ namespace docx
      *              If the value is omitted, numbering continues from the highest page number in the previous section.
      */
     void SetPageNumber(const PageNumberFormat fmt = PageNumberFormat::Decimal, const unsigned int start = 0);
-    void RemovePageNumber();
+    void RemovePageNumber(); // keeps a default footer set by SetFooter()
+
+    // header and footer
+    // The content of the fragment is copied. Sections with the same header or
+    // footer content share one part of the package.
+    enum class HeaderFooterType {
+      Default, // every page, or the odd pages if Even is set too
+      First,   // the first page of the section
+      Even     // the even pages, applies to the whole document
+    };
+    bool SetHeader(const Fragment& content, const HeaderFooterType type = HeaderFooterType::Default);
+    bool SetFooter(const Fragment& content, const HeaderFooterType type = HeaderFooterType::Default);
+    void RemoveHeader(const HeaderFooterType type = HeaderFooterType::Default);
+    void RemoveFooter(const HeaderFooterType type = HeaderFooterType::Default);
 
     // paragraph
     Paragraph FirstParagraph();
@@ -362,8 +422,11 @@ namespace docx
   class Paragraph : public Box
   {
     friend class Document;
+    friend class Fragment;
     friend class Section;
     friend class TableCell;
+    friend class TextIndex;
+    friend class LayoutEstimate;
     friend std::ostream& operator<<(std::ostream& out, const Paragraph& p);
 
   public:
@@ -386,8 +449,15 @@ namespace docx
     Run AppendRun(const std::string& text);
     Run AppendRun(const std::string& text, const double fontSize);
     Run AppendRun(const std::string& text, const double fontSize, const std::string& fontAscii, const std::string& fontEastAsia = "");
+    Run AppendRun(const TextView& text);
+    Run AppendRun(const TextView& text, const double fontSize);
     Run AppendPageBreak();
 
+    // add a hyperlink, an external URL or "#name" for a bookmark, and return its run
+    // Links to the same URL share one relationship. Fails (an empty run) for
+    // external URLs in paragraphs that do not belong to a document.
+    Run AppendHyperlink(const std::string& url, const std::string& text);
+
     // paragraph formatting
     enum class Alignment { Left, Centered, Right, Justified, Distributed };
     void SetAlignment(const Alignment alignment);
@@ -424,9 +494,15 @@ namespace docx
     void SetBorders(const BorderStyle style = BorderStyle::Single, const double width = 0.5, const char* color = "auto");
     void SetBorders_(const char* elemName, const BorderStyle style, const double width, const char* color);
 
+    // list item at a level from 0 to 8 of a list made by Document::AddList()
+    void SetNumbering(const int listId, const int level = 0);
+    void RemoveNumbering();
+    bool GetNumbering(int& listId, int& level); // false if not a list item
+
     // helper
     void SetFontSize(const double fontSize);
     void SetFont(const std::string& fontAscii, const std::string& fontEastAsia = "");
+    void SetFont(const TextView& fontAscii, const TextView& fontEastAsia = TextView());
     void SetFontStyle(const Run::FontStyle fontStyle);
     void SetCharacterSpacing(const int characterSpacing);
     std::string GetText();
@@ -489,10 +565,12 @@ namespace docx
     Bookmark();
     Bookmark(const Bookmark& rhs);
     ~Bookmark();
+    void operator=(const Bookmark& right);
     bool operator==(const Bookmark& rhs);
 
-    inline unsigned int GetId() const;
-    inline std::string GetName() const;
+    operator bool();
+    unsigned int GetId() const;
+    std::string GetName() const;
 
   private:
     struct Impl;
@@ -502,8 +580,94 @@ namespace docx
   };
 
 
+  // time and size of one package part
+  struct PartStats
+  {
+    std::string name;
+    size_t bytes;   // uncompressed size
+    size_t nodes;   // number of xml nodes, 0 if the part is not kept as a DOM
+    double xmlTime; // seconds spent serializing (Save) or parsing (Open)
+    double zipTime; // seconds spent deflating and writing (Save) or inflating (Open)
+  };
+
+  // Per-phase statistics of Document::Save() and Document::Open().
+  // Nothing is measured unless a Stats object is passed in.
+  struct Stats
+  {
+    Stats();
+
+    std::vector<PartStats> parts;
+    double openTime;          // opening the archive
+    double copyTime;          // Save() only, copying the parts left unchanged since Open() or the last Save()
+    double closeTime;         // writing the central directory and closing the archive
+    double findBookmarksTime; // Open() only
+    double totalTime;
+    size_t allocations;       // allocations made by the xml DOM on the calling thread, counted only
+    size_t allocatedBytes;    // when built with MINIDOCX_COUNT_ALLOCATIONS (WITH_ALLOCATION_STATS)
+  };
+
+
+  // The counts of Document::GetStatistics(), as Word counts them: words are
+  // separated by Unicode spaces, and Chinese and Japanese characters count
+  // as one word each.
+  struct DocumentStatistics
+  {
+    size_t words;
+    size_t characters;           // without spaces
+    size_t charactersWithSpaces; // tabs included, line breaks not
+    size_t paragraphs;           // those with text
+  };
+
+
+  // Body content built apart from any document and spliced in by
+  // Document::AppendFragment(). Each fragment owns its own DOM, so
+  // fragments can be built on worker threads while the document is not.
+  class Fragment
+  {
+    friend class Document;
+    friend class Section;
+
+  public:
+    // constructs an empty fragment
+    Fragment();
+    Fragment(Fragment&& f);
+    ~Fragment();
+
+    // get paragraph
+    Paragraph FirstParagraph();
+    Paragraph LastParagraph();
+
+    // add paragraph
+    Paragraph AppendParagraph();
+    Paragraph AppendParagraph(const std::string& text);
+    Paragraph AppendParagraph(const std::string& text, const double fontSize);
+    Paragraph AppendParagraph(const std::string& text, const double fontSize, const std::string& fontAscii, const std::string& fontEastAsia = "");
+    Paragraph AppendParagraph(const TextView& text);
+    Paragraph AppendParagraph(const TextView& text, const double fontSize);
+    Paragraph AppendPageBreak();
+
+    // add table
+    Table AppendTable(const int rows, const int cols);
+
+  private:
+    struct Impl;
+    Impl* impl_;
+
+    // non-copyable
+    Fragment(const Fragment&);
+    void operator=(const Fragment&);
+  }; // class Fragment
+
+
   class Document
   {
+    friend class Paragraph;
+    friend class Section;
+    friend class Template;
+    friend class TextIndex;
+    friend class LayoutEstimate;
+    friend class Run;
+    friend class Table;
     friend std::ostream& operator<<(std::ostream& out, const Document& doc);
 
   public:
@@ -512,8 +676,14 @@ namespace docx
     ~Document();
 
     // save document to file
-    bool Save(const std::string& path);
-    bool Open(const std::string& path);
+    // After Open() or Save(), Save() copies the entries of the archive still
+    // compressed and writes only the parts changed since: word/settings.xml for
+    // SetVars() and SetReadOnly(), word/document.xml once the body was edited
+    // or a handle into it was handed out since Open(). The copy is written
+    // next to the target and replaces it once complete. Save() fails when that
+    // archive can no longer be read, e.g. once it was moved or deleted.
+    bool Save(const std::string& path, Stats* stats = NULL);
+    bool Open(const std::string& path, Stats* stats = NULL);
 
     // get paragraph
     Paragraph FirstParagraph();
@@ -524,10 +694,14 @@ namespace docx
     Paragraph AppendParagraph(const std::string& text);
     Paragraph AppendParagraph(const std::string& text, const double fontSize);
     Paragraph AppendParagraph(const std::string& text, const double fontSize, const std::string& fontAscii, const std::string& fontEastAsia = "");
+    Paragraph AppendParagraph(const TextView& text);
+    Paragraph AppendParagraph(const TextView& text, const double fontSize);
     Paragraph PrependParagraph();
     Paragraph PrependParagraph(const std::string& text);
     Paragraph PrependParagraph(const std::string& text, const double fontSize);
     Paragraph PrependParagraph(const std::string& text, const double fontSize, const std::string& fontAscii, const std::string& fontEastAsia = "");
+    Paragraph PrependParagraph(const TextView& text);
+    Paragraph PrependParagraph(const TextView& text, const double fontSize);
 
     Paragraph InsertParagraphBefore(const Paragraph& p);
     Paragraph InsertParagraphAfter(const Paragraph& p);
@@ -549,6 +723,33 @@ namespace docx
     // add text frame
     TextFrame AppendTextFrame(const int w, const int h);
 
+    // add the content of a fragment in order and leave it empty
+    void AppendFragment(Fragment&& f);
+
+    // add the body of another document as new sections, bookmarks are renumbered
+    // and the lists it uses are copied, as are the pictures, headers and other
+    // parts it refers to. A bookmark named as one of ours gets a suffix ("_2",
+    // "_3"...) that the links and REF/PAGEREF fields of that body follow.
+    // Fails, leaving this document as it was, when one of those parts cannot
+    // be read, e.g. once the archive of other was deleted.
+    bool Append(const Document& other);
+
+    // add content converted from HTML or Markdown
+    // The input is read in a single pass and its paragraphs, runs and tables
+    // are built directly in the body. Headings, bold, italic, underline,
+    // strikethrough, code, line breaks, lists, block quotes and tables are
+    // kept, links become hyperlinks; pictures and scripts are left out.
+    void ImportHtml(const std::string& html);
+    void ImportMarkdown(const std::string& markdown);
+
+    // lists
+    // Returns the id of a new list for Paragraph::SetNumbering(), 0 on failure.
+    // Each numbered list starts at 1. All lists of a format share one
+    // definition (w:abstractNum) in word/numbering.xml and differ only by a
+    // small w:num, so thousands of lists keep the part small.
+    enum class ListFormat { Bullet, Decimal, LowerLetter, UpperLetter, LowerRoman, UpperRoman };
+    int AddList(const ListFormat format = ListFormat::Bullet);
+
     // document settings
     void SetReadOnly(const bool enabled = true);
 
@@ -557,15 +758,186 @@ namespace docx
     void AddVars(const std::map<std::string, std::string>& vars);
 
     // bookmarks
-    void FindBookmarks();
-    std::vector<Bookmark> GetBookmarks();
-    Bookmark AddBookmark(const std::string& name, const Run& start, const Run& end);
+    void FindBookmarks(); // rebuilds the bookmark index, called by Open()
+    std::vector<Bookmark> GetBookmarks(); // ordered by id
+    Bookmark FindBookmark(const std::string& name);
+    Bookmark FindBookmark(const unsigned int id);
+    Bookmark AddBookmark(const std::string& name, const Run& start, const Run& end); // fails if the name is taken
     void RemoveBookmark(Bookmark& b);
 
+    // table of contents
+    // Inserts a TOC field before p, or at the end of the body when p is empty,
+    // listing the headings of levels 1 to maxLevel. Headings are found in one
+    // pass by their style (Heading1...) or outline level and bookmarked, and
+    // the field is filled with linked entries and their page numbers, so it
+    // reads right before Word updates it. The page numbers come from layout,
+    // which is updated for the new paragraphs, or are counted from explicit
+    // page and section breaks without one.
+    // Returns the number of entries, 0 when there are no headings.
+    size_t InsertTableOfContents(const Paragraph& p, const int maxLevel = 3, LayoutEstimate* layout = NULL);
+
+    // template filling
+    // Replaces the text of every bookmark and {{name}} placeholder whose name is
+    // a key of values. Fields without a value keep their current text, so the
+    // same document can be filled again and again. The fields are located once
+    // by CompileFields(), call it again to pick up fields added later; the
+    // placeholders it found before stay fields, also once filled.
+    void Fill(const std::map<std::string, std::string>& values);
+    void CompileFields();
+    std::vector<std::string> GetFields(); // distinct field names
+
+    // find and replace
+    // Replaces every occurrence of the first string of each pair with the second,
+    // also when the occurrence spans several runs. All patterns are searched in a
+    // single pass over the text of each paragraph; where occurrences overlap, the
+    // leftmost and then the longest wins. The replacement takes the formatting of
+    // the run where the occurrence begins. Returns the number of replacements.
+    size_t ReplaceAll(const std::vector<std::pair<std::string, std::string> >& replacements);
+
+    // statistics
+    // The first call counts the text of the body, tables included, in one
+    // pass. From then on the counts are kept up to date as runs, paragraphs
+    // and tables are edited, added or removed, so later calls take constant
+    // time; after Open() the next call counts again. Save() writes the
+    // counts to docProps/app.xml.
+    DocumentStatistics GetStatistics();
+
   private:
     struct Impl;
     Impl* impl_;
   }; // class Document
 
 
+  // A template prepared for mail merge. Open() parses the template once and
+  // keeps word/document.xml as static slices around its fields, Render() then
+  // writes a document per record without copying or serializing the DOM; the
+  // other entries of the template are copied still compressed.
+  // Render() does not modify the template and may be called from several threads.
+  class Template
+  {
+  public:
+    Template();
+    ~Template();
+
+    bool Open(const std::string& path);
+    std::vector<std::string> GetFields();
+    bool Render(const std::map<std::string, std::string>& values, const std::string& path) const;
+
+  private:
+    struct Impl;
+    Impl* impl_;
+
+    void Compile();
+
+    // non-copyable
+    Template(const Template&);
+    void operator=(const Template&);
+  }; // class Template
+
+
+  // where a query was found
+  struct TextMatch
+  {
+    Paragraph paragraph;
+    Run run;       // the run where the match begins
+    size_t offset; // in bytes from the start of the text of the paragraph
+  };
+
+  // A search index over the text of every paragraph of a document, including
+  // those in tables and text boxes. The text is kept in one buffer with maps
+  // back to the runs; with n-grams enabled, queries of three bytes or more only
+  // look at the paragraphs containing all of their trigrams.
+  // The index refers to the nodes of the document: call Update() after editing
+  // or adding a paragraph and Remove() before removing one.
+  class TextIndex
+  {
+  public:
+    TextIndex();
+    ~TextIndex();
+
+    void Build(const Document& doc, const bool ngrams = true);
+    std::vector<TextMatch> Find(const std::string& query, const size_t limit = 0) const; // 0 for no limit
+    void Update(const Paragraph& p);
+    void Remove(const Paragraph& p);
+
+  private:
+    struct Impl;
+    Impl* impl_;
+
+    // non-copyable
+    TextIndex(const TextIndex&);
+    void operator=(const TextIndex&);
+  }; // class TextIndex
+
+
+  // An estimate of how the body breaks into lines and pages, without a word
+  // processor. Text is measured with built-in metrics of Times New Roman,
+  // Arial and Courier New (other fonts are scaled from the closest of them,
+  // East Asian characters take a full em) and broken at spaces and between
+  // East Asian characters. Page size, margins, columns, the document grid,
+  // font sizes, line and paragraph spacing, indents, page and column breaks,
+  // section breaks, table rows and inline pictures are taken into account;
+  // styles are not, so documents relying on them come out less precise.
+  // Each paragraph is measured once: call Update() after editing or adding a
+  // paragraph and Remove() before removing one, and only those are measured
+  // again when the pages are next asked for.
+  class LayoutEstimate
+  {
+  public:
+    LayoutEstimate();
+    ~LayoutEstimate();
+
+    void Build(const Document& doc);
+    void Update(const Paragraph& p);
+    void Remove(const Paragraph& p);
+
+    int GetPageCount();
+    int GetPage(const Paragraph& p);      // the page p starts on from 1, 0 if p is not laid out
+    int GetLineCount(const Paragraph& p); // 0 if p is not laid out
+
+  private:
+    struct Impl;
+    Impl* impl_;
+
+    // non-copyable
+    LayoutEstimate(const LayoutEstimate&);
+    void operator=(const LayoutEstimate&);
+  }; // class LayoutEstimate
+
+
+  // Concatenates the documents into a new one, each input starting a new section.
+  // Works on the serialized word/document.xml of one input at a time without
+  // building a DOM; bookmark and relationship ids are renumbered and the parts
+  // the inputs refer to (images, headers, footers...) are copied over. A
+  // bookmark named as one of an earlier input is renamed as Append() does.
+  // Styles, settings, fonts and theme come from the first input; the lists of
+  // the later ones are added to its numbering under new ids. Footnotes,
+  // endnotes and comments keep their ids, so Concat fails if more than one
+  // input has any, and an output it could not finish is removed.
+  bool Concat(const std::vector<std::string>& inputs, const std::string& output);
+
+
+  // Writes each section of the document to a package of its own, named after
+  // outputPattern with "{}" replaced by the section number starting at 1
+  // ("part.docx" without "{}" gives "part_1.docx", "part_2.docx"...).
+  // word/document.xml is scanned once as it is inflated, so only a few sections
+  // are held in memory while the packages are written on several threads.
+  // Each package keeps the pictures, headers, links and other parts its
+  // section refers to, and the styles, numbering, footnotes and comments of
+  // the input whole. Returns the number of files written, 0 on failure, in
+  // which case the files written already are deleted.
+  size_t SplitBySection(const std::string& input, const std::string& outputPattern);
+
+
+  // Converts the body of a document to plain text, Markdown or HTML (a
+  // fragment without <html> and <body>). word/document.xml is read with a pull
+  // parser as it is inflated and the output is written as it is produced, so
+  // memory use does not grow with the document. Paragraphs, headings, list
+  // items, bold/italic/underline/strikethrough runs, tabs, breaks and tables
+  // are kept; pictures, field codes and deleted text are left out.
+  bool ToText(const std::string& input, std::ostream& out);
+  bool ToMarkdown(const std::string& input, std::ostream& out);
+  bool ToHtml(const std::string& input, std::ostream& out);
+
+
 } // namespace docx
@@ -0,0 +1,63 @@
+// Helpers of the tests. A failed CHECK prints the condition and exits, so
+// ctest reports the test as failed.
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+
+#include "zip.h"
+
+#define CHECK(cond)                                                         \
+  do {                                                                      \
+    if (!(cond)) {                                                          \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      std::exit(1);                                                         \
+    }                                                                       \
+  } while (0)
+
+// the content of an entry of an archive, empty if there is none
+inline std::string ReadEntry(const char* path, const char* name)
+{
+  std::string data;
+  struct zip_t* zip = zip_open(path, 0, 'r');
+  CHECK(zip != NULL);
+  if (zip_entry_open(zip, name) == 0) {
+    void* buf = NULL;
+    size_t size = 0;
+    CHECK(zip_entry_read(zip, &buf, &size) >= 0);
+    data.assign(static_cast<const char*>(buf), size);
+    std::free(buf);
+    zip_entry_close(zip);
+  }
+  zip_close(zip);
+  return data;
+}
+
+// the names and contents of the entries of an archive
+inline std::map<std::string, std::string> ReadEntries(const char* path)
+{
+  std::map<std::string, std::string> entries;
+  struct zip_t* zip = zip_open(path, 0, 'r');
+  CHECK(zip != NULL);
+  const ssize_t n = zip_entries_total(zip);
+  for (ssize_t i = 0; i < n; i++) {
+    CHECK(zip_entry_openbyindex(zip, static_cast<int>(i)) == 0);
+    void* buf = NULL;
+    size_t size = 0;
+    CHECK(zip_entry_read(zip, &buf, &size) >= 0);
+    entries[zip_entry_name(zip)].assign(static_cast<const char*>(buf), size);
+    std::free(buf);
+    zip_entry_close(zip);
+  }
+  zip_close(zip);
+  return entries;
+}
+
+// the number of occurrences of what in text
+inline size_t Count(const std::string& text, const std::string& what)
+{
+  size_t n = 0;
+  for (size_t pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1)) n++;
+  return n;
+}
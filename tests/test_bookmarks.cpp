@@ -0,0 +1,73 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+int main()
+{
+  Document doc;
+
+  auto p1 = doc.AppendParagraph("first");
+  auto p2 = doc.AppendParagraph("second");
+  auto b1 = doc.AddBookmark("one", p1.FirstRun(), p1.FirstRun());
+  auto b2 = doc.AddBookmark("two", p2.FirstRun(), p2.FirstRun());
+  CHECK(b1 && b2);
+  CHECK(doc.GetBookmarks().size() == 2);
+
+  // removing a paragraph forgets the bookmarks inside it
+  doc.RemoveParagraph(p1);
+  CHECK(!doc.FindBookmark("one"));
+  CHECK(!doc.FindBookmark(b1.GetId()));
+  CHECK(doc.FindBookmark("two"));
+  CHECK(doc.GetBookmarks().size() == 1);
+
+  // so the name can be taken again
+  CHECK(doc.AddBookmark("one", p2.FirstRun(), p2.FirstRun()));
+
+  // the same for tables
+  auto tbl = doc.AppendTable(2, 2);
+  auto cell = tbl.GetCell(1, 1).FirstParagraph();
+  auto r = cell.AppendRun("cell");
+  CHECK(doc.AddBookmark("cell", r, r));
+  doc.RemoveTable(tbl);
+  CHECK(!doc.FindBookmark("cell"));
+  CHECK(doc.GetBookmarks().size() == 2);
+
+  // a bookmark ending in the removed paragraph is gone, its start included
+  auto p3 = doc.AppendParagraph("third");
+  auto p4 = doc.AppendParagraph("fourth");
+  CHECK(doc.AddBookmark("span", p3.FirstRun(), p4.FirstRun()));
+  doc.RemoveParagraph(p4);
+  CHECK(!doc.FindBookmark("span"));
+
+  // handles kept from before the paragraph went change nothing
+  auto p5 = doc.AppendParagraph("fifth");
+  auto stale = doc.AddBookmark("stale", p5.FirstRun(), p5.FirstRun());
+  auto found = doc.FindBookmark("stale");
+  CHECK(stale && found);
+  doc.RemoveParagraph(p5);
+  doc.RemoveBookmark(found);
+  doc.RemoveBookmark(stale);
+  CHECK(doc.GetBookmarks().size() == 2);
+
+  // cells dropped by merging forget their bookmarks too
+  auto merged = doc.AppendTable(1, 2);
+  auto right = merged.GetCell(0, 1).FirstParagraph().AppendRun("right");
+  CHECK(doc.AddBookmark("right", right, right));
+  CHECK(merged.MergeCells(merged.GetCell(0, 0), merged.GetCell(0, 1)));
+  CHECK(!doc.FindBookmark("right"));
+  CHECK(doc.GetBookmarks().size() == 2);
+
+  // a live handle still removes its bookmark
+  auto two = doc.FindBookmark("two");
+  doc.RemoveBookmark(two);
+  CHECK(!doc.FindBookmark("two"));
+  CHECK(doc.AddBookmark("two", p2.FirstRun(), p2.FirstRun()));
+
+  doc.Save("test_bookmarks.docx");
+  Document reopened;
+  CHECK(reopened.Open("test_bookmarks.docx"));
+  CHECK(reopened.GetBookmarks().size() == 2);
+  CHECK(reopened.FindBookmark("two"));
+  return 0;
+}
@@ -0,0 +1,284 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+// a document with a bookmark, a numbered list and a link
+void BuildPart(Document& doc, const std::string& name, const std::string& url)
+{
+  auto p = doc.AppendParagraph();
+  auto r = p.AppendRun(name);
+  CHECK(doc.AddBookmark(name, r, r));
+  const int list = doc.AddList(Document::ListFormat::Decimal);
+  doc.AppendParagraph(name + " item").SetNumbering(list);
+  doc.AppendParagraph().AppendHyperlink(url, name + " link");
+}
+
+// 1x1 pixel pictures, red and blue
+const unsigned char RED_PNG[] = {
+  0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+  0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x08, 0x06, 0x00, 0x00, 0x00, 0x1f, 0x15, 0xc4,
+  0x89, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0xf8, 0xcf, 0xc0, 0xf0,
+  0x1f, 0x00, 0x05, 0x00, 0x01, 0xff, 0x89, 0x99, 0x3d, 0x1d, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45,
+  0x4e, 0x44, 0xae, 0x42, 0x60, 0x82
+};
+const unsigned char BLUE_PNG[] = {
+  0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+  0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x08, 0x06, 0x00, 0x00, 0x00, 0x1f, 0x15, 0xc4,
+  0x89, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0x60, 0x60, 0xf8, 0xff,
+  0x1f, 0x00, 0x03, 0x02, 0x01, 0xff, 0xe6, 0x77, 0x0b, 0xae, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45,
+  0x4e, 0x44, 0xae, 0x42, 0x60, 0x82
+};
+
+// a paragraph with a picture in a section with a header
+void BuildPictured(Document& doc, const unsigned char* png, const size_t size, const std::string& header)
+{
+  CHECK(doc.AppendParagraph().AppendRun().AppendPicture(reinterpret_cast<const char*>(png), size, 10, 10));
+  Fragment f;
+  f.AppendParagraph(header);
+  CHECK(doc.LastSection().SetHeader(f));
+}
+
+// every r:id and r:embed of the body names a relationship whose part is in the archive
+bool Resolves(const char* path)
+{
+  std::map<std::string, std::string> entries = ReadEntries(path);
+  const std::string& xml = entries["word/document.xml"];
+  const std::string& rels = entries["word/_rels/document.xml.rels"];
+  for (const std::string attr : { " r:id=\"", " r:embed=\"" }) {
+    for (size_t pos = xml.find(attr); pos != std::string::npos; pos = xml.find(attr, pos + 1)) {
+      const size_t begin = pos + attr.size();
+      const std::string id = xml.substr(begin, xml.find('"', begin) - begin);
+      const size_t at = rels.find(" Id=\"" + id + "\"");
+      if (at == std::string::npos) return false;
+      const size_t start = rels.rfind('<', at);
+      const std::string rel = rels.substr(start, rels.find('>', at) - start);
+      if (rel.find("External") != std::string::npos) continue;
+      const size_t target = rel.find("Target=\"") + 8;
+      if (entries.count("word/" + rel.substr(target, rel.find('"', target) - target)) == 0) return false;
+    }
+  }
+  return true;
+}
+
+// the entries whose name starts with prefix and which hold text
+int CountEntries(const std::map<std::string, std::string>& entries, const std::string& prefix, const std::string& text)
+{
+  int n = 0;
+  for (auto& e : entries) {
+    if (e.first.compare(0, prefix.size(), prefix) == 0 && e.second.find(text) != std::string::npos) n++;
+  }
+  return n;
+}
+
+int CountSections(Document& doc)
+{
+  int n = 0;
+  for (auto s = doc.FirstSection(); s; s = s.Next()) n++;
+  return n;
+}
+
+// a copy of the package 'from' with a footnotes part holding the separator and 'notes'
+void AddFootnotes(const char* from, const char* to, const std::string& notes)
+{
+  std::map<std::string, std::string> entries = ReadEntries(from);
+  std::string& rels = entries["word/_rels/document.xml.rels"];
+  rels.insert(rels.rfind("</Relationships>"), "<Relationship Id=\"rIdNotes\" "
+    "Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/footnotes\" Target=\"footnotes.xml\"/>");
+  std::string& types = entries["[Content_Types].xml"];
+  types.insert(types.rfind("</Types>"), "<Override PartName=\"/word/footnotes.xml\" "
+    "ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.footnotes+xml\"/>");
+  entries["word/footnotes.xml"] = "<w:footnotes xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\">"
+    "<w:footnote w:type=\"separator\" w:id=\"-1\"><w:p/></w:footnote>" + notes + "</w:footnotes>";
+
+  struct zip_t* zip = zip_open(to, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+  CHECK(zip != NULL);
+  for (auto& e : entries) {
+    CHECK(zip_entry_open(zip, e.first.c_str()) == 0);
+    CHECK(zip_entry_write(zip, e.second.data(), e.second.size()) == 0);
+    zip_entry_close(zip);
+  }
+  zip_close(zip);
+}
+
+int main()
+{
+  Document a, b;
+  BuildPart(a, "first", "https://example.com/a");
+  BuildPart(b, "second", "https://example.com/b");
+  b.LastParagraph().InsertSectionBreak();
+  b.AppendParagraph("second end");
+
+  // Append(): the body of b follows as new sections
+  Document merged;
+  BuildPart(merged, "first", "https://example.com/a");
+  merged.Append(b);
+  CHECK(CountSections(merged) == 3);
+  CHECK(merged.FirstSection().Next().FirstParagraph().GetText() == "second");
+  CHECK(merged.LastParagraph().GetText() == "second end");
+
+  // bookmarks are renumbered after ours and can be found by name
+  auto first = merged.FindBookmark("first");
+  auto second = merged.FindBookmark("second");
+  CHECK(first && second);
+  CHECK(first.GetId() != second.GetId());
+  CHECK(merged.GetBookmarks().size() == 2);
+
+  // the list of b keeps its own numbering
+  int list1 = 0, list2 = 0, level = -1;
+  CHECK(merged.FirstParagraph().Next().GetNumbering(list1, level));
+  CHECK(merged.FirstSection().Next().FirstParagraph().Next().GetNumbering(list2, level));
+  CHECK(list1 != list2);
+  CHECK(level == 0);
+
+  CHECK(merged.Save("test_concat_append.docx"));
+  const std::string rels = ReadEntry("test_concat_append.docx", "word/_rels/document.xml.rels");
+  CHECK(Count(rels, "https://example.com/a") == 1);
+  CHECK(Count(rels, "https://example.com/b") == 1);
+
+  // bookmarks named as ours get a suffix, the links and fields of that body follow them
+  Document linked;
+  BuildPart(linked, "first", "https://example.com/a");
+  linked.AppendParagraph().AppendHyperlink("#first", "to first");
+  linked.ImportMarkdown("# Heading\n");
+  CHECK(linked.InsertTableOfContents(linked.FirstParagraph()) == 1);
+  std::string toc;
+  for (auto& bookmark : linked.GetBookmarks()) {
+    if (bookmark.GetName() != "first") toc = bookmark.GetName();
+  }
+  Document twice;
+  BuildPart(twice, "first", "https://example.com/a");
+  CHECK(twice.Append(linked));
+  CHECK(twice.Append(linked));
+  CHECK(twice.GetBookmarks().size() == 5);
+  CHECK(twice.FindBookmark("first") && twice.FindBookmark("first_2") && twice.FindBookmark("first_3"));
+  CHECK(twice.FindBookmark(toc) && twice.FindBookmark(toc + "_2"));
+  CHECK(twice.Save("test_concat_renamed.docx"));
+  std::string renamed = ReadEntry("test_concat_renamed.docx", "word/document.xml");
+  CHECK(Count(renamed, "w:anchor=\"first\"") == 0);
+  CHECK(Count(renamed, "w:anchor=\"first_2\"") == 1);
+  CHECK(Count(renamed, "w:anchor=\"first_3\"") == 1);
+  CHECK(Count(renamed, "w:anchor=\"" + toc + "\"") == 1);
+  CHECK(Count(renamed, "w:anchor=\"" + toc + "_2\"") == 1);
+  CHECK(Count(renamed, "PAGEREF " + toc + " ") == 1);
+  CHECK(Count(renamed, "PAGEREF " + toc + "_2 ") == 1);
+
+  // Concat() renames them the same way
+  CHECK(linked.Save("test_concat_linked.docx"));
+  CHECK(Concat({ "test_concat_linked.docx", "test_concat_linked.docx" }, "test_concat_renamed.docx"));
+  Document concatRenamed;
+  CHECK(concatRenamed.Open("test_concat_renamed.docx"));
+  CHECK(concatRenamed.GetBookmarks().size() == 4);
+  CHECK(concatRenamed.FindBookmark("first_2") && concatRenamed.FindBookmark(toc + "_2"));
+  renamed = ReadEntry("test_concat_renamed.docx", "word/document.xml");
+  CHECK(Count(renamed, "w:anchor=\"first\"") == 1);
+  CHECK(Count(renamed, "w:anchor=\"first_2\"") == 1);
+  CHECK(Count(renamed, "w:anchor=\"" + toc + "_2\"") == 1);
+  CHECK(Count(renamed, "PAGEREF " + toc + " ") == 1);
+  CHECK(Count(renamed, "PAGEREF " + toc + "_2 ") == 1);
+
+  // appending to itself fails, an empty document changes nothing
+  CHECK(!merged.Append(merged));
+  Document empty;
+  CHECK(merged.Append(empty));
+  CHECK(CountSections(merged) == 3);
+
+  // the picture and header an opened document read from its archive are copied
+  {
+    Document pictured;
+    BuildPictured(pictured, RED_PNG, sizeof(RED_PNG), "opened header");
+    CHECK(pictured.Save("test_concat_pictured.docx"));
+  }
+  Document opened;
+  CHECK(opened.Open("test_concat_pictured.docx"));
+  Document target;
+  BuildPictured(target, BLUE_PNG, sizeof(BLUE_PNG), "target header");
+  CHECK(target.Append(opened));
+  CHECK(target.Save("test_concat_opened.docx"));
+  CHECK(Resolves("test_concat_opened.docx"));
+  std::map<std::string, std::string> entries = ReadEntries("test_concat_opened.docx");
+  CHECK(CountEntries(entries, "word/media/", "PNG") == 2);
+  CHECK(CountEntries(entries, "word/header", "opened header") == 1);
+  CHECK(CountEntries(entries, "word/header", "target header") == 1);
+
+  // and again after an incremental save, the names taken are not reused
+  Document reopened;
+  CHECK(reopened.Open("test_concat_opened.docx"));
+  CHECK(reopened.Append(opened));
+  CHECK(reopened.Save("test_concat_opened.docx"));
+  CHECK(Resolves("test_concat_opened.docx"));
+  entries = ReadEntries("test_concat_opened.docx");
+  CHECK(CountEntries(entries, "word/media/", "PNG") == 3);
+  CHECK(CountEntries(entries, "word/header", "opened header") == 2);
+
+  // a part that cannot be read fails the append and leaves the document alone
+  CHECK(std::remove("test_concat_pictured.docx") == 0);
+  Document left;
+  left.AppendParagraph("alone");
+  CHECK(!left.Append(opened));
+  CHECK(left.FirstParagraph() == left.LastParagraph());
+
+  // Concat(): the same from the files
+  CHECK(a.Save("test_concat_a.docx"));
+  CHECK(b.Save("test_concat_b.docx"));
+  CHECK(Concat({ "test_concat_a.docx", "test_concat_b.docx", "test_concat_a.docx" }, "test_concat.docx"));
+
+  Document concat;
+  CHECK(concat.Open("test_concat.docx"));
+  CHECK(CountSections(concat) == 4);
+  CHECK(concat.FirstParagraph().GetText() == "first");
+  CHECK(concat.LastSection().FirstParagraph().GetText() == "first");
+
+  // each bookmark has an id of its own
+  auto bookmarks = concat.GetBookmarks();
+  CHECK(bookmarks.size() == 3);
+  CHECK(concat.FindBookmark("first") && concat.FindBookmark("second") && concat.FindBookmark("first_2"));
+  for (size_t i = 1; i < bookmarks.size(); i++) {
+    CHECK(bookmarks[i - 1].GetId() < bookmarks[i].GetId());
+  }
+
+  // the links still point to their targets
+  const std::string xml = ReadEntry("test_concat.docx", "word/document.xml");
+  const std::string concatRels = ReadEntry("test_concat.docx", "word/_rels/document.xml.rels");
+  CHECK(Count(xml, "<w:hyperlink") == 3);
+  CHECK(concatRels.find("https://example.com/a") != std::string::npos);
+  CHECK(concatRels.find("https://example.com/b") != std::string::npos);
+
+  // the lists of the later inputs are added under ids of their own
+  std::vector<int> lists;
+  for (auto p = concat.FirstParagraph(); p; p = p.Next()) {
+    int list = 0;
+    if (p.GetText().find(" item") != std::string::npos && p.GetNumbering(list, level)) lists.push_back(list);
+  }
+  CHECK(lists.size() == 3);
+  CHECK(lists[0] != lists[1] && lists[1] != lists[2] && lists[0] != lists[2]);
+  const std::string numbering = ReadEntry("test_concat.docx", "word/numbering.xml");
+  CHECK(Count(numbering, "<w:num ") == 3);
+  CHECK(Count(numbering, "<w:abstractNum ") == 3);
+  CHECK(Count(concatRels, "relationships/numbering\"") == 1);
+
+  // a list of a later input only
+  Document plain;
+  plain.AppendParagraph("plain");
+  CHECK(plain.Save("test_concat_plain.docx"));
+  CHECK(Concat({ "test_concat_plain.docx", "test_concat_b.docx" }, "test_concat_lists.docx"));
+  CHECK(Count(ReadEntry("test_concat_lists.docx", "word/numbering.xml"), "<w:num ") == 1);
+  CHECK(Resolves("test_concat_lists.docx"));
+
+  // footnotes are kept from one input, a second input with notes fails
+  const std::string note = "<w:footnote w:id=\"1\"><w:p><w:r><w:t>note</w:t></w:r></w:p></w:footnote>";
+  AddFootnotes("test_concat_a.docx", "test_concat_notes.docx", note);
+  AddFootnotes("test_concat_b.docx", "test_concat_separator.docx", "");
+  CHECK(Concat({ "test_concat_b.docx", "test_concat_notes.docx" }, "test_concat_footnotes.docx"));
+  CHECK(Count(ReadEntry("test_concat_footnotes.docx", "word/footnotes.xml"), ">note<") == 1);
+  CHECK(Concat({ "test_concat_notes.docx", "test_concat_separator.docx" }, "test_concat_footnotes.docx"));
+  std::map<std::string, std::string> concatEntries = ReadEntries("test_concat_footnotes.docx");
+  CHECK(CountEntries(concatEntries, "word/footnotes", "") == 1);
+  CHECK(Count(concatEntries["word/footnotes.xml"], ">note<") == 1);
+  CHECK(!Concat({ "test_concat_notes.docx", "test_concat_b.docx", "test_concat_notes.docx" }, "test_concat_conflict.docx"));
+  CHECK(std::fopen("test_concat_conflict.docx", "rb") == NULL);
+
+  // a missing input fails
+  CHECK(!Concat({ "test_concat_a.docx", "missing.docx" }, "test_concat_missing.docx"));
+  return 0;
+}
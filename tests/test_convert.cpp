@@ -0,0 +1,81 @@
+#include <sstream>
+
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+int main()
+{
+  Document doc;
+  doc.AppendParagraph("Plain & <text>");
+  auto p = doc.AppendParagraph();
+  p.AppendRun("bold").SetFontStyle(Run::Bold);
+  p.AppendRun(" and ");
+  p.AppendRun("italic ").SetFontStyle(Run::Italic);
+  p.AppendRun("both").SetFontStyle(Run::Bold | Run::Italic);
+  doc.AppendParagraph().AppendRun().AppendTextWithBreaks("a\tb\nc");
+  const int list = doc.AddList(Document::ListFormat::Bullet);
+  doc.AppendParagraph("one").SetNumbering(list);
+  doc.AppendParagraph("two").SetNumbering(list);
+  auto tbl = doc.AppendTable(2, 2);
+  tbl.GetCell(0, 0).FirstParagraph().AppendRun("h1");
+  tbl.GetCell(0, 1).FirstParagraph().AppendRun("h2");
+  tbl.GetCell(1, 0).FirstParagraph().AppendRun("c|1");
+  tbl.GetCell(1, 1).FirstParagraph().AppendRun("c2");
+  doc.AppendParagraph("*stars*");
+  CHECK(doc.Save("test_convert.docx"));
+
+  std::ostringstream text;
+  CHECK(ToText("test_convert.docx", text));
+  CHECK(text.str() ==
+    "Plain & <text>\n"
+    "bold and italic both\n"
+    "a\tb\nc\n"
+    "one\n"
+    "two\n"
+    "h1\th2\n"
+    "c|1\tc2\n"
+    "*stars*\n");
+
+  // emphasis keeps the spaces outside the markers, special characters are escaped
+  std::ostringstream markdown;
+  CHECK(ToMarkdown("test_convert.docx", markdown));
+  CHECK(markdown.str() ==
+    "Plain & \\<text\\>\n\n"
+    "**bold** and *italic* ***both***\n\n"
+    "a\tb  \nc\n\n"
+    "- one\n"
+    "- two\n\n"
+    "| h1 | h2 |\n"
+    "| --- | --- |\n"
+    "| c\\|1 | c2 |\n\n"
+    "\\*stars\\*\n\n");
+
+  std::ostringstream html;
+  CHECK(ToHtml("test_convert.docx", html));
+  CHECK(html.str() ==
+    "<p>Plain &amp; &lt;text&gt;</p>\n"
+    "<p><strong>bold</strong> and <em>italic</em> <strong><em>both</em></strong></p>\n"
+    "<p>a&emsp;b<br/>c</p>\n"
+    "<ul>\n<li>one</li>\n<li>two</li>\n</ul>\n"
+    "<table>\n"
+    "<tr><td>h1</td><td>h2</td></tr>\n"
+    "<tr><td>c|1</td><td>c2</td></tr>\n"
+    "</table>\n"
+    "<p>*stars*</p>\n");
+
+  // a large document comes out whole
+  Document large;
+  for (int i = 0; i < 20000; i++) large.AppendParagraph("paragraph " + std::to_string(i));
+  CHECK(large.Save("test_convert_large.docx"));
+  std::ostringstream out;
+  CHECK(ToText("test_convert_large.docx", out));
+  CHECK(Count(out.str(), "\n") == 20000);
+  CHECK(out.str().compare(out.str().size() - 16, 16, "paragraph 19999\n") == 0);
+
+  // a missing input fails
+  std::ostringstream none;
+  CHECK(!ToHtml("missing.docx", none));
+  return 0;
+}
@@ -0,0 +1,78 @@
+#include <thread>
+#include <vector>
+
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+// a chapter: a heading, two paragraphs and a table
+void BuildChapter(Fragment& f, const int n)
+{
+  const std::string name = "Chapter " + std::to_string(n);
+  f.AppendParagraph(name, 16);
+  for (int i = 1; i <= 2; i++) {
+    f.AppendParagraph(name + "." + std::to_string(i));
+  }
+  auto tbl = f.AppendTable(2, 2);
+  tbl.GetCell(0, 0).FirstParagraph().AppendRun(name + " cell");
+}
+
+int main()
+{
+  const int chapters = 4;
+
+  // the chapters are built on worker threads, the document is not touched
+  std::vector<Fragment> fragments(chapters);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < chapters; i++) {
+    workers.push_back(std::thread(BuildChapter, std::ref(fragments[i]), i + 1));
+  }
+  for (auto& worker : workers) worker.join();
+
+  Document doc;
+  doc.AppendParagraph("Title");
+  CHECK(doc.GetStatistics().paragraphs == 1);
+  for (auto& f : fragments) {
+    doc.AppendFragment(std::move(f));
+    // the fragment is left empty
+    CHECK(!f.FirstParagraph());
+  }
+  doc.AppendParagraph("End");
+
+  // the paragraphs follow in the order of the fragments
+  std::vector<std::string> texts;
+  for (auto p = doc.FirstParagraph(); p; p = p.Next()) texts.push_back(p.GetText());
+  CHECK(texts.size() == 2 + chapters * 3);
+  CHECK(texts.front() == "Title");
+  CHECK(texts.back() == "End");
+  for (int i = 0; i < chapters; i++) {
+    const std::string name = "Chapter " + std::to_string(i + 1);
+    CHECK(texts[1 + i * 3] == name);
+    CHECK(texts[2 + i * 3] == name + ".1");
+    CHECK(texts[3 + i * 3] == name + ".2");
+  }
+
+  // the appended content is counted and belongs to the single section
+  CHECK(doc.GetStatistics().paragraphs == 2 + chapters * 4);
+  CHECK(doc.LastParagraph().GetSection() == doc.FirstSection());
+  CHECK(!doc.FirstSection().Next());
+
+  // appending an empty fragment changes nothing
+  Fragment empty;
+  doc.AppendFragment(std::move(empty));
+  CHECK(doc.LastParagraph().GetText() == "End");
+
+  CHECK(doc.Save("test_fragment.docx"));
+  const std::string xml = ReadEntry("test_fragment.docx", "word/document.xml");
+  CHECK(Count(xml, "<w:tbl>") == chapters);
+  CHECK(Count(xml, " cell</w:t>") == chapters);
+  // the body still ends with its w:sectPr
+  CHECK(xml.find("</w:tbl>") < xml.rfind("<w:sectPr"));
+
+  Document reopened;
+  CHECK(reopened.Open("test_fragment.docx"));
+  CHECK(reopened.FirstParagraph().Next().GetText() == "Chapter 1");
+  CHECK(reopened.LastParagraph().GetText() == "End");
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+int main()
+{
+  Document doc;
+  doc.AppendParagraph("first section");
+  doc.AppendSectionBreak();
+  doc.AppendParagraph("second section");
+  doc.AppendSectionBreak();
+  doc.AppendParagraph("third section");
+
+  auto first = doc.FirstSection();
+  auto second = first.Next();
+  auto third = doc.LastSection();
+  CHECK(second && third);
+
+  // sections with the same content share a part
+  Fragment header;
+  header.AppendParagraph("Shared header");
+  CHECK(first.SetHeader(header));
+  CHECK(second.SetHeader(header));
+
+  Fragment footer;
+  footer.AppendParagraph("Custom footer");
+  CHECK(second.SetFooter(footer));
+  CHECK(third.SetFooter(footer, Section::HeaderFooterType::First));
+
+  // RemovePageNumber drops the footer SetPageNumber added, but not one set with SetFooter
+  first.SetPageNumber();
+  first.RemovePageNumber();
+  second.RemovePageNumber();
+  third.SetPageNumber(Section::PageNumberFormat::LowerRoman, 3);
+
+  CHECK(doc.Save("test_header_footer.docx"));
+  const std::string xml = ReadEntry("test_header_footer.docx", "word/document.xml");
+  CHECK(Count(xml, "<w:headerReference") == 2);
+  CHECK(Count(xml, "<w:footerReference") == 3);
+  CHECK(Count(xml, "<w:titlePg") == 1);
+  CHECK(Count(xml, "w:fmt=\"lowerRoman\"") == 1);
+
+  CHECK(ReadEntry("test_header_footer.docx", "word/header1.xml").find("Shared header") != std::string::npos);
+  CHECK(ReadEntry("test_header_footer.docx", "word/header2.xml").empty());
+  CHECK(ReadEntry("test_header_footer.docx", "word/footer1.xml").find("Custom footer") != std::string::npos);
+  const std::string types = ReadEntry("test_header_footer.docx", "[Content_Types].xml");
+  CHECK(Count(types, "wordprocessingml.header+xml") == 1);
+
+  // the parts survive an incremental save
+  Document reopened;
+  CHECK(reopened.Open("test_header_footer.docx"));
+  reopened.AppendParagraph("more");
+  CHECK(reopened.Save("test_header_footer.docx"));
+  CHECK(ReadEntry("test_header_footer.docx", "word/header1.xml").find("Shared header") != std::string::npos);
+  return 0;
+}
@@ -0,0 +1,55 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+int main()
+{
+  const int links = 100000;
+  const int urls = 100;
+
+  // many links to a few URLs
+  Document doc;
+  auto p = doc.AppendParagraph();
+  for (int i = 0; i < links; i++) {
+    auto r = p.AppendHyperlink("https://example.com/page?id=" + std::to_string(i % urls) + "&tab=1", "link");
+    CHECK(r);
+  }
+
+  // the run takes the link formatting and counts as text
+  auto r = doc.AppendParagraph("see ").AppendHyperlink("https://example.com/other", "other page");
+  CHECK(r.GetText() == "other page");
+  CHECK(r.GetFontColor() == "0563C1");
+  CHECK(doc.GetStatistics().words == 1 + 3); // "linklink..." is one word
+  CHECK(doc.GetStatistics().characters == 4 * links + 12);
+
+  // links to bookmarks need no relationship, in fragments too
+  CHECK(doc.AppendParagraph().AppendHyperlink("#top", "top"));
+  Fragment f;
+  CHECK(f.AppendParagraph().AppendHyperlink("#top", "top"));
+  CHECK(!f.AppendParagraph().AppendHyperlink("https://example.com", "external"));
+  CHECK(!doc.AppendParagraph().AppendHyperlink("", "empty"));
+
+  // a link in a table cell
+  auto tbl = doc.AppendTable(1, 1);
+  CHECK(tbl.GetCell(0, 0).FirstParagraph().AppendHyperlink("https://example.com/other", "cell"));
+
+  CHECK(doc.Save("test_hyperlinks.docx"));
+  const std::string rels = ReadEntry("test_hyperlinks.docx", "word/_rels/document.xml.rels");
+  const std::string xml = ReadEntry("test_hyperlinks.docx", "word/document.xml");
+
+  // one relationship per URL, escaped
+  CHECK(Count(rels, "relationships/hyperlink\"") == urls + 1);
+  CHECK(Count(rels, "TargetMode=\"External\"") == urls + 1);
+  CHECK(rels.find("Target=\"https://example.com/page?id=7&amp;tab=1\"") != std::string::npos);
+  CHECK(Count(xml, "<w:hyperlink r:id=") == links + 2);
+  CHECK(Count(xml, "<w:hyperlink w:anchor=\"top\"") == 1);
+
+  // the links survive Open() and Save()
+  Document opened;
+  CHECK(opened.Open("test_hyperlinks.docx"));
+  CHECK(opened.AppendParagraph().AppendHyperlink("https://example.com/page?id=7&tab=1", "again"));
+  CHECK(opened.Save("test_hyperlinks.docx"));
+  CHECK(Count(ReadEntry("test_hyperlinks.docx", "word/_rels/document.xml.rels"), "relationships/hyperlink\"") == urls + 1);
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+// the text of each run of a paragraph, '*' after bold and '/' after italic ones
+std::string Runs(Paragraph p)
+{
+  std::string runs;
+  for (auto r = p.FirstRun(); r; r = r.Next()) {
+    runs += "[" + r.GetText();
+    if (r.GetFontStyle() & Run::Bold) runs += "*";
+    if (r.GetFontStyle() & Run::Italic) runs += "/";
+    runs += "]";
+  }
+  return runs;
+}
+
+// the list of a paragraph, 0 if it is not a list item
+int List(Paragraph p)
+{
+  int list = 0, level = 0;
+  return p.GetNumbering(list, level) ? list : 0;
+}
+
+int main()
+{
+  Document html;
+  html.AppendParagraph("before");
+  CHECK(html.GetStatistics().words == 1);
+  html.ImportHtml(
+    "<h2>Title &amp; more</h2>"
+    "<p>Some <b>bold</b>, <i>italic</i> and <code>x</code><br>next</p>"
+    "<ul><li>a</li><li>b</li></ul><ol><li>one</li></ol>"
+    "<blockquote>quoted</blockquote>"
+    "<table><tr><th>h</th><td>c</td></tr></table>"
+    "<p><a href=\"https://example.com\">link</a></p>"
+    "<script>bad()</script><img src=\"x.png\">"
+    "<p>&copy; &#169; &#xA9;</p>");
+
+  auto p = html.FirstParagraph().Next();
+  CHECK(p.GetText() == "Title & more");
+  p = p.Next();
+  CHECK(Runs(p) == "[Some][ bold*][,][ italic/][ and][ x][next]");
+  auto a = p.Next();
+  auto b = a.Next();
+  auto one = b.Next();
+  CHECK(a.GetText() == "a" && b.GetText() == "b" && one.GetText() == "one");
+  CHECK(List(a) != 0 && List(a) == List(b));
+  CHECK(List(one) != 0 && List(one) != List(a));
+  CHECK(List(one.Next()) == 0);
+  CHECK(one.Next().GetText() == "quoted");
+  CHECK(html.LastParagraph().GetText() == "\xC2\xA9 \xC2\xA9 \xC2\xA9");
+
+  CHECK(html.Save("test_import_html.docx"));
+
+  // the statistics kept up to date include the imported text, as a fresh count does
+  const DocumentStatistics stats = html.GetStatistics();
+  Document counted;
+  CHECK(counted.Open("test_import_html.docx"));
+  CHECK(stats.words == counted.GetStatistics().words);
+  CHECK(stats.characters == counted.GetStatistics().characters);
+  CHECK(stats.words == 20);
+
+  std::string xml = ReadEntry("test_import_html.docx", "word/document.xml");
+  CHECK(xml.find("<w:outlineLvl w:val=\"1\"/>") != std::string::npos);
+  CHECK(xml.find("Courier New") != std::string::npos);
+  CHECK(xml.find("<w:ind w:left=\"720\"/>") != std::string::npos);
+  CHECK(Count(xml, "<w:tbl>") == 1);
+  CHECK(xml.find("<w:hyperlink r:id=") != std::string::npos);
+  CHECK(xml.find("bad()") == std::string::npos);
+  CHECK(xml.find("<w:drawing>") == std::string::npos);
+  CHECK(Count(ReadEntry("test_import_html.docx", "word/_rels/document.xml.rels"), "https://example.com") == 1);
+  CHECK(ReadEntry("test_import_html.docx", "word/numbering.xml").find("w:val=\"decimal\"") != std::string::npos);
+
+  Document markdown;
+  markdown.ImportMarkdown(
+    "# Head\n"
+    "\n"
+    "Some **bold** and *it* and `code`  \n"
+    "break\n"
+    "\n"
+    "- a\n"
+    "- b\n"
+    "\n"
+    "1. one\n"
+    "2. two\n"
+    "\n"
+    "> quote\n"
+    "\n"
+    "| h | i |\n"
+    "|---|---|\n"
+    "| 1 | 2 |\n"
+    "\n"
+    "[link](https://example.com)\n");
+
+  p = markdown.FirstParagraph();
+  CHECK(p.GetText() == "Head");
+  p = p.Next();
+  CHECK(p.GetText() == "Some bold and it and codebreak");
+  a = p.Next();
+  b = a.Next();
+  one = b.Next();
+  auto two = one.Next();
+  CHECK(List(a) != 0 && List(a) == List(b));
+  CHECK(List(one) != 0 && List(one) == List(two) && List(one) != List(a));
+  CHECK(two.Next().GetText() == "quote");
+
+  CHECK(markdown.Save("test_import_markdown.docx"));
+  xml = ReadEntry("test_import_markdown.docx", "word/document.xml");
+  CHECK(xml.find("<w:outlineLvl w:val=\"0\"/>") != std::string::npos);
+  CHECK(Count(xml, "<w:br/>") == 1);
+  CHECK(Count(xml, "<w:tr>") == 2);
+  CHECK(xml.find(">link</w:t>") != std::string::npos);
+
+  // both open again
+  Document opened;
+  CHECK(opened.Open("test_import_html.docx"));
+  CHECK(opened.Open("test_import_markdown.docx"));
+  return 0;
+}
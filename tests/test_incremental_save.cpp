@@ -0,0 +1,93 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+#include <cstring>
+
+using namespace docx;
+
+bool FileExists(const char* path)
+{
+  FILE* f = std::fopen(path, "rb");
+  if (f != NULL) std::fclose(f);
+  return f != NULL;
+}
+
+int main()
+{
+  {
+    Document doc;
+    doc.AppendParagraph("hello");
+    CHECK(doc.Save("test_incremental_save.docx"));
+  }
+
+  // a part the library knows nothing about
+  static const char ITEM[] = "<root>custom</root>";
+  struct zip_t* zip = zip_open("test_incremental_save.docx", ZIP_DEFAULT_COMPRESSION_LEVEL, 'a');
+  CHECK(zip != NULL);
+  zip_entry_open(zip, "customXml/item1.xml");
+  zip_entry_write(zip, ITEM, std::strlen(ITEM));
+  zip_entry_close(zip);
+  zip_close(zip);
+
+  // a handle taken before a save still changes what the next save writes
+  Document doc;
+  CHECK(doc.Open("test_incremental_save.docx"));
+  auto p = doc.FirstParagraph();
+  CHECK(doc.Save("test_incremental_save.docx"));
+  p.AppendRun(" world");
+  CHECK(doc.Save("test_incremental_save.docx"));
+  CHECK(!FileExists("test_incremental_save.docx.tmp"));
+  {
+    Document reopened;
+    CHECK(reopened.Open("test_incremental_save.docx"));
+    CHECK(reopened.FirstParagraph().GetText() == "hello world");
+  }
+
+  // saving to another path leaves the source alone and keeps every entry
+  std::map<std::string, std::string> before = ReadEntries("test_incremental_save.docx");
+  doc.AppendParagraph("again");
+  CHECK(doc.Save("test_incremental_save_copy.docx"));
+  std::map<std::string, std::string> after = ReadEntries("test_incremental_save_copy.docx");
+  CHECK(ReadEntries("test_incremental_save.docx") == before);
+  CHECK(after["customXml/item1.xml"] == ITEM);
+  CHECK(after["word/document.xml"] != before["word/document.xml"]);
+  {
+    Document reopened;
+    CHECK(reopened.Open("test_incremental_save_copy.docx"));
+    CHECK(reopened.LastParagraph().GetText() == "again");
+  }
+
+  // a metadata-only save rewrites word/settings.xml alone
+  Document meta;
+  CHECK(meta.Open("test_incremental_save_copy.docx"));
+  std::map<std::string, std::string> vars;
+  vars["version"] = "2";
+  meta.SetVars(vars);
+  CHECK(meta.Save("test_incremental_save_copy.docx"));
+  std::map<std::string, std::string> saved = ReadEntries("test_incremental_save_copy.docx");
+  CHECK(saved.size() == after.size());
+  for (std::map<std::string, std::string>::const_iterator it = after.begin(); it != after.end(); ++it) {
+    if (it->first != "word/settings.xml") CHECK(saved[it->first] == it->second);
+  }
+  CHECK(saved["word/settings.xml"] != after["word/settings.xml"]);
+  {
+    Document reopened;
+    CHECK(reopened.Open("test_incremental_save_copy.docx"));
+    CHECK(reopened.GetVars()["version"] == "2");
+  }
+
+  // a failed save leaves the source as it was
+  CHECK(!doc.Save("no/such/directory/test_incremental_save.docx"));
+  CHECK(ReadEntries("test_incremental_save.docx") == before);
+
+  // without its source the package cannot be written, nor half of it
+  {
+    Document moved;
+    CHECK(moved.Open("test_incremental_save_copy.docx"));
+    moved.AppendParagraph("moved");
+    CHECK(std::rename("test_incremental_save_copy.docx", "test_incremental_save_moved.docx") == 0);
+    CHECK(!moved.Save("test_incremental_save_copy.docx"));
+    CHECK(!FileExists("test_incremental_save_copy.docx"));
+  }
+  return 0;
+}
@@ -0,0 +1,81 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+// the page count of a fresh estimate
+int Pages(Document& doc)
+{
+  LayoutEstimate layout;
+  layout.Build(doc);
+  return layout.GetPageCount();
+}
+
+int main()
+{
+  std::string text;
+  for (int i = 0; i < 100; i++) text += "word ";
+
+  Document doc;
+  auto p1 = doc.AppendParagraph("short");
+  auto p2 = doc.AppendParagraph(text);
+  auto p3 = doc.AppendParagraph(text, 24);
+  doc.AppendPageBreak();
+  auto p4 = doc.AppendParagraph("after the break");
+
+  LayoutEstimate layout;
+  layout.Build(doc);
+  CHECK(layout.GetPageCount() == 2);
+  CHECK(layout.GetLineCount(p1) == 1);
+  CHECK(layout.GetLineCount(p2) > 1);
+  // larger text takes more lines
+  CHECK(layout.GetLineCount(p3) > 2 * layout.GetLineCount(p2));
+  CHECK(layout.GetPage(p1) == 1);
+  CHECK(layout.GetPage(p4) == 2);
+
+  // paragraphs that are not laid out
+  Paragraph none;
+  CHECK(layout.GetPage(none) == 0);
+  CHECK(layout.GetLineCount(none) == 0);
+  Fragment f;
+  CHECK(layout.GetPage(f.AppendParagraph("elsewhere")) == 0);
+
+  // Update() after adding and editing gives what a fresh estimate gives
+  for (int i = 0; i < 100; i++) layout.Update(doc.AppendParagraph("line " + std::to_string(i)));
+  CHECK(layout.GetPageCount() > 2);
+  CHECK(layout.GetPageCount() == Pages(doc));
+  const int lines = layout.GetLineCount(p1);
+  p1.FirstRun().AppendText(" " + text + text);
+  layout.Update(p1);
+  CHECK(layout.GetLineCount(p1) > lines);
+  CHECK(layout.GetPageCount() == Pages(doc));
+
+  // Remove() before removing
+  const int pages = layout.GetPageCount();
+  layout.Remove(p3);
+  CHECK(doc.RemoveParagraph(p3));
+  CHECK(layout.GetPageCount() < pages);
+  CHECK(layout.GetPageCount() == Pages(doc));
+
+  // table rows and narrower pages take room
+  const int before = Pages(doc);
+  doc.AppendTable(60, 2);
+  CHECK(Pages(doc) > before);
+  const int portrait = Pages(doc);
+  doc.FirstSection().SetPageOrient(Section::Orientation::Landscape);
+  CHECK(Pages(doc) > portrait);
+
+  // a section break starts a new page
+  Document sections;
+  sections.AppendParagraph("first").InsertSectionBreak();
+  auto second = sections.AppendParagraph("second");
+  LayoutEstimate sectionLayout;
+  sectionLayout.Build(sections);
+  CHECK(sectionLayout.GetPageCount() == 2);
+  CHECK(sectionLayout.GetPage(second) == 2);
+
+  // an empty document has one page
+  Document empty;
+  CHECK(Pages(empty) == 1);
+  return 0;
+}
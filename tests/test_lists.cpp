@@ -0,0 +1,84 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+int main()
+{
+  const int lists = 2000;
+
+  Document doc;
+  const int bullets = doc.AddList();
+  CHECK(bullets > 0);
+  auto p = doc.AppendParagraph("bullet");
+  p.SetNumbering(bullets);
+  auto nested = doc.AppendParagraph("nested");
+  nested.SetNumbering(bullets, 1);
+
+  // many numbered lists, each starting at 1
+  std::vector<int> ids;
+  for (int i = 0; i < lists; i++) {
+    const int list = doc.AddList(Document::ListFormat::Decimal);
+    CHECK(list > 0);
+    doc.AppendParagraph("item " + std::to_string(i)).SetNumbering(list);
+    ids.push_back(list);
+  }
+  for (size_t i = 1; i < ids.size(); i++) CHECK(ids[i] > ids[i - 1]);
+
+  int list = 0, level = -1;
+  CHECK(p.GetNumbering(list, level));
+  CHECK(list == bullets && level == 0);
+  CHECK(nested.GetNumbering(list, level));
+  CHECK(list == bullets && level == 1);
+  CHECK(doc.LastParagraph().GetNumbering(list, level));
+  CHECK(list == ids.back());
+
+  // levels are kept from 0 to 8
+  nested.SetNumbering(bullets, 12);
+  CHECK(nested.GetNumbering(list, level) && level == 8);
+  nested.SetNumbering(bullets, 3);
+  CHECK(nested.GetNumbering(list, level) && level == 3);
+
+  // a paragraph stops being an item
+  auto plain = doc.AppendParagraph("plain");
+  CHECK(!plain.GetNumbering(list, level));
+  plain.SetNumbering(bullets);
+  plain.RemoveNumbering();
+  CHECK(!plain.GetNumbering(list, level));
+
+  CHECK(doc.Save("test_lists.docx"));
+
+  // one definition per format, a small w:num per list
+  std::string numbering = ReadEntry("test_lists.docx", "word/numbering.xml");
+  CHECK(Count(numbering, "<w:abstractNum ") == 2);
+  CHECK(Count(numbering, "<w:num ") == lists + 1);
+  CHECK(Count(numbering, "<w:startOverride w:val=\"1\"/>") == lists);
+  CHECK(numbering.size() < 200 * static_cast<size_t>(lists));
+  CHECK(Count(ReadEntry("test_lists.docx", "word/_rels/document.xml.rels"), "relationships/numbering\"") == 1);
+  CHECK(Count(ReadEntry("test_lists.docx", "[Content_Types].xml"), "/word/numbering.xml") == 1);
+
+  // after Open() new lists share the existing definitions
+  Document opened;
+  CHECK(opened.Open("test_lists.docx"));
+  CHECK(opened.FirstParagraph().GetNumbering(list, level));
+  CHECK(list == bullets && level == 0);
+  const int more = opened.AddList(Document::ListFormat::Decimal);
+  CHECK(more > ids.back());
+  const int roman = opened.AddList(Document::ListFormat::UpperRoman);
+  CHECK(roman > more);
+  opened.AppendParagraph("more").SetNumbering(more);
+  opened.AppendParagraph("roman").SetNumbering(roman);
+  CHECK(opened.Save("test_lists.docx"));
+
+  numbering = ReadEntry("test_lists.docx", "word/numbering.xml");
+  CHECK(Count(numbering, "<w:abstractNum ") == 3);
+  CHECK(Count(numbering, "<w:num ") == lists + 3);
+  CHECK(numbering.find("w:val=\"upperRoman\"") != std::string::npos);
+
+  // a document without lists has no numbering part
+  Document none;
+  none.AppendParagraph("no lists");
+  CHECK(none.Save("test_lists_none.docx"));
+  CHECK(ReadEntries("test_lists_none.docx").count("word/numbering.xml") == 0);
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include <set>
+
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+// the values of an attribute throughout a part
+std::vector<std::string> Values(const std::string& xml, const std::string& attribute)
+{
+  std::vector<std::string> values;
+  const std::string key = " " + attribute + "=\"";
+  for (size_t pos = xml.find(key); pos != std::string::npos; pos = xml.find(key, pos + 1)) {
+    const size_t begin = pos + key.size();
+    values.push_back(xml.substr(begin, xml.find('"', begin) - begin));
+  }
+  return values;
+}
+
+// true if no value occurs twice
+bool Distinct(const std::vector<std::string>& values)
+{
+  return std::set<std::string>(values.begin(), values.end()).size() == values.size();
+}
+
+int main()
+{
+  const int links = 10000;
+
+  // many links, each URL twice, with a header and a list
+  Document doc;
+  for (int i = 0; i < links; i++) {
+    const std::string url = "https://example.com/" + std::to_string(i);
+    auto p = doc.AppendParagraph();
+    CHECK(p.AppendHyperlink(url, "link"));
+    CHECK(p.AppendHyperlink(url, "again"));
+  }
+  Fragment header;
+  header.AppendParagraph("header");
+  CHECK(doc.FirstSection().SetHeader(header));
+  doc.LastParagraph().SetNumbering(doc.AddList());
+  CHECK(doc.Save("test_package.docx"));
+
+  std::string rels = ReadEntry("test_package.docx", "word/_rels/document.xml.rels");
+  std::string types = ReadEntry("test_package.docx", "[Content_Types].xml");
+
+  // one relationship per URL, each with an id of its own
+  CHECK(Count(rels, "TargetMode=\"External\"") == links);
+  std::vector<std::string> ids = Values(rels, "Id");
+  CHECK(Distinct(ids));
+  CHECK(Count(rels, "relationships/header\"") == 1);
+  CHECK(Count(rels, "relationships/numbering\"") == 1);
+
+  // every part has its content type, once
+  std::vector<std::string> parts = Values(types, "PartName");
+  CHECK(Distinct(parts));
+  CHECK(Count(types, "PartName=\"/word/document.xml\"") == 1);
+  CHECK(Count(types, "PartName=\"/word/header1.xml\"") == 1);
+  CHECK(Count(types, "PartName=\"/word/numbering.xml\"") == 1);
+  CHECK(Distinct(Values(types, "Extension")));
+
+  // the document refers to the relationships that exist
+  const std::string xml = ReadEntry("test_package.docx", "word/document.xml");
+  std::vector<std::string> used = Values(xml, "r:id");
+  const std::set<std::string> known(ids.begin(), ids.end());
+  CHECK(used.size() == 2 * links + 1);
+  for (const auto& id : used) CHECK(known.count(id) > 0);
+
+  // after Open() new ids follow the existing ones and shared URLs are found
+  Document opened;
+  CHECK(opened.Open("test_package.docx"));
+  auto p = opened.AppendParagraph();
+  CHECK(p.AppendHyperlink("https://example.com/0", "old"));
+  CHECK(p.AppendHyperlink("https://example.com/new", "new"));
+  CHECK(opened.Save("test_package.docx"));
+
+  rels = ReadEntry("test_package.docx", "word/_rels/document.xml.rels");
+  types = ReadEntry("test_package.docx", "[Content_Types].xml");
+  ids = Values(rels, "Id");
+  CHECK(ids.size() == known.size() + 1);
+  CHECK(Distinct(ids));
+  CHECK(Count(rels, "https://example.com/0\"") == 1);
+  CHECK(Count(rels, "https://example.com/new\"") == 1);
+  CHECK(Distinct(Values(types, "PartName")));
+  return 0;
+}
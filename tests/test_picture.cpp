@@ -0,0 +1,107 @@
+#include <fstream>
+#include <iterator>
+
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+// 1x1 pixel pictures, red and blue
+const unsigned char RED_PNG[] = {
+  0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+  0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x08, 0x06, 0x00, 0x00, 0x00, 0x1f, 0x15, 0xc4,
+  0x89, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0xf8, 0xcf, 0xc0, 0xf0,
+  0x1f, 0x00, 0x05, 0x00, 0x01, 0xff, 0x89, 0x99, 0x3d, 0x1d, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45,
+  0x4e, 0x44, 0xae, 0x42, 0x60, 0x82
+};
+const unsigned char BLUE_PNG[] = {
+  0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+  0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x08, 0x06, 0x00, 0x00, 0x00, 0x1f, 0x15, 0xc4,
+  0x89, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0x60, 0x60, 0xf8, 0xff,
+  0x1f, 0x00, 0x03, 0x02, 0x01, 0xff, 0xe6, 0x77, 0x0b, 0xae, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45,
+  0x4e, 0x44, 0xae, 0x42, 0x60, 0x82
+};
+
+// the compression method of an entry, read from its local header
+int CompressionMethod(const char* path, const std::string& name)
+{
+  std::ifstream in(path, std::ios::binary);
+  const std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  const std::string signature("PK\x03\x04", 4);
+  for (size_t pos = data.find(signature); pos != std::string::npos; pos = data.find(signature, pos + 1)) {
+    if (pos + 30 > data.size()) break;
+    const size_t nameSize = static_cast<unsigned char>(data[pos + 26]) | static_cast<unsigned char>(data[pos + 27]) << 8;
+    if (data.compare(pos + 30, nameSize, name) == 0)
+      return static_cast<unsigned char>(data[pos + 8]) | static_cast<unsigned char>(data[pos + 9]) << 8;
+  }
+  return -1;
+}
+
+int main()
+{
+  {
+    std::ofstream out("test_picture.png", std::ios::binary);
+    out.write(reinterpret_cast<const char*>(RED_PNG), sizeof(RED_PNG));
+  }
+  const char* red = reinterpret_cast<const char*>(RED_PNG);
+  const char* blue = reinterpret_cast<const char*>(BLUE_PNG);
+
+  // the same red picture from a file and from a buffer, the blue one twice
+  Document doc;
+  auto r = doc.AppendParagraph().AppendRun();
+  CHECK(r.AppendPicture("test_picture.png", 1440, 1440));
+  CHECK(r.AppendPicture("test_picture.png", 720, 720));
+  CHECK(r.AppendPicture(red, sizeof(RED_PNG), 1440, 720));
+  auto r2 = doc.AppendParagraph().AppendRun();
+  CHECK(r2.AppendPicture(blue, sizeof(BLUE_PNG), 1440, 1440));
+  CHECK(r2.AppendPicture(blue, sizeof(BLUE_PNG), 1440, 1440));
+
+  // a large uncompressed bitmap
+  std::string bmp(4096, '\0');
+  bmp[0] = 'B';
+  bmp[1] = 'M';
+  CHECK(r2.AppendPicture(bmp.data(), bmp.size(), 1440, 1440));
+
+  // unknown formats, missing files and fragments fail
+  CHECK(!r.AppendPicture("not a picture", 13, 1440, 1440));
+  CHECK(!r.AppendPicture("missing.png", 1440, 1440));
+  Fragment f;
+  CHECK(!f.AppendParagraph().AppendRun().AppendPicture(red, sizeof(RED_PNG), 1440, 1440));
+
+  CHECK(doc.Save("test_picture.docx"));
+  auto entries = ReadEntries("test_picture.docx");
+
+  // each distinct picture is stored once
+  size_t media = 0;
+  for (const auto& entry : entries) {
+    if (entry.first.compare(0, 11, "word/media/") == 0) media++;
+  }
+  CHECK(media == 3);
+  CHECK(entries["word/media/image1.png"] == std::string(red, sizeof(RED_PNG)));
+  CHECK(entries["word/media/image2.png"] == std::string(blue, sizeof(BLUE_PNG)));
+  CHECK(entries["word/media/image3.bmp"] == bmp);
+
+  const std::string& xml = entries["word/document.xml"];
+  const std::string& rels = entries["word/_rels/document.xml.rels"];
+  const std::string& types = entries["[Content_Types].xml"];
+  CHECK(Count(xml, "<w:drawing>") == 6);
+  CHECK(Count(rels, "relationships/image\"") == 3);
+  CHECK(Count(types, "Extension=\"png\"") == 1);
+  CHECK(Count(types, "Extension=\"bmp\"") == 1);
+
+  // PNG is stored as it is, the bitmap deflated
+  CHECK(CompressionMethod("test_picture.docx", "word/media/image1.png") == 0);
+  CHECK(CompressionMethod("test_picture.docx", "word/media/image3.bmp") == 8);
+
+  // after Open() the pictures are copied and new ones added next to them
+  Document opened;
+  CHECK(opened.Open("test_picture.docx"));
+  auto r3 = opened.AppendParagraph().AppendRun();
+  CHECK(r3.AppendPicture(blue, sizeof(BLUE_PNG), 720, 720));
+  CHECK(opened.Save("test_picture.docx"));
+  entries = ReadEntries("test_picture.docx");
+  CHECK(entries["word/media/image1.png"] == std::string(red, sizeof(RED_PNG)));
+  CHECK(entries["word/media/image2.png"] == std::string(blue, sizeof(BLUE_PNG)));
+  CHECK(Count(entries["word/document.xml"], "<w:drawing>") == 7);
+  return 0;
+}
@@ -0,0 +1,60 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+int main()
+{
+  Document doc;
+  auto p1 = doc.AppendParagraph("Dear NAME, your order ORDER-1 has shipped.");
+
+  // an occurrence across three runs, the first one bold
+  auto p2 = doc.AppendParagraph();
+  auto bold = p2.AppendRun("Contact: NA");
+  bold.SetFontStyle(Run::Bold);
+  p2.AppendRun("M");
+  p2.AppendRun("E today");
+
+  // overlapping patterns: the leftmost and then the longest wins
+  auto p3 = doc.AppendParagraph("ORDER-12 and ORDER-1");
+
+  auto tbl = doc.AppendTable(1, 1);
+  tbl.GetCell(0, 0).FirstParagraph().AppendRun("NAME in a cell");
+
+  const size_t wordsBefore = doc.GetStatistics().words;
+
+  std::vector<std::pair<std::string, std::string> > replacements;
+  replacements.push_back(std::make_pair("NAME", "Ada Lovelace"));
+  replacements.push_back(std::make_pair("ORDER-1", "#100"));
+  replacements.push_back(std::make_pair("ORDER-12", "#200"));
+  CHECK(doc.ReplaceAll(replacements) == 6);
+
+  CHECK(p1.GetText() == "Dear Ada Lovelace, your order #100 has shipped.");
+  CHECK(p2.GetText() == "Contact: Ada Lovelace today");
+  CHECK(p3.GetText() == "#200 and #100");
+
+  // the replacement takes the formatting of the run where it begins
+  CHECK(bold.GetText() == "Contact: Ada Lovelace");
+  CHECK(bold.GetFontStyle() & Run::Bold);
+  CHECK(bold.Next().GetText() == "");
+
+  // the statistics follow: three names gained a word each
+  CHECK(doc.GetStatistics().words == wordsBefore + 3);
+
+  // nothing left to replace
+  CHECK(doc.ReplaceAll(replacements) == 0);
+
+  // empty patterns are ignored, replacing with nothing removes the text
+  replacements.clear();
+  replacements.push_back(std::make_pair("", "x"));
+  replacements.push_back(std::make_pair(" today", ""));
+  CHECK(doc.ReplaceAll(replacements) == 1);
+  CHECK(p2.GetText() == "Contact: Ada Lovelace");
+
+  CHECK(doc.Save("test_replace.docx"));
+  const std::string xml = ReadEntry("test_replace.docx", "word/document.xml");
+  CHECK(Count(xml, "Ada Lovelace") == 3);
+  CHECK(xml.find("NAME") == std::string::npos);
+  CHECK(xml.find("Ada Lovelace in a cell") != std::string::npos);
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+// the text of a new run holding text
+std::string Ingest(Paragraph& p, const std::string& text)
+{
+  auto r = p.AppendRun();
+  r.AppendText(text);
+  return r.GetText();
+}
+
+int main()
+{
+  Document doc;
+  auto p = doc.AppendParagraph();
+
+  // clean text is kept as it is, tabs and line ends included
+  CHECK(Ingest(p, "plain") == "plain");
+  CHECK(Ingest(p, "a\tb\nc\r") == "a\tb\nc\r");
+  CHECK(Ingest(p, "\xC3\xA9 \xE4\xBD\xA0 \xF0\x9F\x98\x80") == "\xC3\xA9 \xE4\xBD\xA0 \xF0\x9F\x98\x80");
+
+  // control characters are dropped
+  CHECK(Ingest(p, std::string("a\x01\x08\x0B\x0C\x1F" "b\0c", 9)) == "abc");
+
+  // malformed UTF-8 becomes U+FFFD
+  const std::string fffd = "\xEF\xBF\xBD";
+  CHECK(Ingest(p, "\x80") == fffd);                      // lone continuation byte
+  CHECK(Ingest(p, "\xC0\x80") == fffd + fffd);           // overlong
+  CHECK(Ingest(p, "\xED\xA0\x80") == fffd + fffd + fffd); // surrogate
+  CHECK(Ingest(p, "x\xE4\xBD") == "x" + fffd + fffd);    // cut short
+  CHECK(Ingest(p, "\xEF\xBF\xBE") == fffd + fffd + fffd); // U+FFFE
+  CHECK(Ingest(p, "\xF5\x80\x80\x80").size() == 4 * fffd.size());
+
+  // a bad byte anywhere in long text, where the vector loops run
+  for (size_t i = 0; i < 80; i++) {
+    std::string text(80, 'a');
+    text[i] = '\x02';
+    CHECK(Ingest(p, text) == std::string(79, 'a'));
+    text[i] = '\xFF';
+    CHECK(Ingest(p, text) == std::string(i, 'a') + fffd + std::string(79 - i, 'a'));
+  }
+
+  // leading and trailing white space is preserved
+  auto q = doc.AppendParagraph();
+  q.AppendRun("  leading");
+  q.AppendRun("trailing ");
+  q.AppendRun("\ttab");
+  q.AppendRun("inner space");
+  CHECK(q.GetText() == "  leadingtrailing \ttabinner space");
+
+  // the same through paragraphs, fragments and the TextView overloads
+  CHECK(doc.AppendParagraph("x\x07y").GetText() == "xy");
+  Fragment f;
+  CHECK(f.AppendParagraph("x\x07y").GetText() == "xy");
+  CHECK(doc.AppendParagraph(TextView("x\x07y\xFF", 4)).GetText() == "xy" + fffd);
+
+  CHECK(doc.Save("test_sanitize.docx"));
+  const std::string xml = ReadEntry("test_sanitize.docx", "word/document.xml");
+  CHECK(xml.find("<w:t xml:space=\"preserve\">  leading</w:t>") != std::string::npos);
+  CHECK(xml.find("<w:t xml:space=\"preserve\">trailing </w:t>") != std::string::npos);
+  CHECK(xml.find("<w:t xml:space=\"preserve\">\ttab</w:t>") != std::string::npos);
+  CHECK(xml.find("<w:t>inner space</w:t>") != std::string::npos);
+
+  // the result is well-formed
+  Document opened;
+  CHECK(opened.Open("test_sanitize.docx"));
+  CHECK(opened.FirstParagraph().Next().GetText() == q.GetText());
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+// the number of sections, walking forwards
+int CountSections(Document& doc)
+{
+  int n = 0;
+  for (auto s = doc.FirstSection(); s; s = s.Next()) n++;
+  return n;
+}
+
+int main()
+{
+  Document doc;
+  auto p1 = doc.AppendParagraph("1");
+  auto p2 = doc.AppendParagraph("2");
+  auto p3 = doc.AppendParagraph("3");
+  auto p4 = doc.AppendParagraph("4");
+  CHECK(CountSections(doc) == 1);
+
+  auto s1 = p2.InsertSectionBreak();
+  auto s2 = s1.Next();
+  CHECK(CountSections(doc) == 2);
+  CHECK(s1.FirstParagraph().GetText() == "1");
+  CHECK(s1.LastParagraph().GetText() == "2");
+  CHECK(s2.FirstParagraph().GetText() == "3");
+  CHECK(s2.LastParagraph().GetText() == "4");
+  CHECK(s2.Prev() == s1);
+  CHECK(p4.GetSection() == doc.LastSection());
+
+  // paragraphs added or inserted later belong to the right section
+  auto p5 = doc.AppendParagraph("5");
+  auto p0 = doc.PrependParagraph("0");
+  CHECK(p5.GetSection() == s2);
+  CHECK(p0.GetSection() == doc.FirstSection());
+  CHECK(doc.FirstSection().FirstParagraph().GetText() == "0");
+  CHECK(doc.LastSection().LastParagraph().GetText() == "5");
+
+  // a break in the middle of the second section
+  p4.InsertSectionBreak();
+  CHECK(CountSections(doc) == 3);
+  CHECK(doc.LastSection().FirstParagraph().GetText() == "5");
+  CHECK(p3.GetSection().LastParagraph().GetText() == "4");
+
+  // and merged again
+  p4.RemoveSectionBreak();
+  CHECK(CountSections(doc) == 2);
+  CHECK(p5.GetSection() == p3.GetSection());
+
+  // removing a paragraph keeps the index right
+  doc.RemoveParagraph(p3);
+  CHECK(doc.LastSection().FirstParagraph().GetText() == "4");
+
+  // the index is rebuilt after Open
+  CHECK(doc.Save("test_sections.docx"));
+  Document reopened;
+  CHECK(reopened.Open("test_sections.docx"));
+  CHECK(CountSections(reopened) == 2);
+  CHECK(reopened.FirstSection().LastParagraph().GetText() == "2");
+  CHECK(reopened.LastSection().FirstParagraph().GetText() == "4");
+  CHECK(reopened.LastSection().Prev() == reopened.FirstSection());
+  (void)p1;
+  return 0;
+}
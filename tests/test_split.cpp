@@ -0,0 +1,112 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+#if defined(_WIN32)
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#else
+#include <sys/stat.h>
+#endif
+
+using namespace docx;
+
+// a 1x1 pixel picture
+const unsigned char PNG[] = {
+  0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+  0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x08, 0x06, 0x00, 0x00, 0x00, 0x1f, 0x15, 0xc4,
+  0x89, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0xf8, 0xcf, 0xc0, 0xf0,
+  0x1f, 0x00, 0x05, 0x00, 0x01, 0xff, 0x89, 0x99, 0x3d, 0x1d, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45,
+  0x4e, 0x44, 0xae, 0x42, 0x60, 0x82
+};
+
+// the number of entries whose name starts with prefix
+int CountEntries(const std::map<std::string, std::string>& entries, const std::string& prefix)
+{
+  int n = 0;
+  for (auto& e : entries) {
+    if (e.first.compare(0, prefix.size(), prefix) == 0) n++;
+  }
+  return n;
+}
+
+int main()
+{
+  // three sections, the second in landscape with a header of its own
+  Document doc;
+  doc.AppendParagraph("one a").AppendRun().AppendPicture(reinterpret_cast<const char*>(PNG), sizeof(PNG), 10, 10);
+  doc.AppendParagraph("one b").InsertSectionBreak();
+  doc.AppendParagraph("two a");
+  auto two = doc.AppendParagraph("two b").InsertSectionBreak();
+  two.SetPageOrient(Section::Orientation::Landscape);
+  Fragment header;
+  header.AppendParagraph("two header");
+  CHECK(two.SetHeader(header));
+  auto table = doc.AppendTable(1, 1);
+  table.GetCell(0, 0).FirstParagraph().AppendRun("three cell");
+  doc.AppendParagraph("three a").AppendHyperlink("https://example.com/three", " link");
+  doc.AddList();
+  CHECK(doc.Save("test_split.docx"));
+
+  CHECK(SplitBySection("test_split.docx", "test_split_{}.docx") == 3);
+
+  const char* texts[][2] = { { "one a", "one b" }, { "two a", "two b" }, { "three a", "three a" } };
+  for (int i = 0; i < 3; i++) {
+    const std::string path = "test_split_" + std::to_string(i + 1) + ".docx";
+    const std::string xml = ReadEntry(path.c_str(), "word/document.xml");
+
+    // one section each, its w:sectPr at the end of the body
+    CHECK(Count(xml, "<w:sectPr") == 1);
+    CHECK(xml.find("<w:sectPr") > xml.rfind("</w:p>"));
+    CHECK(xml.find("</w:body>") != std::string::npos);
+    CHECK(Count(xml, "<w:tbl>") == (i == 2 ? 1 : 0));
+
+    Document part;
+    CHECK(part.Open(path));
+    CHECK(!part.FirstSection().Next());
+    CHECK(part.FirstParagraph().GetText() == texts[i][0]);
+    CHECK(part.LastParagraph().GetText() == texts[i][1]);
+
+    // only the parts of its own section, the numbering of all
+    auto entries = ReadEntries(path.c_str());
+    const std::string& rels = entries["word/_rels/document.xml.rels"];
+    const std::string& types = entries["[Content_Types].xml"];
+    CHECK(CountEntries(entries, "word/media/") == (i == 0 ? 1 : 0));
+    CHECK(CountEntries(entries, "word/header") == (i == 1 ? 1 : 0));
+    CHECK(Count(rels, "relationships/image\"") == (i == 0 ? 1 : 0));
+    CHECK(Count(rels, "relationships/header\"") == (i == 1 ? 1 : 0));
+    CHECK(Count(rels, "https://example.com/three") == (i == 2 ? 1 : 0));
+    CHECK(Count(types, "/word/header") == (i == 1 ? 1 : 0));
+    CHECK(entries.count("word/numbering.xml") == 1);
+    CHECK(entries.count("word/settings.xml") == 1);
+    CHECK(Count(rels, "relationships/numbering\"") == 1);
+  }
+
+  // the second keeps its orientation and header
+  Document second;
+  CHECK(second.Open("test_split_2.docx"));
+  CHECK(second.FirstSection().GetPageOrient() == Section::Orientation::Landscape);
+  const std::string xml = ReadEntry("test_split_2.docx", "word/document.xml");
+  CHECK(xml.find("<w:headerReference") != std::string::npos);
+  bool headerFound = false;
+  for (const auto& entry : ReadEntries("test_split_2.docx")) {
+    if (entry.first.compare(0, 11, "word/header") == 0 && entry.second.find("two header") != std::string::npos)
+      headerFound = true;
+  }
+  CHECK(headerFound);
+
+  // without "{}" the number goes before the extension
+  CHECK(SplitBySection("test_split.docx", "test_split_part.docx") == 3);
+  Document part;
+  CHECK(part.Open("test_split_part_3.docx"));
+  CHECK(part.LastParagraph().GetText() == "three a");
+
+  // a failure leaves no package behind, here the second cannot be created
+  mkdir("test_split_dir1", 0755);
+  std::remove("test_split_dir1/part.docx");
+  CHECK(SplitBySection("test_split.docx", "test_split_dir{}/part.docx") == 0);
+  CHECK(std::fopen("test_split_dir1/part.docx", "rb") == NULL);
+
+  // a missing input writes nothing
+  CHECK(SplitBySection("missing.docx", "test_split_missing.docx") == 0);
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+bool Equal(const DocumentStatistics& a, const DocumentStatistics& b)
+{
+  return a.words == b.words && a.characters == b.characters
+    && a.charactersWithSpaces == b.charactersWithSpaces && a.paragraphs == b.paragraphs;
+}
+
+// counts again from scratch
+DocumentStatistics Recount(const Document& doc)
+{
+  Document copy;
+  copy.Append(doc);
+  return copy.GetStatistics();
+}
+
+int main()
+{
+  Document doc;
+  doc.AppendParagraph("Hello world");
+  doc.AppendParagraph();
+  doc.AppendParagraph(u8"你好 世界");
+
+  DocumentStatistics s = doc.GetStatistics();
+  CHECK(s.words == 2 + 4);
+  CHECK(s.characters == 10 + 4);
+  CHECK(s.charactersWithSpaces == 11 + 5);
+  CHECK(s.paragraphs == 2);
+
+  // the counts follow the edits
+  auto p = doc.AppendParagraph("one");
+  auto r = p.AppendRun(" two");
+  r.AppendTabs(1);
+  r.AppendText("three");
+  CHECK(Equal(doc.GetStatistics(), Recount(doc)));
+  CHECK(doc.GetStatistics().words == 6 + 3);
+
+  // handles reached through other handles count for their own document only
+  Document other;
+  other.AppendParagraph("other words");
+  const DocumentStatistics o = other.GetStatistics();
+  Run copy = r;
+  copy.AppendText(" four");
+  p.Prev().Next().AppendRun(" five");
+  other.FirstParagraph().FirstRun().AppendText(" more");
+  CHECK(Equal(doc.GetStatistics(), Recount(doc)));
+  CHECK(doc.GetStatistics().words == 6 + 5);
+  CHECK(other.GetStatistics().words == o.words + 1);
+
+  auto tbl = doc.AppendTable(2, 2);
+  tbl.GetCell(0, 0).FirstParagraph().AppendRun("in a cell");
+  CHECK(Equal(doc.GetStatistics(), Recount(doc)));
+
+  r.ClearText();
+  CHECK(Equal(doc.GetStatistics(), Recount(doc)));
+  doc.RemoveTable(tbl);
+  doc.RemoveParagraph(p);
+  CHECK(Equal(doc.GetStatistics(), s));
+
+  // Save writes the counts to docProps/app.xml, whether they are tracked or not
+  CHECK(doc.Save("test_statistics.docx"));
+  std::string app = ReadEntry("test_statistics.docx", "docProps/app.xml");
+  CHECK(app.find("<Words>6</Words>") != std::string::npos);
+  CHECK(app.find("<Characters>14</Characters>") != std::string::npos);
+
+  Document reopened;
+  CHECK(reopened.Open("test_statistics.docx"));
+  reopened.AppendParagraph("more words here");
+  CHECK(reopened.Save("test_statistics.docx"));
+  app = ReadEntry("test_statistics.docx", "docProps/app.xml");
+  CHECK(app.find("<Words>9</Words>") != std::string::npos);
+  CHECK(reopened.GetStatistics().words == 9);
+  return 0;
+}
@@ -0,0 +1,55 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+const PartStats* FindPart(const Stats& stats, const std::string& name)
+{
+  for (size_t i = 0; i < stats.parts.size(); i++) {
+    if (stats.parts[i].name == name) return &stats.parts[i];
+  }
+  return NULL;
+}
+
+int main()
+{
+  Document doc;
+  for (int i = 0; i < 100; i++) {
+    doc.AppendParagraph("Lorem ipsum dolor sit amet");
+  }
+
+  // Save reports every part it writes
+  Stats saved;
+  CHECK(doc.Save("test_stats.docx", &saved));
+  const PartStats* document = FindPart(saved, "word/document.xml");
+  CHECK(document != NULL);
+  CHECK(document->bytes == ReadEntry("test_stats.docx", "word/document.xml").size());
+  CHECK(document->nodes > 100);
+  CHECK(FindPart(saved, "word/settings.xml") != NULL);
+  CHECK(FindPart(saved, "[Content_Types].xml") != NULL);
+  CHECK(saved.totalTime >= saved.openTime + saved.closeTime);
+
+  // Open reports the parts it parses
+  Document reopened;
+  Stats opened;
+  CHECK(reopened.Open("test_stats.docx", &opened));
+  document = FindPart(opened, "word/document.xml");
+  CHECK(document != NULL);
+  CHECK(document->bytes == ReadEntry("test_stats.docx", "word/document.xml").size());
+  CHECK(document->nodes > 100);
+  CHECK(opened.copyTime == 0);
+
+  // a save after Open reports the changed parts only
+  std::map<std::string, std::string> vars;
+  vars["key"] = "value";
+  reopened.SetVars(vars);
+  Stats resaved;
+  CHECK(reopened.Save("test_stats_copy.docx", &resaved));
+  CHECK(resaved.parts.size() == 1);
+  CHECK(resaved.parts[0].name == "word/settings.xml");
+
+  // the same object can be passed again, it is reset first
+  CHECK(reopened.Save("test_stats_copy.docx", &resaved));
+  CHECK(resaved.parts.empty());
+  return 0;
+}
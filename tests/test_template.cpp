@@ -0,0 +1,69 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+#include <cstring>
+
+using namespace docx;
+
+int main()
+{
+  Document doc;
+  doc.AppendParagraph("Dear {{name}}, you owe {{amount}}.");
+  doc.AppendParagraph("Regards, {{ signature }}");
+  CHECK(doc.Save("test_template_source.docx"));
+
+  // parts the library knows nothing about
+  static const char THEME[] = "<a:theme xmlns:a=\"http://schemas.openxmlformats.org/drawingml/2006/main\" name=\"Test\"/>";
+  static const char ITEM[] = "<root>custom</root>";
+  struct zip_t* zip = zip_open("test_template_source.docx", ZIP_DEFAULT_COMPRESSION_LEVEL, 'a');
+  CHECK(zip != NULL);
+  zip_entry_open(zip, "word/theme/theme1.xml");
+  zip_entry_write(zip, THEME, std::strlen(THEME));
+  zip_entry_close(zip);
+  zip_entry_open(zip, "customXml/item1.xml");
+  zip_entry_write(zip, ITEM, std::strlen(ITEM));
+  zip_entry_close(zip);
+  zip_close(zip);
+
+  Template tpl;
+  CHECK(tpl.Open("test_template_source.docx"));
+  std::vector<std::string> fields = tpl.GetFields();
+  CHECK(fields.size() == 3);
+  CHECK(fields[0] == "name" && fields[1] == "amount" && fields[2] == "signature");
+
+  // values are escaped and stripped of control characters, fields without a value keep their text
+  std::map<std::string, std::string> values;
+  values["name"] = "Alice & Bob";
+  values["amount"] = "<$5\x01>";
+  CHECK(tpl.Render(values, "test_template.docx"));
+
+  Document rendered;
+  CHECK(rendered.Open("test_template.docx"));
+  auto p = rendered.FirstParagraph();
+  CHECK(p.GetText() == "Dear Alice & Bob, you owe <$5>.");
+  CHECK(p.Next().GetText() == "Regards, {{ signature }}");
+
+  // every other entry of the source is written back as it is
+  std::map<std::string, std::string> source = ReadEntries("test_template_source.docx");
+  std::map<std::string, std::string> output = ReadEntries("test_template.docx");
+  CHECK(source.size() == output.size());
+  CHECK(output["word/theme/theme1.xml"] == THEME);
+  CHECK(output["customXml/item1.xml"] == ITEM);
+  for (std::map<std::string, std::string>::const_iterator it = source.begin(); it != source.end(); ++it) {
+    CHECK(output.count(it->first) == 1);
+    if (it->first != "word/document.xml") CHECK(output[it->first] == it->second);
+  }
+
+  // the template is not changed by rendering
+  values["signature"] = "Carol";
+  CHECK(tpl.Render(values, "test_template.docx"));
+  CHECK(rendered.Open("test_template.docx"));
+  CHECK(rendered.FirstParagraph().Next().GetText() == "Regards, Carol");
+
+  // the template no longer needs its source, and a failed write is reported
+  CHECK(std::remove("test_template_source.docx") == 0);
+  CHECK(tpl.Render(values, "test_template.docx"));
+  CHECK(ReadEntries("test_template.docx").size() == source.size());
+  CHECK(!tpl.Render(values, "no/such/directory/test_template.docx"));
+  return 0;
+}
@@ -0,0 +1,55 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+// the elements of the last run of the saved document, "t", "tab" or "br" with the text
+std::string Markup(Document& doc, const std::string& text)
+{
+  auto r = doc.AppendParagraph().AppendRun();
+  r.AppendTextWithBreaks(text);
+  CHECK(doc.Save("test_text_breaks.docx"));
+  const std::string xml = ReadEntry("test_text_breaks.docx", "word/document.xml");
+  const size_t begin = xml.rfind("<w:r>");
+  const size_t end = xml.find("</w:r>", begin);
+  CHECK(begin != std::string::npos && end != std::string::npos);
+  std::string run = xml.substr(begin + 5, end - begin - 5);
+  const size_t rPr = run.find("<w:rPr/>");
+  if (rPr != std::string::npos) run.erase(rPr, 8);
+  return run;
+}
+
+int main()
+{
+  Document doc;
+  CHECK(Markup(doc, "plain") == "<w:t>plain</w:t>");
+  CHECK(Markup(doc, "a\tb") == "<w:t>a</w:t><w:tab/><w:t>b</w:t>");
+  CHECK(Markup(doc, "one\ntwo\r\nthree\rfour")
+    == "<w:t>one</w:t><w:br/><w:t>two</w:t><w:br/><w:t>three</w:t><w:br/><w:t>four</w:t>");
+  CHECK(Markup(doc, "\n\t\r\n") == "<w:br/><w:tab/><w:br/>");
+  CHECK(Markup(doc, "end\n") == "<w:t>end</w:t><w:br/>");
+  CHECK(Markup(doc, " a \tb") == "<w:t xml:space=\"preserve\"> a </w:t><w:tab/><w:t>b</w:t>");
+
+  // control characters are dropped and non-ASCII text passes through
+  CHECK(Markup(doc, "\xE4\xBD\xA0\x01\t\xE5\xA5\xBD") == "<w:t>\xE4\xBD\xA0</w:t><w:tab/><w:t>\xE5\xA5\xBD</w:t>");
+
+  // long text, where the vector loops run
+  std::string text(100, 'x');
+  text[40] = '\n';
+  text[70] = '\t';
+  CHECK(Markup(doc, text) == "<w:t>" + std::string(40, 'x') + "</w:t><w:br/><w:t>" + std::string(29, 'x')
+    + "</w:t><w:tab/><w:t>" + std::string(29, 'x') + "</w:t>");
+
+  // GetText() reads the pieces, the statistics count tabs but not breaks
+  Document counted;
+  auto r = counted.AppendParagraph().AppendRun();
+  r.AppendTextWithBreaks(TextView("ab\tcd\nef", 8));
+  CHECK(r.GetText() == "abcdef");
+  auto stats = counted.GetStatistics();
+  CHECK(stats.words == 3);
+  CHECK(stats.characters == 6);
+  CHECK(stats.charactersWithSpaces == 7);
+  r.AppendTextWithBreaks(" gh");
+  CHECK(counted.GetStatistics().words == 4);
+  return 0;
+}
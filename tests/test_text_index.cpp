@@ -0,0 +1,89 @@
+#include <algorithm>
+
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+// the texts of the paragraphs of the matches, sorted
+std::vector<std::string> Texts(const std::vector<TextMatch>& matches)
+{
+  std::vector<std::string> texts;
+  for (auto m : matches) texts.push_back(m.paragraph.GetText());
+  std::sort(texts.begin(), texts.end());
+  return texts;
+}
+
+void CheckIndex(Document& doc, const bool ngrams)
+{
+  TextIndex index;
+  index.Build(doc, ngrams);
+
+  // a match across runs, found at its offset in the paragraph
+  auto matches = index.Find("quick brown");
+  CHECK(matches.size() == 1);
+  CHECK(matches[0].paragraph == doc.FirstParagraph());
+  CHECK(matches[0].offset == 4);
+  CHECK(matches[0].run.GetText() == "The quick ");
+
+  // short queries and several matches in one paragraph
+  CHECK(index.Find("o").size() == 5);
+  CHECK(index.Find("fox").size() == 3);
+  CHECK(index.Find("fox", 2).size() == 2);
+  CHECK(index.Find("cat").empty());
+  CHECK(index.Find("").empty());
+
+  // text in table cells is indexed too
+  matches = index.Find("cell fox");
+  CHECK(matches.size() == 1);
+  CHECK(matches[0].paragraph.GetText() == "cell fox");
+
+  // a match does not run into the next paragraph
+  CHECK(index.Find("dogfox").empty());
+
+  // updates after editing and adding paragraphs
+  auto second = doc.FirstParagraph().Next();
+  second.FirstRun().ClearText();
+  second.FirstRun().AppendText("a red cat");
+  index.Update(second);
+  auto added = doc.AppendParagraph("another cat");
+  index.Update(added);
+  CHECK(Texts(index.Find("fox")) == std::vector<std::string>({ "The quick brown fox", "cell fox" }));
+  CHECK(index.Find("cat").size() == 2);
+  CHECK(index.Find("red cat")[0].paragraph == second);
+
+  // removing before the paragraph goes
+  index.Remove(added);
+  CHECK(doc.RemoveParagraph(added));
+  CHECK(index.Find("cat").size() == 1);
+  CHECK(index.Find("another").empty());
+
+  // restore the second paragraph for the next round
+  second.FirstRun().ClearText();
+  second.FirstRun().AppendText("fox and dog");
+}
+
+int main()
+{
+  Document doc;
+  auto p = doc.AppendParagraph();
+  p.AppendRun("The quick ");
+  p.AppendRun("brown fox");
+  doc.AppendParagraph("fox and dog");
+  auto tbl = doc.AppendTable(1, 1);
+  tbl.GetCell(0, 0).FirstParagraph().AppendRun("cell fox");
+
+  CheckIndex(doc, true);
+  CheckIndex(doc, false);
+
+  // an index over an opened document
+  CHECK(doc.Save("test_text_index.docx"));
+  Document opened;
+  CHECK(opened.Open("test_text_index.docx"));
+  TextIndex index;
+  index.Build(opened);
+  auto matches = index.Find("brown fox");
+  CHECK(matches.size() == 1);
+  CHECK(matches[0].paragraph.GetText() == "The quick brown fox");
+  return 0;
+}
@@ -0,0 +1,67 @@
+#include <cstring>
+
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+int main()
+{
+  // views into one buffer, none of them ends with a zero
+  const char buffer[] = { 'T', 'i', 't', 'l', 'e', 'B', 'o', 'd', 'y', ' ', 't', 'e', 'x', 't', 'A', 'r', 'i', 'a', 'l', 'X' };
+  const TextView title(buffer, 5);
+  const TextView body(buffer + 5, 9);
+  const TextView arial(buffer + 14, 5);
+
+  Document doc;
+  auto p1 = doc.AppendParagraph(title, 16);
+  auto p0 = doc.PrependParagraph(body);
+  auto r = p1.AppendRun(TextView(" and ", 5));
+  r.AppendText(body);
+  r.SetFont(arial);
+  p1.SetFont(arial, TextView("SimSun", 6));
+
+  CHECK(p0.GetText() == "Body text");
+  CHECK(p1.GetText() == "Title and Body text");
+  CHECK(p1.FirstRun().GetFontSize() == 16);
+  std::string ascii, eastAsia;
+  r.GetFont(ascii, eastAsia);
+  CHECK(ascii == "Arial");
+  CHECK(eastAsia == "SimSun");
+
+  // an empty view adds an empty run
+  CHECK(p1.AppendRun(TextView()).GetText().empty());
+
+  // the same through a fragment
+  Fragment f;
+  CHECK(f.AppendParagraph(body, 11).GetText() == "Body text");
+
+  // GetText() into a buffer: truncated like snprintf(), the full length returned
+  char out[32];
+  CHECK(r.GetText(out, sizeof(out)) == 14);
+  CHECK(std::strcmp(out, " and Body text") == 0);
+  CHECK(r.GetText(out, 5) == 14);
+  CHECK(std::strcmp(out, " and") == 0);
+  out[0] = 'x';
+  CHECK(r.GetText(out, 0) == 14);
+  CHECK(out[0] == 'x');
+  CHECK(Run().GetText(out, sizeof(out)) == 0);
+  CHECK(out[0] == '\0');
+
+  // GetTextView() points into the document for a single w:t
+  TextView view;
+  auto single = p0.FirstRun();
+  CHECK(single.GetTextView(view));
+  CHECK(std::string(view.data, view.size) == "Body text");
+  CHECK(view.data[view.size] == '\0');
+  CHECK(!r.GetTextView(view)); // two w:t
+  auto empty = p0.AppendRun();
+  CHECK(!empty.GetTextView(view));
+
+  CHECK(doc.Save("test_text_view.docx"));
+  Document opened;
+  CHECK(opened.Open("test_text_view.docx"));
+  CHECK(opened.FirstParagraph().GetText() == "Body text");
+  CHECK(opened.LastParagraph().GetText() == "Title and Body text");
+  return 0;
+}
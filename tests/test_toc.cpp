@@ -0,0 +1,90 @@
+#include "minidocx.hpp"
+#include "check.hpp"
+
+using namespace docx;
+
+int main()
+{
+  // no headings, no table of contents
+  Document empty;
+  empty.AppendParagraph("text");
+  CHECK(empty.InsertTableOfContents(Paragraph()) == 0);
+  CHECK(empty.FirstParagraph() == empty.LastParagraph());
+
+  Document doc;
+  auto intro = doc.AppendParagraph("intro");
+  doc.ImportMarkdown("# One\n\ntext\n\n## One.A\n\n#### too deep\n");
+  doc.AppendPageBreak();
+  doc.ImportMarkdown("# Two & more\n");
+
+  // three entries before the first paragraph, each its own paragraph
+  CHECK(doc.InsertTableOfContents(intro) == 3);
+  CHECK(doc.FirstParagraph().Next().Next().Next() == intro);
+
+  // the headings are bookmarked for the links of the entries
+  auto bookmarks = doc.GetBookmarks();
+  CHECK(bookmarks.size() == 3);
+  for (auto& b : bookmarks) CHECK(b.GetName().compare(0, 4, "_Toc") == 0);
+
+  CHECK(doc.Save("test_toc.docx"));
+  std::string xml = ReadEntry("test_toc.docx", "word/document.xml");
+  const size_t end = xml.find(">intro<");
+  const std::string toc = xml.substr(0, end);
+  CHECK(Count(toc, "TOC \\o \"1-3\" \\h \\z \\u") == 1);
+  CHECK(Count(toc, "<w:fldChar w:fldCharType=\"begin\"/>") == 4);
+  CHECK(Count(toc, "<w:fldChar w:fldCharType=\"end\"/>") == 4);
+  CHECK(Count(toc, "<w:hyperlink w:anchor=\"" + bookmarks[0].GetName() + "\"") == 1);
+  CHECK(Count(toc, "PAGEREF ") == 3);
+  CHECK(toc.find(">too deep<") == std::string::npos);
+
+  // the entries read right before Word updates them, pages counted from the page break
+  CHECK(toc.find("<w:t>One</w:t>") < toc.find("<w:t>One.A</w:t>"));
+  CHECK(toc.find("<w:t>Two &amp; more</w:t>") != std::string::npos);
+  CHECK(Count(toc, "<w:t>1</w:t>") == 2);
+  CHECK(Count(toc, "<w:t>2</w:t>") == 1);
+  // the second level is indented
+  CHECK(Count(toc, "<w:ind w:left=") == 1);
+
+  // deeper levels and the end of the body
+  Document deep;
+  deep.ImportMarkdown("# a\n\n#### d\n");
+  CHECK(deep.InsertTableOfContents(Paragraph(), 4) == 2);
+  CHECK(deep.Save("test_toc_deep.docx"));
+  xml = ReadEntry("test_toc_deep.docx", "word/document.xml");
+  CHECK(xml.find("TOC \\o \"1-4\"") > xml.find(">d</w:t>"));
+
+  // page numbers from a layout estimate
+  Document laid;
+  std::string markdown;
+  for (int i = 0; i < 50; i++) {
+    markdown += "# Chapter " + std::to_string(i) + "\n\n";
+    for (int j = 0; j < 20; j++) markdown += "Some text to fill the page with lines.\n\n";
+  }
+  laid.ImportMarkdown(markdown);
+  LayoutEstimate layout;
+  layout.Build(laid);
+  const int pages = layout.GetPageCount();
+  CHECK(pages > 1);
+  CHECK(laid.InsertTableOfContents(laid.FirstParagraph(), 1, &layout) == 50);
+  CHECK(layout.GetPageCount() > pages);
+  int last = 0;
+  for (auto p = laid.FirstParagraph(); p; p = p.Next()) {
+    if (p.GetText() == "Chapter 49") last = layout.GetPage(p);
+  }
+  CHECK(last > 1);
+  CHECK(laid.Save("test_toc_layout.docx"));
+  xml = ReadEntry("test_toc_layout.docx", "word/document.xml");
+  // the page shown after the PAGEREF of the last heading
+  const size_t ref = xml.find("PAGEREF " + laid.GetBookmarks().back().GetName() + " ");
+  CHECK(ref != std::string::npos);
+  CHECK(xml.find("<w:t>", ref) == xml.find("<w:t>" + std::to_string(last) + "</w:t>", ref));
+
+  // tens of thousands of headings
+  Document large;
+  markdown.clear();
+  for (int i = 0; i < 20000; i++) markdown += "## Heading " + std::to_string(i) + "\n\n";
+  large.ImportMarkdown(markdown);
+  CHECK(large.InsertTableOfContents(large.FirstParagraph()) == 20000);
+  CHECK(large.GetBookmarks().size() == 20000);
+  return 0;
+}